@@ -51,6 +51,16 @@ KERNELAPI void KERNELABI
 ArchMmuSwitchMemorySpace(
     _In_ SystemMemorySpace_t*);
 
+/**
+ * ArchMmuGetLargePageSize
+ * * Retrieves the size of the large pages the architecture can map with a single entry. Mappings
+ * * that cover a large page with a physically contiguous and aligned run will be mapped with one.
+ * 
+ * @return The size of a large page in bytes, or 0 if large pages are not supported.
+ */
+KERNELAPI size_t KERNELABI
+ArchMmuGetLargePageSize(void);
+
 /**
  * ArchMmuGetPageAttributes
  * * Retrieves memory attributes for the number of virtual address provided. The array
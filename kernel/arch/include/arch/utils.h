@@ -40,6 +40,12 @@ ArchDumpThreadContext(
 KERNELAPI UUId_t KERNELABI
 ArchGetProcessorCoreId(void);
 
+/* ArchGetTimestamp
+ * Reads the timestamp counter of the current processor core, 0 if there is none. */
+KERNELAPI void KERNELABI
+ArchGetTimestamp(
+    _Out_ uint64_t* Timestamp);
+
 /* ArchProcessorInitialize
  * Initializes and fills in the processor structure for the calling processor. */
 KERNELAPI void KERNELABI
@@ -307,6 +307,17 @@ CpuInvalidateMemoryCache(
 
 extern void _rdtsc(uint64_t *Value);
 
+void
+ArchGetTimestamp(
+    _Out_ uint64_t* Timestamp)
+{
+    if (!(GetMachine()->Processor.Data[CPU_DATA_FEATURES_EDX] & CPUID_FEAT_EDX_TSC)) {
+        *Timestamp = 0;
+        return;
+    }
+    _rdtsc(Timestamp);
+}
+
 void
 ArchStallProcessorCore(
     size_t MilliSeconds)
@@ -41,6 +41,17 @@ extern PAGE_MASTER_LEVEL* MmVirtualGetMasterTable(SystemMemorySpace_t* MemorySpa
 extern PageTable_t* MmVirtualGetTable(PAGE_MASTER_LEVEL* ParentPageMasterTable, PAGE_MASTER_LEVEL* PageMasterTable,
     VirtualAddress_t VirtualAddress, int IsCurrent, int CreateIfMissing, int* Update);
 
+#if defined(amd64) || defined(__amd64__)
+extern _Atomic(uint64_t)* MmVirtualGetDirectoryEntry(PAGE_MASTER_LEVEL* ParentPageMasterTable, PAGE_MASTER_LEVEL* PageMasterTable,
+    VirtualAddress_t VirtualAddress, int IsCurrent, int CreateIfMissing, int* Update);
+
+// Large pages are mapped directly by page-directory entries, and only for ranges that cover
+// them completely. Operations on a part of a large page split it into a page-table first.
+#define __LARGE_PAGES
+#define IS_LARGE_PAGE(Mapping)            (((Mapping) & (PAGE_PRESENT | PAGETABLE_LARGE)) == (PAGE_PRESENT | PAGETABLE_LARGE))
+#define COVERS_LARGE_PAGE(Address, Count) (!((Address) % LARGE_PAGE_SIZE) && (Count) >= PAGES_PER_LARGE_PAGE)
+#endif
+
 extern void memory_invalidate_addr(uintptr_t pda);
 extern void memory_load_cr3(uintptr_t pda);
 extern void memory_reload_cr3(void);
@@ -56,11 +67,15 @@ uintptr_t LastReservedAddress = 0;
 
 void
 PrintPhysicalMemoryUsage(void) {
-    int    MaxBlocks       = READ_VOLATILE(GetMachine()->PhysicalMemory.capacity);
-    int    FreeBlocks      = READ_VOLATILE(GetMachine()->PhysicalMemory.index);
-    int    AllocatedBlocks = MaxBlocks - FreeBlocks;
-    size_t ReservedMemory  = READ_VOLATILE(LastReservedAddress);
-    size_t MemoryInUse     = ReservedMemory + ((size_t)AllocatedBlocks * (size_t)PAGE_SIZE);
+    size_t MaxBlocks;
+    size_t FreeBlocks;
+    size_t AllocatedBlocks;
+    size_t ReservedMemory = READ_VOLATILE(LastReservedAddress);
+    size_t MemoryInUse;
+    
+    PageAllocatorGetStatistics(&GetMachine()->PhysicalMemory, &MaxBlocks, &FreeBlocks);
+    AllocatedBlocks = MaxBlocks - FreeBlocks;
+    MemoryInUse     = ReservedMemory + (AllocatedBlocks * (size_t)PAGE_SIZE);
     
     TRACE("Memory in use %" PRIuIN " Bytes", MemoryInUse);
     TRACE("Block status %" PRIuIN "/%" PRIuIN, AllocatedBlocks, MaxBlocks);
@@ -88,7 +103,7 @@ AllocateBootMemory(
 OsStatus_t
 InitializeSystemMemory(
     _In_ Multiboot_t*        BootInformation,
-    _In_ bounded_stack_t*    PhysicalMemory,
+    _In_ PageAllocator_t*    PhysicalMemory,
     _In_ StaticMemoryPool_t* GlobalAccessMemory,
     _In_ SystemMemoryMap_t*  MemoryMap,
     _In_ size_t*             MemoryGranularity,
@@ -130,8 +145,8 @@ InitializeSystemMemory(
     
     // Create the physical memory map
     Count = MemorySize / PAGE_SIZE;
-    bounded_stack_construct(PhysicalMemory, (void*)AllocateBootMemory(
-        Count * sizeof(void*)), (int)Count);
+    PageAllocatorConstruct(PhysicalMemory, (void*)AllocateBootMemory(
+        PageAllocatorCalculateSize(Count)), PAGE_SIZE, Count);
     
     // Create the global access memory, it needs to start after the last reserved
     // memory address, because the reserved memory is not freeable or allocatable.
@@ -171,9 +186,8 @@ InitializeSystemMemory(
                 Address = LastReservedAddress;
             }
             
-            while (Address < Limit) {
-                bounded_stack_push(PhysicalMemory, (void*)Address);
-                Address += PAGE_SIZE;
+            if (Address < Limit) {
+                PageAllocatorAddRange(PhysicalMemory, Address, Limit - Address);
             }
         }
         RegionPointer++;
@@ -244,6 +258,76 @@ ConvertX86AttributesToGeneric(
     return GenericFlags;
 }
 
+#if defined(__LARGE_PAGES)
+static _Atomic(uint64_t)*
+GetLargePageEntry(
+    _In_  PAGE_MASTER_LEVEL* ParentDirectory,
+    _In_  PAGE_MASTER_LEVEL* Directory,
+    _In_  VirtualAddress_t   Address,
+    _In_  int                IsCurrent,
+    _Out_ uint64_t*          Mapping)
+{
+    _Atomic(uint64_t)* Entry;
+    int                Update;
+
+    Entry = MmVirtualGetDirectoryEntry(ParentDirectory, Directory, Address, IsCurrent, 0, &Update);
+    if (Entry != NULL) {
+        *Mapping = atomic_load(Entry);
+        if (IS_LARGE_PAGE(*Mapping)) {
+            return Entry;
+        }
+    }
+    return NULL;
+}
+
+static int
+IsLargePageRun(
+    _In_ VirtualAddress_t   Address,
+    _In_ PhysicalAddress_t* PhysicalAddressValues,
+    _In_ int                PageCount)
+{
+    int i;
+
+    if (!COVERS_LARGE_PAGE(Address, PageCount) || (PhysicalAddressValues[0] % LARGE_PAGE_SIZE)) {
+        return 0;
+    }
+
+    for (i = 1; i < PAGES_PER_LARGE_PAGE; i++) {
+        if (PhysicalAddressValues[i] != PhysicalAddressValues[0] + (i * PAGE_SIZE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static OsStatus_t
+SetLargePage(
+    _In_ PAGE_MASTER_LEVEL* ParentDirectory,
+    _In_ PAGE_MASTER_LEVEL* Directory,
+    _In_ VirtualAddress_t   Address,
+    _In_ PhysicalAddress_t  PhysicalAddress,
+    _In_ unsigned int       X86Attributes,
+    _In_ int                IsCurrent)
+{
+    _Atomic(uint64_t)* Entry;
+    uint64_t           Zero = 0;
+    int                Update;
+
+    // A large page can only be used if nothing is mapped in its space yet, otherwise the
+    // caller maps the range with normal pages
+    Entry = MmVirtualGetDirectoryEntry(ParentDirectory, Directory, Address, IsCurrent, 1, &Update);
+    if (Entry == NULL || !atomic_compare_exchange_strong(Entry, &Zero,
+            (PhysicalAddress & LARGE_PAGE_MASK) | X86Attributes | PAGETABLE_LARGE)) {
+        return OsExists;
+    }
+
+    if (IsCurrent) {
+        memory_invalidate_addr(Address);
+    }
+    return OsSuccess;
+}
+#endif
+
 void
 ArchMmuSwitchMemorySpace(
     SystemMemorySpace_t* MemorySpace)
@@ -275,6 +359,16 @@ ArchMmuGetPageAttributes(
 
     Directory = MmVirtualGetMasterTable(MemorySpace, StartAddress, &ParentDirectory, &IsCurrent);
     while (PageCount) {
+#if defined(__LARGE_PAGES)
+        uint64_t LargeMapping;
+        if (GetLargePageEntry(ParentDirectory, Directory, StartAddress, IsCurrent, &LargeMapping)) {
+            Index = PAGE_TABLE_INDEX(StartAddress);
+            for (; Index < ENTRIES_PER_PAGE && PageCount; Index++, PageCount--, i++, StartAddress += PAGE_SIZE) {
+                AttributeValues[i] = ConvertX86AttributesToGeneric(LargeMapping & ATTRIBUTE_MASK);
+            }
+            continue;
+        }
+#endif
         Table = MmVirtualGetTable(ParentDirectory, Directory, StartAddress, IsCurrent, 0, &Update);
         if (Table == NULL) {
             Status = (i == 0) ? OsDoesNotExist : OsIncomplete;
@@ -318,7 +412,33 @@ ArchMmuUpdatePageAttributes(
     }
     
     Directory = MmVirtualGetMasterTable(MemorySpace, StartAddress, &ParentDirectory, &IsCurrent);
-    while (PageCount) {
+    while (PageCount && Status == OsSuccess) {
+#if defined(__LARGE_PAGES)
+        // Large pages that are updated as a whole keep being large pages, as long as they stay
+        // present. Anything else falls through and gets the large page split.
+        _Atomic(uint64_t)* Entry;
+        uint64_t           LargeMapping;
+        Entry = GetLargePageEntry(ParentDirectory, Directory, StartAddress, IsCurrent, &LargeMapping);
+        if (Entry != NULL && COVERS_LARGE_PAGE(StartAddress, PageCount) && (X86Attributes & PAGE_PRESENT)) {
+            if (!i) {
+                *Attributes = ConvertX86AttributesToGeneric(LargeMapping & ATTRIBUTE_MASK);
+            }
+
+            if (!atomic_compare_exchange_strong(Entry, &LargeMapping,
+                    (LargeMapping & LARGE_PAGE_MASK) | X86Attributes | PAGETABLE_LARGE)) {
+                Status = (i == 0) ? OsBusy : OsIncomplete;
+                break;
+            }
+
+            if (IsCurrent) {
+                memory_invalidate_addr(StartAddress);
+            }
+            PageCount    -= PAGES_PER_LARGE_PAGE;
+            i            += PAGES_PER_LARGE_PAGE;
+            StartAddress += LARGE_PAGE_SIZE;
+            continue;
+        }
+#endif
         Table = MmVirtualGetTable(ParentDirectory, Directory, StartAddress, IsCurrent, 0, &Update);
         if (Table == NULL) {
             Status = (i == 0) ? OsDoesNotExist : OsIncomplete;
@@ -370,6 +490,13 @@ ArchMmuCommitVirtualPage(
 
     Directory = MmVirtualGetMasterTable(MemorySpace, StartAddress, &ParentDirectory, &IsCurrent);
     while (PageCount && Status == OsSuccess) {
+#if defined(__LARGE_PAGES)
+        uint64_t LargeMapping;
+        if (GetLargePageEntry(ParentDirectory, Directory, StartAddress, IsCurrent, &LargeMapping)) {
+            Status = (i == 0) ? OsExists : OsIncomplete;
+            break;
+        }
+#endif
         Table = MmVirtualGetTable(ParentDirectory, Directory, StartAddress, IsCurrent, 0, &Update);
         if (!Table) {
             Status = (i == 0) ? OsDoesNotExist : OsIncomplete;
@@ -440,6 +567,18 @@ ArchMmuSetContiguousVirtualPages(
 
     Directory = MmVirtualGetMasterTable(MemorySpace, StartAddress, &ParentDirectory, &IsCurrent);
     while (PageCount && Status == OsSuccess) {
+#if defined(__LARGE_PAGES)
+        if ((X86Attributes & PAGE_PRESENT) && COVERS_LARGE_PAGE(StartAddress, PageCount) &&
+            !(PhysicalStartAddress % LARGE_PAGE_SIZE) &&
+            SetLargePage(ParentDirectory, Directory, StartAddress, PhysicalStartAddress,
+                X86Attributes, IsCurrent) == OsSuccess) {
+            PageCount            -= PAGES_PER_LARGE_PAGE;
+            i                    += PAGES_PER_LARGE_PAGE;
+            StartAddress         += LARGE_PAGE_SIZE;
+            PhysicalStartAddress += LARGE_PAGE_SIZE;
+            continue;
+        }
+#endif
         Table = MmVirtualGetTable(ParentDirectory, Directory, StartAddress, IsCurrent, 1, &Update);
         assert(Table != NULL);
         
@@ -543,6 +682,16 @@ ArchMmuSetVirtualPages(
 
     Directory = MmVirtualGetMasterTable(MemorySpace, StartAddress, &ParentDirectory, &IsCurrent);
     while (PageCount && Status == OsSuccess) {
+#if defined(__LARGE_PAGES)
+        if ((X86Attributes & PAGE_PRESENT) && IsLargePageRun(StartAddress, &PhysicalAddressValues[i], PageCount) &&
+            SetLargePage(ParentDirectory, Directory, StartAddress, PhysicalAddressValues[i],
+                X86Attributes, IsCurrent) == OsSuccess) {
+            PageCount    -= PAGES_PER_LARGE_PAGE;
+            i            += PAGES_PER_LARGE_PAGE;
+            StartAddress += LARGE_PAGE_SIZE;
+            continue;
+        }
+#endif
         Table = MmVirtualGetTable(ParentDirectory, Directory, StartAddress, IsCurrent, 1, &Update);
         assert(Table != NULL);
         
@@ -585,6 +734,31 @@ ArchMmuClearVirtualPages(
 
     Directory = MmVirtualGetMasterTable(MemorySpace, StartAddress, &ParentDirectory, &IsCurrent);
     while (PageCount && Status == OsSuccess) {
+#if defined(__LARGE_PAGES)
+        // Large pages that are cleared as a whole release the entire run of physical
+        // memory, partial clears fall through and get the large page split
+        _Atomic(uint64_t)* Entry;
+        uint64_t           LargeMapping;
+        Entry = GetLargePageEntry(ParentDirectory, Directory, StartAddress, IsCurrent, &LargeMapping);
+        if (Entry != NULL && COVERS_LARGE_PAGE(StartAddress, PageCount)) {
+            if (!atomic_compare_exchange_strong(Entry, &LargeMapping, 0)) {
+                continue;
+            }
+
+            if (IsCurrent) {
+                memory_invalidate_addr(StartAddress);
+            }
+
+            if (!(LargeMapping & PAGE_PERSISTENT)) {
+                PageAllocatorFreeContiguous(&GetMachine()->PhysicalMemory,
+                    (uintptr_t)(LargeMapping & LARGE_PAGE_MASK), PAGES_PER_LARGE_PAGE);
+            }
+            PageCount    -= PAGES_PER_LARGE_PAGE;
+            i            += PAGES_PER_LARGE_PAGE;
+            StartAddress += LARGE_PAGE_SIZE;
+            continue;
+        }
+#endif
         Table = MmVirtualGetTable(ParentDirectory, Directory, StartAddress, IsCurrent, 0, &Update);
         if (Table == NULL) {
             Status = (i == 0) ? OsDoesNotExist : OsIncomplete;
@@ -603,9 +777,7 @@ ArchMmuClearVirtualPages(
             // is marked as present, otherwise we don't
             if ((Mapping & PAGE_PRESENT) && !(Mapping & PAGE_PERSISTENT)) {
                 Mapping &= PAGE_MASK;
-                IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-                bounded_stack_push(&GetMachine()->PhysicalMemory, (void*)Mapping);
-                IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+                PageAllocatorFree(&GetMachine()->PhysicalMemory, 1, &Mapping);
             }
         }
     }
@@ -632,6 +804,19 @@ ArchMmuVirtualToPhysical(
     
     Directory = MmVirtualGetMasterTable(MemorySpace, StartAddress, &ParentDirectory, &IsCurrent);
     while (PageCount && Status == OsSuccess) {
+#if defined(__LARGE_PAGES)
+        uint64_t LargeMapping;
+        if (GetLargePageEntry(ParentDirectory, Directory, StartAddress, IsCurrent, &LargeMapping)) {
+            Index = PAGE_TABLE_INDEX(StartAddress);
+            for (; Index < ENTRIES_PER_PAGE && PageCount; Index++, PageCount--, i++, StartAddress += PAGE_SIZE) {
+                PhysicalAddressValues[i] = (LargeMapping & LARGE_PAGE_MASK) + (Index * PAGE_SIZE);
+                if (!i) {
+                    PhysicalAddressValues[i] |= StartAddress & ATTRIBUTE_MASK;
+                }
+            }
+            continue;
+        }
+#endif
         Table = MmVirtualGetTable(ParentDirectory, Directory, StartAddress, IsCurrent, 0, &Update);
         if (Table == NULL) {
             Status = (i == 0) ? OsDoesNotExist : OsIncomplete;
@@ -652,6 +837,16 @@ ArchMmuVirtualToPhysical(
     return Status;
 }
 
+size_t
+ArchMmuGetLargePageSize(void)
+{
+#if defined(__LARGE_PAGES)
+    return LARGE_PAGE_SIZE;
+#else
+    return 0;
+#endif
+}
+
 OsStatus_t
 SetDirectIoAccess(
     _In_ UUId_t               CoreId,
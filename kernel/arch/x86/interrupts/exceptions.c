@@ -51,6 +51,7 @@ HardFault(
     uintptr_t Base  = 0;
     char *Name      = NULL;
     LogSetRenderMode(1);
+    LogFlush();
 
     // Was it a page-fault?
     if (PFAddress != __MASK) {
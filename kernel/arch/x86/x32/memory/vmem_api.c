@@ -269,10 +269,8 @@ DestroyVirtualSpace(
 
             // If it has a mapping - free it
             if ((CurrentMapping & PAGE_MASK) != 0) {
-                CurrentMapping &= PAGE_MASK;
-                IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-                bounded_stack_push(&GetMachine()->PhysicalMemory, (void*)CurrentMapping);
-                IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+                uintptr_t PhysicalPage = (uintptr_t)(CurrentMapping & PAGE_MASK);
+                PageAllocatorFree(&GetMachine()->PhysicalMemory, 1, &PhysicalPage);
             }
         }
         kfree(Table);
@@ -71,8 +71,8 @@ MmVirtualGetMasterTable(
     return Directory;
 }
 
-PageTable_t*
-MmVirtualGetTable(
+static PageDirectory_t*
+MmVirtualGetDirectory(
 	_In_  PageMasterTable_t*    ParentPageMasterTable,
 	_In_  PageMasterTable_t*    PageMasterTable,
 	_In_  VirtualAddress_t      VirtualAddress,
@@ -82,7 +82,6 @@ MmVirtualGetTable(
 {
     PageDirectoryTable_t* DirectoryTable = NULL;
     PageDirectory_t*      Directory      = NULL;
-	PageTable_t*          Table          = NULL;
 	uintptr_t             Physical       = 0;
     unsigned int               CreateFlags    = PAGE_PRESENT | PAGE_WRITE;
     uint64_t              ParentMapping;
@@ -91,7 +90,6 @@ MmVirtualGetTable(
     // Initialize indices and variables
     int PmIndex     = PAGE_LEVEL_4_INDEX(VirtualAddress);
     int PdpIndex    = PAGE_DIRECTORY_POINTER_INDEX(VirtualAddress);
-    int PdIndex     = PAGE_DIRECTORY_INDEX(VirtualAddress);
     *Update         = 0;
     
     if (VirtualAddress > MEMORY_LOCATION_KERNEL_END) {
@@ -154,7 +152,7 @@ SyncPmlWithParent:
 
             // Update our copy
             atomic_store(&PageMasterTable->pTables[PmIndex], Physical);
-            PageMasterTable->vTables[PmIndex] = (uintptr_t)Table;
+            PageMasterTable->vTables[PmIndex] = (uintptr_t)DirectoryTable;
             *Update                           = IsCurrent;
         }
     }
@@ -195,14 +193,96 @@ SyncPdp:
         *Update                           = IsCurrent;
     }
 
-    // Sanitize the status of the allocation/synchronization
+    return Directory;
+}
+
+_Atomic(uint64_t)*
+MmVirtualGetDirectoryEntry(
+	_In_  PageMasterTable_t*    ParentPageMasterTable,
+	_In_  PageMasterTable_t*    PageMasterTable,
+	_In_  VirtualAddress_t      VirtualAddress,
+    _In_  int                   IsCurrent,
+    _In_  int                   CreateIfMissing,
+    _Out_ int*                  Update)
+{
+    PageDirectory_t* Directory = MmVirtualGetDirectory(ParentPageMasterTable, PageMasterTable,
+        VirtualAddress, IsCurrent, CreateIfMissing, Update);
+    if (Directory == NULL) {
+        return NULL;
+    }
+    return &Directory->pTables[PAGE_DIRECTORY_INDEX(VirtualAddress)];
+}
+
+static PageTable_t*
+MmVirtualSplitLargePage(
+    _In_    PageDirectory_t* Directory,
+    _In_    int              PdIndex,
+    _InOut_ uint64_t*        Mapping,
+    _In_    unsigned int     CreateFlags)
+{
+    PageTable_t* Table;
+    uintptr_t    Physical;
+    uint64_t     Address    = *Mapping & LARGE_PAGE_MASK;
+    uint64_t     Attributes = *Mapping & (ATTRIBUTE_MASK & ~PAGETABLE_LARGE);
+
+    // Build a page-table that maps the exact same memory with the same attributes before
+    // swapping it in, so the mapping never changes for anyone walking the tables meanwhile
+    Table = (PageTable_t*)kmalloc_p(sizeof(PageTable_t), &Physical);
+    assert(Table != NULL);
+    for (int Index = 0; Index < ENTRIES_PER_PAGE; Index++) {
+        atomic_store_explicit(&Table->Pages[Index], (Address + (Index * PAGE_SIZE)) | Attributes,
+            memory_order_relaxed);
+    }
+
+    Physical |= CreateFlags;
+    if (!atomic_compare_exchange_strong(&Directory->pTables[PdIndex], Mapping, Physical)) {
+        // Someone else changed the entry, let the caller inspect it again
+        kfree((void*)Table);
+        return NULL;
+    }
+    Directory->vTables[PdIndex] = (uint64_t)Table;
+    return Table;
+}
+
+PageTable_t*
+MmVirtualGetTable(
+	_In_  PageMasterTable_t*    ParentPageMasterTable,
+	_In_  PageMasterTable_t*    PageMasterTable,
+	_In_  VirtualAddress_t      VirtualAddress,
+    _In_  int                   IsCurrent,
+    _In_  int                   CreateIfMissing,
+    _Out_ int*                  Update)
+{
+    PageDirectory_t* Directory;
+	PageTable_t*     Table       = NULL;
+	uintptr_t        Physical    = 0;
+    unsigned int     CreateFlags = PAGE_PRESENT | PAGE_WRITE;
+    uint64_t         ParentMapping;
+    int              Result;
+    int              PdIndex     = PAGE_DIRECTORY_INDEX(VirtualAddress);
+
+    if (VirtualAddress > MEMORY_LOCATION_KERNEL_END) {
+        CreateFlags |= PAGE_USER;
+    }
+
+    Directory = MmVirtualGetDirectory(ParentPageMasterTable, PageMasterTable,
+        VirtualAddress, IsCurrent, CreateIfMissing, Update);
     if (Directory == NULL) {
         return NULL;
     }
 
     ParentMapping = atomic_load(&Directory->pTables[PdIndex]);
 SyncPd:
-    if (ParentMapping & PAGE_PRESENT) {
+    if ((ParentMapping & PAGE_PRESENT) && (ParentMapping & PAGETABLE_LARGE)) {
+        // The caller needs the page-table, so a large page covering the address
+        // must be split up into normal pages first
+        Table = MmVirtualSplitLargePage(Directory, PdIndex, &ParentMapping, CreateFlags);
+        if (Table == NULL) {
+            goto SyncPd;
+        }
+        *Update = IsCurrent;
+    }
+    else if (ParentMapping & PAGE_PRESENT) {
         Table = (PageTable_t*)Directory->vTables[PdIndex];
         assert(Table != NULL);
     }
@@ -338,10 +418,8 @@ MmVirtualDestroyPageTable(
         }
 
         if ((Mapping & PAGE_MASK) != 0) {
-            Mapping &= PAGE_MASK;
-            IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-            bounded_stack_push(&GetMachine()->PhysicalMemory, (void*)Mapping);
-            IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+            uintptr_t PhysicalPage = (uintptr_t)(Mapping & PAGE_MASK);
+            PageAllocatorFree(&GetMachine()->PhysicalMemory, 1, &PhysicalPage);
         }
     }
     kfree(PageTable);
@@ -360,6 +438,13 @@ MmVirtualDestroyPageDirectory(
         if ((Mapping & PAGETABLE_INHERITED) || !(Mapping & PAGE_PRESENT)) {
             continue;
         }
+
+        // Large pages share the bit of inherited tables for being persistent
+        if (Mapping & PAGETABLE_LARGE) {
+            PageAllocatorFreeContiguous(&GetMachine()->PhysicalMemory,
+                (uintptr_t)(Mapping & LARGE_PAGE_MASK), PAGES_PER_LARGE_PAGE);
+            continue;
+        }
         MmVirtualDestroyPageTable((PageTable_t*)PageDirectory->vTables[Index]);
     }
     kfree(PageDirectory);
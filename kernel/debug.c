@@ -158,6 +158,7 @@ DebugPanic(
     vsprintf(&MessageBuffer[0], Message, Arguments);
     va_end(Arguments);
     LogSetRenderMode(1);
+    LogFlush();
     LogAppendMessage(LOG_ERROR, &MessageBuffer[0]);
     
     // Log cpu and threads
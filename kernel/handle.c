@@ -26,36 +26,83 @@
 //#define __TRACE
 
 #include <ddk/barrier.h>
-#include <ds/list.h>
-#include <ds/queue.h>
+#include <ds/hashtable.h>
 #include <debug.h>
 #include <handle.h>
 #include <heap.h>
+#include <irq_spinlock.h>
+#include <mutex.h>
 #include <threading.h>
 #include <string.h>
 
+// Handles are slots in a two level table, the lower bits of a handle select the slot
+// and the upper bits are the generation of the slot, which is increased every time
+// the slot is reused. The chunks of slots are never freed, so the table can be read
+// without locks, and a handle is valid as long as the slot carries the same id.
+#define HANDLE_INDEX_BITS      21
+#define HANDLE_CHUNK_BITS      8
+#define HANDLE_MAX_SLOTS       (1U << HANDLE_INDEX_BITS)
+#define HANDLE_SLOTS_PER_CHUNK (1U << HANDLE_CHUNK_BITS)
+#define HANDLE_CHUNK_COUNT     (HANDLE_MAX_SLOTS / HANDLE_SLOTS_PER_CHUNK)
+#define HANDLE_GENERATION_MASK ((1U << (32 - HANDLE_INDEX_BITS)) - 1)
+
+#define HANDLE_INDEX(Handle)      ((Handle) & (HANDLE_MAX_SLOTS - 1))
+#define HANDLE_GENERATION(Handle) ((Handle) >> HANDLE_INDEX_BITS)
+
 typedef struct ResourceHandle {
-    void*              Resource;
-    atomic_int         References;
-    HandleType_t       Type;
-    unsigned int            Flags;
-    HandleDestructorFn Destructor;
-    element_t*         PathHeader;
-    element_t          Header;
+    _Atomic(UUId_t)        Id;   // UUID_INVALID while the slot is free
+    atomic_int             References;
+    UUId_t                 Key;  // The last id given to the slot
+    HandleType_t           Type;
+    unsigned int           Flags;
+    void*                  Resource;
+    HandleDestructorFn     Destructor;
+    char*                  Path;
+    struct ResourceHandle* Link; // Free list or cleanup list
 } ResourceHandle_t;
 
-static Semaphore_t     EventHandle   = SEMAPHORE_INIT(0, 1);
-static queue_t         CleanQueue    = QUEUE_INIT;
-static list_t          Handles       = LIST_INIT;                      // TODO: hashtable
-static list_t          PathRegister  = LIST_INIT_CMP(list_cmp_string); // TODO: hashtable
-static UUId_t          JanitorHandle = UUID_INVALID;
-static _Atomic(UUId_t) HandleIdGen   = ATOMIC_VAR_INIT(1); // 0 is reserved for invalid
+static Semaphore_t        EventHandle   = SEMAPHORE_INIT(0, 1);
+static IrqSpinlock_t      CleanLock     = OS_IRQ_SPINLOCK_INIT;
+static ResourceHandle_t*  CleanHandles  = NULL;
+static UUId_t             JanitorHandle = UUID_INVALID;
+
+// Slots are reused in the order they were freed, so a slot goes through as many
+// generations as possible before the id of a destroyed handle comes back
+static Mutex_t            SlotsLock     = OS_MUTEX_INIT(MUTEX_PLAIN);
+static ResourceHandle_t*  FreeSlots     = NULL;
+static ResourceHandle_t*  FreeSlotsTail = NULL;
+static UUId_t             SlotCount     = 0;
+static _Atomic(uintptr_t) SlotChunks[HANDLE_CHUNK_COUNT];
+
+// Paths are hashed to the handle instance, the generation changes whenever a path is
+// registered or removed, which invalidates the path caches of the senders
+static Mutex_t               PathLock       = OS_MUTEX_INIT(MUTEX_PLAIN);
+static HashTable_t*          PathRegister   = NULL;
+static _Atomic(unsigned int) PathGeneration = ATOMIC_VAR_INIT(1);
 
 static inline ResourceHandle_t*
 LookupHandleInstance(
     _In_ UUId_t Handle)
 {
-    return (ResourceHandle_t*)list_find_value(&Handles, (void*)(uintptr_t)Handle);
+    ResourceHandle_t* Chunk;
+    ResourceHandle_t* Instance;
+    UUId_t            Index = HANDLE_INDEX(Handle);
+
+    if (Handle == UUID_INVALID) {
+        return NULL;
+    }
+
+    Chunk = (ResourceHandle_t*)atomic_load_explicit(
+        &SlotChunks[Index >> HANDLE_CHUNK_BITS], memory_order_acquire);
+    if (!Chunk) {
+        return NULL;
+    }
+
+    Instance = &Chunk[Index & (HANDLE_SLOTS_PER_CHUNK - 1)];
+    if (atomic_load_explicit(&Instance->Id, memory_order_acquire) != Handle) {
+        return NULL;
+    }
+    return Instance;
 }
 
 static inline ResourceHandle_t*
@@ -75,23 +122,153 @@ LookupSafeHandleInstance(
     return Instance;
 }
 
+// The slot can be reused while the resource is read, which is detected by checking
+// the id of the slot again once the resource has been read
+static void*
+ReadHandleResource(
+    _In_ UUId_t Handle,
+    _In_ int    Type)
+{
+    ResourceHandle_t* Instance = LookupSafeHandleInstance(Handle);
+    void*             Resource;
+    if (!Instance) {
+        return NULL;
+    }
+    
+    smp_rmb();
+    Resource = Instance->Resource;
+    if (Type != -1 && Instance->Type != (HandleType_t)Type) {
+        Resource = NULL;
+    }
+
+    smp_rmb();
+    if (atomic_load(&Instance->Id) != Handle) {
+        return NULL;
+    }
+    return Resource;
+}
+
+static ResourceHandle_t*
+AllocateHandleSlot(void)
+{
+    ResourceHandle_t* Instance = NULL;
+    ResourceHandle_t* Chunk;
+    UUId_t            Index;
+
+    MutexLock(&SlotsLock);
+    if (FreeSlots) {
+        Instance  = FreeSlots;
+        FreeSlots = Instance->Link;
+        if (!FreeSlots) {
+            FreeSlotsTail = NULL;
+        }
+    }
+    else if (SlotCount < HANDLE_MAX_SLOTS) {
+        Index = SlotCount;
+        Chunk = (ResourceHandle_t*)atomic_load(&SlotChunks[Index >> HANDLE_CHUNK_BITS]);
+        if (!Chunk) {
+            Chunk = (ResourceHandle_t*)kmalloc(sizeof(ResourceHandle_t) * HANDLE_SLOTS_PER_CHUNK);
+            if (Chunk) {
+                memset(Chunk, 0, sizeof(ResourceHandle_t) * HANDLE_SLOTS_PER_CHUNK);
+                atomic_store_explicit(&SlotChunks[Index >> HANDLE_CHUNK_BITS],
+                    (uintptr_t)Chunk, memory_order_release);
+            }
+        }
+
+        if (Chunk) {
+            Instance      = &Chunk[Index & (HANDLE_SLOTS_PER_CHUNK - 1)];
+            Instance->Key = Index;
+            SlotCount++;
+        }
+    }
+    MutexUnlock(&SlotsLock);
+    return Instance;
+}
+
+static void
+FreeHandleSlot(
+    _In_ ResourceHandle_t* Instance)
+{
+    atomic_store(&Instance->Id, UUID_INVALID);
+    Instance->Link = NULL;
+
+    MutexLock(&SlotsLock);
+    if (FreeSlotsTail) {
+        FreeSlotsTail->Link = Instance;
+    }
+    else {
+        FreeSlots = Instance;
+    }
+    FreeSlotsTail = Instance;
+    MutexUnlock(&SlotsLock);
+}
+
+static inline DataKey_t
+GetPathKey(
+    _In_ const char* Path)
+{
+    DataKey_t Key;
+    Key.Value.String.Pointer = Path;
+    Key.Value.String.Length  = 0;
+    return Key;
+}
+
+static void
+RemoveHandlePath(
+    _In_ ResourceHandle_t* Instance)
+{
+    MutexLock(&PathLock);
+    HashTableRemove(PathRegister, GetPathKey(Instance->Path));
+    atomic_fetch_add(&PathGeneration, 1);
+    MutexUnlock(&PathLock);
+}
+
+// Drops a reference, the last reference hands the handle to the janitor, which
+// destroys the resource and frees the slot
+static void
+ReleaseHandleInstance(
+    _In_ ResourceHandle_t* Instance)
+{
+    int References = atomic_fetch_sub(&Instance->References, 1);
+    if ((References - 1) == 0) {
+        TRACE("[destroy_handle] cleaning up %u", atomic_load(&Instance->Id));
+        if (Instance->Path) {
+            RemoveHandlePath(Instance);
+        }
+
+        IrqSpinlockAcquire(&CleanLock);
+        Instance->Link = CleanHandles;
+        CleanHandles   = Instance;
+        IrqSpinlockRelease(&CleanLock);
+        SemaphoreSignal(&EventHandle, 1);
+    }
+}
+
+// References are only ever taken while the handle is alive, and the id is checked
+// again once the reference is taken, as the slot might have been reused meanwhile
 static ResourceHandle_t*
 AcquireHandleInstance(
     _In_ UUId_t Handle)
 {
     ResourceHandle_t* Instance = LookupHandleInstance(Handle);
-    int               PreviousReferences;
+    int               References;
     if (!Instance) {
-        WARNING("[acquire_handle] failed to find %u");
+        WARNING("[acquire_handle] failed to find %u", Handle);
         return NULL;
     }
 
-    PreviousReferences = atomic_fetch_add(&Instance->References, 1);
-    if (PreviousReferences <= 0) {
-        // Special case, to prevent race-conditioning. If the reference
-        // count ever reach 0 this was called on cleanup.
-        WARNING("[acquire_handle] handle was destroyed %u: %i",
-            Handle, PreviousReferences);
+    References = atomic_load(&Instance->References);
+    do {
+        if (References <= 0) {
+            WARNING("[acquire_handle] handle was destroyed %u: %i",
+                Handle, References);
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak(&Instance->References, &References, References + 1));
+
+    if (atomic_load(&Instance->Id) != Handle) {
+        ReleaseHandleInstance(Instance);
+        WARNING("[acquire_handle] handle was destroyed %u", Handle);
         return NULL;
     }
     return Instance;
@@ -104,24 +281,31 @@ CreateHandle(
     _In_ void*              Resource)
 {
     ResourceHandle_t* Instance;
+    UUId_t            Generation;
     UUId_t            HandleId;
     
-    Instance = (ResourceHandle_t*)kmalloc(sizeof(ResourceHandle_t));
+    Instance = AllocateHandleSlot();
     if (!Instance) {
+        ERROR("[create_handle] out of handles");
         return UUID_INVALID;
     }
     
-    HandleId = atomic_fetch_add(&HandleIdGen, 1);
-    memset(Instance, 0, sizeof(ResourceHandle_t));
+    // Generation 0 is skipped, so no handle is ever UUID_INVALID
+    Generation = (HANDLE_GENERATION(Instance->Key) + 1) & HANDLE_GENERATION_MASK;
+    if (!Generation) {
+        Generation = 1;
+    }
+    HandleId = (Generation << HANDLE_INDEX_BITS) | HANDLE_INDEX(Instance->Key);
     
-    ELEMENT_INIT(&Instance->Header, (uintptr_t)HandleId, Instance);
+    Instance->Key        = HandleId;
     Instance->Type       = Type;
+    Instance->Flags      = 0;
     Instance->Resource   = Resource;
     Instance->Destructor = Destructor;
-    Instance->References = ATOMIC_VAR_INIT(1);
-    smp_wmb();
-    
-    list_append(&Handles, &Instance->Header);
+    Instance->Path       = NULL;
+    Instance->Link       = NULL;
+    atomic_store(&Instance->Id, HandleId);
+    atomic_store(&Instance->References, 1);
     
     TRACE("[create_handle] => id %u", HandleId);
     return HandleId;
@@ -150,9 +334,7 @@ RegisterHandlePath(
     _In_ const char* Path)
 {
     ResourceHandle_t* Instance;
-    UUId_t            ExistingHandle;
     char*             PathKey;
-    OsStatus_t        Status;
     TRACE("[handle_register_path] %u => %s", Handle, Path);
     
     if (!Path) {
@@ -166,28 +348,23 @@ RegisterHandlePath(
         return OsDoesNotExist;
     }
     
-    Status = LookupHandleByPath(Path, &ExistingHandle);
-    if (Instance->PathHeader || Status != OsDoesNotExist) {
-        ERROR("[handle_register_path] path already registered [%u]", Status);
-        return OsExists;
-    }
-    
-    Instance->PathHeader = kmalloc(sizeof(element_t));
-    if (!Instance->PathHeader) {
-        return OsOutOfMemory;
-    }
-    
     PathKey = strdup(Path);
     if (!PathKey) {
-        kfree(Instance->PathHeader);
-        Instance->PathHeader = NULL;
         return OsOutOfMemory;
     }
     
-    ELEMENT_INIT(Instance->PathHeader, PathKey, Instance);
-    smp_wmb();
+    MutexLock(&PathLock);
+    if (Instance->Path || HashTableGetValue(PathRegister, GetPathKey(PathKey))) {
+        MutexUnlock(&PathLock);
+        kfree(PathKey);
+        ERROR("[handle_register_path] path already registered");
+        return OsExists;
+    }
     
-    list_append(&PathRegister, Instance->PathHeader);
+    Instance->Path = PathKey;
+    HashTableInsert(PathRegister, GetPathKey(PathKey), Instance);
+    atomic_fetch_add(&PathGeneration, 1);
+    MutexUnlock(&PathLock);
     return OsSuccess;
 }
 
@@ -199,28 +376,54 @@ LookupHandleByPath(
     ResourceHandle_t* Instance;
     TRACE("[handle_lookup_by_path] %s", Path);
     
-    Instance = list_find_value(&PathRegister, (void*)Path);
-    if (!Instance) {
+    MutexLock(&PathLock);
+    Instance = HashTableGetValue(PathRegister, GetPathKey(Path));
+    if (Instance) {
+        *HandleOut = atomic_load(&Instance->Id);
+    }
+    MutexUnlock(&PathLock);
+    
+    if (!Instance || *HandleOut == UUID_INVALID) {
         WARNING("[handle_lookup_by_path] %s not found", Path);
         return OsDoesNotExist;
     }
-    
-    smp_rmb();
-    *HandleOut = (UUId_t)(uintptr_t)Instance->Header.key;
     return OsSuccess;
 }
 
+OsStatus_t
+LookupHandleByPathCached(
+    _In_  const char*        Path,
+    _In_  HandlePathCache_t* Cache,
+    _Out_ UUId_t*            HandleOut)
+{
+    unsigned int Generation = atomic_load(&PathGeneration);
+    size_t       Length;
+    OsStatus_t   Status;
+
+    // The generation is read before the lookup, so a change meanwhile invalidates the entry
+    if (Cache->Generation == Generation &&
+        !strncmp(&Cache->Path[0], Path, HANDLE_PATH_CACHE_LENGTH)) {
+        *HandleOut = Cache->Handle;
+        return OsSuccess;
+    }
+
+    Status = LookupHandleByPath(Path, HandleOut);
+    if (Status == OsSuccess) {
+        Length = strnlen(Path, HANDLE_PATH_CACHE_LENGTH);
+        if (Length < HANDLE_PATH_CACHE_LENGTH) {
+            memcpy(&Cache->Path[0], Path, Length + 1);
+            Cache->Handle     = *HandleOut;
+            Cache->Generation = Generation;
+        }
+    }
+    return Status;
+}
+
 void*
 LookupHandle(
     _In_ UUId_t Handle)
 {
-    ResourceHandle_t* Instance = LookupSafeHandleInstance(Handle);
-    if (!Instance) {
-        return NULL;
-    }
-    
-    smp_rmb();
-    return Instance->Resource;
+    return ReadHandleResource(Handle, -1);
 }
 
 void*
@@ -228,16 +431,7 @@ LookupHandleOfType(
     _In_ UUId_t       Handle,
     _In_ HandleType_t Type)
 {
-    ResourceHandle_t* Instance = LookupSafeHandleInstance(Handle);
-    if (!Instance) {
-        return NULL;
-    }
-    
-    smp_rmb();
-    if (Instance->Type != Type) {
-        return NULL;
-    }
-    return Instance->Resource;
+    return ReadHandleResource(Handle, (int)Type);
 }
 
 void
@@ -245,51 +439,41 @@ DestroyHandle(
     _In_ UUId_t Handle)
 {
     ResourceHandle_t* Instance = LookupSafeHandleInstance(Handle);
-    int               References;
     if (!Instance) {
         return;
     }
     TRACE("[destroy_handle] => %u", Handle);
-
-    References = atomic_fetch_sub(&Instance->References, 1);
-    if ((References - 1) == 0) {
-        TRACE("[destroy_handle] cleaning up %u", Handle);
-        if (Instance->PathHeader) {
-            list_remove(&PathRegister, Instance->PathHeader);
-        }
-        
-        list_remove(&Handles, &Instance->Header);
-        queue_push(&CleanQueue, &Instance->Header);
-        SemaphoreSignal(&EventHandle, 1);
-    }
+    ReleaseHandleInstance(Instance);
 }
 
 static void
 HandleJanitorThread(
     _In_Opt_ void* Args)
 {
-    element_t*        Element;
     ResourceHandle_t* Instance;
+    ResourceHandle_t* Next;
     int               Run = 1;
     _CRT_UNUSED(Args);
     
     while (Run) {
         SemaphoreWait(&EventHandle, 0);
         
-        Element = queue_pop(&CleanQueue);
-        while (Element) {
+        IrqSpinlockAcquire(&CleanLock);
+        Instance     = CleanHandles;
+        CleanHandles = NULL;
+        IrqSpinlockRelease(&CleanLock);
+        
+        while (Instance) {
             smp_rmb();
-            Instance = (ResourceHandle_t*)Element->value;
+            Next = Instance->Link;
             if (Instance->Destructor) {
                 Instance->Destructor(Instance->Resource);
             }
-            if (Instance->PathHeader) {
-                kfree((void*)Instance->PathHeader->key);
-                kfree((void*)Instance->PathHeader);
+            if (Instance->Path) {
+                kfree(Instance->Path);
             }
-            kfree(Instance);
-            
-            Element = queue_pop(&CleanQueue);
+            FreeHandleSlot(Instance);
+            Instance = Next;
         }
     }
 }
@@ -297,6 +481,7 @@ HandleJanitorThread(
 OsStatus_t
 InitializeHandles(void)
 {
+    PathRegister = HashTableCreate(KeyString, 64, HASHTABLE_DEFAULT_LOADFACTOR);
     return OsSuccess;
 }
 
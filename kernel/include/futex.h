@@ -26,6 +26,23 @@
 #include <os/osdefs.h>
 #include <os/futex.h>
 
+struct FutexBucket;
+struct SchedulerObject;
+
+// The wait node of a thread, it is embedded in the thread so waiting and waking
+// never allocates. The thread is linked into a futex bucket while Bucket is set.
+typedef struct FutexWaiter {
+    struct FutexWaiter*     Link;
+    struct FutexWaiter*     Previous;
+    struct FutexBucket*     Bucket;
+    struct SchedulerObject* Object;
+    void*                   Context;
+    uintptr_t               Address;
+} FutexWaiter_t;
+
+/* FutexInitialize
+ * Allocates the futex buckets, the number of buckets is scaled by the number of cores
+ * in the machine so it must be called after the cores have been enumerated. */
 KERNELAPI void KERNELABI
 FutexInitialize(void);
 
@@ -61,7 +78,9 @@ FutexWake(
     _In_ int           Flags);
 
 /* FutexWakeOperation
- * Wakes up a blocked thread on the given atomic variable. */
+ * Performs the operation on the second atomic variable, then wakes up to Count threads
+ * blocked on the first. If the comparison holds for the previous value of the second
+ * variable, up to Count2 threads blocked on it are woken as well. */
 KERNELAPI OsStatus_t KERNELABI
 FutexWakeOperation(
     _In_ _Atomic(int)* Futex,
@@ -71,4 +90,17 @@ FutexWakeOperation(
     _In_ int           Operation,
     _In_ int           Flags);
 
+/* FutexRequeue
+ * Wakes up to Count threads blocked on the first atomic variable, and moves up to Count2
+ * of the remaining onto the second without waking them. Nothing is done if the first
+ * variable no longer holds the expected value. */
+KERNELAPI OsStatus_t KERNELABI
+FutexRequeue(
+    _In_ _Atomic(int)* Futex,
+    _In_ int           Count,
+    _In_ _Atomic(int)* Futex2,
+    _In_ int           Count2,
+    _In_ int           ExpectedValue,
+    _In_ int           Flags);
+
 #endif //!__FUTEX_H__
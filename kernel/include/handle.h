@@ -38,6 +38,16 @@ typedef enum HandleType {
 
 typedef void (*HandleDestructorFn)(void*);
 
+// Remembers the handle a path resolved to, the cache is invalidated whenever a path is
+// registered or removed. Only paths that fit in the cache are cached.
+#define HANDLE_PATH_CACHE_LENGTH 64
+
+typedef struct HandlePathCache {
+    unsigned int Generation;
+    UUId_t       Handle;
+    char         Path[HANDLE_PATH_CACHE_LENGTH];
+} HandlePathCache_t;
+
 KERNELAPI OsStatus_t KERNELABI
 InitializeHandles(void);
 
@@ -46,7 +56,8 @@ InitializeHandleJanitor(void);
 
 /**
  * CreateHandle
- * * Allocates a new handle for a system resource with a reference of 1.
+ * * Allocates a new handle for a system resource with a reference of 1. Returns
+ * * UUID_INVALID if the handle table is full.
  */
 KERNELAPI UUId_t KERNELABI
 CreateHandle(
@@ -85,6 +96,21 @@ LookupHandleByPath(
     _In_  const char* Path,
     _Out_ UUId_t*     HandleOut);
 
+/**
+ * LookupHandleByPathCached
+ * * Resolves a handle from the given path like LookupHandleByPath, but returns the
+ * * handle from the cache if the same path was resolved before, and the registered
+ * * paths did not change since. The cache must be zero initialized before first use.
+ * @param Path      [In]  The path to resolve a handle for.
+ * @param Cache     [In]  The cache of the caller.
+ * @param HandleOut [Out] A pointer to handle storage.
+ */
+KERNELAPI OsStatus_t KERNELABI
+LookupHandleByPathCached(
+    _In_  const char*        Path,
+    _In_  HandlePathCache_t* Cache,
+    _Out_ UUId_t*            HandleOut);
+
 /**
  * AcquireHandle
  * * Acquires the handle given for the calling process. This can fail if the handle
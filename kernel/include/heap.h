@@ -23,6 +23,7 @@
 #define __VALI_HEAP_H__
 
 #include <os/osdefs.h>
+#include <os/types/heap.h>
 
 typedef struct MemoryCache MemoryCache_t;
 
@@ -32,7 +33,7 @@ typedef struct MemoryCache MemoryCache_t;
 
 // Configuration options for caches
 #define HEAP_CACHE_DEFAULT        0x04 // Only set for fixed size caches
-#define HEAP_SLAB_NO_ATOMIC_CACHE 0x08 // Set to disable smp optimizations
+#define HEAP_SLAB_NO_ATOMIC_CACHE 0x08 // Set to disable the per-core magazines
 #define HEAP_INITIAL_SLAB         0x10 // Set to allocate the initial slab
 #define HEAP_SINGLE_SLAB          0x20 // Set to disable multiple slabs
 
@@ -67,10 +68,30 @@ void MemoryCacheFree(MemoryCache_t* Cache, void* Object);
 void MemoryCacheDestroy(MemoryCache_t* Cache);
 
 // MemoryCacheReap
-// Performs memory cleanup on all system caches, also shrinks them if possible
-// to free up memory. Returns number of pages freed.
+// Returns the objects in the depots to their slabs, and frees the slabs that are entirely
+// free in all system caches. Returns number of pages freed. The heap also registers itself
+// as a shrinker, so this is run by the memory reclaim thread when memory runs low.
 int MemoryCacheReap(void);
 
+// MemoryCacheQuery
+// Fills in the statistics of up to MaxCount of the caches in the system. Returns the total
+// number of caches, which can be more than MaxCount. Statistics must be a kernel buffer, it
+// is written with the cache list locked.
+KERNELAPI int KERNELABI
+MemoryCacheQuery(
+    _In_ HeapCacheStatistics_t* Statistics,
+    _In_ int                    MaxCount);
+
+// MemoryCacheProfile
+// Every SampleInterval'th allocation records its caller and size, zero disables sampling
+// and a negative interval leaves it unchanged. Copies up to MaxCount of the most recent
+// samples, oldest first, and returns the number of samples available.
+KERNELAPI int KERNELABI
+MemoryCacheProfile(
+    _In_ int                  SampleInterval,
+    _In_ HeapProfileSample_t* Samples,
+    _In_ int                  MaxCount);
+
 // MemoryCacheDump
 // Dumps information about the cache and the slabs allocated for it.
 // If NULL is passed the fixed size caches will be dumped.
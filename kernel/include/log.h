@@ -27,6 +27,8 @@
 
 #define LOG_INITIAL_SIZE   (1024 * 4)
 #define LOG_PREFFERED_SIZE (1024 * 65)
+#define LOG_CORE_LINES     256 // Must be a power of two
+#define LOG_BOOT_LINES     64  // Must be a power of two
 
 #define LOG_RAW     0
 #define LOG_TRACE   1
@@ -41,7 +43,8 @@ KERNELAPI void KERNELABI
 LogInitialize(void);
 
 /* LogInitializeFull
- * Upgrades the log to a larger buffer, initializing pipes and installs the message thread. */
+ * Upgrades the log to a larger buffer, creates a message ring for every core and installs
+ * the log thread that renders them. */
 KERNELAPI void KERNELABI
 LogInitializeFull(void);
 
@@ -52,9 +55,22 @@ KERNELAPI void KERNELABI
 LogSetRenderMode(
     _In_ int Enable);
 
+/* LogWakeDeferred
+ * Called on the timer tick, wakes the log thread for messages that were appended with
+ * interrupts disabled, where the thread can't be woken directly. */
+KERNELAPI void KERNELABI
+LogWakeDeferred(void);
+
+/* LogFlush
+ * Renders all pending messages on the calling core, and every message appended after
+ * this, instead of leaving them for the log thread. Used by the panic paths. */
+KERNELAPI void KERNELABI
+LogFlush(void);
+
 /* LogAppendMessage
- * Appends a new message of the given parameters to the global log object. If the buffer
- * reaches the end wrap-around will happen. */
+ * Appends a new message of the given parameters to the ring of the calling core, the
+ * message is dropped and counted if the ring is full. The log thread renders the rings
+ * in the order of the message timestamps. */
 KERNELAPI void KERNELABI
 LogAppendMessage(
     _In_ int         Type,
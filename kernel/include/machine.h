@@ -25,12 +25,12 @@
 #ifndef __VALI_MACHINE__
 #define __VALI_MACHINE__
 
-#include <ds/bounded_stack.h>
 #include <os/osdefs.h>
 #include <os/mollenos.h>
 #include <irq_spinlock.h>
 #include <multiboot.h>
 #include <time.h>
+#include <utils/page_allocator.h>
 #include <utils/static_memory_pool.h>
 
 // Components
@@ -53,8 +53,7 @@ typedef struct SystemMachine {
     // UMA Hardware Resources
     SystemCpu_t                 Processor;      // Used in UMA mode
     SystemMemorySpace_t         SystemSpace;    // Used in UMA mode
-    bounded_stack_t             PhysicalMemory;
-    IrqSpinlock_t               PhysicalMemoryLock;
+    PageAllocator_t             PhysicalMemory;
     
     // Global Hardware Resources
     StaticMemoryPool_t          GlobalAccessMemory;
@@ -95,7 +94,7 @@ InitializeSystemTimers(void);
 KERNELAPI OsStatus_t KERNELABI
 InitializeSystemMemory(
     _In_ Multiboot_t*        BootInformation,
-    _In_ bounded_stack_t*    Memory,
+    _In_ PageAllocator_t*    PhysicalMemory,
     _In_ StaticMemoryPool_t* GlobalAccessMemory,
     _In_ SystemMemoryMap_t*  MemoryMap,
     _In_ size_t*             MemoryGranularity,
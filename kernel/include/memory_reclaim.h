@@ -0,0 +1,91 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Memory Reclaim Interface
+ * - Returns memory that is cached by the kernel to the physical page allocator when
+ *   memory runs low. Subsystems that cache memory register shrinkers, which are run
+ *   by the reclaim thread once the free pages drop below the low watermark, until the
+ *   free pages are above the high watermark again.
+ */
+
+#ifndef __MEMORY_RECLAIM_H__
+#define __MEMORY_RECLAIM_H__
+
+#include <os/osdefs.h>
+
+// Shrinkers are called with this flag from an allocation that failed, and must then
+// not block on anything that could be held by the allocating thread
+#define MEMORY_RECLAIM_DIRECT 0x1
+
+// Returns the number of pages that were given back to the page allocator, PageCount
+// is the number of pages that are still needed
+typedef size_t (*MemoryShrinkFn)(void* Context, size_t PageCount, unsigned int Flags);
+
+typedef struct MemoryShrinker {
+    struct MemoryShrinker* Link;
+    const char*            Name;
+    MemoryShrinkFn         Shrink;
+    void*                  Context;
+} MemoryShrinker_t;
+
+#define MEMORY_SHRINKER_INIT(Name, Shrink, Context) { NULL, Name, Shrink, Context }
+
+/* MemoryReclaimInitialize
+ * Calculates the watermarks from the size of the physical memory. Shrinkers can be
+ * registered before this is called. */
+KERNELAPI void KERNELABI
+MemoryReclaimInitialize(void);
+
+/* MemoryReclaimStart
+ * Creates the reclaim thread and starts watching the free pages, requires threading. */
+KERNELAPI OsStatus_t KERNELABI
+MemoryReclaimStart(void);
+
+/* MemoryReclaimRegisterShrinker
+ * Registers a shrinker, the structure is owned by the caller and must stay valid
+ * until it is unregistered. */
+KERNELAPI void KERNELABI
+MemoryReclaimRegisterShrinker(
+    _In_ MemoryShrinker_t* Shrinker);
+
+/* MemoryReclaimUnregisterShrinker
+ * Unregisters a shrinker, it is not called once this returns. */
+KERNELAPI void KERNELABI
+MemoryReclaimUnregisterShrinker(
+    _In_ MemoryShrinker_t* Shrinker);
+
+/* MemoryReclaim
+ * Runs the shrinkers until the given number of pages were freed, or all shrinkers have
+ * been run. Returns the number of pages freed. */
+KERNELAPI size_t KERNELABI
+MemoryReclaim(
+    _In_ size_t       PageCount,
+    _In_ unsigned int Flags);
+
+/* MemoryReclaimGetStatistics
+ * Retrieves the watermarks in pages, the number of times the reclaim thread has run, and
+ * the number of pages that were reclaimed in total. */
+KERNELAPI void KERNELABI
+MemoryReclaimGetStatistics(
+    _Out_ size_t* LowWatermark,
+    _Out_ size_t* HighWatermark,
+    _Out_ size_t* NumberOfRuns,
+    _Out_ size_t* PagesReclaimed);
+
+#endif //!__MEMORY_RECLAIM_H__
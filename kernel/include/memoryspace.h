@@ -33,6 +33,8 @@
 /* SystemMemorySpace Definitions
  * Definitions, bit definitions and magic constants for memory spaces */
 #define MEMORY_DATACOUNT                4
+#define MEMORY_SPACE_MAX_CORES          256
+#define MEMORY_SPACE_CORE_WORDS         (MEMORY_SPACE_MAX_CORES / 32)
 
 /* SystemMemorySpace (Type) Definitions
  * Definitions, bit definitions and magic constants for memory spaces */
@@ -65,10 +67,13 @@ typedef struct SystemMemoryMappingHandler {
     size_t    Length;
 } SystemMemoryMappingHandler_t;
 
+// The context is shared by a memory space and its children, as they share page tables,
+// which also makes it the place to track which cores have the tables loaded
 typedef struct SystemMemorySpaceContext {
     DynamicMemoryPool_t Heap;
     list_t*             MemoryHandlers;
     uintptr_t           SignalHandler;
+    _Atomic(uint32_t)   ActiveCores[MEMORY_SPACE_CORE_WORDS];
 } SystemMemorySpaceContext_t;
 
 typedef struct SystemMemorySpace {
@@ -101,11 +106,20 @@ DestroyMemorySpace(
 
 /* SwitchMemorySpace
  * Switches the current address space out with the the address space provided 
- * for the current cpu */
+ * for the current cpu, and marks the cpu as active in the new address space */
 KERNELAPI void KERNELABI
 SwitchMemorySpace(
     _In_ SystemMemorySpace_t*);
 
+/* GetMemorySynchronizationStatistics
+ * Retrieves the number of tlb shootdowns sent to other cores, the number of pages
+ * they invalidated and the total time spent waiting for them to complete. */
+KERNELAPI void KERNELABI
+GetMemorySynchronizationStatistics(
+    _Out_ size_t*   ShootdownsSent,
+    _Out_ size_t*   PagesInvalidated,
+    _Out_ uint64_t* WaitTimeNs);
+
 /* GetCurrentMemorySpace
  * Returns the current address space if there is no active threads or threading
  * is not setup it returns the kernel address space */
@@ -27,10 +27,12 @@
 
 #include <os/osdefs.h>
 #include <os/spinlock.h>
+#include <ds/timerwheel.h>
 #include <irq_spinlock.h>
 #include <time.h>
 
 typedef struct list list_t;
+typedef struct SchedulerTraceRing SchedulerTraceRing_t;
 
 /* Scheduler Definitions
  * Contains magic constants, bit definitions and settings. */
@@ -43,6 +45,13 @@ typedef struct list list_t;
 #define SCHEDULER_TIMESLICE_INITIAL     10
 #define SCHEDULER_BOOST                 10000
 
+// Idle cores steal queued objects from the busiest core of their domain, and busy
+// cores do so every balance interval if the busiest core has queued at least the
+// imbalance more objects. Migrated objects stay on their new core for the cooldown.
+#define SCHEDULER_BALANCE_INTERVAL      100
+#define SCHEDULER_BALANCE_IMBALANCE     2
+#define SCHEDULER_MIGRATION_COOLDOWN    500
+
 #define SCHEDULER_TIMEOUT_INFINITE      0
 #define SCHEDULER_SLEEP_OK              0
 #define SCHEDULER_SLEEP_INTERRUPTED     1
@@ -58,16 +67,24 @@ typedef struct SchedulerQueue {
     SchedulerObject_t* Tail;
 } SchedulerQueue_t;
 
+// The sleep queue is a timer wheel of deadlines in milliseconds, its time is the
+// number of milliseconds the scheduler has been advanced by. The trace ring is
+// allocated the first time scheduler tracing is enabled.
 typedef struct SystemScheduler {
     IrqSpinlock_t          SyncObject;
-    SchedulerQueue_t       SleepQueue;
+    TimerWheel_t           SleepQueue;
     SchedulerQueue_t       Queues[SCHEDULER_LEVEL_COUNT];
     _Atomic(int)           ObjectCount;
     _Atomic(unsigned long) Bandwidth;
     clock_t                LastBoost;
+    _Atomic(int)           QueuedCount;
+    _Atomic(int)           StealPending;
+    clock_t                LastBalance;
+    SchedulerTraceRing_t*  Trace;
 } SystemScheduler_t;
 
-#define SCHEDULER_INIT { { 0 }, { 0 }, { { 0 } }, ATOMIC_VAR_INIT(0), ATOMIC_VAR_INIT(0), 0 }
+#define SCHEDULER_INIT { { 0 }, { 0 }, { { 0 } }, ATOMIC_VAR_INIT(0), ATOMIC_VAR_INIT(0), 0, \
+    ATOMIC_VAR_INIT(0), ATOMIC_VAR_INIT(0), 0, NULL }
 
 /* SchedulerCreateObject
  * Creates a new scheduling object and allocates a cpu core for the object.
@@ -109,7 +126,7 @@ SchedulerSleep(
 /**
  * SchedulerBlock
  * * Blocks the current scheduler object, and adds it to the given blocking queue.
- * 
+ * * Without a queue the caller keeps track of the object and must queue it again.
  */
 KERNELAPI void KERNELABI
 SchedulerBlock(
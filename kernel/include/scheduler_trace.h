@@ -0,0 +1,64 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scheduler Trace Interface
+ * - Records scheduling events in a fixed size ring per core, which is drained
+ *   through a system call. The oldest records are overwritten when a ring is full.
+ */
+
+#ifndef __VALI_SCHEDULER_TRACE_H__
+#define __VALI_SCHEDULER_TRACE_H__
+
+#include <os/osdefs.h>
+#include <os/types/scheduler_trace.h>
+
+// Must be a power of two
+#define SCHEDULER_TRACE_RING_SIZE 2048
+
+typedef struct SchedulerTraceRing SchedulerTraceRing_t;
+
+/* SchedulerTraceRecord
+ * Records an event in the ring of the calling core, does nothing while tracing is
+ * disabled. Safe to call from interrupt context. */
+KERNELAPI void KERNELABI
+SchedulerTraceRecord(
+    _In_ int      Event,
+    _In_ UUId_t   Thread,
+    _In_ int      Queue,
+    _In_ int      QueueLength,
+    _In_ uint32_t Data);
+
+/* SchedulerTraceControl
+ * Enables or disables tracing on the cores of the calling domain. The rings are
+ * allocated the first time tracing is enabled and are kept afterwards. */
+KERNELAPI OsStatus_t KERNELABI
+SchedulerTraceControl(
+    _In_ int Enable);
+
+/* SchedulerTraceDrain
+ * Copies up to MaxCount of the records that have not been drained yet, ring by ring,
+ * and removes them from the rings. Drains add a clock record to the ring of the
+ * calling core once per system tick, and rings that were overwritten add a lost
+ * record. Returns the number of records copied. */
+KERNELAPI int KERNELABI
+SchedulerTraceDrain(
+    _In_ SchedulerTraceRecord_t* Records,
+    _In_ int                     MaxCount);
+
+#endif //!__VALI_SCHEDULER_TRACE_H__
@@ -28,6 +28,8 @@
 #include <os/osdefs.h>
 #include <os/context.h>
 #include <ds/list.h>
+#include <futex.h>
+#include <handle.h>
 #include <semaphore.h>
 #include <mutex.h>
 #include <signal.h>
@@ -115,6 +117,8 @@ typedef struct SystemThread {
     uintptr_t               Data[THREADING_CONFIGDATA_COUNT];
     
     ThreadSignals_t         Signaling;
+    HandlePathCache_t       IpcPathCache;
+    FutexWaiter_t           FutexWaiter;
 } MCoreThread_t;
 
 /* ThreadingEnable
@@ -180,6 +184,12 @@ KERNELAPI MCoreThread_t* KERNELABI
 GetCurrentThreadForCore(
     _In_ UUId_t CoreId);
 
+/* GetCurrentThread
+ * Retrieves the thread that is calling. The core is read with interrupts disabled, as
+ * the thread can otherwise be migrated between reading the core and its current thread. */
+KERNELAPI MCoreThread_t* KERNELABI
+GetCurrentThread(void);
+
 /* GetCurrentThreadId
  * Retrives the current thread id on the current cpu from the callers perspective */
 KERNELAPI UUId_t KERNELABI
@@ -0,0 +1,153 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Physical Page Allocator
+ * - Buddy allocator for physical page frames, kept as one free bitmap per order. Single
+ *   pages are served from per-core page caches, which only take the allocator lock when
+ *   they need to be refilled or drained.
+ */
+
+#ifndef __UTILS_PAGE_ALLOCATOR_H__
+#define __UTILS_PAGE_ALLOCATOR_H__
+
+#include <os/osdefs.h>
+#include <irq_spinlock.h>
+
+// Order 9 blocks are 2MB with 4KB pages, the largest order leaves room for one above that
+#define PAGE_ALLOCATOR_ORDERS        11
+#define PAGE_ALLOCATOR_CACHE_SIZE    64
+#define PAGE_ALLOCATOR_CACHE_BATCH   32
+
+// Cores with a higher id than this allocate through the allocator lock
+#define PAGE_ALLOCATOR_MAX_CORES     64
+
+struct PageAllocator;
+
+// Invoked when an allocation leaves the allocator with fewer free pages than the watermark
+typedef void (*PageAllocatorWatermarkFn)(struct PageAllocator*);
+
+typedef struct PageCache {
+    int       Count;
+    uintptr_t Pages[PAGE_ALLOCATOR_CACHE_SIZE];
+} PageCache_t;
+
+typedef struct PageAllocator {
+    size_t        PageSize;
+    size_t        PageCount;
+    size_t        FreePages;
+    size_t        FreeBlocks[PAGE_ALLOCATOR_ORDERS];
+    uint64_t*     Bitmaps[PAGE_ALLOCATOR_ORDERS];   // Bit is set for every free block
+    uint64_t*     Summaries[PAGE_ALLOCATOR_ORDERS]; // Bit is set for every non-empty bitmap word
+    size_t        SummaryWords[PAGE_ALLOCATOR_ORDERS];
+    IrqSpinlock_t SyncObject;
+    PageCache_t   Caches[PAGE_ALLOCATOR_MAX_CORES];
+
+    size_t                   Watermark;
+    PageAllocatorWatermarkFn WatermarkHandler;
+} PageAllocator_t;
+
+/* PageAllocatorCalculateSize
+ * Returns the number of bytes of storage the allocator needs to track the given number
+ * of pages. */
+KERNELAPI size_t KERNELABI
+PageAllocatorCalculateSize(
+    _In_ size_t PageCount);
+
+/* PageAllocatorConstruct
+ * Initializes the allocator for the physical range 0 => PageCount * PageSize, with all
+ * pages marked as allocated. Usable memory is then added with PageAllocatorAddRange. */
+KERNELAPI void KERNELABI
+PageAllocatorConstruct(
+    _In_ PageAllocator_t* Allocator,
+    _In_ void*            Storage,
+    _In_ size_t           PageSize,
+    _In_ size_t           PageCount);
+
+/* PageAllocatorAddRange
+ * Marks the pages in the given range as free. The range is trimmed to whole pages inside
+ * the memory tracked, and must not overlap memory that is already free. */
+KERNELAPI void KERNELABI
+PageAllocatorAddRange(
+    _In_ PageAllocator_t* Allocator,
+    _In_ uintptr_t        Address,
+    _In_ size_t           Length);
+
+/* PageAllocatorAllocate
+ * Allocates the given number of individual pages, which are not neccessarily contiguous.
+ * Either all pages are allocated, or none. */
+KERNELAPI OsStatus_t KERNELABI
+PageAllocatorAllocate(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              PageCount,
+    _In_ uintptr_t*       Pages);
+
+/* PageAllocatorFree
+ * Frees pages allocated by PageAllocatorAllocate or PageAllocatorAllocateContiguous. */
+KERNELAPI void KERNELABI
+PageAllocatorFree(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              PageCount,
+    _In_ uintptr_t*       Pages);
+
+/* PageAllocatorAllocateContiguous
+ * Allocates a physically contiguous run of pages whose start address is aligned to the
+ * given alignment, which must be a power of two. Used for DMA buffers and large pages. */
+KERNELAPI OsStatus_t KERNELABI
+PageAllocatorAllocateContiguous(
+    _In_  PageAllocator_t* Allocator,
+    _In_  size_t           PageCount,
+    _In_  size_t           Alignment,
+    _Out_ uintptr_t*       Address);
+
+/* PageAllocatorFreeContiguous
+ * Frees a run of pages allocated by PageAllocatorAllocateContiguous. Any part of the
+ * run can be freed on its own. */
+KERNELAPI void KERNELABI
+PageAllocatorFreeContiguous(
+    _In_ PageAllocator_t* Allocator,
+    _In_ uintptr_t        Address,
+    _In_ size_t           PageCount);
+
+/* PageAllocatorSetWatermark
+ * Installs a handler that is invoked whenever an allocation leaves fewer free pages than
+ * the watermark outside of the page caches. The handler is invoked from the allocating
+ * context, which can have interrupts disabled, so it must not block or allocate. */
+KERNELAPI void KERNELABI
+PageAllocatorSetWatermark(
+    _In_ PageAllocator_t*         Allocator,
+    _In_ size_t                   Watermark,
+    _In_ PageAllocatorWatermarkFn Handler);
+
+/* PageAllocatorDrainCache
+ * Returns the pages in the page cache of the calling core to the allocator, so they can
+ * be merged with their buddies. */
+KERNELAPI void KERNELABI
+PageAllocatorDrainCache(
+    _In_ PageAllocator_t* Allocator);
+
+/* PageAllocatorGetStatistics
+ * Retrieves the number of pages tracked, and the number of those that are free, which
+ * includes the pages held by the page caches. */
+KERNELAPI void KERNELABI
+PageAllocatorGetStatistics(
+    _In_  PageAllocator_t* Allocator,
+    _Out_ size_t*          PageCount,
+    _Out_ size_t*          FreePages);
+
+#endif //!__UTILS_PAGE_ALLOCATOR_H__
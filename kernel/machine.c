@@ -38,6 +38,7 @@
 #include <handle.h>
 #include <heap.h>
 #include <interrupts.h>
+#include <memory_reclaim.h>
 #include <scheduler.h>
 #include <stdio.h>
 #include <threading.h>
@@ -51,7 +52,7 @@ static SystemMachine_t Machine = {
     { 0 }, { 0 }, { 0 }, { 0 },                        // Strings
     REVISION_MAJOR, REVISION_MINOR, REVISION_BUILD,
     { 0 }, SYSTEM_CPU_INIT, { 0 }, { 0 },              // BootInformation, Processor, MemorySpace, PhysicalMemory
-    OS_IRQ_SPINLOCK_INIT, { 0 }, { { 0 } }, LIST_INIT, // GAMemory, Memory Map, SystemDomains
+    { 0 }, { { 0 } }, LIST_INIT,                       // GAMemory, Memory Map, SystemDomains
     NULL, 0, NULL,                                     // InterruptControllers
     { { { 0 } } },                                     // SystemTime
     ATOMIC_VAR_INIT(1), ATOMIC_VAR_INIT(1), 
@@ -90,7 +91,6 @@ InitializeMachine(
     memcpy(&Machine.BootInformation, BootInformation, sizeof(Multiboot_t));
     Crc32GenerateTable();
     LogInitialize();
-    FutexInitialize();
 
     sprintf(&Machine.Architecture[0], "System: %s", ARCHITECTURE_NAME);
     sprintf(&Machine.Bootloader[0],   "Boot: %s", (char*)(uintptr_t)BootInformation->BootLoaderName);
@@ -121,6 +121,7 @@ InitializeMachine(
 #error "Kernel does not support non-mmio platforms"
 #endif
     MemoryCacheInitialize();
+    MemoryReclaimInitialize();
     Status = InitializeConsole();
     if (Status != OsSuccess) {
         ERROR("Failed to initialize output for system.");
@@ -139,6 +140,7 @@ InitializeMachine(
 #else
     SetMachineUmaMode();
 #endif
+    FutexInitialize();
 
     // Create the rest of the OS systems
     Status = InitializeHandles();
@@ -163,6 +165,12 @@ InitializeMachine(
         ArchProcessorIdle();
     }
 
+    Status = MemoryReclaimStart();
+    if (Status != OsSuccess) {
+        ERROR("Failed to initialize memory reclaim.");
+        ArchProcessorIdle();
+    }
+
     // Perform the full acpi initialization sequence
 #ifdef __OSCONFIG_ACPI_SUPPORT
     if (AcpiAvailable() == ACPI_AVAILABLE) {
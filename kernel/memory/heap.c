@@ -23,64 +23,120 @@
 #define __MODULE "HEAP"
 //#define __TRACE
 
+#include <arch/interrupts.h>
 #include <arch/utils.h>
 #include <assert.h>
+#include <component/domain.h>
 #include <ddk/io.h>
 #include <debug.h>
 #include <ds/list.h>
 #include <heap.h>
+#include <irq_spinlock.h>
 #include <mutex.h>
 #include <memoryspace.h>
 #include <machine.h>
+#include <memory_reclaim.h>
 #include <string.h>
 
 #define MEMORY_OVERRUN_PATTERN                      0xA5A5A5A5
 #define MEMORY_SLAB_ONSITE_THRESHOLD                512
-#define MEMORY_ATOMIC_CACHE(Cache, Core)            (MemoryAtomicCache_t*)(Cache->AtomicCaches + (Core * (sizeof(MemoryAtomicCache_t) + (Cache->ObjectCount * sizeof(void*)))))
-#define MEMORY_ATOMIC_ELEMENT(AtomicCache, Element) ((uintptr_t**)((uintptr_t)AtomicCache + sizeof(MemoryAtomicCache_t) + (Element * sizeof(void*))))
 #define MEMORY_SLAB_ELEMENT(Cache, Slab, Element)   (void*)((uintptr_t)Slab->Address + (Element * (Cache->ObjectSize + Cache->ObjectPadding)))
+#define MEMORY_SLAB_MAX_OBJECTS                     0x10000
 
-// Slab size is equal to a page size, and memory layout of a slab is as below
-// FreeBitmap | Object | Object | Object |
+// Magazines hold up to this many objects, caches of larger objects use less of it
+#define MEMORY_MAGAZINE_CAPACITY                    31
+
+// Cores with a higher id than this allocate through the slab layer, and slabs are kept
+// in one node per domain, domains with a higher id share nodes
+#define MEMORY_CACHE_MAX_CORES                      64
+#define MEMORY_CACHE_MAX_NODES                      8
+
+// The per-core magazines and the nodes of other domains than the first are allocated
+// on first use, this marks them as being allocated
+#define MEMORY_CACHE_PENDING                        ((uintptr_t)1)
+
+// Slab size is a power of two number of pages, and memory layout of a slab is as below
+// MemorySlab_t | FreeObjects | Object | Object | Object |
+// FreeObjects is a stack of the indices of free objects in the slab, with
+// NumberOfFreeObjects being the top of it.
 typedef struct MemorySlab {
-    element_t  Header;
-    int        NumberOfFreeObjects;
-    uintptr_t* Address;  // Points to first object
-    uint8_t*   FreeBitmap;
+    element_t           Header;
+    struct MemoryCache* Cache;
+    int                 Node;
+    int                 NumberOfFreeObjects;
+    uintptr_t*          Address;     // Points to first object
+    uint16_t*           FreeObjects;
 } MemorySlab_t;
 
-// Memory Atomic Cache is followed directly by the buffer area for pointers
-// MemoryAtomicCache_t | Pointer | Pointer | Pointer | Pointer | MemoryAtomicCache_t ...
-typedef struct MemoryAtomicCache {
-    _Atomic(int) Available;
-    int          Limit;
-} MemoryAtomicCache_t;
+// Magazines are stacks of free objects that are cached by the cores, which
+// are exchanged as a whole with the depot of the cache
+typedef struct MemoryMagazine {
+    struct MemoryMagazine* Link;
+    int                    Count;
+    void*                  Objects[MEMORY_MAGAZINE_CAPACITY];
+} MemoryMagazine_t;
+
+// The previous magazine is always either full or empty, so a core can switch between
+// allocating and freeing a magazine worth of objects without visiting the depot. The
+// allocations and frees served by the magazines are counted here.
+typedef struct MemoryCpuCache {
+    MemoryMagazine_t* Loaded;
+    MemoryMagazine_t* Previous;
+    uint64_t          NumberOfAllocations;
+    uint64_t          NumberOfFrees;
+} MemoryCpuCache_t;
+
+typedef struct MemoryDepot {
+    IrqSpinlock_t     SyncObject;
+    MemoryMagazine_t* FullMagazines;
+    MemoryMagazine_t* EmptyMagazines;
+    int               NumberOfFull;
+    int               NumberOfEmpty;
+} MemoryDepot_t;
+
+// The counters of a node are protected by the node lock, and count the allocations
+// and frees that are served by the slabs of the node
+typedef struct MemoryCacheNode {
+    Mutex_t  SyncObject;
+    int      NumberOfFreeObjects;
+    list_t   FreeSlabs;
+    list_t   PartialSlabs;
+    list_t   FullSlabs;
+    uint64_t NumberOfAllocations;
+    uint64_t NumberOfFrees;
+    size_t   NumberOfSlabsCreated;
+    size_t   NumberOfSlabsReaped;
+} MemoryCacheNode_t;
 
 typedef struct MemoryCache {
-    const char*      Name;
-    Mutex_t          SyncObject;
-    unsigned int          Flags;
-
-    size_t           ObjectSize;
-    size_t           ObjectAlignment;
-    size_t           ObjectPadding;
-    int              ObjectCount;      // Count per slab
-    int              PageCount;
-    int              NumberOfFreeObjects;
-    void           (*ObjectConstructor)(struct MemoryCache*, void*);
-    void           (*ObjectDestructor)(struct MemoryCache*, void*);
-
-    int              SlabOnSite;
-    size_t           SlabStructureSize;
-    list_t           FreeSlabs;
-    list_t           PartialSlabs;
-    list_t           FullSlabs;
-
-    uintptr_t        AtomicCaches;
+    struct MemoryCache* Link;
+    const char*        Name;
+    unsigned int       Flags;
+
+    size_t             ObjectSize;
+    size_t             ObjectAlignment;
+    size_t             ObjectPadding;
+    int                ObjectCount;      // Count per slab
+    int                PageCount;
+    void             (*ObjectConstructor)(struct MemoryCache*, void*);
+    void             (*ObjectDestructor)(struct MemoryCache*, void*);
+
+    int                SlabOnSite;
+    size_t             SlabStructureSize;
+    MemoryCacheNode_t  PrimaryNode;
+    _Atomic(uintptr_t) Nodes[MEMORY_CACHE_MAX_NODES];
+
+    int                MagazineSize;     // Zero if the magazine layer is disabled
+    MemoryDepot_t      Depot;
+    _Atomic(uintptr_t) CpuCaches;        // Array of MEMORY_CACHE_MAX_CORES entries
+
+    _Atomic(size_t)    SlabObjectsInUse; // Objects taken out of the slabs
+    _Atomic(size_t)    HighWaterMark;
 } MemoryCache_t;
 
 // All the standard caches DO not use contigious memory
-static MemoryCache_t InitialCache = { 0 };
+static MemoryCache_t InitialCache  = { 0 };
+static MemoryCache_t MagazineCache = { 0 };
 static struct FixedCache {
     size_t         ObjectSize;
     const char*    Name;
@@ -104,6 +160,30 @@ static struct FixedCache {
     { 0,      NULL,               NULL, 0 }
 };
 
+// All slabs are allocated from the global access memory, so the slab that owns an
+// address is found by looking up its page in this table
+static MemorySlab_t** SlabOwners      = NULL;
+static uintptr_t      SlabOwnersStart = 0;
+static size_t         SlabOwnersCount = 0;
+
+// All caches in the system, including the fixed size caches
+static Mutex_t        CachesLock;
+static MemoryCache_t* Caches = NULL;
+
+// Held while caches are reaped, a cache that is destroyed waits for it after being
+// unlinked, so the reap can release the slabs of a cache without the caches lock
+static Mutex_t        ReapLock;
+
+// The allocation profiler is disabled while the interval is zero, otherwise every
+// interval'th allocation is recorded in the sample ring
+static _Atomic(unsigned int) ProfileInterval = ATOMIC_VAR_INIT(0);
+static _Atomic(unsigned int) ProfileTicks    = ATOMIC_VAR_INIT(0);
+static IrqSpinlock_t         ProfileLock;
+static HeapProfileSample_t   ProfileSamples[HEAP_PROFILE_MAX_SAMPLES];
+static size_t                ProfileCount = 0;
+
+static void* cache_allocate(MemoryCache_t* Cache);
+
 static uintptr_t
 allocate_virtual_memory(
     _In_ int PageCount)
@@ -116,6 +196,15 @@ allocate_virtual_memory(
     Status = MemorySpaceMap(GetCurrentMemorySpace(), &Address, &Pages[0], 
         PageSize * PageCount, MAPPING_COMMIT | MAPPING_DOMAIN, 
         MAPPING_VIRTUAL_GLOBAL);
+    
+    // Try to reclaim cached memory once before giving up, this is only possible when
+    // the allocation is allowed to take locks
+    if (Status != OsSuccess && !InterruptIsDisabled() &&
+        MemoryReclaim(PageCount, MEMORY_RECLAIM_DIRECT)) {
+        Status = MemorySpaceMap(GetCurrentMemorySpace(), &Address, &Pages[0], 
+            PageSize * PageCount, MAPPING_COMMIT | MAPPING_DOMAIN, 
+            MAPPING_VIRTUAL_GLOBAL);
+    }
     if (Status != OsSuccess) {
         ERROR("Ran out of memory for allocation in the heap");
         return 0;
@@ -136,6 +225,65 @@ free_virtual_memory(
     }
 }
 
+static inline int
+cache_current_node_index(void)
+{
+    SystemDomain_t* Domain = GetCurrentDomain();
+    return (Domain != NULL) ? (int)(Domain->Id % MEMORY_CACHE_MAX_NODES) : 0;
+}
+
+static void
+cache_construct_node(
+    _In_ MemoryCacheNode_t* Node)
+{
+    MutexConstruct(&Node->SyncObject, MUTEX_RECURSIVE);
+    Node->NumberOfFreeObjects = 0;
+    list_construct(&Node->FreeSlabs);
+    list_construct(&Node->PartialSlabs);
+    list_construct(&Node->FullSlabs);
+    Node->NumberOfAllocations  = 0;
+    Node->NumberOfFrees        = 0;
+    Node->NumberOfSlabsCreated = 0;
+    Node->NumberOfSlabsReaped  = 0;
+}
+
+static inline MemoryCacheNode_t*
+cache_node(
+    _In_ MemoryCache_t* Cache,
+    _In_ int            Index)
+{
+    uintptr_t Node = atomic_load(&Cache->Nodes[Index]);
+    return (Node > MEMORY_CACHE_PENDING) ? (MemoryCacheNode_t*)Node : NULL;
+}
+
+// Returns the node of the calling domain, which is allocated on first use. Until then
+// the allocations are done in the primary node.
+static MemoryCacheNode_t*
+cache_current_node(
+    _In_  MemoryCache_t* Cache,
+    _Out_ int*           IndexOut)
+{
+    MemoryCacheNode_t* Node;
+    uintptr_t          Expected = 0;
+    int                Index    = cache_current_node_index();
+
+    Node = cache_node(Cache, Index);
+    if (!Node && atomic_compare_exchange_strong(&Cache->Nodes[Index], &Expected, MEMORY_CACHE_PENDING)) {
+        Node = (MemoryCacheNode_t*)kmalloc(sizeof(MemoryCacheNode_t));
+        if (Node) {
+            cache_construct_node(Node);
+        }
+        atomic_store(&Cache->Nodes[Index], (uintptr_t)Node);
+    }
+
+    if (!Node) {
+        Index = 0;
+        Node  = &Cache->PrimaryNode;
+    }
+    *IndexOut = Index;
+    return Node;
+}
+
 static inline struct FixedCache*
 cache_find_fixed_size(
     _In_ size_t Size)
@@ -154,25 +302,22 @@ cache_find_fixed_size(
     return Selected;
 }
 
+static inline size_t
+cache_calculate_slab_structure_size(
+    _In_ size_t ObjectsPerSlab)
+{
+    // The slab metadata is followed by the stack of free object indices
+    return sizeof(MemorySlab_t) + (ObjectsPerSlab * sizeof(uint16_t));
+}
+
 static int
 slab_allocate_index(
     _In_ MemoryCache_t* Cache,
     _In_ MemorySlab_t*  Slab)
 {
-    int i;
-    
+    assert(Slab->NumberOfFreeObjects > 0);
     assert(Slab->NumberOfFreeObjects <= Cache->ObjectCount);
-    for (i = 0; i < (int)Cache->ObjectCount; i++) {
-        unsigned Block  = i / 8;
-        unsigned Offset = i % 8;
-        uint8_t  Bit    = (1u << Offset);
-        if (!(Slab->FreeBitmap[Block] & Bit)) {
-            Slab->FreeBitmap[Block] |= Bit;
-            Slab->NumberOfFreeObjects--;
-            return i;
-        }
-    }
-    return -1;
+    return (int)Slab->FreeObjects[--Slab->NumberOfFreeObjects];
 }
 
 static void
@@ -181,34 +326,54 @@ slab_free_index(
     _In_ MemorySlab_t*  Slab,
     _In_ int            Index)
 {
-    unsigned Block  = Index / 8;
-    unsigned Offset = Index % 8;
-    uint8_t  Bit    = (1u << Offset);
     assert(Slab->NumberOfFreeObjects < Cache->ObjectCount);
-    if (Index < (int)Cache->ObjectCount) {
-        Slab->FreeBitmap[Block] &= ~(Bit);
-        Slab->NumberOfFreeObjects++;
-    }
+    assert(Index >= 0 && Index < Cache->ObjectCount);
+    Slab->FreeObjects[Slab->NumberOfFreeObjects++] = (uint16_t)Index;
 }
 
 static int
-slab_contains_address(
+slab_object_index(
     _In_ MemoryCache_t* Cache,
     _In_ MemorySlab_t*  Slab,
     _In_ uintptr_t      Address)
 {
     size_t    ObjectSize = Cache->ObjectSize + Cache->ObjectPadding;
     uintptr_t Base       = (uintptr_t)Slab->Address;
-    uintptr_t End        = Base + (Cache->ObjectCount * ObjectSize);
-    int       Index      = -1;
-    if (Address >= Base && Address < End) {
-        Index = (int)((Address - Base) / ObjectSize);
-        assert(Index >= 0);
-        assert(Index < Cache->ObjectCount);
-    }
+    int       Index;
+
+    assert(Address >= Base);
+    Index = (int)((Address - Base) / ObjectSize);
+    assert(Index < Cache->ObjectCount);
+    assert(Address == (Base + (Index * ObjectSize)));
     return Index;
 }
 
+static void
+slab_set_owner(
+    _In_ uintptr_t     Address,
+    _In_ int           PageCount,
+    _In_ MemorySlab_t* Slab)
+{
+    size_t Page = (Address - SlabOwnersStart) / GetMemorySpacePageSize();
+    int    i;
+
+    assert(Address >= SlabOwnersStart && (Page + PageCount) <= SlabOwnersCount);
+    for (i = 0; i < PageCount; i++) {
+        SlabOwners[Page + i] = Slab;
+    }
+}
+
+static MemorySlab_t*
+slab_find_owner(
+    _In_ uintptr_t Address)
+{
+    size_t Page = (Address - SlabOwnersStart) / GetMemorySpacePageSize();
+    if (Address < SlabOwnersStart || Page >= SlabOwnersCount) {
+        return NULL;
+    }
+    return SlabOwners[Page];
+}
+
 static void
 slab_initalize_objects(MemoryCache_t* Cache, MemorySlab_t* Slab)
 {
@@ -225,6 +390,9 @@ slab_initalize_objects(MemoryCache_t* Cache, MemorySlab_t* Slab)
             *((uint32_t*)Address) = MEMORY_OVERRUN_PATTERN;
         }
         Address += Cache->ObjectPadding;
+
+        // Push them in reverse, so the objects are handed out in address order
+        Slab->FreeObjects[i] = (uint16_t)(Cache->ObjectCount - 1 - i);
     }
 }
 
@@ -246,7 +414,8 @@ slab_destroy_objects(
 
 static MemorySlab_t* 
 slab_create(
-    _In_ MemoryCache_t* Cache)
+    _In_ MemoryCache_t* Cache,
+    _In_ int            Node)
 {
     MemorySlab_t* Slab;
     uintptr_t     ObjectAddress;
@@ -259,7 +428,7 @@ slab_create(
 
     if (Cache->SlabOnSite) {
         Slab          = (MemorySlab_t*)DataAddress;
-        ObjectAddress = DataAddress + Cache->SlabStructureSize;
+        ObjectAddress = DataAddress + cache_calculate_slab_structure_size(Cache->ObjectCount);
         if (Cache->ObjectAlignment != 0 && (ObjectAddress % Cache->ObjectAlignment)) {
             ObjectAddress += Cache->ObjectAlignment - (ObjectAddress % Cache->ObjectAlignment);
         }
@@ -278,6 +447,7 @@ slab_create(
         Slab = (MemorySlab_t*)kmalloc(Cache->SlabStructureSize);
         if (!Slab) {
             ERROR("[heap] [slab_create] failed to allocate a new slab structure");
+            free_virtual_memory(DataAddress, Cache->PageCount);
             return NULL;
         }
         
@@ -292,10 +462,13 @@ slab_create(
     memset(Slab, 0, Cache->SlabStructureSize);
 
     ELEMENT_INIT(&Slab->Header, 0, Slab);
+    Slab->Cache               = Cache;
+    Slab->Node                = Node;
     Slab->NumberOfFreeObjects = Cache->ObjectCount;
-    Slab->FreeBitmap          = (uint8_t*)((uintptr_t)Slab + sizeof(MemorySlab_t));
+    Slab->FreeObjects         = (uint16_t*)((uintptr_t)Slab + sizeof(MemorySlab_t));
     Slab->Address             = (uintptr_t*)ObjectAddress;
     slab_initalize_objects(Cache, Slab);
+    slab_set_owner(DataAddress, Cache->PageCount, Slab);
     return Slab;
 }
 
@@ -305,10 +478,12 @@ static void slab_destroy(
 {
     slab_destroy_objects(Cache, Slab);
     if (!Cache->SlabOnSite) {
+        slab_set_owner((uintptr_t)Slab->Address, Cache->PageCount, NULL);
         free_virtual_memory((uintptr_t)Slab->Address, Cache->PageCount);
         kfree(Slab);
     }
     else {
+        slab_set_owner((uintptr_t)Slab, Cache->PageCount, NULL);
         free_virtual_memory((uintptr_t)Slab, Cache->PageCount);
     }
 }
@@ -322,146 +497,329 @@ slab_dump_information(
     uintptr_t EndAddress   = StartAddress + (Cache->ObjectCount * (Cache->ObjectSize + Cache->ObjectPadding));
     
     // Write slab information
-    WRITELINE(" -- slab: 0x%" PRIxIN " => 0x%" PRIxIN ", FreeObjects %" PRIuIN "", StartAddress, EndAddress, Slab->NumberOfFreeObjects);
+    WRITELINE(" -- slab: 0x%" PRIxIN " => 0x%" PRIxIN ", FreeObjects %i", StartAddress, EndAddress, Slab->NumberOfFreeObjects);
+}
+
+// The counters are read without stopping the other cores, so the frees of an object can
+// be seen before its allocation. The nodes are not locked either, as this is called with
+// the caches lock held, and caches are created with node locks held.
+static void
+cache_get_statistics(
+    _In_ MemoryCache_t*         Cache,
+    _In_ HeapCacheStatistics_t* Statistics)
+{
+    MemoryCpuCache_t*  CpuCaches = (MemoryCpuCache_t*)atomic_load(&Cache->CpuCaches);
+    MemoryCacheNode_t* Node;
+    int                i;
+
+    memset(Statistics, 0, sizeof(HeapCacheStatistics_t));
+    strncpy(&Statistics->Name[0], Cache->Name, HEAP_CACHE_NAME_LENGTH - 1);
+    Statistics->ObjectSize     = Cache->ObjectSize;
+    Statistics->ObjectsPerSlab = (size_t)Cache->ObjectCount;
+    Statistics->PagesPerSlab   = (size_t)Cache->PageCount;
+
+    for (i = 0; i < MEMORY_CACHE_MAX_NODES; i++) {
+        Node = cache_node(Cache, i);
+        if (!Node) {
+            continue;
+        }
+
+        Statistics->NumberOfSlabs += list_count(&Node->FreeSlabs) + 
+            list_count(&Node->PartialSlabs) + list_count(&Node->FullSlabs);
+        Statistics->NumberOfAllocations  += Node->NumberOfAllocations;
+        Statistics->NumberOfFrees        += Node->NumberOfFrees;
+        Statistics->NumberOfSlabsCreated += Node->NumberOfSlabsCreated;
+        Statistics->NumberOfSlabsReaped  += Node->NumberOfSlabsReaped;
+    }
+
+    if ((uintptr_t)CpuCaches > MEMORY_CACHE_PENDING) {
+        for (i = 0; i < MEMORY_CACHE_MAX_CORES; i++) {
+            Statistics->NumberOfAllocations += CpuCaches[i].NumberOfAllocations;
+            Statistics->NumberOfFrees       += CpuCaches[i].NumberOfFrees;
+        }
+    }
+
+    if (Statistics->NumberOfAllocations > Statistics->NumberOfFrees) {
+        Statistics->ObjectsInUse = (size_t)(Statistics->NumberOfAllocations - Statistics->NumberOfFrees);
+    }
+    Statistics->HighWaterMark = atomic_load(&Cache->HighWaterMark);
 }
 
 static void
 cache_dump_information(
     _In_ MemoryCache_t* Cache)
 {
-    element_t* i;
+    HeapCacheStatistics_t Statistics;
+    MemoryCacheNode_t*    Node;
+    element_t*            i;
+    int                   j;
     
     // Write cache information
-    WRITELINE("%s: Object Size %" PRIuIN ", Alignment %" PRIuIN ", Padding %" PRIuIN ", Count %" PRIuIN ", FreeObjects %" PRIuIN "",
+    cache_get_statistics(Cache, &Statistics);
+    WRITELINE("%s: Object Size %" PRIuIN ", Alignment %" PRIuIN ", Padding %" PRIuIN ", Count %i, Magazine Size %i",
         Cache->Name, Cache->ObjectSize, Cache->ObjectAlignment, Cache->ObjectPadding,
-        Cache->ObjectCount, Cache->NumberOfFreeObjects);
-        
-    // Dump slabs
-    WRITELINE("* full slabs");
-    _foreach(i, &Cache->FullSlabs) {
-        slab_dump_information(Cache, i->value);
+        Cache->ObjectCount, Cache->MagazineSize);
+    WRITELINE("* %" PRIuIN " allocations, %" PRIuIN " frees, %" PRIuIN " in use, %" PRIuIN " peak, %" PRIuIN " slabs created, %" PRIuIN " reaped",
+        (size_t)Statistics.NumberOfAllocations, (size_t)Statistics.NumberOfFrees, Statistics.ObjectsInUse,
+        Statistics.HighWaterMark, Statistics.NumberOfSlabsCreated, Statistics.NumberOfSlabsReaped);
+    if (Cache->MagazineSize) {
+        WRITELINE("* depot: %i full magazines, %i empty magazines",
+            Cache->Depot.NumberOfFull, Cache->Depot.NumberOfEmpty);
     }
-    
-    WRITELINE("* partial slabs");
-    _foreach(i, &Cache->PartialSlabs) {
-        slab_dump_information(Cache, i->value);
-    }
-    
-    WRITELINE("* free slabs");
-    _foreach(i, &Cache->FreeSlabs) {
-        slab_dump_information(Cache, i->value);
+
+    for (j = 0; j < MEMORY_CACHE_MAX_NODES; j++) {
+        Node = cache_node(Cache, j);
+        if (!Node) {
+            continue;
+        }
+        if (!list_count(&Node->FullSlabs) && !list_count(&Node->PartialSlabs) &&
+            !list_count(&Node->FreeSlabs)) {
+            continue;
+        }
+
+        // Dump slabs
+        WRITELINE("* node %i: FreeObjects %i", j, Node->NumberOfFreeObjects);
+        WRITELINE("* full slabs");
+        _foreach(i, &Node->FullSlabs) {
+            slab_dump_information(Cache, i->value);
+        }
+        
+        WRITELINE("* partial slabs");
+        _foreach(i, &Node->PartialSlabs) {
+            slab_dump_information(Cache, i->value);
+        }
+        
+        WRITELINE("* free slabs");
+        _foreach(i, &Node->FreeSlabs) {
+            slab_dump_information(Cache, i->value);
+        }
     }
     WRITELINE("");
 }
 
-struct FindSlabContext {
-    MemoryCache_t* Cache;
-    uintptr_t      Address;
-    int            Found;
-};
-
+// Smaller objects are cheaper to keep around, so they get the larger magazines
 static int
-SlabContainsAddress(
-    _In_ int        Unused,
-    _In_ element_t* Element,
-    _In_ void*      ContextPointer)
+cache_calculate_magazine_size(
+    _In_ size_t ObjectSize)
 {
-    struct FindSlabContext* Context = ContextPointer;
-    int                     Index   = slab_contains_address(
-        Context->Cache, Element->value, Context->Address);
-    
-    if (Index == -1) {
-        return LIST_ENUMERATE_CONTINUE;
+    if (ObjectSize <= 256) {
+        return MEMORY_MAGAZINE_CAPACITY;
     }
-    
-    Context->Found = 1;
-    return LIST_ENUMERATE_STOP;
+    else if (ObjectSize <= 4096) {
+        return 15;
+    }
+    else if (ObjectSize <= 32768) {
+        return 7;
+    }
+    return 1;
 }
 
-static int
-cache_contains_address(
-    _In_ MemoryCache_t* Cache,
-    _In_ uintptr_t      Address)
+// Magazines with objects go on the full list, and empty magazines on the empty list
+static void
+cache_depot_put(
+    _In_ MemoryCache_t*    Cache,
+    _In_ MemoryMagazine_t* Magazine)
 {
-    struct FindSlabContext Context = {
-        .Cache   = Cache,
-        .Address = Address,
-        .Found   = 0
-    };
-    
-    TRACE("cache_contains_address(%s, 0x%" PRIxIN ")", Cache->Name, Address);
-
-    // Check partials first, we have to lock the cache as slabs can 
-    // get rearranged as we go, which is not ideal
-    MutexLock(&Cache->SyncObject);
-    list_enumerate(&Cache->PartialSlabs, SlabContainsAddress, &Context);
-    if (!Context.Found) {
-        list_enumerate(&Cache->FullSlabs, SlabContainsAddress, &Context);
+    IrqSpinlockAcquire(&Cache->Depot.SyncObject);
+    if (Magazine->Count) {
+        Magazine->Link              = Cache->Depot.FullMagazines;
+        Cache->Depot.FullMagazines  = Magazine;
+        Cache->Depot.NumberOfFull++;
     }
-    MutexUnlock(&Cache->SyncObject);
-    return Context.Found;
+    else {
+        Magazine->Link              = Cache->Depot.EmptyMagazines;
+        Cache->Depot.EmptyMagazines = Magazine;
+        Cache->Depot.NumberOfEmpty++;
+    }
+    IrqSpinlockRelease(&Cache->Depot.SyncObject);
 }
 
-static inline size_t
-cache_calculate_slab_structure_size(
-    _In_ size_t ObjectsPerSlab)
+static MemoryMagazine_t*
+cache_depot_get(
+    _In_ MemoryCache_t* Cache,
+    _In_ int            Full)
 {
-    size_t SlabStructure = sizeof(MemorySlab_t);
-    // Calculate how many bytes the slab metadata will need
-    SlabStructure += (ObjectsPerSlab / 8);
-    if (ObjectsPerSlab % 8) {
-        SlabStructure++;
+    MemoryMagazine_t* Magazine;
+
+    IrqSpinlockAcquire(&Cache->Depot.SyncObject);
+    if (Full) {
+        Magazine = Cache->Depot.FullMagazines;
+        if (Magazine) {
+            Cache->Depot.FullMagazines = Magazine->Link;
+            Cache->Depot.NumberOfFull--;
+        }
+    }
+    else {
+        Magazine = Cache->Depot.EmptyMagazines;
+        if (Magazine) {
+            Cache->Depot.EmptyMagazines = Magazine->Link;
+            Cache->Depot.NumberOfEmpty--;
+        }
     }
-    return SlabStructure;
+    IrqSpinlockRelease(&Cache->Depot.SyncObject);
+    return Magazine;
 }
 
-static size_t
-cache_calculate_atomic_cache(
+// The per-core magazines are allocated on first use, as the array can't be allocated
+// before the fixed size caches exist. kmalloc might end up in the same cache, which
+// then uses the slab layer until the array is in place.
+static MemoryCpuCache_t*
+cache_get_cpu_caches(
     _In_ MemoryCache_t* Cache)
 {
-    // number of cpu * cpu_cache_objects + number of cpu * objects per slab * pointer size
-    size_t BytesRequired = 0;
-    int    NumberOfCores = atomic_load(&GetMachine()->NumberOfCores);
-    
-    if (NumberOfCores > 1) {
-        BytesRequired = (NumberOfCores * 
-            (sizeof(MemoryAtomicCache_t) + (Cache->ObjectCount * sizeof(void*))));
-        if (cache_find_fixed_size(BytesRequired) == NULL) {
-            BytesRequired = 0;
+    MemoryCpuCache_t* CpuCaches;
+    uintptr_t         Expected = 0;
+
+    CpuCaches = (MemoryCpuCache_t*)atomic_load(&Cache->CpuCaches);
+    if ((uintptr_t)CpuCaches > MEMORY_CACHE_PENDING) {
+        return CpuCaches;
+    }
+
+    if (!atomic_compare_exchange_strong(&Cache->CpuCaches, &Expected, MEMORY_CACHE_PENDING)) {
+        return NULL;
+    }
+
+    CpuCaches = (MemoryCpuCache_t*)kmalloc(sizeof(MemoryCpuCache_t) * MEMORY_CACHE_MAX_CORES);
+    if (CpuCaches) {
+        memset(CpuCaches, 0, sizeof(MemoryCpuCache_t) * MEMORY_CACHE_MAX_CORES);
+    }
+    atomic_store(&Cache->CpuCaches, (uintptr_t)CpuCaches);
+    return CpuCaches;
+}
+
+// Allocates an object from the magazines of the calling core. Interrupts are disabled
+// while the magazines are used, so they can't be touched by anyone else.
+static void*
+cache_magazine_allocate(
+    _In_ MemoryCache_t*    Cache,
+    _In_ MemoryCpuCache_t* CpuCaches)
+{
+    MemoryCpuCache_t* CpuCache;
+    MemoryMagazine_t* Magazine;
+    void*             Object = NULL;
+    IntStatus_t       State;
+    UUId_t            CoreId;
+
+    State  = InterruptDisable();
+    CoreId = ArchGetProcessorCoreId();
+    if (CoreId < MEMORY_CACHE_MAX_CORES) {
+        CpuCache = &CpuCaches[CoreId];
+        if (!CpuCache->Loaded || !CpuCache->Loaded->Count) {
+            // Previous is full, switch to it, otherwise exchange the empty previous
+            // magazine for a full one from the depot
+            if (CpuCache->Previous && CpuCache->Previous->Count) {
+                Magazine           = CpuCache->Loaded;
+                CpuCache->Loaded   = CpuCache->Previous;
+                CpuCache->Previous = Magazine;
+            }
+            else {
+                Magazine = cache_depot_get(Cache, 1);
+                if (Magazine) {
+                    if (CpuCache->Previous) {
+                        cache_depot_put(Cache, CpuCache->Previous);
+                    }
+                    CpuCache->Previous = CpuCache->Loaded;
+                    CpuCache->Loaded   = Magazine;
+                }
+            }
+        }
+
+        if (CpuCache->Loaded && CpuCache->Loaded->Count) {
+            Object = CpuCache->Loaded->Objects[--CpuCache->Loaded->Count];
+            CpuCache->NumberOfAllocations++;
         }
     }
-    return BytesRequired;
+    InterruptRestoreState(State);
+    return Object;
 }
 
-static void
-cache_initialize_atomic_cache(
-    _In_ MemoryCache_t* Cache)
+// Frees an object to the magazines of the calling core, an empty magazine is allocated
+// for the depot if it has none left. Fails if no magazine could be allocated.
+static OsStatus_t
+cache_magazine_free(
+    _In_ MemoryCache_t*    Cache,
+    _In_ MemoryCpuCache_t* CpuCaches,
+    _In_ void*             Object)
 {
-    size_t AtomicCacheSize = cache_calculate_atomic_cache(Cache);
-    int    NumberOfCores = atomic_load(&GetMachine()->NumberOfCores);
-    int    i;
-    if (AtomicCacheSize) {
-        Cache->AtomicCaches = (uintptr_t)kmalloc(AtomicCacheSize);
-        if (!Cache->AtomicCaches) {
-            return;
+    MemoryCpuCache_t* CpuCache;
+    MemoryMagazine_t* Magazine;
+    IntStatus_t       State;
+    UUId_t            CoreId;
+
+    while (1) {
+        State  = InterruptDisable();
+        CoreId = ArchGetProcessorCoreId();
+        if (CoreId >= MEMORY_CACHE_MAX_CORES) {
+            InterruptRestoreState(State);
+            return OsError;
         }
-        
-        memset((void*)Cache->AtomicCaches, 0, AtomicCacheSize);
-        for (i = 0; i < NumberOfCores; i++) {
-            MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(Cache, i);
-            AtomicCache->Available           = ATOMIC_VAR_INIT(0);
-            AtomicCache->Limit               = Cache->ObjectCount;
+
+        CpuCache = &CpuCaches[CoreId];
+        if (!CpuCache->Loaded || CpuCache->Loaded->Count == Cache->MagazineSize) {
+            // Previous is empty, switch to it, otherwise exchange the full previous
+            // magazine for an empty one from the depot
+            if (CpuCache->Previous && !CpuCache->Previous->Count) {
+                Magazine           = CpuCache->Loaded;
+                CpuCache->Loaded   = CpuCache->Previous;
+                CpuCache->Previous = Magazine;
+            }
+            else {
+                Magazine = cache_depot_get(Cache, 0);
+                if (Magazine) {
+                    if (CpuCache->Previous) {
+                        cache_depot_put(Cache, CpuCache->Previous);
+                    }
+                    CpuCache->Previous = CpuCache->Loaded;
+                    CpuCache->Loaded   = Magazine;
+                }
+            }
         }
+
+        if (CpuCache->Loaded && CpuCache->Loaded->Count < Cache->MagazineSize) {
+            CpuCache->Loaded->Objects[CpuCache->Loaded->Count++] = Object;
+            CpuCache->NumberOfFrees++;
+            InterruptRestoreState(State);
+            return OsSuccess;
+        }
+        InterruptRestoreState(State);
+
+        // Magazines can only be allocated with interrupts enabled, as the slab layer
+        // might have to block
+        Magazine = (MemoryMagazine_t*)cache_allocate(&MagazineCache);
+        if (!Magazine) {
+            return OsOutOfMemory;
+        }
+        Magazine->Count = 0;
+        cache_depot_put(Cache, Magazine);
     }
 }
 
 static void
-cache_drain_atomic_cache(
+cache_destroy_magazines(
     _In_ MemoryCache_t* Cache)
 {
-    // Send out IPI to all cores to empty their caches and put them into the gloal
-    // cache, this should be done when attempting to free up memory.
-    // @todo
+    MemoryCpuCache_t* CpuCaches = (MemoryCpuCache_t*)atomic_load(&Cache->CpuCaches);
+    MemoryMagazine_t* Magazine;
+    int               i;
+
+    if ((uintptr_t)CpuCaches > MEMORY_CACHE_PENDING) {
+        for (i = 0; i < MEMORY_CACHE_MAX_CORES; i++) {
+            if (CpuCaches[i].Loaded) {
+                MemoryCacheFree(&MagazineCache, CpuCaches[i].Loaded);
+            }
+            if (CpuCaches[i].Previous) {
+                MemoryCacheFree(&MagazineCache, CpuCaches[i].Previous);
+            }
+        }
+        kfree(CpuCaches);
+    }
+
+    while ((Magazine = cache_depot_get(Cache, 1)) != NULL) {
+        MemoryCacheFree(&MagazineCache, Magazine);
+    }
+    while ((Magazine = cache_depot_get(Cache, 0)) != NULL) {
+        MemoryCacheFree(&MagazineCache, Magazine);
+    }
 }
 
 // Object size is the size of the actual object
@@ -537,6 +895,7 @@ cache_calculate_slab_size(
         ReservedSpace = cache_calculate_slab_structure_size(ObjectsPerSlab);
     }
 
+    assert(ObjectsPerSlab <= MEMORY_SLAB_MAX_OBJECTS);
     if (Cache != NULL) {
         Cache->ObjectCount       = (int)ObjectsPerSlab;
         Cache->SlabOnSite        = SlabOnSite;
@@ -570,7 +929,8 @@ MemoryCacheConstruct(
         ObjectPadding += ObjectAlignment - ((ObjectSize + ObjectPadding) % ObjectAlignment);
     }
 
-    MutexConstruct(&Cache->SyncObject, MUTEX_RECURSIVE);
+    // Caches are reused from the cache_cache, so start out from a clean slate
+    memset(Cache, 0, sizeof(MemoryCache_t));
     Cache->Name                = Name;
     Cache->Flags               = Flags;
     Cache->ObjectSize          = ObjectSize;
@@ -578,31 +938,36 @@ MemoryCacheConstruct(
     Cache->ObjectPadding       = ObjectPadding;
     Cache->ObjectConstructor   = ObjectConstructor;
     Cache->ObjectDestructor    = ObjectDestructor;
-    Cache->AtomicCaches        = 0;
-    Cache->NumberOfFreeObjects = 0;
     
-    list_construct(&Cache->FreeSlabs);
-    list_construct(&Cache->PartialSlabs);
-    list_construct(&Cache->FullSlabs);
+    cache_construct_node(&Cache->PrimaryNode);
+    atomic_store(&Cache->Nodes[0], (uintptr_t)&Cache->PrimaryNode);
+    IrqSpinlockConstruct(&Cache->Depot.SyncObject);
     
     cache_calculate_slab_size(Cache, ObjectSize, ObjectAlignment, ObjectPadding, ObjectMinCount);
     
-    // We only perform this if it has been requested and is not a default cache
-    if (!(Cache->Flags & (HEAP_CACHE_DEFAULT | HEAP_SLAB_NO_ATOMIC_CACHE))) {
-        cache_initialize_atomic_cache(Cache);
+    // Caches that are limited to a single slab must not have their objects held
+    // by the cores
+    if (!(Cache->Flags & (HEAP_SLAB_NO_ATOMIC_CACHE | HEAP_SINGLE_SLAB))) {
+        Cache->MagazineSize = cache_calculate_magazine_size(ObjectSize);
     }
     
     // Should we create the initial slab?
     if (Flags & HEAP_INITIAL_SLAB) {
-        MemorySlab_t* Slab = slab_create(Cache);
+        MemorySlab_t* Slab = slab_create(Cache, 0);
         assert(Slab != NULL);
-        Cache->NumberOfFreeObjects = Cache->ObjectCount;
-        list_append(&Cache->FreeSlabs, &Slab->Header);
+        Cache->PrimaryNode.NumberOfFreeObjects  = Cache->ObjectCount;
+        Cache->PrimaryNode.NumberOfSlabsCreated = 1;
+        list_append(&Cache->PrimaryNode.FreeSlabs, &Slab->Header);
     }
     
     TRACE("[cache_construct] [%s] number of objects %i/%i", 
-        Cache->Name, Cache->NumberOfFreeObjects, Cache->ObjectCount);
+        Cache->Name, Cache->PrimaryNode.NumberOfFreeObjects, Cache->ObjectCount);
     
+    MutexLock(&CachesLock);
+    Cache->Link = Caches;
+    Caches      = Cache;
+    MutexUnlock(&CachesLock);
+
     // Flush writes to other cpus
     smp_wmb();
 }
@@ -664,153 +1029,199 @@ void
 MemoryCacheDestroy(
     _In_ MemoryCache_t* Cache)
 {
-    // If there are any cpu caches, free them, there is no need to drain the cpu caches
-    // here at this point as we assume that when destroying a cache we do it for good reason
-    if (Cache->AtomicCaches != 0) {
-        kfree((void*)Cache->AtomicCaches);
+    MemoryCache_t** Link;
+    int             i;
+
+    MutexLock(&CachesLock);
+    for (Link = &Caches; *Link != NULL; Link = &(*Link)->Link) {
+        if (*Link == Cache) {
+            *Link = Cache->Link;
+            break;
+        }
+    }
+    MutexUnlock(&CachesLock);
+
+    // Wait for a reap that might still be releasing slabs of this cache
+    MutexLock(&ReapLock);
+    MutexUnlock(&ReapLock);
+
+    // There is no need to return the objects in the magazines to their slabs, as we assume
+    // that when destroying a cache we do it for good reason, only the magazines are freed
+    cache_destroy_magazines(Cache);
+    for (i = 0; i < MEMORY_CACHE_MAX_NODES; i++) {
+        MemoryCacheNode_t* Node = cache_node(Cache, i);
+        if (!Node) {
+            continue;
+        }
+
+        cache_destroy_list(Cache, &Node->FreeSlabs);
+        cache_destroy_list(Cache, &Node->PartialSlabs);
+        cache_destroy_list(Cache, &Node->FullSlabs);
+        if (Node != &Cache->PrimaryNode) {
+            kfree(Node);
+        }
     }
-    cache_destroy_list(Cache, &Cache->FreeSlabs);
-    cache_destroy_list(Cache, &Cache->PartialSlabs);
-    cache_destroy_list(Cache, &Cache->FullSlabs);
     MemoryCacheFree(&InitialCache, Cache);
 }
 
-void*
-MemoryCacheAllocate(
+static void
+cache_update_high_water_mark(
     _In_ MemoryCache_t* Cache)
 {
-    MemorySlab_t* Slab;
-    void*         Allocated;
-    int           Index;
-    TRACE("MemoryCacheAllocate(%s)", Cache->Name);
+    size_t InUse = atomic_fetch_add(&Cache->SlabObjectsInUse, 1) + 1;
+    size_t Peak  = atomic_load(&Cache->HighWaterMark);
+    while (InUse > Peak && !atomic_compare_exchange_weak(&Cache->HighWaterMark, &Peak, InUse));
+}
 
-    // Can we allocate from cpu cache? No need to use explicit macros with memory
-    // barriers here as there is no risc of other cpus changing the atomic caches
-    if (Cache->AtomicCaches != 0) {
-        MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(Cache, ArchGetProcessorCoreId());
-        int Available = atomic_load(&AtomicCache->Available);
-        while (Available) {
-            if (atomic_compare_exchange_weak(&AtomicCache->Available, &Available, Available - 1)) {
-                Allocated = MEMORY_ATOMIC_ELEMENT(AtomicCache, (Available - 1))[0];
-                TRACE("[heap] [%s] ATOMIC ALLOC 0x%" PRIxIN " (%u, %u, %u)", 
-                    Cache->Name, Allocated, Cache->ObjectSize, Cache->ObjectPadding, Available);
-                return Allocated;
-            }
-        }
-    }
+static void*
+cache_allocate_object(
+    _In_ MemoryCache_t* Cache)
+{
+    MemoryCacheNode_t* Node;
+    MemorySlab_t*      Slab;
+    void*              Allocated;
+    int                NodeIndex;
+    int                Index;
+
+    Node = cache_current_node(Cache, &NodeIndex);
 
-    MutexLock(&Cache->SyncObject);
-    if (Cache->NumberOfFreeObjects) {
-        element_t* Element = list_front(&Cache->PartialSlabs);
+    MutexLock(&Node->SyncObject);
+    if (Node->NumberOfFreeObjects) {
+        element_t* Element = list_front(&Node->PartialSlabs);
         if (Element) {
             Slab = Element->value;
             assert(Slab->NumberOfFreeObjects != 0);
             if (Slab->NumberOfFreeObjects == 1) {
-                list_remove(&Cache->PartialSlabs, Element);
+                list_remove(&Node->PartialSlabs, Element);
             }
         }
         else {
-            Element = list_front(&Cache->FreeSlabs);
+            Element = list_front(&Node->FreeSlabs);
             assert(Element != NULL);
             
             Slab = Element->value;
-            list_remove(&Cache->FreeSlabs, Element);
+            list_remove(&Node->FreeSlabs, Element);
             if (Slab->NumberOfFreeObjects > 1) {
-                list_append(&Cache->PartialSlabs, Element);
+                list_append(&Node->PartialSlabs, Element);
             }
         }
         
         Index = slab_allocate_index(Cache, Slab);
-        assert(Index != -1);
-        
         if (!Slab->NumberOfFreeObjects) {
-            list_append(&Cache->FullSlabs, Element);
+            list_append(&Node->FullSlabs, Element);
         }
-        Cache->NumberOfFreeObjects--;
+        Node->NumberOfFreeObjects--;
         
         Allocated = MEMORY_SLAB_ELEMENT(Cache, Slab, Index);
     }
     else if (!(Cache->Flags & HEAP_SINGLE_SLAB)) {
-        Slab = slab_create(Cache);
+        Slab = slab_create(Cache, NodeIndex);
         if (!Slab) {
-            MutexUnlock(&Cache->SyncObject);
+            MutexUnlock(&Node->SyncObject);
             ERROR("[heap] [%s] slab_create returned NULL", Cache->Name);
             return NULL;
         }
         
         Index = slab_allocate_index(Cache, Slab);
-        assert(Index != -1);
-        
         if (!Slab->NumberOfFreeObjects) {
-            list_append(&Cache->FullSlabs, &Slab->Header);
+            list_append(&Node->FullSlabs, &Slab->Header);
         }
         else {
-            list_append(&Cache->PartialSlabs, &Slab->Header);
-            Cache->NumberOfFreeObjects += (Cache->ObjectCount - 1);
+            list_append(&Node->PartialSlabs, &Slab->Header);
+            Node->NumberOfFreeObjects += (Cache->ObjectCount - 1);
         }
+        Node->NumberOfSlabsCreated++;
         
         Allocated = MEMORY_SLAB_ELEMENT(Cache, Slab, Index);
     }
     else {
         ERROR("[heap] [%s] ran out of objects %i/%i", Cache->Name,
-            Cache->NumberOfFreeObjects, Cache->ObjectCount);
+            Node->NumberOfFreeObjects, Cache->ObjectCount);
         Allocated = NULL;
         Index     = -1;
     }
-    MutexUnlock(&Cache->SyncObject);
+
+    if (Allocated) {
+        Node->NumberOfAllocations++;
+        cache_update_high_water_mark(Cache);
+    }
+    MutexUnlock(&Node->SyncObject);
 
     TRACE(" => 0x%" PRIxIN " (%u [0x%x], %u, %i)", Allocated, Cache->ObjectSize, 
         LODWORD(&Cache->ObjectSize), Cache->ObjectPadding, Index);
     return Allocated;
 }
 
-struct FreeContext {
-    MemoryCache_t* Cache;
-    uintptr_t      Object;
-    element_t*     Element;
-    int            AddToFree;
-};
-
-static int
-FreeInSlab(
-    _In_ int        Unused,
-    _In_ element_t* Element,
-    _In_ void*      ContextPointer)
+// Returns an object to its slab, the node lock must be held
+static void
+node_return_object(
+    _In_ MemoryCache_t*     Cache,
+    _In_ MemoryCacheNode_t* Node,
+    _In_ MemorySlab_t*      Slab,
+    _In_ void*              Object)
 {
-    struct FreeContext* Context = ContextPointer;
-    MemorySlab_t*       Slab    = Element->value;
-    int                 Index   = slab_contains_address(Context->Cache, Slab, Context->Object);
-    int                 Result  = LIST_ENUMERATE_STOP;
-    
-    if (Index == -1) {
-        return LIST_ENUMERATE_CONTINUE;
+    int Index = slab_object_index(Cache, Slab, (uintptr_t)Object);
+
+    slab_free_index(Cache, Slab, Index);
+    Node->NumberOfFreeObjects++;
+    atomic_fetch_sub(&Cache->SlabObjectsInUse, 1);
+
+    // Move the slab from full to partial, or from partial to free. A slab can go directly
+    // from full to free if the count is 1
+    if (Slab->NumberOfFreeObjects == 1) {
+        list_remove(&Node->FullSlabs, &Slab->Header);
+        if (Cache->ObjectCount == 1) {
+            list_append(&Node->FreeSlabs, &Slab->Header);
+        }
+        else {
+            list_append(&Node->PartialSlabs, &Slab->Header);
+        }
     }
-    
-    slab_free_index(Context->Cache, Slab, Index);
-    if (Slab->NumberOfFreeObjects == Context->Cache->ObjectCount) {
-        Context->AddToFree = 1;
-        Result |= LIST_ENUMERATE_REMOVE;
+    else if (Slab->NumberOfFreeObjects == Cache->ObjectCount) {
+        list_remove(&Node->PartialSlabs, &Slab->Header);
+        list_append(&Node->FreeSlabs, &Slab->Header);
     }
-    
-    Context->Element = Element;
-    Context->Cache->NumberOfFreeObjects++;
-    smp_wmb();
-    
-    return Result;
 }
 
-void
-MemoryCacheFree(
+static void
+cache_free_object(
     _In_ MemoryCache_t* Cache,
+    _In_ MemorySlab_t*  Slab,
     _In_ void*          Object)
 {
-    struct FreeContext Context = { 
-        .Cache     = Cache, 
-        .Object    = (uintptr_t)Object, 
-        .Element   = NULL, 
-        .AddToFree = 0
-    };
-    
+    MemoryCacheNode_t* Node = cache_node(Cache, Slab->Node);
+
+    MutexLock(&Node->SyncObject);
+    node_return_object(Cache, Node, Slab, Object);
+    Node->NumberOfFrees++;
+    MutexUnlock(&Node->SyncObject);
+}
+
+// Returns an object from a magazine to its slab without counting it as a free, as it
+// was already counted when it was put in the magazine. Fails if the node is busy.
+static OsStatus_t
+cache_drain_object(
+    _In_ MemoryCache_t* Cache,
+    _In_ void*          Object)
+{
+    MemorySlab_t*      Slab = slab_find_owner((uintptr_t)Object);
+    MemoryCacheNode_t* Node = cache_node(Cache, Slab->Node);
+
+    if (MutexTryLock(&Node->SyncObject) != OsSuccess) {
+        return OsBusy;
+    }
+    node_return_object(Cache, Node, Slab, Object);
+    MutexUnlock(&Node->SyncObject);
+    return OsSuccess;
+}
+
+static void
+cache_free(
+    _In_ MemoryCache_t* Cache,
+    _In_ MemorySlab_t*  Slab,
+    _In_ void*          Object)
+{
+    MemoryCpuCache_t* CpuCaches;
     TRACE("MemoryCacheFree(%s, 0x%" PRIxIN ")", Cache->Name, Object);
 
     // Handle debug flags
@@ -818,53 +1229,304 @@ MemoryCacheFree(
         memset(Object, MEMORY_OVERRUN_PATTERN, Cache->ObjectSize);
     }
 
-    // Can we push to cpu cache?
-    if (Cache->AtomicCaches != 0) {
-        TRACE("[heap] [%s] ATOMIC FREE 0x%" PRIxIN, Cache->Name, Object);
-        MemoryAtomicCache_t* AtomicCache = MEMORY_ATOMIC_CACHE(Cache, ArchGetProcessorCoreId());
-        int Available = atomic_load(&AtomicCache->Available);
-        while (Available < AtomicCache->Limit) {
-            if (atomic_compare_exchange_weak(&AtomicCache->Available, &Available, Available + 1)) {
-                MEMORY_ATOMIC_ELEMENT(AtomicCache, Available)[0] = Object;
-                return;
-            }
+    // Objects from slabs of other nodes are returned to their own node, so the
+    // magazines only ever hold local memory
+    if (Cache->MagazineSize && Slab->Node == cache_current_node_index()) {
+        CpuCaches = cache_get_cpu_caches(Cache);
+        if (CpuCaches && cache_magazine_free(Cache, CpuCaches, Object) == OsSuccess) {
+            return;
         }
-        
-        // If the atomic cache is full then drain it
     }
+    cache_free_object(Cache, Slab, Object);
+}
 
-    MutexLock(&Cache->SyncObject);
-    list_enumerate(&Cache->PartialSlabs, FreeInSlab, &Context);
-    if (Context.AddToFree) {
-        list_append(&Cache->FreeSlabs, Context.Element);
+static void
+cache_profile_record(
+    _In_ size_t Size,
+    _In_ void*  Caller)
+{
+    HeapProfileSample_t* Sample;
+
+    IrqSpinlockAcquire(&ProfileLock);
+    Sample         = &ProfileSamples[ProfileCount % HEAP_PROFILE_MAX_SAMPLES];
+    Sample->Caller = (uintptr_t)Caller;
+    Sample->Size   = Size;
+    ProfileCount++;
+    IrqSpinlockRelease(&ProfileLock);
+}
+
+// This is on the allocation path, so all it costs while the profiler is disabled
+// is the load of the interval
+static inline void
+cache_profile_allocation(
+    _In_ size_t Size,
+    _In_ void*  Caller)
+{
+    unsigned int Interval = atomic_load_explicit(&ProfileInterval, memory_order_relaxed);
+    if (Interval && !(atomic_fetch_add_explicit(&ProfileTicks, 1, memory_order_relaxed) % Interval)) {
+        cache_profile_record(Size, Caller);
     }
-    
-    // Element was not present in partial slabs, check the full slabs now
-    if (!Context.Element) {
-        list_enumerate(&Cache->FullSlabs, FreeInSlab, &Context);
-        if (Context.Element) {
-            // AddToFree is set if the object was removed already
-            if (!Context.AddToFree) {
-                list_remove(&Cache->FullSlabs, Context.Element);
+}
+
+static void*
+cache_allocate(
+    _In_ MemoryCache_t* Cache)
+{
+    MemoryCpuCache_t* CpuCaches;
+    void*             Allocated;
+    TRACE("MemoryCacheAllocate(%s)", Cache->Name);
+
+    if (Cache->MagazineSize) {
+        CpuCaches = cache_get_cpu_caches(Cache);
+        Allocated = CpuCaches ? cache_magazine_allocate(Cache, CpuCaches) : NULL;
+        if (Allocated) {
+            TRACE("[heap] [%s] MAGAZINE ALLOC 0x%" PRIxIN, Cache->Name, Allocated);
+            return Allocated;
+        }
+    }
+    return cache_allocate_object(Cache);
+}
+
+void*
+MemoryCacheAllocate(
+    _In_ MemoryCache_t* Cache)
+{
+    cache_profile_allocation(Cache->ObjectSize, __builtin_return_address(0));
+    return cache_allocate(Cache);
+}
+
+void
+MemoryCacheFree(
+    _In_ MemoryCache_t* Cache,
+    _In_ void*          Object)
+{
+    MemorySlab_t* Slab = slab_find_owner((uintptr_t)Object);
+    assert(Slab != NULL && Slab->Cache == Cache);
+    cache_free(Cache, Slab, Object);
+}
+
+int
+MemoryCacheQuery(
+    _In_ HeapCacheStatistics_t* Statistics,
+    _In_ int                    MaxCount)
+{
+    HeapCacheStatistics_t CacheStatistics;
+    MemoryCache_t*        Cache;
+    int                   Count = 0;
+
+    // The statistics are gathered on the stack, as the node locks must not be held
+    // while writing to the callers buffer. The list lock is, so it must be a kernel buffer
+    MutexLock(&CachesLock);
+    for (Cache = Caches; Cache != NULL; Cache = Cache->Link) {
+        if (Count < MaxCount) {
+            cache_get_statistics(Cache, &CacheStatistics);
+            memcpy(&Statistics[Count], &CacheStatistics, sizeof(HeapCacheStatistics_t));
+        }
+        Count++;
+    }
+    MutexUnlock(&CachesLock);
+    return Count;
+}
+
+int
+MemoryCacheProfile(
+    _In_ int                  SampleInterval,
+    _In_ HeapProfileSample_t* Samples,
+    _In_ int                  MaxCount)
+{
+    size_t Available;
+    size_t Copied;
+    size_t First;
+    size_t i;
+
+    if (SampleInterval >= 0) {
+        atomic_store(&ProfileInterval, (unsigned int)SampleInterval);
+    }
+
+    // Copy the most recent samples that fit
+    IrqSpinlockAcquire(&ProfileLock);
+    Available = MIN(ProfileCount, HEAP_PROFILE_MAX_SAMPLES);
+    Copied    = MIN(Available, (size_t)MAX(MaxCount, 0));
+    First     = ProfileCount - Copied;
+    for (i = 0; i < Copied; i++) {
+        Samples[i] = ProfileSamples[(First + i) % HEAP_PROFILE_MAX_SAMPLES];
+    }
+    IrqSpinlockRelease(&ProfileLock);
+    return (int)Available;
+}
+
+// Returns the objects of the full magazines in the depot to their slabs. The magazines
+// of the cores are left alone, they can only be touched by their own core. Magazines
+// that could not be drained are put back, and the drained ones are added to the chain,
+// or put back as empty magazines if no chain is given.
+static void
+cache_drain_depot(
+    _In_ MemoryCache_t*     Cache,
+    _In_ MemoryMagazine_t** Drained)
+{
+    MemoryMagazine_t* Magazine;
+    MemoryMagazine_t* Busy = NULL;
+
+    while ((Magazine = cache_depot_get(Cache, 1)) != NULL) {
+        while (Magazine->Count) {
+            if (cache_drain_object(Cache, Magazine->Objects[Magazine->Count - 1]) != OsSuccess) {
+                break;
             }
-            
-            // A slab can go directly from full to free if the count is 1
-            if (Cache->ObjectCount == 1) {
-                list_append(&Cache->FreeSlabs, Context.Element);
+            Magazine->Count--;
+        }
+
+        if (Magazine->Count || !Drained) {
+            Magazine->Link = Busy;
+            Busy           = Magazine;
+        }
+        else {
+            Magazine->Link = *Drained;
+            *Drained       = Magazine;
+        }
+    }
+
+    while (Busy != NULL) {
+        Magazine = Busy;
+        Busy     = Magazine->Link;
+        cache_depot_put(Cache, Magazine);
+    }
+}
+
+// Moves the free slabs of the cache to the given list, busy nodes are skipped
+static void
+cache_collect_slabs(
+    _In_ MemoryCache_t* Cache,
+    _In_ list_t*        Slabs)
+{
+    element_t* Element;
+    int        i;
+
+    for (i = 0; i < MEMORY_CACHE_MAX_NODES; i++) {
+        MemoryCacheNode_t* Node = cache_node(Cache, i);
+        if (!Node || MutexTryLock(&Node->SyncObject) != OsSuccess) {
+            continue;
+        }
+
+        while ((Element = list_front(&Node->FreeSlabs)) != NULL) {
+            list_remove(&Node->FreeSlabs, Element);
+            list_append(Slabs, Element);
+            Node->NumberOfFreeObjects -= Cache->ObjectCount;
+            Node->NumberOfSlabsReaped++;
+        }
+        MutexUnlock(&Node->SyncObject);
+    }
+}
+
+static size_t
+cache_release_slabs(
+    _In_ MemoryCache_t* Cache,
+    _In_ list_t*        Slabs)
+{
+    element_t* Element;
+    size_t     Freed = 0;
+
+    while ((Element = list_front(Slabs)) != NULL) {
+        list_remove(Slabs, Element);
+        slab_destroy(Cache, Element->value);
+        Freed += Cache->PageCount;
+    }
+    return Freed;
+}
+
+// Only node locks that are free are taken, and in direct mode the reap gives up
+// instead of waiting on the other locks, as the allocation that failed can hold any
+// of them. The slabs of caches that keep their slab structures off-site are not
+// reaped in direct mode either, as freeing the structure can end in a locked cache.
+static size_t
+cache_reap(
+    _In_ unsigned int Flags)
+{
+    MemoryCache_t*    Cache;
+    MemoryMagazine_t* Drained = NULL;
+    MemoryMagazine_t* Magazine;
+    list_t            Slabs;
+    size_t            Freed = 0;
+
+    if (Flags & MEMORY_RECLAIM_DIRECT) {
+        if (MutexTryLock(&ReapLock) != OsSuccess) {
+            return 0;
+        }
+        if (MutexTryLock(&CachesLock) != OsSuccess) {
+            MutexUnlock(&ReapLock);
+            return 0;
+        }
+    }
+    else {
+        MutexLock(&ReapLock);
+        MutexLock(&CachesLock);
+    }
+
+    for (Cache = Caches; Cache != NULL; Cache = Cache->Link) {
+        if ((Flags & MEMORY_RECLAIM_DIRECT) && !Cache->SlabOnSite) {
+            continue;
+        }
+
+        // The drained magazines are given back to the magazine cache once done, except
+        // in direct mode where the magazine cache can be locked
+        list_construct(&Slabs);
+        if (Cache->MagazineSize) {
+            cache_drain_depot(Cache, (Flags & MEMORY_RECLAIM_DIRECT) ? NULL : &Drained);
+        }
+        cache_collect_slabs(Cache, &Slabs);
+        
+        // The slabs are released without the caches lock, as that can free memory in
+        // other caches. A cache unlinked meanwhile stays valid, including its link, as
+        // it is not destroyed before the reap lock is released.
+        if (list_count(&Slabs)) {
+            MutexUnlock(&CachesLock);
+            Freed += cache_release_slabs(Cache, &Slabs);
+
+            if (Flags & MEMORY_RECLAIM_DIRECT) {
+                if (MutexTryLock(&CachesLock) != OsSuccess) {
+                    break;
+                }
             }
             else {
-                list_append(&Cache->PartialSlabs, Context.Element);
+                MutexLock(&CachesLock);
             }
         }
     }
-    MutexUnlock(&Cache->SyncObject);
+    if (Cache == NULL) {
+        MutexUnlock(&CachesLock);
+    }
+
+    // The magazine cache is collected again once the drained magazines are freed, as
+    // it might have been walked before them
+    if (Drained != NULL) {
+        while (Drained != NULL) {
+            Magazine = Drained;
+            Drained  = Magazine->Link;
+            MemoryCacheFree(&MagazineCache, Magazine);
+        }
+        list_construct(&Slabs);
+        cache_collect_slabs(&MagazineCache, &Slabs);
+        Freed += cache_release_slabs(&MagazineCache, &Slabs);
+    }
+    MutexUnlock(&ReapLock);
+    return Freed;
+}
+
+static size_t
+cache_shrink(
+    _In_ void*        Context,
+    _In_ size_t       PageCount,
+    _In_ unsigned int Flags)
+{
+    _CRT_UNUSED(Context);
+    _CRT_UNUSED(PageCount);
+    return cache_reap(Flags);
 }
 
+static MemoryShrinker_t HeapShrinker = MEMORY_SHRINKER_INIT("heap", cache_shrink, NULL);
+
 int MemoryCacheReap(void)
 {
-    // Iterate the caches in the system and drain their cpu caches
-    // Then start looking at the entirely free slabs, and free them.
-    return 0;
+    return (int)cache_reap(0);
 }
 
 void* kmalloc(size_t Size)
@@ -882,7 +1544,8 @@ void* kmalloc(size_t Size)
         Selected->Cache = MemoryCacheCreate(Selected->Name, Selected->ObjectSize,
             Selected->ObjectSize, 0, Selected->InitializationFlags, NULL, NULL);
     }
-    return MemoryCacheAllocate(Selected->Cache);
+    cache_profile_allocation(Size, __builtin_return_address(0));
+    return cache_allocate(Selected->Cache);
 }
 
 void* kmalloc_p(size_t Size, uintptr_t* DmaOut)
@@ -901,35 +1564,25 @@ void* kmalloc_p(size_t Size, uintptr_t* DmaOut)
 
 void kfree(void* Object)
 {
-    struct FixedCache* Selected = NULL;
-    int                i = 0;
-
-    // Find the cache that the allocation was done in
-    while (DefaultCaches[i].ObjectSize != 0) {
-        if (DefaultCaches[i].Cache != NULL) {
-            if (cache_contains_address(DefaultCaches[i].Cache, (uintptr_t)Object)) {
-                Selected = &DefaultCaches[i];
-                break;
-            }
-        }
-        i++;
-    }
-    if (Selected == NULL) {
+    // The slab that owns the object knows which cache it was allocated in
+    MemorySlab_t* Slab = slab_find_owner((uintptr_t)Object);
+    if (Slab == NULL) {
         ERROR("Could not find a cache for object 0x%" PRIxIN "", Object);
         MemoryCacheDump(NULL);
         assert(0);
     }
-    MemoryCacheFree(Selected->Cache, Object);
+    cache_free(Slab->Cache, Slab, Object);
 }
 
 void
 MemoryCacheDump(
     _In_ MemoryCache_t* Cache)
 {
-    int MaxBlocks  = GetMachine()->PhysicalMemory.capacity;
-    int FreeBlocks = GetMachine()->PhysicalMemory.index;
-    int i          = 0;
+    size_t MaxBlocks;
+    size_t FreeBlocks;
+    int    i = 0;
     
+    PageAllocatorGetStatistics(&GetMachine()->PhysicalMemory, &MaxBlocks, &FreeBlocks);
     if (Cache != NULL) {
         cache_dump_information(Cache);
         return;
@@ -952,7 +1605,27 @@ MemoryCacheDump(
 void
 MemoryCacheInitialize(void)
 {
-    // Initialize the default cache and disable atomics for this one
+    StaticMemoryPool_t* Pool     = &GetMachine()->GlobalAccessMemory;
+    size_t              PageSize = GetMemorySpacePageSize();
+    int                 PageCount;
+
+    // Create the table of slab owners, it covers all of the global access memory
+    SlabOwnersStart = Pool->StartAddress;
+    SlabOwnersCount = Pool->Length / PageSize;
+    PageCount       = (int)DIVUP(SlabOwnersCount * sizeof(MemorySlab_t*), PageSize);
+    SlabOwners      = (MemorySlab_t**)allocate_virtual_memory(PageCount);
+    assert(SlabOwners != NULL);
+    memset(SlabOwners, 0, PageCount * PageSize);
+
+    MutexConstruct(&CachesLock, MUTEX_PLAIN);
+    MutexConstruct(&ReapLock, MUTEX_PLAIN);
+    IrqSpinlockConstruct(&ProfileLock);
+
+    // Initialize the default cache and disable atomics for this one, and the cache for
+    // magazines, which must not have magazines of its own
     MemoryCacheConstruct(&InitialCache, "cache_cache", sizeof(MemoryCache_t), 
-        16, 0, HEAP_CACHE_DEFAULT, NULL, NULL);
+        16, 0, HEAP_CACHE_DEFAULT | HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    MemoryCacheConstruct(&MagazineCache, "magazine_cache", sizeof(MemoryMagazine_t),
+        sizeof(void*), 0, HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    MemoryReclaimRegisterShrinker(&HeapShrinker);
 }
@@ -0,0 +1,202 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Memory Reclaim Interface
+ * - Returns memory that is cached by the kernel to the physical page allocator when
+ *   memory runs low.
+ */
+
+#define __MODULE "RECLAIM"
+//#define __TRACE
+
+#include <assert.h>
+#include <debug.h>
+#include <machine.h>
+#include <memory_reclaim.h>
+#include <mutex.h>
+#include <scheduler.h>
+#include <semaphore.h>
+#include <threading.h>
+
+// The low watermark is 1/64th of the physical memory within these bounds, and the
+// high watermark is twice that
+#define MEMORY_RECLAIM_MIN_WATERMARK 64
+#define MEMORY_RECLAIM_MAX_WATERMARK 16384
+
+// When a run could not reclaim anything, the thread waits this long before it can be
+// woken again, as every allocation below the watermark would wake it otherwise
+#define MEMORY_RECLAIM_BACKOFF_MS    100
+
+static Mutex_t           ShrinkersLock   = OS_MUTEX_INIT(MUTEX_PLAIN);
+static MemoryShrinker_t* Shrinkers       = NULL;
+static Semaphore_t       ReclaimEvent    = SEMAPHORE_INIT(0, 1);
+static _Atomic(int)      ReclaimPending  = ATOMIC_VAR_INIT(0);
+static UUId_t            ReclaimHandle   = UUID_INVALID;
+static size_t            LowWatermark    = 0;
+static size_t            HighWatermark   = 0;
+static _Atomic(size_t)   NumberOfRuns    = ATOMIC_VAR_INIT(0);
+static _Atomic(size_t)   PagesReclaimed  = ATOMIC_VAR_INIT(0);
+
+size_t
+MemoryReclaim(
+    _In_ size_t       PageCount,
+    _In_ unsigned int Flags)
+{
+    MemoryShrinker_t* Shrinker;
+    size_t            Freed = 0;
+
+    // A failing allocation can come from a shrinker, or from a thread that is registering
+    // one, which already holds the lock
+    if (Flags & MEMORY_RECLAIM_DIRECT) {
+        if (MutexTryLock(&ShrinkersLock) != OsSuccess) {
+            return 0;
+        }
+    }
+    else {
+        MutexLock(&ShrinkersLock);
+    }
+
+    for (Shrinker = Shrinkers; Shrinker != NULL && Freed < PageCount; Shrinker = Shrinker->Link) {
+        size_t ShrinkerFreed = Shrinker->Shrink(Shrinker->Context, PageCount - Freed, Flags);
+        TRACE("[reclaim] %s freed %" PRIuIN " pages", Shrinker->Name, ShrinkerFreed);
+        Freed += ShrinkerFreed;
+    }
+    MutexUnlock(&ShrinkersLock);
+
+    atomic_fetch_add(&PagesReclaimed, Freed);
+    return Freed;
+}
+
+static void
+MemoryReclaimThread(
+    _In_Opt_ void* Arguments)
+{
+    PageAllocator_t* Allocator = &GetMachine()->PhysicalMemory;
+    size_t           PageCount;
+    size_t           FreePages;
+    size_t           Freed;
+    size_t           TotalFreed;
+    clock_t          Unused;
+    _CRT_UNUSED(Arguments);
+
+    while (1) {
+        SemaphoreWait(&ReclaimEvent, 0);
+        atomic_fetch_add(&NumberOfRuns, 1);
+
+        // Keep reclaiming until the high watermark is reached, or nothing more can be freed
+        TotalFreed = 0;
+        PageAllocatorGetStatistics(Allocator, &PageCount, &FreePages);
+        while (FreePages < HighWatermark) {
+            Freed = MemoryReclaim(HighWatermark - FreePages, 0);
+            if (!Freed) {
+                break;
+            }
+            TotalFreed += Freed;
+            PageAllocatorGetStatistics(Allocator, &PageCount, &FreePages);
+        }
+        TRACE("[reclaim] freed %" PRIuIN " pages, %" PRIuIN "/%" PRIuIN " pages free",
+            TotalFreed, FreePages, PageCount);
+
+        // Give the cached pages of this core back, so the freed pages can be merged
+        PageAllocatorDrainCache(Allocator);
+        if (!TotalFreed && FreePages < LowWatermark) {
+            SchedulerSleep(MEMORY_RECLAIM_BACKOFF_MS, &Unused);
+        }
+        atomic_store(&ReclaimPending, 0);
+    }
+}
+
+// Called by the page allocator from the allocating context, which is why the thread is
+// only signalled once per run
+static void
+MemoryReclaimWatermarkHandler(
+    _In_ PageAllocator_t* Allocator)
+{
+    _CRT_UNUSED(Allocator);
+    if (!atomic_exchange(&ReclaimPending, 1)) {
+        SemaphoreSignal(&ReclaimEvent, 1);
+    }
+}
+
+void
+MemoryReclaimInitialize(void)
+{
+    size_t PageCount;
+    size_t FreePages;
+
+    PageAllocatorGetStatistics(&GetMachine()->PhysicalMemory, &PageCount, &FreePages);
+    LowWatermark  = MIN(MAX(PageCount / 64, MEMORY_RECLAIM_MIN_WATERMARK), MEMORY_RECLAIM_MAX_WATERMARK);
+    HighWatermark = LowWatermark * 2;
+    TRACE("[reclaim] watermarks %" PRIuIN "/%" PRIuIN " pages", LowWatermark, HighWatermark);
+}
+
+OsStatus_t
+MemoryReclaimStart(void)
+{
+    OsStatus_t Status = CreateThread("reclaim", MemoryReclaimThread, NULL, 0,
+        UUID_INVALID, &ReclaimHandle);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    PageAllocatorSetWatermark(&GetMachine()->PhysicalMemory, LowWatermark,
+        MemoryReclaimWatermarkHandler);
+    return OsSuccess;
+}
+
+void
+MemoryReclaimRegisterShrinker(
+    _In_ MemoryShrinker_t* Shrinker)
+{
+    assert(Shrinker != NULL && Shrinker->Shrink != NULL);
+
+    MutexLock(&ShrinkersLock);
+    Shrinker->Link = Shrinkers;
+    Shrinkers      = Shrinker;
+    MutexUnlock(&ShrinkersLock);
+}
+
+void
+MemoryReclaimUnregisterShrinker(
+    _In_ MemoryShrinker_t* Shrinker)
+{
+    MemoryShrinker_t** Link;
+
+    MutexLock(&ShrinkersLock);
+    for (Link = &Shrinkers; *Link != NULL; Link = &(*Link)->Link) {
+        if (*Link == Shrinker) {
+            *Link = Shrinker->Link;
+            break;
+        }
+    }
+    MutexUnlock(&ShrinkersLock);
+}
+
+void
+MemoryReclaimGetStatistics(
+    _Out_ size_t* LowWatermarkOut,
+    _Out_ size_t* HighWatermarkOut,
+    _Out_ size_t* NumberOfRunsOut,
+    _Out_ size_t* PagesReclaimedOut)
+{
+    *LowWatermarkOut   = LowWatermark;
+    *HighWatermarkOut  = HighWatermark;
+    *NumberOfRunsOut   = atomic_load(&NumberOfRuns);
+    *PagesReclaimedOut = atomic_load(&PagesReclaimed);
+}
@@ -37,35 +37,72 @@
 #include <machine.h>
 #include <string.h>
 #include <threading.h>
+#include <timers.h>
+
+// Ranges above this many pages are invalidated by flushing the entire tlb
+#define MEMORY_SYNC_FLUSH_THRESHOLD 32
+#define MEMORY_SYNC_SPIN_COUNT      100000
+#define MEMORY_SYNC_TIMEOUT         1000
 
 typedef struct MemorySynchronizationObject {
     _Atomic(int) CallsCompleted;
-    UUId_t       MemorySpaceHandle;
     uintptr_t    Address;
     size_t       Length;
+    int          PageCount;
+    int          FullFlush;
 } MemorySynchronizationObject_t;
 
+static struct {
+    _Atomic(size_t)   ShootdownsSent;
+    _Atomic(size_t)   PagesInvalidated;
+    _Atomic(uint64_t) WaitTimeNs;
+} SynchronizationStatistics;
+
+// The memory space context each core has loaded, only the core itself updates its entry
+static SystemMemorySpaceContext_t* LoadedContexts[MEMORY_SPACE_MAX_CORES] = { 0 };
+
 static void
 MemorySynchronizationHandler(
     _In_ void* Context)
 {
-    MemorySynchronizationObject_t* Object        = (MemorySynchronizationObject_t*)Context;
-    SystemMemorySpace_t*           Current       = GetCurrentMemorySpace();
-    UUId_t                         CurrentHandle = GetCurrentMemorySpaceHandle();
-
-    // Make sure the current address space is matching
-    // If NULL => everyone must update
-    // If it matches our parent, we must update
-    // If it matches us, we must update
+    MemorySynchronizationObject_t* Object = (MemorySynchronizationObject_t*)Context;
+
     smp_mb();
-    if (Object->MemorySpaceHandle  == UUID_INVALID ||
-        Current->ParentHandle      == Object->MemorySpaceHandle || 
-        CurrentHandle              == Object->MemorySpaceHandle) {
+    if (Object->FullFlush) {
+        CpuInvalidateMemoryCache(NULL, 0);
+    }
+    else {
         CpuInvalidateMemoryCache((void*)Object->Address, Object->Length);
     }
+    atomic_fetch_add(&SynchronizationStatistics.PagesInvalidated, Object->PageCount);
     atomic_fetch_add(&Object->CallsCompleted, 1);
 }
 
+static int
+SendMemorySynchronization(
+    _In_ SystemMemorySpaceContext_t*    Context,
+    _In_ MemorySynchronizationObject_t* Object)
+{
+    UUId_t   CurrentCoreId = ArchGetProcessorCoreId();
+    uint32_t Cores;
+    UUId_t   CoreId;
+    int      Executions = 0;
+    int      i;
+
+    for (i = 0; i < MEMORY_SPACE_CORE_WORDS; i++) {
+        Cores = atomic_load(&Context->ActiveCores[i]);
+        while (Cores) {
+            CoreId = (UUId_t)((i * 32) + __builtin_ctz(Cores));
+            Cores &= Cores - 1;
+            if (CoreId != CurrentCoreId &&
+                TxuMessageSend(CoreId, CpuFunctionCustom, MemorySynchronizationHandler, Object, 1) == OsSuccess) {
+                Executions++;
+            }
+        }
+    }
+    return Executions;
+}
+
 static void
 SynchronizeMemoryRegion(
     _In_ SystemMemorySpace_t* MemorySpace,
@@ -75,39 +112,64 @@ SynchronizeMemoryRegion(
     // We can easily allocate this object on the stack as the stack is globally
     // visible to all kernel code. This spares us allocation on heap
     MemorySynchronizationObject_t Object = { 
+        .CallsCompleted = 0,
         .Address        = Address,
         .Length         = Length,
-        .CallsCompleted = 0
+        .PageCount      = DIVUP((Length + (Address % GetMemorySpacePageSize())), GetMemorySpacePageSize()),
+        .FullFlush      = 0
     };
     
-    int     NumberOfCores;
-    int     NumberOfActiveCores;
-    clock_t InterruptedAt;
-    size_t  Timeout = 1000;
+    SystemMemorySpaceContext_t* Context = NULL;
+    LargeInteger_t              Frequency;
+    LargeInteger_t              Start;
+    LargeInteger_t              End;
+    int                         NumberOfCores;
+    clock_t                     InterruptedAt;
+    size_t                      Timeout = MEMORY_SYNC_TIMEOUT;
+    int                         Spins   = 0;
 
     // Skip this entire step if there is no multiple cores active
-    NumberOfActiveCores = atomic_load(&GetMachine()->NumberOfActiveCores);
-    if (NumberOfActiveCores <= 1) {
+    if (atomic_load(&GetMachine()->NumberOfActiveCores) <= 1) {
         return;
     }
 
-    // Check for global address, in that case invalidate all cores
-    if (StaticMemoryPoolContains(&GetMachine()->GlobalAccessMemory, Address)) {
-        Object.MemorySpaceHandle = UUID_INVALID; // Everyone must update
+    // Global access memory and the kernel space are mapped in every memory space, so
+    // every core must invalidate those. Otherwise only the cores that have the memory
+    // space loaded, and as those translations are not global a full flush is possible
+    if (!StaticMemoryPoolContains(&GetMachine()->GlobalAccessMemory, Address)) {
+        Context = MemorySpace->Context;
+    }
+
+    smp_mb();
+    if (Context != NULL) {
+        Object.FullFlush = Object.PageCount > MEMORY_SYNC_FLUSH_THRESHOLD;
+        NumberOfCores    = SendMemorySynchronization(Context, &Object);
     }
     else {
-        if (MemorySpace->ParentHandle == UUID_INVALID) {
-            Object.MemorySpaceHandle = GetCurrentMemorySpaceHandle(); // Children of us must update
-        }
-        else {
-            Object.MemorySpaceHandle = MemorySpace->ParentHandle; // Parent and siblings!
-        }
+        NumberOfCores = ProcessorMessageSend(1, CpuFunctionCustom, MemorySynchronizationHandler, &Object, 1);
     }
     
-    NumberOfCores = ProcessorMessageSend(1, CpuFunctionCustom, MemorySynchronizationHandler, &Object, 1);
+    if (!NumberOfCores) {
+        return;
+    }
+    atomic_fetch_add(&SynchronizationStatistics.ShootdownsSent, NumberOfCores);
+
+    // The other cores usually respond within microseconds, so spin before
+    // yielding the core in between checks
+    TimersQueryPerformanceTick(&Start);
     while (atomic_load(&Object.CallsCompleted) != NumberOfCores && Timeout > 0) {
-        SchedulerSleep(5, &InterruptedAt);
-        Timeout -= 5;
+        if (Spins < MEMORY_SYNC_SPIN_COUNT) {
+            Spins++;
+            continue;
+        }
+        SchedulerSleep(1, &InterruptedAt);
+        Timeout--;
+    }
+    
+    if (TimersQueryPerformanceFrequency(&Frequency) == OsSuccess &&
+        TimersQueryPerformanceTick(&End) == OsSuccess && Frequency.QuadPart > 0) {
+        atomic_fetch_add(&SynchronizationStatistics.WaitTimeNs,
+            ((uint64_t)(End.QuadPart - Start.QuadPart) * 1000000000ULL) / (uint64_t)Frequency.QuadPart);
     }
     
     if (!Timeout) {
@@ -130,6 +192,7 @@ CreateMemorySpaceContext(
         GetMachine()->MemoryGranularity);
     Context->SignalHandler  = 0;
     Context->MemoryHandlers = kmalloc(sizeof(list_t));
+    memset((void*)&Context->ActiveCores[0], 0, sizeof(Context->ActiveCores));
     if (!Context->MemoryHandlers) {
         assert(0);
     }
@@ -258,7 +321,35 @@ void
 SwitchMemorySpace(
     _In_ SystemMemorySpace_t* MemorySpace)
 {
+    UUId_t                      CoreId   = ArchGetProcessorCoreId();
+    SystemMemorySpaceContext_t* Previous;
+    SystemMemorySpaceContext_t* Next     = MemorySpace->Context;
+    uint32_t                    CoreBit  = 1U << (CoreId % 32);
+
+    assert(CoreId < MEMORY_SPACE_MAX_CORES);
+    Previous = LoadedContexts[CoreId];
+
+    // Mark the core before loading the tables, and unmark it in the previous space after,
+    // so a shootdown can never miss a core that holds translations for a space
+    if (Next != NULL && Next != Previous) {
+        atomic_fetch_or(&Next->ActiveCores[CoreId / 32], CoreBit);
+    }
     ArchMmuSwitchMemorySpace(MemorySpace);
+    if (Previous != NULL && Previous != Next) {
+        atomic_fetch_and(&Previous->ActiveCores[CoreId / 32], ~CoreBit);
+    }
+    LoadedContexts[CoreId] = Next;
+}
+
+void
+GetMemorySynchronizationStatistics(
+    _Out_ size_t*   ShootdownsSent,
+    _Out_ size_t*   PagesInvalidated,
+    _Out_ uint64_t* WaitTimeNs)
+{
+    *ShootdownsSent   = atomic_load(&SynchronizationStatistics.ShootdownsSent);
+    *PagesInvalidated = atomic_load(&SynchronizationStatistics.PagesInvalidated);
+    *WaitTimeNs       = atomic_load(&SynchronizationStatistics.WaitTimeNs);
 }
 
 SystemMemorySpace_t*
@@ -346,6 +437,74 @@ ResolveVirtualSystemMemorySpaceAddress(
     return VirtualBase;
 }
 
+static void
+FreeVirtualSystemMemorySpaceAddress(
+    _In_ SystemMemorySpace_t* SystemMemorySpace,
+    _In_ VirtualAddress_t     Address)
+{
+    // Free the range in either GAM or Process memory
+    if (SystemMemorySpace->Context != NULL && DynamicMemoryPoolContains(&SystemMemorySpace->Context->Heap, Address)) {
+        DynamicMemoryPoolFree(&SystemMemorySpace->Context->Heap, Address);
+    }
+    else if (StaticMemoryPoolContains(&GetMachine()->GlobalAccessMemory, Address)) {
+        StaticMemoryPoolFree(&GetMachine()->GlobalAccessMemory, Address);
+    }
+}
+
+static OsStatus_t
+AllocatePhysicalSystemMemorySpacePages(
+    _In_ VirtualAddress_t VirtualBase,
+    _In_ uintptr_t*       PhysicalAddressValues,
+    _In_ int              PageCount)
+{
+    PageAllocator_t* Allocator     = &GetMachine()->PhysicalMemory;
+    size_t           PageSize      = GetMemorySpacePageSize();
+    size_t           LargePageSize = ArchMmuGetLargePageSize();
+    int              Index         = 0;
+    OsStatus_t       Status;
+    
+    // The large pages the mapping covers are backed by runs that are aligned like the
+    // virtual address, so the architecture can map each of them with a single entry.
+    // If memory is too fragmented for a run, the rest is allocated as normal pages.
+    if (LargePageSize != 0) {
+        int PagesPerLarge = (int)(LargePageSize / PageSize);
+        int LeadingPages  = (int)(((LargePageSize - (VirtualBase % LargePageSize)) % LargePageSize) / PageSize);
+        
+        if (LeadingPages + PagesPerLarge <= PageCount) {
+            if (LeadingPages != 0) {
+                Status = PageAllocatorAllocate(Allocator, LeadingPages, &PhysicalAddressValues[0]);
+                if (Status != OsSuccess) {
+                    return Status;
+                }
+            }
+            
+            Index = LeadingPages;
+            while (Index + PagesPerLarge <= PageCount) {
+                if (PageAllocatorAllocateContiguous(Allocator, PagesPerLarge, LargePageSize,
+                        &PhysicalAddressValues[Index]) != OsSuccess) {
+                    break;
+                }
+                
+                for (int i = 1; i < PagesPerLarge; i++) {
+                    PhysicalAddressValues[Index + i] = PhysicalAddressValues[Index] + (i * PageSize);
+                }
+                Index += PagesPerLarge;
+            }
+        }
+    }
+    
+    if (Index < PageCount) {
+        Status = PageAllocatorAllocate(Allocator, PageCount - Index, &PhysicalAddressValues[Index]);
+        if (Status != OsSuccess) {
+            if (Index != 0) {
+                PageAllocatorFree(Allocator, Index, &PhysicalAddressValues[0]);
+            }
+            return Status;
+        }
+    }
+    return OsSuccess;
+}
+
 OsStatus_t
 MemorySpaceMap(
     _In_    SystemMemorySpace_t* MemorySpace,
@@ -372,28 +531,29 @@ MemorySpaceMap(
     assert(PhysicalAddressValues != NULL);
     assert(PlacementFlags != 0);
     
-    // In case the mappings are provided, we would like to force the COMMIT flag.
-    if (PlacementFlags & MAPPING_PHYSICAL_FIXED) {
-        MemoryFlags |= MAPPING_COMMIT;
-    }
-    else if (MemoryFlags & MAPPING_COMMIT) {
-        IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-        bounded_stack_pop_multiple(&GetMachine()->PhysicalMemory,
-            (void**)&PhysicalAddressValues[0], PageCount);
-        IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
-    }
-    
     // Resolve the virtual address, if virtual-base is zero then we have trouble, as something
     // went wrong during the phase to figure out where to place
     VirtualBase = ResolveVirtualSystemMemorySpaceAddress(MemorySpace,
         Address, Length, PlacementFlags);
     if (!VirtualBase) {
-        // Cleanup physical mappings
-        // TODO
-        ERROR("[memory_map] implement cleanup of phys virt");
         return OsInvalidParameters;
     }
     
+    // In case the mappings are provided, we would like to force the COMMIT flag. Otherwise
+    // the physical pages are allocated after the placement, so they can match it.
+    if (PlacementFlags & MAPPING_PHYSICAL_FIXED) {
+        MemoryFlags |= MAPPING_COMMIT;
+    }
+    else if (MemoryFlags & MAPPING_COMMIT) {
+        Status = AllocatePhysicalSystemMemorySpacePages(VirtualBase, &PhysicalAddressValues[0], PageCount);
+        if (Status != OsSuccess) {
+            if ((PlacementFlags & MAPPING_VIRTUAL_MASK) != MAPPING_VIRTUAL_FIXED) {
+                FreeVirtualSystemMemorySpaceAddress(MemorySpace, VirtualBase);
+            }
+            return Status;
+        }
+    }
+    
     Status = ArchMmuSetVirtualPages(MemorySpace, VirtualBase, 
         PhysicalAddressValues, PageCount, MemoryFlags, &PagesUpdated);
     if (Status != OsSuccess) {
@@ -501,10 +661,11 @@ MemorySpaceCommit(
     assert(PhysicalAddressValues != NULL);
 
     if (!(Placement & MAPPING_PHYSICAL_FIXED)) {
-        IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-        bounded_stack_pop_multiple(&GetMachine()->PhysicalMemory, 
-            (void**)&PhysicalAddressValues[0], PageCount);
-        IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+        Status = PageAllocatorAllocate(&GetMachine()->PhysicalMemory,
+            PageCount, &PhysicalAddressValues[0]);
+        if (Status != OsSuccess) {
+            return Status;
+        }
     }
 
     Status = ArchMmuCommitVirtualPage(MemorySpace, Address, &PhysicalAddressValues[0],
@@ -513,10 +674,8 @@ MemorySpaceCommit(
         ERROR("[memory] [commit] status %u, comitting address 0x%" PRIxIN ", length 0x%" PRIxIN,
             Status, Address, Length);
         if (!(Placement & MAPPING_PHYSICAL_FIXED)) {
-            IrqSpinlockAcquire(&GetMachine()->PhysicalMemoryLock);
-            bounded_stack_push_multiple(&GetMachine()->PhysicalMemory, 
-                (void**)&PhysicalAddressValues[0], PageCount);
-            IrqSpinlockRelease(&GetMachine()->PhysicalMemoryLock);
+            PageAllocatorFree(&GetMachine()->PhysicalMemory,
+                PageCount, &PhysicalAddressValues[0]);
         }
     }
     return Status;
@@ -601,16 +760,7 @@ MemorySpaceUnmap(
             Address, Size, Status);
     }
 
-    // Free the range in either GAM or Process memory
-    if (MemorySpace->Context != NULL && DynamicMemoryPoolContains(&MemorySpace->Context->Heap, Address)) {
-        DynamicMemoryPoolFree(&MemorySpace->Context->Heap, Address);
-    }
-    else if (StaticMemoryPoolContains(&GetMachine()->GlobalAccessMemory, Address)) {
-        StaticMemoryPoolFree(&GetMachine()->GlobalAccessMemory, Address);
-    }
-    else {
-        // Ignore
-    }
+    FreeVirtualSystemMemorySpaceAddress(MemorySpace, Address);
     return OsSuccess;
 }
 
@@ -20,36 +20,75 @@
  * - Contains the shared kernel log interface for logging-usage
  */
 
+#include <arch/interrupts.h>
 #include <arch/output.h>
+#include <arch/thread.h>
 #include <arch/utils.h>
 #include <assert.h>
+#include <component/cpu.h>
+#include <component/domain.h>
+#include <ddk/barrier.h>
+#include <ddk/io.h>
+#include <debug.h>
 #include <handle.h>
 #include <heap.h>
-#include <irq_spinlock.h>
 #include <log.h>
 #include <machine.h>
+#include <os/spinlock.h>
+#include <scheduler.h>
+#include <semaphore.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <threading.h>
 
+#define LOG_MAXIMUM_CORES  256
+#define LOG_DRAIN_BATCH    64
+#define LOG_DRAIN_INTERVAL 10
+#define LOG_FLUSH_ATTEMPTS 100000
+
 typedef struct SystemLogLine {
-    int    Type;
-    UUId_t CoreId;
-    UUId_t ThreadHandle;
-    char   Data[128]; // Message
+    uint64_t Timestamp;
+    int      Type;
+    UUId_t   CoreId;
+    UUId_t   ThreadHandle;
+    char     Data[128]; // Message
 } SystemLogLine_t;
 
+// Only the owning core appends to its ring, with interrupts disabled, and only the
+// holder of the log lock consumes it. Messages are dropped and counted when it is full.
+typedef struct SystemLogRing {
+    _Atomic(size_t)       Head;
+    _Atomic(size_t)       Tail;
+    _Atomic(size_t)       Lost;
+    size_t                LostReported;
+    UUId_t                CoreId;
+    size_t                Mask;
+    SystemLogLine_t*      Lines;
+    struct SystemLogRing* Link;
+} SystemLogRing_t;
+
+// The history of merged lines, rendered from RenderIndex to LineIndex
 typedef struct SystemLog {
     uintptr_t*       StartOfData;
     size_t           DataSize;
     int              NumberOfLines;
     SystemLogLine_t* Lines;
-    IrqSpinlock_t    SyncObject;
+    spinlock_t       SyncObject;
     
     int LineIndex;
     int RenderIndex;
     int AllowRender;
+    int Deferred;
+    int Panic;
+    int RenderCore;
+    
+    SystemLogRing_t* Rings;
+
+    // The log thread waits on the semaphore while the rings are empty
+    Semaphore_t  Signal;
+    _Atomic(int) Idle;
+    _Atomic(int) WakePending;
 } SystemLog_t;
 
 static char* TypeDescriptions[] = {
@@ -71,6 +110,12 @@ static uint32_t TypeColors[] = {
 static SystemLog_t LogObject                 = { 0 };
 static char StaticLogSpace[LOG_INITIAL_SIZE] = { 0 };
 
+// Cores without a ring of their own share the boot ring, which needs a lock
+static SystemLogRing_t  BootRing                        = { 0 };
+static SystemLogLine_t  BootLines[LOG_BOOT_LINES]       = { 0 };
+static spinlock_t       BootSyncObject                  = _SPN_INITIALIZER_NP(spinlock_plain);
+static SystemLogRing_t* CoreRings[LOG_MAXIMUM_CORES]    = { 0 };
+
 void
 LogInitialize(void)
 {
@@ -80,27 +125,95 @@ LogInitialize(void)
     
     LogObject.Lines         = (SystemLogLine_t*)&StaticLogSpace[0];
     LogObject.NumberOfLines = LOG_INITIAL_SIZE / sizeof(SystemLogLine_t);
+    LogObject.RenderCore    = -1;
+    spinlock_init(&LogObject.SyncObject, spinlock_plain);
+    SemaphoreConstruct(&LogObject.Signal, 0, 1);
+    
+    BootRing.Mask  = LOG_BOOT_LINES - 1;
+    BootRing.Lines = &BootLines[0];
+    LogObject.Rings = &BootRing;
 }
 
-void
-LogInitializeFull(void)
+static void
+LogStoreLine(
+    _In_ SystemLogLine_t* Line)
 {
-    void* UpgradeBuffer;
+    memcpy(&LogObject.Lines[LogObject.LineIndex], Line, sizeof(SystemLogLine_t));
+    LogObject.LineIndex = (LogObject.LineIndex + 1) % LogObject.NumberOfLines;
+    
+    // Drop the oldest line that was never rendered when the history is full
+    if (LogObject.LineIndex == LogObject.RenderIndex) {
+        LogObject.RenderIndex = (LogObject.RenderIndex + 1) % LogObject.NumberOfLines;
+    }
+}
 
-    // Upgrade the buffer
-    UpgradeBuffer = kmalloc(LOG_PREFFERED_SIZE);
-    memset(UpgradeBuffer, 0, LOG_PREFFERED_SIZE);
+static void
+LogReportLost(
+    _In_ SystemLogRing_t* Ring)
+{
+    SystemLogLine_t Line;
+    size_t          Lost = atomic_load(&Ring->Lost);
+    
+    if (Lost != Ring->LostReported) {
+        memset(&Line, 0, sizeof(SystemLogLine_t));
+        Line.Type         = LOG_WARNING;
+        Line.CoreId       = Ring->CoreId;
+        Line.ThreadHandle = UUID_INVALID;
+        snprintf(&Line.Data[0], sizeof(Line.Data) - 1, "%" PRIuIN " messages were lost",
+            Lost - Ring->LostReported);
+        Ring->LostReported = Lost;
+        LogStoreLine(&Line);
+    }
+}
 
-	IrqSpinlockAcquire(&LogObject.SyncObject);
-    memcpy(UpgradeBuffer, (const void*)LogObject.StartOfData, LogObject.DataSize);
-    LogObject.StartOfData   = (uintptr_t*)UpgradeBuffer;
-    LogObject.DataSize      = LOG_PREFFERED_SIZE;
-    LogObject.Lines         = (SystemLogLine_t*)UpgradeBuffer;
-    LogObject.NumberOfLines = LOG_PREFFERED_SIZE / sizeof(SystemLogLine_t);
-	IrqSpinlockRelease(&LogObject.SyncObject);
+// Must be called with the log lock held. Moves up to MaxLines lines from the rings into
+// the history, oldest first, and returns the number of lines moved.
+static int
+LogMergeRings(
+    _In_ int MaxLines)
+{
+    SystemLogRing_t* Ring;
+    SystemLogRing_t* Oldest;
+    SystemLogLine_t* Line;
+    size_t           Tail;
+    int              Merged = 0;
+    
+    while (Merged < MaxLines) {
+        Oldest = NULL;
+        Line   = NULL;
+        for (Ring = LogObject.Rings; Ring != NULL; Ring = Ring->Link) {
+            Tail = atomic_load_explicit(&Ring->Tail, memory_order_relaxed);
+            if (Tail != atomic_load_explicit(&Ring->Head, memory_order_acquire)) {
+                if (!Oldest || Ring->Lines[Tail & Ring->Mask].Timestamp < Line->Timestamp) {
+                    Oldest = Ring;
+                    Line   = &Ring->Lines[Tail & Ring->Mask];
+                }
+            }
+        }
+        
+        if (!Oldest) {
+            break;
+        }
+        
+        // Report losses in the place they happened, before the first line that made it
+        LogReportLost(Oldest);
+        LogStoreLine(Line);
+        atomic_store_explicit(&Oldest->Tail, 
+            atomic_load_explicit(&Oldest->Tail, memory_order_relaxed) + 1, memory_order_release);
+        Merged++;
+    }
+    
+    // Losses on rings that are empty by now
+    if (Merged < MaxLines) {
+        for (Ring = LogObject.Rings; Ring != NULL; Ring = Ring->Link) {
+            LogReportLost(Ring);
+        }
+    }
+    return Merged;
 }
 
-void
+// Must be called with the log lock held
+static void
 LogRenderMessages(void)
 {
     SystemLogLine_t* Line;
@@ -136,6 +249,166 @@ LogRenderMessages(void)
     }
 }
 
+// A panic must be able to render even if it happened while rendering on this core, or
+// if the core that holds the lock was halted, so it gives up on the lock after a while
+static void
+LogFlushMessages(void)
+{
+    IntStatus_t CpuState = InterruptDisable();
+    int         CoreId   = (int)ArchGetProcessorCoreId();
+    int         Locked   = 0;
+    int         i;
+    
+    if (READ_VOLATILE(LogObject.Panic)) {
+        if (READ_VOLATILE(LogObject.RenderCore) != CoreId) {
+            for (i = 0; i < LOG_FLUSH_ATTEMPTS && !Locked; i++) {
+                Locked = spinlock_try_acquire(&LogObject.SyncObject) == spinlock_acquired;
+            }
+        }
+    }
+    else {
+        spinlock_acquire(&LogObject.SyncObject);
+        Locked = 1;
+    }
+    
+    WRITE_VOLATILE(LogObject.RenderCore, CoreId);
+    while (LogMergeRings(LOG_DRAIN_BATCH) == LOG_DRAIN_BATCH) {
+        LogRenderMessages();
+    }
+    LogRenderMessages();
+    
+    if (Locked) {
+        WRITE_VOLATILE(LogObject.RenderCore, -1);
+        spinlock_release(&LogObject.SyncObject);
+    }
+    InterruptRestoreState(CpuState);
+}
+
+static int
+LogDrainBatch(void)
+{
+    IntStatus_t CpuState;
+    int         Merged;
+
+    CpuState = InterruptDisable();
+    spinlock_acquire(&LogObject.SyncObject);
+    WRITE_VOLATILE(LogObject.RenderCore, (int)ArchGetProcessorCoreId());
+    Merged = LogMergeRings(LOG_DRAIN_BATCH);
+    LogRenderMessages();
+    WRITE_VOLATILE(LogObject.RenderCore, -1);
+    spinlock_release(&LogObject.SyncObject);
+    InterruptRestoreState(CpuState);
+    return Merged;
+}
+
+// Renders the rings in small batches so interrupts are never disabled for long. While
+// messages are arriving it sleeps between batches so they are rendered together, and
+// once the rings are empty it waits until an appender wakes it.
+static void
+LogThread(
+    _In_Opt_ void* Args)
+{
+    clock_t InterruptedAt;
+    int     Merged;
+    _CRT_UNUSED(Args);
+    
+    WRITE_VOLATILE(LogObject.Deferred, 1);
+    while (1) {
+        Merged = LogDrainBatch();
+        if (Merged == LOG_DRAIN_BATCH) {
+            ThreadingYield();
+            continue;
+        }
+        if (Merged != 0) {
+            SchedulerSleep(LOG_DRAIN_INTERVAL, &InterruptedAt);
+            continue;
+        }
+
+        // Appenders check the idle flag after their message is published, so either
+        // they see the flag, or the drain after setting it sees their message
+        atomic_store(&LogObject.Idle, 1);
+        smp_mb();
+        if (LogDrainBatch() == 0) {
+            SemaphoreWait(&LogObject.Signal, 0);
+        }
+        atomic_store(&LogObject.Idle, 0);
+    }
+}
+
+static void
+LogCreateRings(
+    _In_ SystemCpu_t* Processor)
+{
+    SystemCpuCore_t* Core;
+    SystemLogRing_t* Ring;
+    IntStatus_t      CpuState;
+    
+    for (Core = Processor->Cores; Core != NULL; Core = Core->Link) {
+        if (Core->Id >= LOG_MAXIMUM_CORES || CoreRings[Core->Id]) {
+            continue;
+        }
+        
+        Ring = (SystemLogRing_t*)kmalloc(sizeof(SystemLogRing_t) + 
+            (LOG_CORE_LINES * sizeof(SystemLogLine_t)));
+        if (!Ring) {
+            continue;
+        }
+        
+        memset(Ring, 0, sizeof(SystemLogRing_t));
+        Ring->CoreId = Core->Id;
+        Ring->Mask   = LOG_CORE_LINES - 1;
+        Ring->Lines  = (SystemLogLine_t*)&Ring[1];
+        
+        CpuState = InterruptDisable();
+        spinlock_acquire(&LogObject.SyncObject);
+        Ring->Link      = LogObject.Rings;
+        LogObject.Rings = Ring;
+        spinlock_release(&LogObject.SyncObject);
+        InterruptRestoreState(CpuState);
+        
+        smp_wmb();
+        CoreRings[Core->Id] = Ring;
+    }
+}
+
+void
+LogInitializeFull(void)
+{
+    void*       UpgradeBuffer;
+    IntStatus_t CpuState;
+    UUId_t      ThreadHandle;
+
+    // Upgrade the buffer
+    UpgradeBuffer = kmalloc(LOG_PREFFERED_SIZE);
+    memset(UpgradeBuffer, 0, LOG_PREFFERED_SIZE);
+
+    CpuState = InterruptDisable();
+	spinlock_acquire(&LogObject.SyncObject);
+    memcpy(UpgradeBuffer, (const void*)LogObject.StartOfData, LogObject.DataSize);
+    LogObject.StartOfData   = (uintptr_t*)UpgradeBuffer;
+    LogObject.DataSize      = LOG_PREFFERED_SIZE;
+    LogObject.Lines         = (SystemLogLine_t*)UpgradeBuffer;
+    LogObject.NumberOfLines = LOG_PREFFERED_SIZE / sizeof(SystemLogLine_t);
+	spinlock_release(&LogObject.SyncObject);
+    InterruptRestoreState(CpuState);
+    
+    // Every core gets a ring, the cores are enumerated by now
+    if (list_count(&GetMachine()->SystemDomains) != 0) {
+        foreach(i, &GetMachine()->SystemDomains) {
+            SystemDomain_t* Domain = (SystemDomain_t*)i->value;
+            LogCreateRings(&Domain->CoreGroup);
+        }
+    }
+    else {
+        LogCreateRings(&GetMachine()->Processor);
+    }
+    
+    // Messages are rendered as they are appended until the thread runs
+    if (CreateThread("log", LogThread, NULL, 0, UUID_INVALID, &ThreadHandle) != OsSuccess) {
+        ERROR("Failed to create the log thread, messages are rendered synchronously");
+    }
+}
+
 void
 LogSetRenderMode(
     _In_ int Enable)
@@ -143,43 +416,96 @@ LogSetRenderMode(
     // Update status, flush log
     LogObject.AllowRender = Enable;
     if (Enable) {
-	    IrqSpinlockAcquire(&LogObject.SyncObject);
-        LogRenderMessages();
-	    IrqSpinlockRelease(&LogObject.SyncObject);
+        LogFlushMessages();
+    }
+}
+
+void
+LogWakeDeferred(void)
+{
+    if (atomic_load_explicit(&LogObject.WakePending, memory_order_relaxed) &&
+        atomic_exchange(&LogObject.WakePending, 0)) {
+        SemaphoreSignal(&LogObject.Signal, 1);
+    }
+}
+
+// Wakes the log thread if it went idle. With interrupts disabled the caller may hold a
+// lock that waking the thread needs, so the wake is left to the next timer tick.
+static void
+LogWakeThread(
+    _In_ int InterruptsDisabled)
+{
+    smp_mb();
+    if (atomic_load_explicit(&LogObject.Idle, memory_order_relaxed) &&
+        atomic_exchange(&LogObject.Idle, 0)) {
+        if (InterruptsDisabled) {
+            atomic_store(&LogObject.WakePending, 1);
+        }
+        else {
+            SemaphoreSignal(&LogObject.Signal, 1);
+        }
     }
 }
 
+void
+LogFlush(void)
+{
+    WRITE_VOLATILE(LogObject.Panic, 1);
+    LogFlushMessages();
+}
+
 void
 LogAppendMessage(
     _In_ int         Type,
     _In_ const char* Message,
     ...)
 {
+    SystemLogRing_t* Ring;
     SystemLogLine_t* Line;
 	va_list          Arguments;
-	UUId_t           CoreId = ArchGetProcessorCoreId();
+    IntStatus_t      CpuState;
+	UUId_t           CoreId;
+    size_t           Head;
+    int              InterruptsDisabled;
 
     assert(Message != NULL);
     
-    // Get a new line object
-	IrqSpinlockAcquire(&LogObject.SyncObject);
-	if ((LogObject.LineIndex + 1) % LogObject.NumberOfLines == LogObject.RenderIndex) {
-	    LogRenderMessages();
-	}
-	
-    Line = &LogObject.Lines[LogObject.LineIndex++];
-    if (LogObject.LineIndex == LogObject.NumberOfLines) {
-        LogObject.LineIndex = 0;
-    }
-    
-    memset((void*)Line, 0, sizeof(SystemLogLine_t));
-    Line->Type         = Type;
-    Line->CoreId       = CoreId;
-    Line->ThreadHandle = GetCurrentThreadId();
-    
-	va_start(Arguments, Message);
-    vsnprintf(&Line->Data[0], sizeof(Line->Data) - 1, Message, Arguments);
-    va_end(Arguments);
-	LogRenderMessages();
-	IrqSpinlockRelease(&LogObject.SyncObject);
+    // Interrupts are disabled so the ring of this core has a single writer
+    InterruptsDisabled = InterruptIsDisabled();
+    CpuState           = InterruptDisable();
+    CoreId   = ArchGetProcessorCoreId();
+    Ring     = (CoreId < LOG_MAXIMUM_CORES) ? READ_VOLATILE(CoreRings[CoreId]) : NULL;
+    if (!Ring) {
+        Ring = &BootRing;
+        spinlock_acquire(&BootSyncObject);
+    }
+    
+    Head = atomic_load_explicit(&Ring->Head, memory_order_relaxed);
+    if (Head - atomic_load_explicit(&Ring->Tail, memory_order_acquire) > Ring->Mask) {
+        atomic_fetch_add(&Ring->Lost, 1);
+    }
+    else {
+        Line = &Ring->Lines[Head & Ring->Mask];
+        ArchGetTimestamp(&Line->Timestamp);
+        Line->Type         = Type;
+        Line->CoreId       = CoreId;
+        Line->ThreadHandle = GetCurrentThreadId();
+        
+    	va_start(Arguments, Message);
+        vsnprintf(&Line->Data[0], sizeof(Line->Data) - 1, Message, Arguments);
+        va_end(Arguments);
+        atomic_store_explicit(&Ring->Head, Head + 1, memory_order_release);
+    }
+    
+    if (Ring == &BootRing) {
+        spinlock_release(&BootSyncObject);
+    }
+    InterruptRestoreState(CpuState);
+    
+    if (!READ_VOLATILE(LogObject.Deferred) || READ_VOLATILE(LogObject.Panic)) {
+        LogFlushMessages();
+    }
+    else {
+        LogWakeThread(InterruptsDisabled);
+    }
 }
@@ -26,36 +26,32 @@
 #include <arch/thread.h>
 #include <arch/utils.h>
 #include <component/cpu.h>
-#include <ds/list.h>
 #include <debug.h>
 #include <ddk/barrier.h>
+#include <ddk/io.h>
 #include <futex.h>
 #include <heap.h>
+#include <machine.h>
 #include <os/spinlock.h>
 #include <memoryspace.h>
 #include <scheduler.h>
 #include <string.h>
+#include <threading.h>
 
-#define FUTEX_HASHTABLE_CAPACITY 64
+#define FUTEX_BUCKETS_PER_CORE 256
 
-// One per memory context
-typedef struct FutexItem {
-    element_t    Header;
-    list_t       BlockQueue;
-    spinlock_t   BlockQueueSyncObject;
-    _Atomic(int) Waiters;
-    
-    SystemMemorySpaceContext_t* Context;
-    uintptr_t                   FutexAddress;
-} FutexItem_t;
-
-// One per futex key
+// The waiters of every futex that hashes to the bucket, in the order they started
+// waiting. Waiters is raised before a waiter checks the futex value, so a wake can
+// skip the bucket without taking the lock when it is zero.
 typedef struct FutexBucket {
-    spinlock_t   SyncObject;
-    list_t       Futexes;
+    spinlock_t     SyncObject;
+    _Atomic(int)   Waiters;
+    FutexWaiter_t* Head;
+    FutexWaiter_t* Tail;
 } FutexBucket_t;
 
-static FutexBucket_t FutexBuckets[FUTEX_HASHTABLE_CAPACITY] = { 0 };
+static FutexBucket_t* FutexBuckets    = NULL;
+static size_t         FutexBucketMask = 0;
 
 static size_t
 GetIntegerHash(size_t x)
@@ -72,74 +68,201 @@ GetIntegerHash(size_t x)
     return x;
 }
 
-static SchedulerObject_t*
-SchedulerGetCurrentObject(
-    _In_ UUId_t CoreId)
+static FutexBucket_t*
+FutexGetBucket(
+    _In_ SystemMemorySpaceContext_t* Context,
+    _In_ uintptr_t                   FutexAddress)
 {
-    return (GetProcessorCore(CoreId)->CurrentThread != NULL) ? 
-        GetProcessorCore(CoreId)->CurrentThread->SchedulerObject : NULL;
+    size_t FutexHash = GetIntegerHash(FutexAddress ^ GetIntegerHash((uintptr_t)Context));
+    return &FutexBuckets[FutexHash & FutexBucketMask];
 }
 
-static FutexBucket_t*
-FutexGetBucket(
-    _In_ uintptr_t FutexAddress)
+// Private futexes are identified by the memory context and the virtual address, others
+// by the physical address so they can be shared between memory spaces
+static OsStatus_t
+FutexGetKey(
+    _In_  _Atomic(int)*                Futex,
+    _In_  int                          Private,
+    _Out_ SystemMemorySpaceContext_t** ContextOut,
+    _Out_ uintptr_t*                   FutexAddressOut)
+{
+    if (!FutexBuckets) {
+        return OsNotSupported;
+    }
+    
+    if (Private) {
+        *ContextOut      = GetCurrentMemorySpace()->Context;
+        *FutexAddressOut = (uintptr_t)Futex;
+        return OsSuccess;
+    }
+    
+    *ContextOut = NULL;
+    if (GetMemorySpaceMapping(GetCurrentMemorySpace(), (uintptr_t)Futex, 
+            1, FutexAddressOut) != OsSuccess) {
+        return OsDoesNotExist;
+    }
+    return OsSuccess;
+}
+
+// Two buckets are always locked in the same order to avoid deadlocks
+static void
+FutexLockBuckets(
+    _In_ FutexBucket_t* Bucket,
+    _In_ FutexBucket_t* Bucket2)
+{
+    if (Bucket == Bucket2) {
+        spinlock_acquire(&Bucket->SyncObject);
+    }
+    else if (Bucket < Bucket2) {
+        spinlock_acquire(&Bucket->SyncObject);
+        spinlock_acquire(&Bucket2->SyncObject);
+    }
+    else {
+        spinlock_acquire(&Bucket2->SyncObject);
+        spinlock_acquire(&Bucket->SyncObject);
+    }
+}
+
+static void
+FutexUnlockBuckets(
+    _In_ FutexBucket_t* Bucket,
+    _In_ FutexBucket_t* Bucket2)
+{
+    spinlock_release(&Bucket->SyncObject);
+    if (Bucket != Bucket2) {
+        spinlock_release(&Bucket2->SyncObject);
+    }
+}
+
+// Must be called with the bucket lock held
+static void
+FutexLinkWaiter(
+    _In_ FutexBucket_t* Bucket,
+    _In_ FutexWaiter_t* Waiter)
+{
+    Waiter->Link     = NULL;
+    Waiter->Previous = Bucket->Tail;
+    if (Bucket->Tail) {
+        Bucket->Tail->Link = Waiter;
+    }
+    else {
+        Bucket->Head = Waiter;
+    }
+    Bucket->Tail = Waiter;
+    WRITE_VOLATILE(Waiter->Bucket, Bucket);
+}
+
+// Must be called with the bucket lock held. The waiter keeps its bucket pointer, the
+// caller clears or updates it.
+static void
+FutexUnlinkWaiter(
+    _In_ FutexBucket_t* Bucket,
+    _In_ FutexWaiter_t* Waiter)
 {
-    size_t FutexHash = GetIntegerHash(FutexAddress);
-    return &FutexBuckets[FutexHash & (FUTEX_HASHTABLE_CAPACITY - 1)];
+    if (Waiter->Previous) {
+        Waiter->Previous->Link = Waiter->Link;
+    }
+    else {
+        Bucket->Head = Waiter->Link;
+    }
+    
+    if (Waiter->Link) {
+        Waiter->Link->Previous = Waiter->Previous;
+    }
+    else {
+        Bucket->Tail = Waiter->Previous;
+    }
+    atomic_fetch_sub(&Bucket->Waiters, 1);
 }
 
 // Must be called with the bucket lock held
-static FutexItem_t*
-FutexGetNode(
+static int
+FutexWakeWaiters(
     _In_ FutexBucket_t*              Bucket,
+    _In_ SystemMemorySpaceContext_t* Context,
     _In_ uintptr_t                   FutexAddress,
-    _In_ SystemMemorySpaceContext_t* Context)
+    _In_ int                         Count)
 {
-    foreach(i, &Bucket->Futexes) {
-        FutexItem_t* Item = (FutexItem_t*)i->value;
-        if (Item->FutexAddress == FutexAddress &&
-            Item->Context      == Context) {
-            return Item;
+    FutexWaiter_t* Waiter = Bucket->Head;
+    FutexWaiter_t* Next;
+    int            Woken = 0;
+    
+    while (Waiter && Woken < Count) {
+        Next = Waiter->Link;
+        if (Waiter->Context == Context && Waiter->Address == FutexAddress) {
+            FutexUnlinkWaiter(Bucket, Waiter);
+            
+            // A waiter that already timed out or was interrupted is not counted. The
+            // bucket pointer is cleared last, as the waiter may return and wait on
+            // something else the moment it sees it cleared.
+            if (SchedulerQueueObject(Waiter->Object) == OsSuccess) {
+                Woken++;
+            }
+            smp_wmb();
+            WRITE_VOLATILE(Waiter->Bucket, NULL);
         }
+        Waiter = Next;
     }
-    return NULL;
+    return Woken;
 }
 
-// Must be called with the bucket lock held
-static FutexItem_t*
-FutexCreateNode(
+// Must be called with both bucket locks held
+static int
+FutexRequeueWaiters(
     _In_ FutexBucket_t*              Bucket,
+    _In_ SystemMemorySpaceContext_t* Context,
     _In_ uintptr_t                   FutexAddress,
-    _In_ SystemMemorySpaceContext_t* Context)
+    _In_ FutexBucket_t*              Bucket2,
+    _In_ uintptr_t                   FutexAddress2,
+    _In_ int                         Count)
 {
-    FutexItem_t* Existing;
-    FutexItem_t* Item = (FutexItem_t*)kmalloc(sizeof(FutexItem_t));
-    if (!Item) {
-        return NULL;
-    }
+    FutexWaiter_t* Waiter = Bucket->Head;
+    FutexWaiter_t* Next;
+    int            Moved = 0;
     
-    memset(Item, 0, sizeof(FutexItem_t));
-    ELEMENT_INIT(&Item->Header, 0, Item);
-    list_construct(&Item->BlockQueue);
-    spinlock_init(&Item->BlockQueueSyncObject, spinlock_plain);
-    Item->FutexAddress = FutexAddress;
-    Item->Context      = Context;
-    
-    spinlock_acquire(&Bucket->SyncObject);
-    Existing = FutexGetNode(Bucket, FutexAddress, Context);
-    if (!Existing) {
-        list_append(&Bucket->Futexes, &Item->Header);
+    while (Waiter && Moved < Count) {
+        Next = Waiter->Link;
+        if (Waiter->Context == Context && Waiter->Address == FutexAddress) {
+            Waiter->Address = FutexAddress2;
+            if (Bucket != Bucket2) {
+                FutexUnlinkWaiter(Bucket, Waiter);
+                atomic_fetch_add(&Bucket2->Waiters, 1);
+                FutexLinkWaiter(Bucket2, Waiter);
+            }
+            Moved++;
+        }
+        Waiter = Next;
     }
-    spinlock_release(&Bucket->SyncObject);
+    return Moved;
+}
+
+// Called by a waiter once it runs again, it is still linked if it timed out or was
+// interrupted. The bucket can change while the lock is taken if it was requeued.
+static void
+FutexRemoveWaiter(
+    _In_ FutexWaiter_t* Waiter)
+{
+    FutexBucket_t* Bucket;
     
-    if (Existing) {
-        kfree(Item);
-        Item = Existing;
+    while (1) {
+        Bucket = READ_VOLATILE(Waiter->Bucket);
+        if (!Bucket) {
+            smp_rmb();
+            break;
+        }
+        
+        spinlock_acquire(&Bucket->SyncObject);
+        if (Bucket == READ_VOLATILE(Waiter->Bucket)) {
+            FutexUnlinkWaiter(Bucket, Waiter);
+            WRITE_VOLATILE(Waiter->Bucket, NULL);
+            spinlock_release(&Bucket->SyncObject);
+            break;
+        }
+        spinlock_release(&Bucket->SyncObject);
     }
-    return Item;
 }
 
-static void
+static int
 FutexPerformOperation(
     _In_ _Atomic(int)* Futex,
     _In_ int           Operation)
@@ -148,9 +271,14 @@ FutexPerformOperation(
     int Val = (Operation >> 12) & 0xFFF;
     int Old = 0;
     
+    if (Op & FUTEX_OP_ARG_SHIFT) {
+        Op  &= ~FUTEX_OP_ARG_SHIFT;
+        Val  = 1 << (Val & 31);
+    }
+    
     switch (Op) {
         case FUTEX_OP_SET: {
-            atomic_store(Futex, Val);
+            Old = atomic_exchange(Futex, Val);
         } break;
         case FUTEX_OP_ADD: {
             Old = atomic_fetch_add(Futex, Val);
@@ -168,6 +296,7 @@ FutexPerformOperation(
         default:
             break;
     }
+    return Old;
 }
 
 static int
@@ -219,11 +348,29 @@ FutexCompareOperation(
 void
 FutexInitialize(void)
 {
-    int i;
-    for (i = 0; i < FUTEX_HASHTABLE_CAPACITY; i++) {
+    int    CoreCount = atomic_load(&GetMachine()->NumberOfCores);
+    size_t Count     = FUTEX_BUCKETS_PER_CORE;
+    size_t i;
+    
+    if (CoreCount < GetMachine()->Processor.NumberOfCores) {
+        CoreCount = GetMachine()->Processor.NumberOfCores;
+    }
+    while (Count < ((size_t)CoreCount * FUTEX_BUCKETS_PER_CORE)) {
+        Count <<= 1;
+    }
+    
+    FutexBuckets = (FutexBucket_t*)kmalloc(Count * sizeof(FutexBucket_t));
+    if (!FutexBuckets) {
+        FATAL(FATAL_SCOPE_KERNEL, "Failed to allocate %" PRIuIN " futex buckets", Count);
+    }
+    
+    for (i = 0; i < Count; i++) {
         spinlock_init(&FutexBuckets[i].SyncObject, spinlock_plain);
-        list_construct(&FutexBuckets[i].Futexes);
+        atomic_store(&FutexBuckets[i].Waiters, 0);
+        FutexBuckets[i].Head = NULL;
+        FutexBuckets[i].Tail = NULL;
     }
+    FutexBucketMask = Count - 1;
     smp_wmb();
 }
 
@@ -234,67 +381,7 @@ FutexWait(
     _In_ int           Flags,
     _In_ size_t        Timeout)
 {
-    SystemMemorySpaceContext_t* Context = NULL;
-    FutexBucket_t*              Bucket;
-    FutexItem_t*                FutexItem;
-    uintptr_t                   FutexAddress;
-    IntStatus_t                 CpuState;
-    TRACE("%u: FutexWait(f 0x%llx, t %u)", GetCurrentThreadId(), Futex, Timeout);
-    
-    if (!SchedulerGetCurrentObject(ArchGetProcessorCoreId())) {
-        // This is called by the ACPICA implemention indirectly through the Semaphore
-        // implementation, which occurs during boot up of cores before a scheduler is running.
-        // In this case we want the semaphore to act like a spinlock, which it will if we just
-        // return anything else than OsTimeout.
-        return OsNotSupported;
-    }
-    
-    // Get the futex context, if the context is private
-    // we can stick to the virtual address for sleeping
-    // otherwise we need to lookup the physical page
-    if (Flags & FUTEX_WAIT_PRIVATE) {
-        Context = GetCurrentMemorySpace()->Context;
-        FutexAddress = (uintptr_t)Futex;
-    }
-    else {
-        if (GetMemorySpaceMapping(GetCurrentMemorySpace(), (uintptr_t)Futex, 
-                1, &FutexAddress) != OsSuccess) {
-            return OsDoesNotExist;
-        }
-    }
-
-    Bucket = FutexGetBucket(FutexAddress);
-    
-    // Disable interrupts here to gain safe passage, as we don't want to be
-    // interrupted in this 'atomic' action. However when competing with other
-    // cpus here, we must take care to flush any changes and reload any changes
-    CpuState = InterruptDisable();
-    
-    spinlock_acquire(&Bucket->SyncObject);
-    FutexItem = FutexGetNode(Bucket, FutexAddress, Context);
-    spinlock_release(&Bucket->SyncObject);
-    
-    if (!FutexItem) {
-        FutexItem = FutexCreateNode(Bucket, FutexAddress, Context);
-        if (!FutexItem) {
-            return OsOutOfMemory;
-        }
-    }
-    
-    (void)atomic_fetch_add(&FutexItem->Waiters, 1);
-    if (atomic_load(Futex) != ExpectedValue) {
-        (void)atomic_fetch_sub(&FutexItem->Waiters, 1);
-        InterruptRestoreState(CpuState);
-        return OsInterrupted;
-    }
-    
-    SchedulerBlock(&FutexItem->BlockQueue, Timeout);
-    InterruptRestoreState(CpuState);
-    ThreadingYield();
-
-    (void)atomic_fetch_sub(&FutexItem->Waiters, 1);
-    TRACE("%u: woke up", GetCurrentThreadId());
-    return SchedulerGetTimeoutReason();
+    return FutexWaitOperation(Futex, ExpectedValue, NULL, 0, 0, Flags, Timeout);
 }
 
 OsStatus_t
@@ -307,14 +394,17 @@ FutexWaitOperation(
     _In_ int           Flags,
     _In_ size_t        Timeout)
 {
-    SystemMemorySpaceContext_t* Context = NULL;
+    SystemMemorySpaceContext_t* Context;
+    MCoreThread_t*              Thread;
+    FutexWaiter_t*              Waiter;
     FutexBucket_t*              Bucket;
-    FutexItem_t*                FutexItem;
     uintptr_t                   FutexAddress;
     IntStatus_t                 CpuState;
+    OsStatus_t                  Status;
     TRACE("%u: FutexWaitOperation(f 0x%llx, t %u)", GetCurrentThreadId(), Futex, Timeout);
     
-    if (!SchedulerGetCurrentObject(ArchGetProcessorCoreId())) {
+    Thread = GetCurrentThread();
+    if (!Thread || !Thread->SchedulerObject) {
         // This is called by the ACPICA implemention indirectly through the Semaphore
         // implementation, which occurs during boot up of cores before a scheduler is running.
         // In this case we want the semaphore to act like a spinlock, which it will if we just
@@ -322,52 +412,44 @@ FutexWaitOperation(
         return OsNotSupported;
     }
     
-    // Get the futex context, if the context is private
-    // we can stick to the virtual address for sleeping
-    // otherwise we need to lookup the physical page
-    if (Flags & FUTEX_WAIT_PRIVATE) {
-        Context = GetCurrentMemorySpace()->Context;
-        FutexAddress = (uintptr_t)Futex;
-    }
-    else {
-        if (GetMemorySpaceMapping(GetCurrentMemorySpace(), (uintptr_t)Futex, 
-                1, &FutexAddress) != OsSuccess) {
-            return OsDoesNotExist;
-        }
+    Status = FutexGetKey(Futex, Flags & FUTEX_WAIT_PRIVATE, &Context, &FutexAddress);
+    if (Status != OsSuccess) {
+        return Status;
     }
     
-    Bucket = FutexGetBucket(FutexAddress);
+    Bucket          = FutexGetBucket(Context, FutexAddress);
+    Waiter          = &Thread->FutexWaiter;
+    Waiter->Object  = Thread->SchedulerObject;
+    Waiter->Context = Context;
+    Waiter->Address = FutexAddress;
     
     // Disable interrupts here to gain safe passage, as we don't want to be
-    // interrupted in this 'atomic' action. However when competing with other
-    // cpus here, we must take care to flush any changes and reload any changes
+    // interrupted in this 'atomic' action. The value is checked with the bucket
+    // locked, a wake always changes the value before taking the lock.
     CpuState = InterruptDisable();
-    
+    atomic_fetch_add(&Bucket->Waiters, 1);
     spinlock_acquire(&Bucket->SyncObject);
-    FutexItem = FutexGetNode(Bucket, FutexAddress, Context);
-    spinlock_release(&Bucket->SyncObject);
-    
-    if (!FutexItem) {
-        FutexItem = FutexCreateNode(Bucket, FutexAddress, Context);
-        if (!FutexItem) {
-            return OsOutOfMemory;
-        }
-    }
-    
-    (void)atomic_fetch_add(&FutexItem->Waiters, 1);
     if (atomic_load(Futex) != ExpectedValue) {
-        (void)atomic_fetch_sub(&FutexItem->Waiters, 1);
+        atomic_fetch_sub(&Bucket->Waiters, 1);
+        spinlock_release(&Bucket->SyncObject);
         InterruptRestoreState(CpuState);
         return OsInterrupted;
     }
     
-    SchedulerBlock(&FutexItem->BlockQueue, Timeout);
-    FutexPerformOperation(Futex2, Operation);
-    FutexWake(Futex2, Count2, Flags);
+    FutexLinkWaiter(Bucket, Waiter);
+    SchedulerBlock(NULL, Timeout);
+    spinlock_release(&Bucket->SyncObject);
+    
+    if (Futex2) {
+        FutexPerformOperation(Futex2, Operation);
+        FutexWake(Futex2, Count2, Flags);
+    }
     InterruptRestoreState(CpuState);
     ThreadingYield();
     
-    (void)atomic_fetch_sub(&FutexItem->Waiters, 1);
+    CpuState = InterruptDisable();
+    FutexRemoveWaiter(Waiter);
+    InterruptRestoreState(CpuState);
     TRACE("%u: woke up", GetCurrentThreadId());
     return SchedulerGetTimeoutReason();
 }
@@ -378,89 +460,117 @@ FutexWake(
     _In_ int           Count,
     _In_ int           Flags)
 {
-    SystemMemorySpaceContext_t* Context = NULL;
-    FutexBucket_t*     Bucket;
-    FutexItem_t*       FutexItem;
-    OsStatus_t         Status = OsDoesNotExist;
-    uintptr_t          FutexAddress;
-    int                WaiterCount;
-    int                i;
+    SystemMemorySpaceContext_t* Context;
+    FutexBucket_t*              Bucket;
+    uintptr_t                   FutexAddress;
+    IntStatus_t                 CpuState;
+    OsStatus_t                  Status;
+    int                         Woken;
     
-    // Get the futex context, if the context is private
-    // we can stick to the virtual address for sleeping
-    // otherwise we need to lookup the physical page
-    if (Flags & FUTEX_WAKE_PRIVATE) {
-        Context = GetCurrentMemorySpace()->Context;
-        FutexAddress = (uintptr_t)Futex;
-    }
-    else {
-        if (GetMemorySpaceMapping(GetCurrentMemorySpace(), (uintptr_t)Futex, 
-                1, &FutexAddress) != OsSuccess) {
-            return OsDoesNotExist;
-        }
+    Status = FutexGetKey(Futex, Flags & FUTEX_WAKE_PRIVATE, &Context, &FutexAddress);
+    if (Status != OsSuccess) {
+        return OsDoesNotExist;
     }
     
-    Bucket = FutexGetBucket(FutexAddress);
-    
-    spinlock_acquire(&Bucket->SyncObject);
-    FutexItem = FutexGetNode(Bucket, FutexAddress, Context);
-    spinlock_release(&Bucket->SyncObject);
-    if (!FutexItem) {
+    // Orders the change of the futex value before the load of the waiter count
+    Bucket = FutexGetBucket(Context, FutexAddress);
+    smp_mb();
+    if (!atomic_load(&Bucket->Waiters)) {
         return OsDoesNotExist;
     }
     
-    WaiterCount = atomic_load(&FutexItem->Waiters);
+    CpuState = InterruptDisable();
+    spinlock_acquire(&Bucket->SyncObject);
+    Woken = FutexWakeWaiters(Bucket, Context, FutexAddress, Count);
+    spinlock_release(&Bucket->SyncObject);
+    InterruptRestoreState(CpuState);
+    return Woken ? OsSuccess : OsDoesNotExist;
+}
+
+OsStatus_t
+FutexWakeOperation(
+    _In_ _Atomic(int)* Futex,
+    _In_ int           Count,
+    _In_ _Atomic(int)* Futex2,
+    _In_ int           Count2,
+    _In_ int           Operation,
+    _In_ int           Flags)
+{
+    SystemMemorySpaceContext_t* Context;
+    FutexBucket_t*              Bucket;
+    FutexBucket_t*              Bucket2;
+    uintptr_t                   FutexAddress;
+    uintptr_t                   FutexAddress2;
+    IntStatus_t                 CpuState;
+    OsStatus_t                  Status;
+    int                         OldValue;
+    int                         Woken;
+    TRACE("%u: FutexWakeOperation(f 0x%llx)", GetCurrentThreadId(), Futex);
     
-WakeWaiters:
-    for (i = 0; i < Count; i++) {
-        element_t* Front;
-        
-        spinlock_acquire(&FutexItem->BlockQueueSyncObject);
-        Front = list_front(&FutexItem->BlockQueue);
-        if (Front) {
-            // This is only neccessary while the list itself is thread-safe
-            // otherwise we need a new list structure that can be shared including
-            // a lock.
-            if (list_remove(&FutexItem->BlockQueue, Front)) {
-                Front = NULL;
-            }
-        }
-        spinlock_release(&FutexItem->BlockQueueSyncObject);
-        
-        if (Front) {
-            Status = SchedulerQueueObject(Front->value);
-            if (Status != OsSuccess) {
-                break;
-            }
-        }
+    Status = FutexGetKey(Futex, Flags & FUTEX_WAKE_PRIVATE, &Context, &FutexAddress);
+    if (Status == OsSuccess) {
+        Status = FutexGetKey(Futex2, Flags & FUTEX_WAKE_PRIVATE, &Context, &FutexAddress2);
+    }
+    if (Status != OsSuccess) {
+        return OsDoesNotExist;
     }
     
-    // Handle possible race-condition between wait/wake
-    if (!WaiterCount && atomic_load(&FutexItem->Waiters) != 0) {
-        WaiterCount = 1; // Only do this once!
-        goto WakeWaiters;
+    // The operation is done with both buckets locked, so no waiter on the second
+    // futex can check its value between the operation and the wake
+    Bucket   = FutexGetBucket(Context, FutexAddress);
+    Bucket2  = FutexGetBucket(Context, FutexAddress2);
+    CpuState = InterruptDisable();
+    FutexLockBuckets(Bucket, Bucket2);
+    OldValue = FutexPerformOperation(Futex2, Operation);
+    Woken    = FutexWakeWaiters(Bucket, Context, FutexAddress, Count);
+    if (FutexCompareOperation(OldValue, Operation)) {
+        Woken += FutexWakeWaiters(Bucket2, Context, FutexAddress2, Count2);
     }
-    return Status;
+    FutexUnlockBuckets(Bucket, Bucket2);
+    InterruptRestoreState(CpuState);
+    return Woken ? OsSuccess : OsDoesNotExist;
 }
 
 OsStatus_t
-FutexWakeOperation(
+FutexRequeue(
     _In_ _Atomic(int)* Futex,
     _In_ int           Count,
     _In_ _Atomic(int)* Futex2,
     _In_ int           Count2,
-    _In_ int           Operation,
+    _In_ int           ExpectedValue,
     _In_ int           Flags)
 {
-    OsStatus_t Status;
-    int        InitialValue;
-    TRACE("%u: FutexWakeOperation(f 0x%llx)", GetCurrentThreadId(), Futex);
+    SystemMemorySpaceContext_t* Context;
+    FutexBucket_t*              Bucket;
+    FutexBucket_t*              Bucket2;
+    uintptr_t                   FutexAddress;
+    uintptr_t                   FutexAddress2;
+    IntStatus_t                 CpuState;
+    OsStatus_t                  Status;
+    int                         Moved;
+    TRACE("%u: FutexRequeue(f 0x%llx, f2 0x%llx)", GetCurrentThreadId(), Futex, Futex2);
     
-    InitialValue = atomic_load(Futex);
-    FutexPerformOperation(Futex2, Operation);
-    Status = FutexWake(Futex, Count, Flags);
-    if (FutexCompareOperation(InitialValue, Operation)) {
-        Status = FutexWake(Futex2, Count2, Flags);
+    Status = FutexGetKey(Futex, Flags & FUTEX_WAKE_PRIVATE, &Context, &FutexAddress);
+    if (Status == OsSuccess) {
+        Status = FutexGetKey(Futex2, Flags & FUTEX_WAKE_PRIVATE, &Context, &FutexAddress2);
+    }
+    if (Status != OsSuccess) {
+        return OsDoesNotExist;
     }
-    return Status;
+    
+    Bucket   = FutexGetBucket(Context, FutexAddress);
+    Bucket2  = FutexGetBucket(Context, FutexAddress2);
+    CpuState = InterruptDisable();
+    FutexLockBuckets(Bucket, Bucket2);
+    if (atomic_load(Futex) != ExpectedValue) {
+        FutexUnlockBuckets(Bucket, Bucket2);
+        InterruptRestoreState(CpuState);
+        return OsInterrupted;
+    }
+    
+    Moved  = FutexWakeWaiters(Bucket, Context, FutexAddress, Count);
+    Moved += FutexRequeueWaiters(Bucket, Context, FutexAddress, Bucket2, FutexAddress2, Count2);
+    FutexUnlockBuckets(Bucket, Bucket2);
+    InterruptRestoreState(CpuState);
+    return Moved ? OsSuccess : OsDoesNotExist;
 }
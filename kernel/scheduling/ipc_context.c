@@ -116,8 +116,12 @@ AllocateMessage(
         Context = LookupHandleOfType(message->address->data.handle, HandleTypeIpcContext);
     }
     else {
-        UUId_t     Handle;
-        OsStatus_t Status = LookupHandleByPath(message->address->data.path, &Handle);
+        // Senders usually address the same service over and over, so the handle of the
+        // last path is cached in the sending thread
+        MCoreThread_t* Thread = GetCurrentThread();
+        UUId_t         Handle;
+        OsStatus_t     Status = LookupHandleByPathCached(message->address->data.path,
+            &Thread->IpcPathCache, &Handle);
         if (Status != OsSuccess) {
             ERROR("[ipc] [allocate] could not find target path %s", message->address->data.path);
             return Status;
@@ -37,6 +37,7 @@
 #include <heap.h>
 #include <machine.h>
 #include <scheduler.h>
+#include <scheduler_trace.h>
 #include <string.h>
 #include <timers.h>
 
@@ -45,6 +46,7 @@
 #define EVENT_QUEUE_FINISH 2
 #define EVENT_BLOCK        3
 #define EVENT_SCHEDULE     4
+#define EVENT_MIGRATE      5
 
 #define STATE_INVALID  0
 #define STATE_INITIAL  1
@@ -66,9 +68,11 @@ typedef struct SchedulerObject {
     void*                   Object;
     
     list_t*                 WaitQueueHandle;
+    TimerWheelEntry_t       Timer;
     size_t                  TimeLeft;
     OsStatus_t              TimeoutReason;
     clock_t                 InterruptedAt;
+    clock_t                 MigratedAt;
 } SchedulerObject_t;
 
 static struct Transition {
@@ -83,7 +87,8 @@ static struct Transition {
     { STATE_RUNNING, EVENT_BLOCK, STATE_BLOCKING },
     { STATE_BLOCKING, EVENT_QUEUE, STATE_RUNNING },
     { STATE_BLOCKING, EVENT_SCHEDULE, STATE_BLOCKED },
-    { STATE_BLOCKED, EVENT_QUEUE, STATE_QUEUEING }
+    { STATE_BLOCKED, EVENT_QUEUE, STATE_QUEUEING },
+    { STATE_QUEUED, EVENT_MIGRATE, STATE_QUEUEING }
 };
 
 #ifdef __TRACE
@@ -92,7 +97,8 @@ static char* EventDescriptions[] = {
     "EVENT_QUEUE",
     "EVENT_QUEUE_FINISH",
     "EVENT_BLOCK",
-    "EVENT_SCHEDULE"
+    "EVENT_SCHEDULE",
+    "EVENT_MIGRATE"
 };
 
 static char* StateDescriptions[] = {
@@ -163,12 +169,12 @@ SchedulerGetCurrentObject(
         GetProcessorCore(CoreId)->CurrentThread->SchedulerObject : NULL;
 }
 
-static const char*
-GetNameOfObject(
+static UUId_t
+GetHandleOfObject(
     _In_ SchedulerObject_t* Object)
 {
     MCoreThread_t* Thread = Object->Object;
-    return (const char*)Thread->Name;
+    return Thread->Handle;
 }
 
 static void
@@ -228,20 +234,19 @@ QueueForScheduler(
     _In_ int                OutsideAdvance)
 {
     int ResultState;
+    int QueuedCount;
     
-    // Verify it doesn't exist in sleep queue, and check both the case where
-    // it is the end of the list and if it's not
-    if (Object->Link != NULL ||
-        Scheduler->SleepQueue.Tail == Object ||
-        Scheduler->SleepQueue.Head == Object) {
-        RemoveFromQueue(&Scheduler->SleepQueue, Object);
-    }
+    // Cancel the sleep if the object is still in the sleep queue
+    (void)TimerWheelRemove(&Scheduler->SleepQueue, &Object->Timer);
     
     ResultState = ExecuteEvent(Object, EVENT_QUEUE_FINISH);
     if (ResultState == STATE_INVALID) {
         FATAL(FATAL_SCOPE_KERNEL, "[scheduler] [queue] object was NOT in correct state for queueing");
     }
     AppendToQueue(&Scheduler->Queues[Object->Queue], Object, Object);
+    QueuedCount = atomic_fetch_add(&Scheduler->QueuedCount, 1) + 1;
+    SchedulerTraceRecord(SCHEDULER_TRACE_ENQUEUE, GetHandleOfObject(Object),
+        Object->Queue, QueuedCount, 0);
 }
 
 static void
@@ -278,21 +283,27 @@ QueueObjectImmediately(
     }
 }
 
+static SystemCpu_t*
+GetSchedulingCoreGroup(void)
+{
+    SystemDomain_t* Domain = GetCurrentDomain();
+    
+    // Use the core range from our domain, objects never leave it
+    if (Domain != NULL) {
+        return &Domain->CoreGroup;
+    }
+    return &GetMachine()->Processor;
+}
+
 static void
 AllocateScheduler(
     _In_ SchedulerObject_t* Object)
 {
-    SystemDomain_t*    Domain    = GetCurrentDomain();
-    SystemCpu_t*       CoreGroup = &GetMachine()->Processor;
+    SystemCpu_t*       CoreGroup = GetSchedulingCoreGroup();
     SystemCpuCore_t*   Iter;
     SystemScheduler_t* Scheduler;
     UUId_t             CoreId;
     
-    // Select the default core range
-    if (Domain != NULL) {
-        // Use the core range from our domain
-        CoreGroup = &Domain->CoreGroup;
-    }
     Scheduler = &CoreGroup->Cores->Scheduler;
     CoreId    = CoreGroup->Cores->Id;
     Iter      = CoreGroup->Cores->Link;
@@ -433,7 +444,9 @@ SchedulerBlock(
     ResultState = ExecuteEvent(Object, EVENT_BLOCK);
     
     // For now the lists include a lock, which perform memory barriers
-    list_append(BlockQueue, &Object->Header);
+    if (BlockQueue != NULL) {
+        list_append(BlockQueue, &Object->Header);
+    }
 }
 
 void
@@ -456,6 +469,8 @@ SchedulerExpediteObject(
         // the rest is then up to the scheduler, or we update the state to QUEUEING,
         // which means we must initiate a queue operation.
         if (ResultState == STATE_QUEUEING) {
+            SchedulerTraceRecord(SCHEDULER_TRACE_WAKE, GetHandleOfObject(Object),
+                Object->Queue, 0, SCHEDULER_TRACE_WAKE_INTERRUPT);
             QueueObjectImmediately(Object);
         }
     }
@@ -485,6 +500,8 @@ SchedulerQueueObject(
     // the rest is then up to the scheduler, or we update the state to QUEUEING,
     // which means we must initiate a queue operation.
     if (ResultState == STATE_QUEUEING) {
+        SchedulerTraceRecord(SCHEDULER_TRACE_WAKE, GetHandleOfObject(Object),
+            Object->Queue, 0, SCHEDULER_TRACE_WAKE_QUEUE);
         Status = QueueObjectImmediately(Object);
     }
     return Status;
@@ -564,6 +581,8 @@ PerformObjectTimeout(
         
         Object->TimeoutReason = OsTimeout;
         TimersGetSystemTick(&Object->InterruptedAt);
+        SchedulerTraceRecord(SCHEDULER_TRACE_WAKE, GetHandleOfObject(Object),
+            Object->Queue, 0, SCHEDULER_TRACE_WAKE_TIMEOUT);
         QueueForScheduler(Scheduler, Object, 0);
     }
     else {
@@ -571,39 +590,178 @@ PerformObjectTimeout(
     }
 }
 
-// The sleep list is thread-safe due to the fact that the function that removes
+static void
+SleepQueueExpire(
+    _In_ TimerWheelEntry_t* Entry,
+    _In_ void*              Context)
+{
+    SchedulerObject_t* Object = (SchedulerObject_t*)((uint8_t*)Entry - offsetof(SchedulerObject_t, Timer));
+    Object->TimeLeft = 0;
+    PerformObjectTimeout((SystemScheduler_t*)Context, Object);
+}
+
+// The sleep queue is thread-safe due to the fact that the function that removes
 // from the sleep queue is only called on this core, while the function that adds
-// is also only called on this core, and the list here is only iterated on this core.
+// is also only called on this core, and the queue here is only advanced on this core.
 static size_t
 SchedulerUpdateSleepQueue(
     _In_ SystemScheduler_t* Scheduler,
-    _In_ SchedulerObject_t* IgnoreObject,
     _In_ size_t             MillisecondsPassed)
 {
-    size_t             NextUpdate = __MASK;
-    SchedulerObject_t* i          = Scheduler->SleepQueue.Head;
+    uint64_t Time = Scheduler->SleepQueue.Time + MillisecondsPassed;
+    uint64_t NextDeadline;
+    
+    TimerWheelAdvance(&Scheduler->SleepQueue, Time, SleepQueueExpire, Scheduler);
+    NextDeadline = TimerWheelNextDeadline(&Scheduler->SleepQueue);
+    if (!NextDeadline) {
+        return __MASK;
+    }
+    return (size_t)MIN(NextDeadline - Time, __MASK);
+}
+
+// Runs on the core that received the migrated object
+static void
+MigrateOnCoreFunction(
+    _In_ void* Context)
+{
+    SystemCpuCore_t*   Core   = GetCurrentProcessorCore();
+    SchedulerObject_t* Object = (SchedulerObject_t*)Context;
+    
+    IrqSpinlockAcquire(&Core->Scheduler.SyncObject);
+    QueueForScheduler(&Core->Scheduler, Object, 1);
+    IrqSpinlockRelease(&Core->Scheduler.SyncObject);
+    atomic_store(&Core->Scheduler.StealPending, 0);
+    if (ThreadingIsCurrentTaskIdle(Core->Id)) {
+        ThreadingYield();
+    }
+}
+
+// Takes the first queued object that may leave this core, starting with the objects
+// that would run first
+static SchedulerObject_t*
+DetachMigratableObject(
+    _In_ SystemScheduler_t* Scheduler,
+    _In_ clock_t            CurrentClock)
+{
+    SchedulerObject_t* Object;
+    int                i;
     
-    while (i) {
-        if (i != IgnoreObject && i->TimeLeft) {
-            i->TimeLeft -= MIN(i->TimeLeft, MillisecondsPassed);
-            if (!i->TimeLeft) {
-                PerformObjectTimeout(Scheduler, i);
+    for (i = 0; i < SCHEDULER_LEVEL_COUNT; i++) {
+        Object = Scheduler->Queues[i].Head;
+        while (Object) {
+            if (!(READ_VOLATILE(Object->Flags) & SCHEDULER_FLAG_BOUND) &&
+                (!Object->MigratedAt || (CurrentClock - Object->MigratedAt) >= SCHEDULER_MIGRATION_COOLDOWN)) {
+                RemoveFromQueue(&Scheduler->Queues[i], Object);
+                atomic_fetch_sub(&Scheduler->QueuedCount, 1);
+                ExecuteEvent(Object, EVENT_MIGRATE);
+                return Object;
             }
+            Object = Object->Link;
         }
+    }
+    return NULL;
+}
+
+// Runs on the busiest core, which hands one of its queued objects to the core that
+// asked for it
+static void
+StealOnCoreFunction(
+    _In_ void* Context)
+{
+    SystemCpuCore_t*   Core   = GetCurrentProcessorCore();
+    SystemCpuCore_t*   Thief  = (SystemCpuCore_t*)Context;
+    SchedulerObject_t* Object = NULL;
+    clock_t            CurrentClock;
+    
+    TimersGetSystemTick(&CurrentClock);
+    
+    // The queues may have changed since the request was sent, never leave the
+    // thief with more queued objects than this core
+    IrqSpinlockAcquire(&Core->Scheduler.SyncObject);
+    if (atomic_load(&Core->Scheduler.QueuedCount) > atomic_load(&Thief->Scheduler.QueuedCount)) {
+        Object = DetachMigratableObject(&Core->Scheduler, CurrentClock);
+    }
+    IrqSpinlockRelease(&Core->Scheduler.SyncObject);
+    
+    if (!Object) {
+        atomic_store(&Thief->Scheduler.StealPending, 0);
+        return;
+    }
+    
+    TRACE("[scheduler] [steal] %u from %u to %u", GetHandleOfObject(Object), Core->Id, Thief->Id);
+    SchedulerTraceRecord(SCHEDULER_TRACE_MIGRATE, GetHandleOfObject(Object),
+        Object->Queue, atomic_load(&Core->Scheduler.QueuedCount), Thief->Id);
+    Object->CoreId     = Thief->Id;
+    Object->MigratedAt = CurrentClock;
+    atomic_fetch_sub(&Core->Scheduler.Bandwidth, Object->TimeSlice);
+    atomic_fetch_sub(&Core->Scheduler.ObjectCount, 1);
+    atomic_fetch_add(&Thief->Scheduler.Bandwidth, Object->TimeSlice);
+    atomic_fetch_add(&Thief->Scheduler.ObjectCount, 1);
+    smp_wmb();
+    
+    if (TxuMessageSend(Thief->Id, CpuFunctionCustom, MigrateOnCoreFunction, Object, 1) != OsSuccess) {
+        atomic_fetch_sub(&Thief->Scheduler.Bandwidth, Object->TimeSlice);
+        atomic_fetch_sub(&Thief->Scheduler.ObjectCount, 1);
+        atomic_fetch_add(&Core->Scheduler.Bandwidth, Object->TimeSlice);
+        atomic_fetch_add(&Core->Scheduler.ObjectCount, 1);
+        Object->CoreId = Core->Id;
+        smp_wmb();
         
-        if (i->TimeLeft) {
-            NextUpdate = MIN(i->TimeLeft, NextUpdate);
+        IrqSpinlockAcquire(&Core->Scheduler.SyncObject);
+        QueueForScheduler(&Core->Scheduler, Object, 1);
+        IrqSpinlockRelease(&Core->Scheduler.SyncObject);
+        atomic_store(&Thief->Scheduler.StealPending, 0);
+    }
+}
+
+// Asks the busiest core of the domain for one of its queued objects. Returns 0 if
+// there are no other cores to balance with.
+static int
+SchedulerBalance(
+    _In_ SystemScheduler_t* Scheduler,
+    _In_ int                Idle)
+{
+    SystemCpuCore_t* Core    = GetCurrentProcessorCore();
+    SystemCpuCore_t* Busiest = NULL;
+    SystemCpuCore_t* Iter    = GetSchedulingCoreGroup()->Cores;
+    int              BusiestQueued = 0;
+    int              Threshold;
+    int              Queued;
+    
+    for (; Iter != NULL; Iter = Iter->Link) {
+        smp_rmb();
+        if (Iter == Core || !(Iter->State & CpuStateRunning)) {
+            continue;
+        }
+        
+        Queued = atomic_load(&Iter->Scheduler.QueuedCount);
+        if (!Busiest || Queued > BusiestQueued) {
+            Busiest       = Iter;
+            BusiestQueued = Queued;
+        }
+    }
+    
+    if (!Busiest) {
+        return 0;
+    }
+    
+    // An idle core takes anything that waits, otherwise the imbalance must be large
+    // enough that moving one object does not turn it around
+    Threshold = Idle ? 1 : atomic_load(&Scheduler->QueuedCount) + SCHEDULER_BALANCE_IMBALANCE;
+    if (BusiestQueued >= Threshold && !atomic_exchange(&Scheduler->StealPending, 1)) {
+        if (TxuMessageSend(Busiest->Id, CpuFunctionCustom, StealOnCoreFunction, Core, 1) != OsSuccess) {
+            atomic_store(&Scheduler->StealPending, 0);
         }
-        i = i->Link;
     }
-    return NextUpdate;
+    return 1;
 }
 
 static void
 HandleObjectRequeue(
     _In_ SystemScheduler_t* Scheduler,
     _In_ SchedulerObject_t* Object,
-    _In_ int                Preemptive)
+    _In_ int                Preemptive,
+    _In_ size_t             MillisecondsPassed)
 {
     int ResultState;
     
@@ -625,12 +783,18 @@ HandleObjectRequeue(
         }
         QueueForScheduler(Scheduler, Object, 0);
     }
-    else if (Object->TimeLeft != 0) {
-        TRACE("[scheduler] [advance] sleep 0x%llx (Head 0x%llx, Tail 0x%llx)", 
-            Object->Link, Scheduler->SleepQueue.Head, Scheduler->SleepQueue.Tail);
-        // OK, so the we are blocking this object which means we won't be
-        // queuing the object up again, should we track the sleep?
-        AppendToQueue(&Scheduler->SleepQueue, Object, Object);
+    else {
+        SchedulerTraceRecord(SCHEDULER_TRACE_SLEEP, GetHandleOfObject(Object),
+            Object->Queue, 0, (uint32_t)Object->TimeLeft);
+        if (Object->TimeLeft != 0) {
+            TRACE("[scheduler] [advance] sleep 0x%llx for %" PRIuIN, Object, Object->TimeLeft);
+            // OK, so the we are blocking this object which means we won't be
+            // queuing the object up again, should we track the sleep? The object went
+            // to sleep at the end of the time that passed, which the sleep queue is
+            // about to be advanced by.
+            TimerWheelAdd(&Scheduler->SleepQueue, &Object->Timer,
+                Scheduler->SleepQueue.Time + MillisecondsPassed + Object->TimeLeft);
+        }
     }
 }
 
@@ -658,7 +822,7 @@ SchedulerAdvance(
         // Steps to take here is, adjusting the current time-slice,
         // updating the sleep queue and returning the current task again
         Object->TimeSliceLeft -= MillisecondsPassed;
-        NextDeadline           = SchedulerUpdateSleepQueue(Scheduler, NULL, MillisecondsPassed);
+        NextDeadline           = SchedulerUpdateSleepQueue(Scheduler, MillisecondsPassed);
         *NextDeadlineOut       = MIN(Object->TimeSliceLeft, NextDeadline);
         TRACE("[scheduler] [advance] redeploy next deadline %llu", *NextDeadlineOut);
         return Object->Object;
@@ -668,15 +832,17 @@ SchedulerAdvance(
     // to requeue immediately is if the thread was running. Otherwise it's because
     // we've been interrupted or blocked.
     if (Object != NULL) {
-        HandleObjectRequeue(Scheduler, Object, Preemptive);
+        HandleObjectRequeue(Scheduler, Object, Preemptive, MillisecondsPassed);
     }
-    NextDeadline = SchedulerUpdateSleepQueue(Scheduler, Object, MillisecondsPassed);
+    NextDeadline = SchedulerUpdateSleepQueue(Scheduler, MillisecondsPassed);
 
     // Get next object
     for (i = 0; i < SCHEDULER_LEVEL_COUNT; i++) {
         if (Scheduler->Queues[i].Head != NULL) {
             NextObject = Scheduler->Queues[i].Head;
             RemoveFromQueue(&Scheduler->Queues[i], NextObject);
+            SchedulerTraceRecord(SCHEDULER_TRACE_DEQUEUE, GetHandleOfObject(NextObject),
+                i, atomic_fetch_sub(&Scheduler->QueuedCount, 1) - 1, 0);
             UpdatePressureForObject(Scheduler, NextObject, i);
             NextDeadline = MIN(NextObject->TimeSlice, NextDeadline);
             ExecuteEvent(NextObject, EVENT_EXECUTE);
@@ -700,12 +866,22 @@ SchedulerAdvance(
                 Scheduler->LastBoost = CurrentClock;
             }
         }
+        
+        // Compare the load against the other cores periodically
+        if ((CurrentClock - Scheduler->LastBalance) >= SCHEDULER_BALANCE_INTERVAL) {
+            Scheduler->LastBalance = CurrentClock;
+            SchedulerBalance(Scheduler, 0);
+        }
         *NextDeadlineOut = NextDeadline;
         TRACE("[scheduler] [advance] next 0x%llx, deadline in %llu", NextObject, NextDeadline);
     }
     else {
-        // Reset boost
+        // Reset boost, and look for work on the other cores before going idle. Keep
+        // looking every balance interval while idle, the busy cores don't wake us.
         Scheduler->LastBoost = 0;
+        if (SchedulerBalance(Scheduler, 1)) {
+            NextDeadline = MIN(NextDeadline, SCHEDULER_BALANCE_INTERVAL);
+        }
         *NextDeadlineOut = (NextDeadline == __MASK) ? 0 : NextDeadline;
         TRACE("[scheduler] [advance] no next object, deadline in %llu", *NextDeadlineOut);
     }
@@ -0,0 +1,296 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scheduler Trace Implementation
+ * - Only the core that owns a ring records in it, with interrupts disabled, so
+ *   recording never waits. Every record gets an index from the head of its ring, and
+ *   the slot of the index is marked with the index when the record is complete. A
+ *   drain only copies the slots that are marked with the index it expects, so it
+ *   neither waits for the core nor copies a record that is being overwritten.
+ */
+
+#define __MODULE "SCHEDTRACE"
+//#define __TRACE
+
+#include <arch/interrupts.h>
+#include <arch/utils.h>
+#include <component/domain.h>
+#include <ddk/barrier.h>
+#include <debug.h>
+#include <heap.h>
+#include <machine.h>
+#include <mutex.h>
+#include <scheduler_trace.h>
+#include <string.h>
+#include <timers.h>
+
+#define SCHEDULER_TRACE_RING_MASK (SCHEDULER_TRACE_RING_SIZE - 1)
+
+// The sequence is the index of the record in the slot plus one, and 0 while the
+// slot is being written
+typedef struct SchedulerTraceSlot {
+    _Atomic(size_t)        Sequence;
+    SchedulerTraceRecord_t Record;
+} SchedulerTraceSlot_t;
+
+// The tail is only used by drains, which are serialized by the trace lock
+struct SchedulerTraceRing {
+    _Atomic(size_t)       Head;
+    size_t                Tail;
+    UUId_t                CoreId;
+    SchedulerTraceSlot_t* Slots;
+};
+
+static Mutex_t      TraceLock    = OS_MUTEX_INIT(MUTEX_PLAIN);
+static _Atomic(int) TraceEnabled = ATOMIC_VAR_INIT(0);
+static clock_t      LastClock    = (clock_t)-1;
+
+static SystemCpu_t*
+GetTraceCoreGroup(void)
+{
+    SystemDomain_t* Domain = GetCurrentDomain();
+    if (Domain != NULL) {
+        return &Domain->CoreGroup;
+    }
+    return &GetMachine()->Processor;
+}
+
+static void
+WriteRecord(
+    _In_ SchedulerTraceRing_t* Ring,
+    _In_ int                   Event,
+    _In_ UUId_t                Thread,
+    _In_ int                   Queue,
+    _In_ int                   QueueLength,
+    _In_ uint32_t              Data)
+{
+    size_t                Index = atomic_fetch_add(&Ring->Head, 1);
+    SchedulerTraceSlot_t* Slot  = &Ring->Slots[Index & SCHEDULER_TRACE_RING_MASK];
+    uint64_t              Timestamp;
+
+    atomic_store_explicit(&Slot->Sequence, 0, memory_order_relaxed);
+    smp_wmb();
+
+    ArchGetTimestamp(&Timestamp);
+    Slot->Record.Timestamp   = Timestamp;
+    Slot->Record.Thread      = (uint32_t)Thread;
+    Slot->Record.Data        = Data;
+    Slot->Record.QueueLength = (uint16_t)MIN(QueueLength, 0xFFFF);
+    Slot->Record.Event       = (uint8_t)Event;
+    Slot->Record.Core        = (uint8_t)Ring->CoreId;
+    Slot->Record.Queue       = (uint8_t)Queue;
+    atomic_store_explicit(&Slot->Sequence, Index + 1, memory_order_release);
+}
+
+void
+SchedulerTraceRecord(
+    _In_ int      Event,
+    _In_ UUId_t   Thread,
+    _In_ int      Queue,
+    _In_ int      QueueLength,
+    _In_ uint32_t Data)
+{
+    SchedulerTraceRing_t* Ring;
+    IntStatus_t           CpuState;
+
+    if (!atomic_load_explicit(&TraceEnabled, memory_order_relaxed)) {
+        return;
+    }
+
+    CpuState = InterruptDisable();
+    smp_rmb();
+    Ring = GetCurrentProcessorCore()->Scheduler.Trace;
+    if (Ring != NULL) {
+        WriteRecord(Ring, Event, Thread, Queue, QueueLength, Data);
+    }
+    InterruptRestoreState(CpuState);
+}
+
+// Pairs a timestamp with the system tick, so the reader can convert timestamps. Only
+// one is recorded per tick, otherwise draining until the rings are empty never ends.
+// Called with the trace lock held.
+static void
+RecordClock(void)
+{
+    clock_t Tick = 0;
+    TimersGetSystemTick(&Tick);
+    if (Tick != LastClock) {
+        LastClock = Tick;
+        SchedulerTraceRecord(SCHEDULER_TRACE_CLOCK, UUID_INVALID,
+            SCHEDULER_TRACE_QUEUE_NONE, 0, (uint32_t)Tick);
+    }
+}
+
+OsStatus_t
+SchedulerTraceControl(
+    _In_ int Enable)
+{
+    SystemCpuCore_t*      Core;
+    SchedulerTraceRing_t* Ring;
+    OsStatus_t            Status = OsSuccess;
+
+    MutexLock(&TraceLock);
+    if (!Enable) {
+        atomic_store(&TraceEnabled, 0);
+        MutexUnlock(&TraceLock);
+        return OsSuccess;
+    }
+
+    for (Core = GetTraceCoreGroup()->Cores; Core != NULL; Core = Core->Link) {
+        if (Core->Scheduler.Trace != NULL) {
+            continue;
+        }
+
+        Ring = (SchedulerTraceRing_t*)kmalloc(sizeof(SchedulerTraceRing_t));
+        if (!Ring) {
+            Status = OsOutOfMemory;
+            break;
+        }
+
+        Ring->Slots = (SchedulerTraceSlot_t*)kmalloc(
+            SCHEDULER_TRACE_RING_SIZE * sizeof(SchedulerTraceSlot_t));
+        if (!Ring->Slots) {
+            kfree(Ring);
+            Status = OsOutOfMemory;
+            break;
+        }
+
+        memset(Ring->Slots, 0, SCHEDULER_TRACE_RING_SIZE * sizeof(SchedulerTraceSlot_t));
+        atomic_store(&Ring->Head, 0);
+        Ring->Tail   = 0;
+        Ring->CoreId = Core->Id;
+        smp_wmb();
+        Core->Scheduler.Trace = Ring;
+    }
+
+    // Cores that got a ring are traced even if another core failed to get one
+    smp_wmb();
+    if (!atomic_exchange(&TraceEnabled, 1)) {
+        LastClock = (clock_t)-1;
+        RecordClock();
+    }
+    MutexUnlock(&TraceLock);
+    if (Status != OsSuccess) {
+        ERROR("[scheduler] [trace] failed to allocate the trace rings");
+    }
+    return Status;
+}
+
+static void
+WriteLostRecord(
+    _In_ SchedulerTraceRing_t*   Ring,
+    _In_ SchedulerTraceRecord_t* Record,
+    _In_ size_t                  Lost,
+    _In_ uint64_t                Timestamp)
+{
+    memset(Record, 0, sizeof(SchedulerTraceRecord_t));
+    Record->Timestamp = Timestamp;
+    Record->Thread    = UUID_INVALID;
+    Record->Data      = (uint32_t)Lost;
+    Record->Event     = SCHEDULER_TRACE_LOST;
+    Record->Core      = (uint8_t)Ring->CoreId;
+    Record->Queue     = SCHEDULER_TRACE_QUEUE_NONE;
+}
+
+static int
+DrainRing(
+    _In_ SchedulerTraceRing_t*   Ring,
+    _In_ SchedulerTraceRecord_t* Records,
+    _In_ int                     MaxCount)
+{
+    SchedulerTraceSlot_t*  Slot;
+    SchedulerTraceRecord_t Record;
+    size_t                 Head = atomic_load(&Ring->Head);
+    size_t                 Index;
+    uint64_t               Timestamp;
+    size_t                 Sequence;
+    size_t                 Lost  = 0;
+    int                    Count = 0;
+
+    if (MaxCount <= 0) {
+        return 0;
+    }
+
+    // Anything older than one ring has been overwritten
+    if ((Head - Ring->Tail) > SCHEDULER_TRACE_RING_SIZE) {
+        Lost       = Head - Ring->Tail - SCHEDULER_TRACE_RING_SIZE;
+        Ring->Tail = Head - SCHEDULER_TRACE_RING_SIZE;
+    }
+
+    // Records that are lost are reported right before the record that follows them,
+    // so the reader knows where the gap is. A pending gap always has room for its
+    // report, as records are only emitted after the gap has been reported.
+    for (Index = Ring->Tail; Index != Head && Count < MaxCount; Index++) {
+        Slot     = &Ring->Slots[Index & SCHEDULER_TRACE_RING_MASK];
+        Sequence = atomic_load_explicit(&Slot->Sequence, memory_order_acquire);
+
+        // A record that is still being written is left for the next drain, while a
+        // record that was overwritten meanwhile is lost
+        if (Sequence != Index + 1) {
+            if (Sequence == 0 || Sequence < Index + 1) {
+                break;
+            }
+            Lost++;
+            continue;
+        }
+
+        memcpy(&Record, &Slot->Record, sizeof(SchedulerTraceRecord_t));
+        smp_rmb();
+        if (atomic_load_explicit(&Slot->Sequence, memory_order_relaxed) != Index + 1) {
+            Lost++;
+            continue;
+        }
+
+        if (Lost != 0) {
+            WriteLostRecord(Ring, &Records[Count++], Lost, Record.Timestamp);
+            Lost = 0;
+            if (Count == MaxCount) {
+                break;
+            }
+        }
+        memcpy(&Records[Count++], &Record, sizeof(SchedulerTraceRecord_t));
+    }
+
+    if (Lost != 0) {
+        ArchGetTimestamp(&Timestamp);
+        WriteLostRecord(Ring, &Records[Count++], Lost, Timestamp);
+    }
+    Ring->Tail = Index;
+    return Count;
+}
+
+int
+SchedulerTraceDrain(
+    _In_ SchedulerTraceRecord_t* Records,
+    _In_ int                     MaxCount)
+{
+    SystemCpuCore_t* Core;
+    int              Count = 0;
+
+    MutexLock(&TraceLock);
+    RecordClock();
+    for (Core = GetTraceCoreGroup()->Cores; Core != NULL && Count < MaxCount; Core = Core->Link) {
+        smp_rmb();
+        if (Core->Scheduler.Trace != NULL) {
+            Count += DrainRing(Core->Scheduler.Trace, &Records[Count], MaxCount - Count);
+        }
+    }
+    MutexUnlock(&TraceLock);
+    return Count;
+}
@@ -25,6 +25,7 @@
 #define __MODULE "thread"
 //#define __TRACE
 
+#include <arch/interrupts.h>
 #include <arch/thread.h>
 #include <arch/utils.h>
 #include <assert.h>
@@ -35,6 +36,7 @@
 #include <heap.h>
 #include <machine.h>
 #include <memoryspace.h>
+#include <scheduler_trace.h>
 #include <string.h>
 #include <stdio.h>
 #include <threading.h>
@@ -494,6 +496,18 @@ GetCurrentThreadForCore(
     return GetProcessorCore(CoreId)->CurrentThread;
 }
 
+MCoreThread_t*
+GetCurrentThread(void)
+{
+    MCoreThread_t* Thread;
+    IntStatus_t    CpuState;
+
+    CpuState = InterruptDisable();
+    Thread   = GetCurrentThreadForCore(ArchGetProcessorCoreId());
+    InterruptRestoreState(CpuState);
+    return Thread;
+}
+
 UUId_t
 GetCurrentThreadId(void)
 {
@@ -563,6 +577,7 @@ ThreadingAdvance(
     SystemCpuCore_t* Core    = GetCurrentProcessorCore();
     MCoreThread_t*   Current = Core->CurrentThread;
     MCoreThread_t*   NextThread;
+    UUId_t           PreviousHandle;
     int              SignalsPending;
     int              Cleanup;
 
@@ -571,6 +586,9 @@ ThreadingAdvance(
         return OsError;
     }
 
+    // The current thread may be destroyed below
+    PreviousHandle = Current->Handle;
+
     Cleanup = atomic_load(&Current->Cleanup);
     Current->ContextActive = Core->InterruptRegisters;
     
@@ -589,6 +607,9 @@ ThreadingAdvance(
     
     TRACE("%u: current thread: %s (Context 0x%" PRIxIN ", IP 0x%" PRIxIN ", PreEmptive %i)",
         Core->Id, Current->Name, *Context, CONTEXT_IP((*Context)), PreEmptive);
+    
+    // Messages logged with interrupts disabled leave waking the log thread to us
+    LogWakeDeferred();
 GetNextThread:
     if ((Current->Flags & THREADING_IDLE) || Cleanup == 1) {
         // If the thread is finished then add it to garbagecollector
@@ -635,6 +656,12 @@ GetNextThread:
     
     // Set next active thread
     if (Current != NextThread) {
+        if (Core->CurrentThread != NextThread) {
+            SchedulerTraceRecord(SCHEDULER_TRACE_SWITCH, NextThread->Handle,
+                (NextThread->Flags & THREADING_IDLE) ? SCHEDULER_TRACE_QUEUE_NONE :
+                    SchedulerObjectGetQueue(NextThread->SchedulerObject),
+                0, PreviousHandle);
+        }
         Core->CurrentThread = NextThread;
         RestoreThreadState(NextThread);
     }
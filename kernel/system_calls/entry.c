@@ -139,11 +139,14 @@ extern OsStatus_t ScFlushHardwareCache(int Cache, void* Start, size_t Length);
 extern OsStatus_t ScSystemQuery(SystemDescriptor_t* Descriptor);
 extern OsStatus_t ScSystemTime(SystemTime_t* SystemTime);
 extern OsStatus_t ScSystemTick(int TickBase, LargeUInteger_t* Tick);
+extern OsStatus_t ScHeapQuery(HeapCacheStatistics_t* Statistics, int* Count);
+extern OsStatus_t ScHeapProfile(int SampleInterval, HeapProfileSample_t* Samples, int* Count);
+extern OsStatus_t ScSchedulerTrace(int Mode, SchedulerTraceRecord_t* Records, int* Count);
 extern OsStatus_t ScPerformanceFrequency(LargeInteger_t *Frequency);
 extern OsStatus_t ScPerformanceTick(LargeInteger_t *Value);
 extern OsStatus_t ScIsServiceAvailable(UUId_t ServiceId);
 
-#define SYSTEM_CALL_COUNT 74
+#define SYSTEM_CALL_COUNT 77
 
 typedef size_t(*SystemCallHandlerFn)(void*,void*,void*,void*,void*);
 
@@ -256,7 +259,10 @@ static struct SystemCallDescriptor {
     DefineSyscall(70, ScSystemTick),
     DefineSyscall(71, ScPerformanceFrequency),
     DefineSyscall(72, ScPerformanceTick),
-    DefineSyscall(73, ScSystemTime)
+    DefineSyscall(73, ScSystemTime),
+    DefineSyscall(74, ScHeapQuery),
+    DefineSyscall(75, ScHeapProfile),
+    DefineSyscall(76, ScSchedulerTrace)
 };
 
 Context_t*
@@ -44,11 +44,17 @@ OsStatus_t
 ScFutexWake(
     _In_ FutexParameters_t* Parameters)
 {
-    // Also two versions of wake
+    // Three versions of wake, the requeue moves waiters to _futex1 if _futex0
+    // still holds the value in _val2
     if (Parameters->_flags & FUTEX_WAKE_OP) {
         return FutexWakeOperation(Parameters->_futex0, Parameters->_val0,
             Parameters->_futex1, Parameters->_val1, Parameters->_val2,
             Parameters->_flags);
     }
+    else if (Parameters->_flags & FUTEX_WAKE_REQUEUE) {
+        return FutexRequeue(Parameters->_futex0, Parameters->_val0,
+            Parameters->_futex1, Parameters->_val1, Parameters->_val2,
+            Parameters->_flags);
+    }
     return FutexWake(Parameters->_futex0, Parameters->_val0, Parameters->_flags);
 }
@@ -31,6 +31,8 @@
 #include <machine.h>
 #include <timers.h>
 #include <debug.h>
+#include <heap.h>
+#include <scheduler_trace.h>
 #include <string.h>
 
 OsStatus_t
@@ -67,9 +69,14 @@ OsStatus_t
 ScSystemQuery(
     _In_ SystemDescriptor_t* Descriptor)
 {
-    int MaxBlocks = GetMachine()->PhysicalMemory.capacity;
-    int FreeBlocks = GetMachine()->PhysicalMemory.index;
+    size_t   MaxBlocks;
+    size_t   FreeBlocks;
+    size_t   ShootdownsSent;
+    size_t   PagesInvalidated;
+    uint64_t WaitTimeNs;
     
+    PageAllocatorGetStatistics(&GetMachine()->PhysicalMemory, &MaxBlocks, &FreeBlocks);
+    GetMemorySynchronizationStatistics(&ShootdownsSent, &PagesInvalidated, &WaitTimeNs);
     Descriptor->NumberOfProcessors  = atomic_load(&GetMachine()->NumberOfProcessors);
     Descriptor->NumberOfActiveCores = atomic_load(&GetMachine()->NumberOfActiveCores);
 
@@ -77,9 +84,105 @@ ScSystemQuery(
     Descriptor->PageSizeBytes              = GetMemorySpacePageSize();
     Descriptor->PagesTotal                 = MaxBlocks;
     Descriptor->PagesUsed                  = MaxBlocks - FreeBlocks;
+    Descriptor->TlbShootdownsSent          = ShootdownsSent;
+    Descriptor->TlbPagesInvalidated        = PagesInvalidated;
+    Descriptor->TlbShootdownWaitNs         = WaitTimeNs;
     return OsSuccess;
 }
 
+OsStatus_t
+ScHeapQuery(
+    _In_ HeapCacheStatistics_t* Statistics,
+    _In_ int*                   Count)
+{
+    HeapCacheStatistics_t* Buffer = NULL;
+    int                    MaxCount;
+    int                    Available;
+
+    if (!Count || (*Count && !Statistics)) {
+        return OsInvalidParameters;
+    }
+
+    // The statistics are gathered with the cache list locked, so they are first
+    // copied to a kernel buffer, which is no larger than the number of caches
+    MaxCount = MIN(MAX(*Count, 0), MemoryCacheQuery(NULL, 0));
+    if (MaxCount) {
+        Buffer = (HeapCacheStatistics_t*)kmalloc(MaxCount * sizeof(HeapCacheStatistics_t));
+        if (!Buffer) {
+            return OsOutOfMemory;
+        }
+    }
+
+    Available = MemoryCacheQuery(Buffer, MaxCount);
+    if (Buffer) {
+        memcpy(Statistics, Buffer, MIN(Available, MaxCount) * sizeof(HeapCacheStatistics_t));
+        kfree(Buffer);
+    }
+    *Count = Available;
+    return OsSuccess;
+}
+
+OsStatus_t
+ScHeapProfile(
+    _In_ int                  SampleInterval,
+    _In_ HeapProfileSample_t* Samples,
+    _In_ int*                 Count)
+{
+    HeapProfileSample_t* Buffer = NULL;
+    int                  MaxCount;
+    int                  Available;
+
+    if (!Count || (*Count && !Samples)) {
+        return OsInvalidParameters;
+    }
+
+    // The sampling interval is system wide, so only system modules may change it
+    if (SampleInterval >= 0 && GetCurrentModule() == NULL) {
+        return OsInvalidPermissions;
+    }
+
+    // The samples are copied out under a spinlock, so they are first copied to a
+    // kernel buffer
+    MaxCount = MIN(MAX(*Count, 0), HEAP_PROFILE_MAX_SAMPLES);
+    if (MaxCount) {
+        Buffer = (HeapProfileSample_t*)kmalloc(MaxCount * sizeof(HeapProfileSample_t));
+        if (!Buffer) {
+            return OsOutOfMemory;
+        }
+    }
+
+    Available = MemoryCacheProfile(SampleInterval, Buffer, MaxCount);
+    if (Buffer) {
+        memcpy(Samples, Buffer, MIN(Available, MaxCount) * sizeof(HeapProfileSample_t));
+        kfree(Buffer);
+    }
+    *Count = Available;
+    return OsSuccess;
+}
+
+OsStatus_t
+ScSchedulerTrace(
+    _In_ int                     Mode,
+    _In_ SchedulerTraceRecord_t* Records,
+    _In_ int*                    Count)
+{
+    switch (Mode) {
+        case SCHEDULER_TRACE_DISABLE:
+        case SCHEDULER_TRACE_ENABLE: {
+            return SchedulerTraceControl(Mode == SCHEDULER_TRACE_ENABLE);
+        }
+        case SCHEDULER_TRACE_DRAIN: {
+            if (!Count || (*Count && !Records)) {
+                return OsInvalidParameters;
+            }
+            *Count = SchedulerTraceDrain(Records, MAX(*Count, 0));
+            return OsSuccess;
+        }
+        default:
+            return OsInvalidParameters;
+    }
+}
+
 OsStatus_t
 ScFlushHardwareCache(
     _In_     int    Cache,
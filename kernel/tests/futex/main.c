@@ -0,0 +1,607 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Futex Stress Test (host)
+ *  - Runs the futex sources on host threads, with a scheduler that blocks the threads
+ *    on condition variables and follows the same rules for wakes that race timeouts.
+ *  - Verifies that futexes with the same address in different memory contexts are
+ *    kept apart, and that FUTEX_WAKE_OP wakes the second futex only when the compare
+ *    holds for its previous value.
+ *  - Stresses FUTEX_WAKE_OP with ticket handoffs and requeue with a condition variable
+ *    broadcast onto its mutex, with some of the waiters timing out. Every pass is run
+ *    with the sized bucket table and with a single bucket that every futex shares.
+ *  - Verifies that no wakes are lost, that the buckets are empty afterwards and that
+ *    waiting and waking never allocates.
+ *  Builds on the host against the kernel sources:
+ *
+ *  cc -O2 -pthread -I../../include -I../../arch/include -I../../../librt/libds/include \
+ *     -idirafter ../../../librt/libc/include -idirafter ../../../librt/libddk/include \
+ *     -o futex_stress main.c
+ *  ./futex_stress
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// futex sources need
+#define __OS_DEFINITIONS__
+#define __SPINLOCK_H__
+#define __VALI_ARCH_INTERRUPT_H__
+#define __ARCH_THREAD_H__
+#define __SYSTEM_INTERFACE_UTILS_H__
+#define __COMPONENT_CPU__
+#define __DDK_IO_H__
+#define __DDK_BARRIERS_H__
+#define __VALI_HEAP_H__
+#define __VALI_MACHINE__
+#define __MEMORY_SPACE_INTERFACE__
+#define __VALI_SCHEDULER_H__
+#define __THREADING_H__
+#define _DEBUG_H_
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _In_
+#define _Out_
+#define KERNELAPI
+#define KERNELABI
+#define __BITS                     64
+#define READ_VOLATILE(var)         (*(volatile typeof(var)*)&(var))
+#define WRITE_VOLATILE(var, value) (*(volatile typeof(var)*)&(var) = (value))
+#define smp_mb()                   atomic_thread_fence(memory_order_seq_cst)
+#define smp_rmb()                  atomic_thread_fence(memory_order_acquire)
+#define smp_wmb()                  atomic_thread_fence(memory_order_release)
+#define PRIuIN                     "zu"
+#define FATAL_SCOPE_KERNEL         0
+#define TRACE(...)
+#define FATAL(Scope, ...)          (printf("fatal: " __VA_ARGS__), printf("\n"), exit(1))
+
+typedef unsigned int UUId_t;
+typedef int          IntStatus_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsExists,
+    OsDoesNotExist,
+    OsInvalidParameters,
+    OsOutOfMemory,
+    OsTimeout,
+    OsInterrupted,
+    OsNotSupported
+} OsStatus_t;
+
+typedef enum {
+    spinlock_plain
+} spinlock_type_t;
+
+typedef struct {
+    pthread_mutex_t Mutex;
+} spinlock_t;
+
+static void spinlock_init(spinlock_t* Lock, spinlock_type_t Type) { (void)Type; pthread_mutex_init(&Lock->Mutex, NULL); }
+static void spinlock_acquire(spinlock_t* Lock) { pthread_mutex_lock(&Lock->Mutex); }
+static void spinlock_release(spinlock_t* Lock) { pthread_mutex_unlock(&Lock->Mutex); }
+
+// Interrupts only guard against preemption on the same core, which the host lacks
+static IntStatus_t InterruptDisable(void) { return 0; }
+static void InterruptRestoreState(IntStatus_t State) { (void)State; }
+
+static _Atomic(int) AllocationCount;
+
+static void* kmalloc(size_t Size) { atomic_fetch_add(&AllocationCount, 1); return malloc(Size); }
+
+#include <futex.h>
+
+typedef struct SystemMemorySpaceContext {
+    int Id;
+} SystemMemorySpaceContext_t;
+
+typedef struct SystemMemorySpace {
+    SystemMemorySpaceContext_t* Context;
+} SystemMemorySpace_t;
+
+typedef struct SystemCpu {
+    int NumberOfCores;
+} SystemCpu_t;
+
+typedef struct SystemMachine {
+    _Atomic(int) NumberOfCores;
+    SystemCpu_t  Processor;
+} SystemMachine_t;
+
+#define STATE_RUNNING  0
+#define STATE_BLOCKING 1
+#define STATE_BLOCKED  2
+#define STATE_QUEUED   3
+
+// The same transitions as the scheduler, a queue either cancels a block that has not
+// yielded yet, or wakes the blocked object. A timeout competes for the same transition.
+typedef struct SchedulerObject {
+    _Atomic(int)    State;
+    size_t          Timeout;
+    OsStatus_t      TimeoutReason;
+    pthread_mutex_t Lock;
+    pthread_cond_t  Signal;
+} SchedulerObject_t;
+
+typedef struct SystemThread {
+    SchedulerObject_t*   SchedulerObject;
+    SystemMemorySpace_t* MemorySpace;
+    FutexWaiter_t        FutexWaiter;
+} MCoreThread_t;
+
+static SystemMachine_t            Machine;
+static SystemMemorySpaceContext_t Contexts[2] = { { 0 }, { 1 } };
+static SystemMemorySpace_t        Spaces[2]   = { { &Contexts[0] }, { &Contexts[1] } };
+static _Thread_local MCoreThread_t* CurrentThread;
+
+static SystemMachine_t* GetMachine(void) { return &Machine; }
+static MCoreThread_t* GetCurrentThread(void) { return CurrentThread; }
+static SystemMemorySpace_t* GetCurrentMemorySpace(void) { return CurrentThread->MemorySpace; }
+
+// Shared futexes are identified by the physical address, which is the same here
+static OsStatus_t GetMemorySpaceMapping(SystemMemorySpace_t* MemorySpace, uintptr_t Address,
+    int PageCount, uintptr_t* PhysicalAddress)
+{
+    (void)MemorySpace;
+    (void)PageCount;
+    *PhysicalAddress = Address;
+    return OsSuccess;
+}
+
+static void SchedulerBlock(void* BlockQueue, size_t Timeout)
+{
+    SchedulerObject_t* Object = CurrentThread->SchedulerObject;
+    (void)BlockQueue;
+
+    Object->Timeout       = Timeout;
+    Object->TimeoutReason = OsSuccess;
+    atomic_store(&Object->State, STATE_BLOCKING);
+}
+
+static OsStatus_t SchedulerQueueObject(SchedulerObject_t* Object)
+{
+    int State = atomic_load(&Object->State);
+
+    while (1) {
+        if (State == STATE_BLOCKING) {
+            if (atomic_compare_exchange_weak(&Object->State, &State, STATE_RUNNING)) {
+                return OsSuccess;
+            }
+        }
+        else if (State == STATE_BLOCKED) {
+            if (atomic_compare_exchange_weak(&Object->State, &State, STATE_QUEUED)) {
+                pthread_mutex_lock(&Object->Lock);
+                pthread_cond_signal(&Object->Signal);
+                pthread_mutex_unlock(&Object->Lock);
+                return OsSuccess;
+            }
+        }
+        else {
+            return OsInvalidParameters;
+        }
+    }
+}
+
+static void ThreadingYield(void)
+{
+    SchedulerObject_t* Object = CurrentThread->SchedulerObject;
+    struct timespec    Deadline;
+    int                State  = STATE_BLOCKING;
+
+    if (!atomic_compare_exchange_strong(&Object->State, &State, STATE_BLOCKED)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &Deadline);
+    Deadline.tv_nsec += (long)(Object->Timeout % 1000) * 1000000L;
+    Deadline.tv_sec  += (time_t)(Object->Timeout / 1000) + Deadline.tv_nsec / 1000000000L;
+    Deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&Object->Lock);
+    while (atomic_load(&Object->State) == STATE_BLOCKED) {
+        if (!Object->Timeout) {
+            pthread_cond_wait(&Object->Signal, &Object->Lock);
+        }
+        else if (pthread_cond_timedwait(&Object->Signal, &Object->Lock, &Deadline) == ETIMEDOUT) {
+            State = STATE_BLOCKED;
+            if (atomic_compare_exchange_strong(&Object->State, &State, STATE_QUEUED)) {
+                Object->TimeoutReason = OsTimeout;
+            }
+        }
+    }
+    pthread_mutex_unlock(&Object->Lock);
+    atomic_store(&Object->State, STATE_RUNNING);
+}
+
+static int SchedulerGetTimeoutReason(void)
+{
+    return CurrentThread->SchedulerObject->TimeoutReason;
+}
+
+#include "../../scheduling/futex.c"
+
+#define MAXIMUM_THREADS 16
+#define TICKET_ROUNDS   20000
+#define CONDITION_ROUNDS 5000
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("futex: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+struct worker {
+    pthread_t           thread;
+    MCoreThread_t       kernel_thread;
+    SchedulerObject_t   object;
+    void*               (*function)(struct worker*);
+    int                 index;
+    size_t              timeout;
+};
+
+static struct worker Workers[MAXIMUM_THREADS];
+static MCoreThread_t MainThread;
+static SchedulerObject_t MainObject;
+
+static void attach_thread(MCoreThread_t* thread, SchedulerObject_t* object, int space)
+{
+    memset(thread, 0, sizeof(MCoreThread_t));
+    memset(object, 0, sizeof(SchedulerObject_t));
+    pthread_mutex_init(&object->Lock, NULL);
+    pthread_cond_init(&object->Signal, NULL);
+    thread->SchedulerObject = object;
+    thread->MemorySpace     = &Spaces[space];
+    CurrentThread           = thread;
+}
+
+static void* worker_entry(void* context)
+{
+    struct worker* worker = context;
+    attach_thread(&worker->kernel_thread, &worker->object, 0);
+    return worker->function(worker);
+}
+
+static void start_workers(int count, void* (*function)(struct worker*))
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        Workers[i].function = function;
+        Workers[i].index    = i;
+        Workers[i].timeout  = (i & 1) ? 1 : 0;
+        CHECK(pthread_create(&Workers[i].thread, NULL, worker_entry, &Workers[i]) == 0);
+    }
+}
+
+static void join_workers(int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        pthread_join(Workers[i].thread, NULL);
+    }
+}
+
+static void check_buckets_empty(void)
+{
+    size_t i;
+    for (i = 0; i <= FutexBucketMask; i++) {
+        CHECK(FutexBuckets[i].Head == NULL && FutexBuckets[i].Tail == NULL);
+        CHECK(atomic_load(&FutexBuckets[i].Waiters) == 0);
+    }
+}
+
+static void wait_for_waiters(_Atomic(int)* futex, int count)
+{
+    SystemMemorySpaceContext_t* context;
+    FutexBucket_t*              bucket;
+    FutexWaiter_t*              waiter;
+    uintptr_t                   address;
+    int                         found = 0;
+
+    CHECK(FutexGetKey(futex, 1, &context, &address) == OsSuccess);
+    bucket = FutexGetBucket(context, address);
+    while (found < count) {
+        sched_yield();
+        found = 0;
+        spinlock_acquire(&bucket->SyncObject);
+        for (waiter = bucket->Head; waiter; waiter = waiter->Link) {
+            if (waiter->Context == context && waiter->Address == address &&
+                atomic_load(&((SchedulerObject_t*)waiter->Object)->State) == STATE_BLOCKED) {
+                found++;
+            }
+        }
+        spinlock_release(&bucket->SyncObject);
+    }
+}
+
+// Keys: the same address in another memory context or shared is another futex
+static _Atomic(int) KeyFutex;
+static _Atomic(int) KeyWoken;
+
+static void* key_waiter(struct worker* worker)
+{
+    // Workers 0 and 1 wait privately in their own context, worker 2 shared
+    worker->kernel_thread.MemorySpace = &Spaces[worker->index == 1];
+    CHECK(FutexWait(&KeyFutex, 0, worker->index < 2 ? FUTEX_WAIT_PRIVATE : 0, 0) == OsSuccess);
+    atomic_fetch_add(&KeyWoken, 1 << (worker->index * 4));
+    return NULL;
+}
+
+static void verify_keys(void)
+{
+    int i;
+
+    atomic_store(&KeyWoken, 0);
+    start_workers(3, key_waiter);
+    for (i = 0; i < 3; i++) {
+        while (atomic_load(&Workers[i].object.State) != STATE_BLOCKED) {
+            sched_yield();
+        }
+    }
+
+    // Each wake must only find the waiter of its own key
+    CHECK(FutexWake(&KeyFutex, INT_MAX, FUTEX_WAKE_PRIVATE) == OsSuccess);
+    while (atomic_load(&KeyWoken) != 0x001) sched_yield();
+    CHECK(FutexWake(&KeyFutex, INT_MAX, FUTEX_WAKE_PRIVATE) == OsDoesNotExist);
+    CHECK(FutexWake(&KeyFutex, INT_MAX, 0) == OsSuccess);
+    while (atomic_load(&KeyWoken) != 0x101) sched_yield();
+    MainThread.MemorySpace = &Spaces[1];
+    CHECK(FutexWake(&KeyFutex, INT_MAX, FUTEX_WAKE_PRIVATE) == OsSuccess);
+    MainThread.MemorySpace = &Spaces[0];
+    join_workers(3);
+    CHECK(atomic_load(&KeyWoken) == 0x111);
+
+    // A changed value, and a timeout without a wake
+    CHECK(FutexWait(&KeyFutex, 1, FUTEX_WAIT_PRIVATE, 0) == OsInterrupted);
+    CHECK(FutexWait(&KeyFutex, 0, FUTEX_WAIT_PRIVATE, 2) == OsTimeout);
+    check_buckets_empty();
+}
+
+// FUTEX_WAKE_OP: the second futex is woken only if the compare holds for its old value
+static _Atomic(int) OpFutex;
+static _Atomic(int) OpFutex2;
+static _Atomic(int) OpWoken[2];
+
+static void* op_waiter(struct worker* worker)
+{
+    _Atomic(int)* futex = worker->index ? &OpFutex2 : &OpFutex;
+
+    CHECK(FutexWait(futex, atomic_load(futex), FUTEX_WAIT_PRIVATE, 0) == OsSuccess);
+    atomic_store(&OpWoken[worker->index], 1);
+    return NULL;
+}
+
+static void verify_wake_operation(void)
+{
+    int i;
+
+    atomic_store(&OpFutex2, 5);
+    atomic_store(&OpWoken[0], 0);
+    atomic_store(&OpWoken[1], 0);
+    start_workers(2, op_waiter);
+    wait_for_waiters(&OpFutex, 1);
+    wait_for_waiters(&OpFutex2, 1);
+
+    // 5 < 3 is false, only the first futex is woken, and 5 + 1 is stored
+    CHECK(FutexWakeOperation(&OpFutex, 1, &OpFutex2, 1,
+        FUTEX_OP(FUTEX_OP_ADD, 1, FUTEX_OP_CMP_LT, 3), FUTEX_WAKE_PRIVATE) == OsSuccess);
+    while (!atomic_load(&OpWoken[0])) sched_yield();
+    for (i = 0; i < 1000; i++) sched_yield();
+    CHECK(atomic_load(&OpFutex2) == 6 && !atomic_load(&OpWoken[1]));
+
+    // The shifted argument sets bit 4, and 6 == 6 holds
+    CHECK(FutexWakeOperation(&OpFutex, 1, &OpFutex2, 1,
+        FUTEX_OP((FUTEX_OP_OR | FUTEX_OP_ARG_SHIFT), 4, FUTEX_OP_CMP_EQ, 6),
+        FUTEX_WAKE_PRIVATE) == OsSuccess);
+    join_workers(2);
+    CHECK(atomic_load(&OpFutex2) == 22 && atomic_load(&OpWoken[1]));
+    check_buckets_empty();
+}
+
+// Ticket handoff: every wake operation hands out one ticket on each futex, the waiters
+// take them and the last tickets must reach the last waiters
+static _Atomic(int) Tickets[2];
+static _Atomic(int) TicketsTaken;
+
+static void* ticket_taker(struct worker* worker)
+{
+    _Atomic(int)* futex = &Tickets[worker->index & 1];
+    int           value;
+
+    while (1) {
+        value = atomic_load(futex);
+        if (value < 0) {
+            break;
+        }
+        if (value > 0) {
+            if (atomic_compare_exchange_weak(futex, &value, value - 1)) {
+                atomic_fetch_add(&TicketsTaken, 1);
+            }
+            continue;
+        }
+        (void)FutexWait(futex, 0, FUTEX_WAIT_PRIVATE, worker->timeout);
+    }
+    return NULL;
+}
+
+static void stress_wake_operation(int threads)
+{
+    int total = TICKET_ROUNDS * 2;
+    int i;
+
+    atomic_store(&Tickets[0], 0);
+    atomic_store(&Tickets[1], 0);
+    atomic_store(&TicketsTaken, 0);
+    start_workers(threads, ticket_taker);
+    for (i = 0; i < TICKET_ROUNDS; i++) {
+        atomic_fetch_add(&Tickets[0], 1);
+        CHECK(FutexWakeOperation(&Tickets[0], 1, &Tickets[1], 1,
+            FUTEX_OP(FUTEX_OP_ADD, 1, FUTEX_OP_CMP_GE, 0), FUTEX_WAKE_PRIVATE) != OsInvalidParameters);
+        if (!(i % 64)) {
+            sched_yield();
+        }
+    }
+
+    // Every ticket must be taken without further wakes, the waiters without a
+    // timeout would otherwise never see them
+    while (atomic_load(&TicketsTaken) != total) {
+        sched_yield();
+    }
+
+    atomic_store(&Tickets[0], -1);
+    atomic_store(&Tickets[1], -1);
+    FutexWake(&Tickets[0], INT_MAX, FUTEX_WAKE_PRIVATE);
+    FutexWake(&Tickets[1], INT_MAX, FUTEX_WAKE_PRIVATE);
+    join_workers(threads);
+    check_buckets_empty();
+}
+
+// Condition broadcast: the waiters are requeued onto the mutex instead of all waking
+// to contend on it
+static _Atomic(int) ConditionMutex;
+static _Atomic(int) ConditionSequence;
+static _Atomic(int) ConditionWaiters;
+static int          ConditionCounter;
+
+static void mutex_lock_contended(_Atomic(int)* mutex)
+{
+    int value = atomic_exchange(mutex, 2);
+    while (value != 0) {
+        (void)FutexWait(mutex, 2, FUTEX_WAIT_PRIVATE, 0);
+        value = atomic_exchange(mutex, 2);
+    }
+}
+
+static void mutex_lock(_Atomic(int)* mutex)
+{
+    int value = 0;
+    if (!atomic_compare_exchange_strong(mutex, &value, 1)) {
+        mutex_lock_contended(mutex);
+    }
+}
+
+static void mutex_unlock(_Atomic(int)* mutex)
+{
+    if (atomic_fetch_sub(mutex, 1) != 1) {
+        atomic_store(mutex, 0);
+        FutexWake(mutex, 1, FUTEX_WAKE_PRIVATE);
+    }
+}
+
+static void* condition_waiter(struct worker* worker)
+{
+    int sequence = 0;
+    int i;
+
+    for (i = 0; i < CONDITION_ROUNDS; i++) {
+        mutex_lock(&ConditionMutex);
+        sequence = atomic_load(&ConditionSequence);
+        mutex_unlock(&ConditionMutex);
+
+        (void)FutexWait(&ConditionSequence, sequence, FUTEX_WAIT_PRIVATE, worker->timeout);
+
+        // Once requeued the waiter is woken by the unlock, and the mutex must be
+        // marked contended as others may still be waiting on it
+        mutex_lock_contended(&ConditionMutex);
+        ConditionCounter++;
+        mutex_unlock(&ConditionMutex);
+    }
+    atomic_fetch_sub(&ConditionWaiters, 1);
+    return NULL;
+}
+
+static void stress_requeue(int threads)
+{
+    int sequence = 0;
+
+    atomic_store(&ConditionMutex, 0);
+    atomic_store(&ConditionWaiters, threads);
+    ConditionCounter = 0;
+    start_workers(threads, condition_waiter);
+    while (atomic_load(&ConditionWaiters)) {
+        mutex_lock(&ConditionMutex);
+        sequence = atomic_fetch_add(&ConditionSequence, 1) + 1;
+        atomic_store(&ConditionMutex, 2);
+        CHECK(FutexRequeue(&ConditionSequence, 1, &ConditionMutex, INT_MAX, sequence,
+            FUTEX_WAKE_PRIVATE) != OsInterrupted);
+        mutex_unlock(&ConditionMutex);
+        sched_yield();
+    }
+    join_workers(threads);
+    CHECK(ConditionCounter == threads * CONDITION_ROUNDS);
+    CHECK(atomic_load(&ConditionMutex) == 0);
+
+    // A changed value cancels the requeue
+    CHECK(FutexRequeue(&ConditionSequence, 1, &ConditionMutex, INT_MAX, sequence - 1,
+        FUTEX_WAKE_PRIVATE) == OsInterrupted);
+    check_buckets_empty();
+}
+
+static void watchdog(int signal)
+{
+    (void)signal;
+    printf("futex: a waiter was never woken\n");
+    _exit(1);
+}
+
+static void run_passes(const char* name)
+{
+    int allocations = atomic_load(&AllocationCount);
+    int threads[]   = { 2, 4, MAXIMUM_THREADS };
+    int i;
+
+    verify_keys();
+    verify_wake_operation();
+    for (i = 0; i < 3; i++) {
+        alarm(120);
+        stress_wake_operation(threads[i]);
+        stress_requeue(threads[i]);
+        printf("futex: %-8s %2i threads, %i tickets and %i broadcasts handed out\n",
+            name, threads[i], TICKET_ROUNDS * 2, threads[i] * CONDITION_ROUNDS);
+    }
+    alarm(0);
+    CHECK(atomic_load(&AllocationCount) == allocations);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    signal(SIGALRM, watchdog);
+    attach_thread(&MainThread, &MainObject, 0);
+    atomic_store(&Machine.NumberOfCores, 4);
+    Machine.Processor.NumberOfCores = 4;
+    FutexInitialize();
+    CHECK(FutexBucketMask + 1 == 4 * FUTEX_BUCKETS_PER_CORE);
+    run_passes("sized");
+
+    // Every futex collides in one bucket
+    FutexBucketMask = 0;
+    run_passes("single");
+    return 0;
+}
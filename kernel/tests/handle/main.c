@@ -0,0 +1,556 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Resource Handle Benchmark (host)
+ *  - Measures create, lookup, acquire/destroy and create/destroy throughput of the
+ *    handle table with 1K, 64K and 1M live handles and 1 to 8 threads, and compares
+ *    lookups against the previous design, a list of all handles.
+ *  - Measures resolving the path of a message target with 16 to 64K registered paths,
+ *    against the hashed registry, the per thread cache and the previous list.
+ *  - Verifies that lookups return the resource of the handle, that destroyed handles
+ *    stay invalid after their slots are reused, that paths are removed with their
+ *    handles, and that the janitor destroys every resource once.
+ *  Builds on the host against the kernel sources:
+ *
+ *  cc -O2 -pthread -I../../include -I../../arch/include -I../../../librt/libds/include \
+ *     -idirafter ../../../librt/libc/include -idirafter ../../../librt/libddk/include \
+ *     -o handle_bench main.c
+ *  ./handle_bench [maximum threads]
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// handle sources need
+#define __OS_DEFINITIONS__
+#define __VALI_IRQ_SPINLOCK_H__
+#define __VALI_MUTEX_H__
+#define __THREADING_H__
+#define __VALI_HEAP_H__
+#define __DDK_BARRIERS_H__
+#define _DEBUG_H_
+#define __DS_DSDEFS_H__
+#define __LIBDS_KERNEL__
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _In_
+#define _In_Opt_
+#define _Out_
+#define _InOut_
+#define KERNELAPI
+#define KERNELABI
+#define DSDECL(ReturnType, Function) ReturnType Function
+#define CRTDECL(ReturnType, Function) ReturnType Function
+#define MIN(a, b)           ((a) < (b) ? (a) : (b))
+#define TRACE(...)
+#define WARNING(...)
+#define ERROR(...)          (printf("error: " __VA_ARGS__), printf("\n"))
+#define _CRT_UNUSED(x)      (void)(x)
+#define smp_rmb()           atomic_thread_fence(memory_order_acquire)
+#define smp_wmb()           atomic_thread_fence(memory_order_release)
+#define UUID_INVALID        0
+
+typedef unsigned int UUId_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsExists,
+    OsDoesNotExist,
+    OsInvalidParameters,
+    OsOutOfMemory
+} OsStatus_t;
+
+static void* kmalloc(size_t Size) { return malloc(Size); }
+static void kfree(void* Object) { free(Object); }
+
+static _Thread_local char ThreadSelf;
+
+static void LockAcquire(_Atomic(uintptr_t)* Owner)
+{
+    uintptr_t Expected = 0;
+    while (!atomic_compare_exchange_weak_explicit(Owner, &Expected, (uintptr_t)&ThreadSelf,
+        memory_order_acquire, memory_order_relaxed)) {
+        Expected = 0;
+        sched_yield();
+    }
+}
+
+static void LockRelease(_Atomic(uintptr_t)* Owner)
+{
+    atomic_store_explicit(Owner, 0, memory_order_release);
+}
+
+typedef struct IrqSpinlock {
+    _Atomic(uintptr_t) Owner;
+} IrqSpinlock_t;
+
+#define OS_IRQ_SPINLOCK_INIT { 0 }
+
+void IrqSpinlockConstruct(IrqSpinlock_t* Spinlock) { atomic_store(&Spinlock->Owner, 0); }
+void IrqSpinlockAcquire(IrqSpinlock_t* Spinlock) { LockAcquire(&Spinlock->Owner); }
+void IrqSpinlockRelease(IrqSpinlock_t* Spinlock) { LockRelease(&Spinlock->Owner); }
+
+#define MUTEX_PLAIN          0
+#define OS_MUTEX_INIT(Flags) { 0 }
+
+typedef struct {
+    _Atomic(uintptr_t) Owner;
+} Mutex_t;
+
+void MutexLock(Mutex_t* Mutex) { LockAcquire(&Mutex->Owner); }
+void MutexUnlock(Mutex_t* Mutex) { LockRelease(&Mutex->Owner); }
+
+// The semaphore is only used to wake the janitor
+typedef struct Semaphore {
+    int             Value;
+    int             MaxValue;
+    pthread_mutex_t Lock;
+    pthread_cond_t  Signal;
+} Semaphore_t;
+
+#define SEMAPHORE_INIT(Value, MaxValue) { Value, MaxValue, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }
+
+OsStatus_t SemaphoreWait(Semaphore_t* Semaphore, size_t Timeout)
+{
+    (void)Timeout;
+    pthread_mutex_lock(&Semaphore->Lock);
+    while (!Semaphore->Value) {
+        pthread_cond_wait(&Semaphore->Signal, &Semaphore->Lock);
+    }
+    Semaphore->Value--;
+    pthread_mutex_unlock(&Semaphore->Lock);
+    return OsSuccess;
+}
+
+void SemaphoreSignal(Semaphore_t* Semaphore, int Value)
+{
+    pthread_mutex_lock(&Semaphore->Lock);
+    Semaphore->Value = MIN(Semaphore->Value + Value, Semaphore->MaxValue);
+    pthread_cond_signal(&Semaphore->Signal);
+    pthread_mutex_unlock(&Semaphore->Lock);
+}
+
+typedef void (*ThreadEntry_t)(void*);
+
+static ThreadEntry_t JanitorEntry;
+
+static void* janitor_start(void* Context)
+{
+    JanitorEntry(Context);
+    return NULL;
+}
+
+OsStatus_t CreateThread(const char* Name, ThreadEntry_t Function, void* Arguments,
+    unsigned int Flags, UUId_t MemorySpaceHandle, UUId_t* Handle)
+{
+    pthread_t Thread;
+    (void)Name; (void)Flags; (void)MemorySpaceHandle;
+
+    JanitorEntry = Function;
+    if (pthread_create(&Thread, NULL, janitor_start, Arguments)) {
+        return OsError;
+    }
+    pthread_detach(Thread);
+    *Handle = 1;
+    return OsSuccess;
+}
+
+#include "../../../librt/libds/list.c"
+#include <ds/ds.h>
+
+void* dsalloc(size_t size) { return malloc(size); }
+void dsfree(void* pointer) { free(pointer); }
+
+int dsmatchkey(KeyType_t type, DataKey_t key1, DataKey_t key2)
+{
+    (void)type;
+    return strcmp(key1.Value.String.Pointer, key2.Value.String.Pointer);
+}
+
+#include "../../../librt/libds/hashtable.c"
+#undef __MODULE
+#include "../../handle.c"
+
+#define MAXIMUM_THREADS    8
+#define MAXIMUM_HANDLES    (1024 * 1024)
+#define OPERATIONS_PER_RUN (8 * 1024 * 1024)
+#define BASELINE_LOOKUPS   (64 * 1024)
+#define MAXIMUM_PATHS      (64 * 1024)
+#define PATH_SENDS         (1024 * 1024)
+#define PATH_BURST         16
+#define MODE_LOOKUP        0
+#define MODE_ACQUIRE       1
+#define MODE_CHURN         2
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("handlebench: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+struct bench_run {
+    int          mode;
+    int          threads;
+    size_t       live;
+    size_t       operations; // Per thread
+    _Atomic(int) errors;
+};
+
+struct bench_thread {
+    struct bench_run* run;
+    int               index;
+};
+
+static const char* modeNames[] = { "lookup", "acquire", "churn" };
+static UUId_t*     Handles;
+static char*       Resources;
+static _Atomic(size_t) DestroyedCount;
+
+static void destroy_resource(void* Resource)
+{
+    (void)Resource;
+    atomic_fetch_add(&DestroyedCount, 1);
+}
+
+static inline uint32_t next_random(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void wait_for_janitor(size_t destroyed)
+{
+    int i;
+    for (i = 0; i < 10000 && atomic_load(&DestroyedCount) < destroyed; i++) {
+        usleep(1000);
+    }
+    CHECK(atomic_load(&DestroyedCount) == destroyed);
+}
+
+static void* thread_main(void* context)
+{
+    struct bench_thread* thread = context;
+    struct bench_run*    run    = thread->run;
+    uint32_t             state  = 0x9E3779B9u * (uint32_t)(thread->index + 1);
+    size_t               i;
+
+    for (i = 0; i < run->operations; i++) {
+        size_t r = next_random(&state) % run->live;
+        void*  resource;
+        UUId_t handle;
+
+        if (run->mode == MODE_LOOKUP) {
+            if (LookupHandleOfType(Handles[r], HandleTypeGeneric) != &Resources[r]) {
+                atomic_fetch_add(&run->errors, 1);
+            }
+        }
+        else if (run->mode == MODE_ACQUIRE) {
+            if (AcquireHandle(Handles[r], &resource) != OsSuccess || resource != &Resources[r]) {
+                atomic_fetch_add(&run->errors, 1);
+                continue;
+            }
+            DestroyHandle(Handles[r]);
+        }
+        else {
+            handle = CreateHandle(HandleTypeGeneric, destroy_resource, &Resources[r]);
+            if (handle == UUID_INVALID || LookupHandle(handle) != &Resources[r]) {
+                atomic_fetch_add(&run->errors, 1);
+                continue;
+            }
+            DestroyHandle(handle);
+        }
+    }
+    return NULL;
+}
+
+static double run_bench(int mode, int threads, size_t live, int* errors)
+{
+    static struct bench_run run;
+    struct bench_thread     contexts[MAXIMUM_THREADS];
+    pthread_t               handles[MAXIMUM_THREADS];
+    struct timespec         start, end;
+    double                  elapsed;
+    int                     i;
+
+    run.mode       = mode;
+    run.threads    = threads;
+    run.live       = live;
+    run.operations = OPERATIONS_PER_RUN / threads;
+    if (mode == MODE_CHURN) {
+        run.operations /= 8;
+    }
+    atomic_store(&run.errors, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threads; i++) {
+        contexts[i].run   = &run;
+        contexts[i].index = i;
+        pthread_create(&handles[i], NULL, thread_main, &contexts[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *errors = atomic_load(&run.errors);
+    elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    return (double)(run.operations * threads) / elapsed / 1000000.0;
+}
+
+static double elapsed_since(struct timespec* start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start->tv_sec) + (double)(end.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+// The previous design kept every handle on one list, which every lookup walks
+static double run_baseline(size_t live)
+{
+    element_t*      elements = calloc(live, sizeof(element_t));
+    list_t          list     = LIST_INIT;
+    uint32_t        state    = 1;
+    struct timespec start;
+    double          elapsed;
+    size_t          i;
+
+    for (i = 0; i < live; i++) {
+        ELEMENT_INIT(&elements[i], (uintptr_t)(i + 1), &Resources[i]);
+        list_append(&list, &elements[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BASELINE_LOOKUPS; i++) {
+        size_t r = next_random(&state) % live;
+        CHECK(list_find_value(&list, (void*)(uintptr_t)(r + 1)) == &Resources[r]);
+    }
+    elapsed = elapsed_since(&start);
+    free(elements);
+    return (double)BASELINE_LOOKUPS / elapsed / 1000000.0;
+}
+
+// Resolves the target of a send like the ipc path does, senders send a burst of
+// messages to one target before moving on to the next
+static size_t resolve_paths(char (*paths)[32], size_t count, int method, list_t* list)
+{
+    HandlePathCache_t cache;
+    uint32_t          state = 7;
+    size_t            resolved = 0;
+    UUId_t            handle;
+    size_t            i, r = 0;
+
+    memset(&cache, 0, sizeof(HandlePathCache_t));
+    for (i = 0; i < PATH_SENDS; i++) {
+        if (!(i % PATH_BURST)) {
+            r = next_random(&state) % count;
+        }
+
+        if (method == 0) {
+            ResourceHandle_t* instance = list_find_value(list, paths[r]);
+            handle = instance ? atomic_load(&instance->Id) : UUID_INVALID;
+        }
+        else if (method == 1) {
+            CHECK(LookupHandleByPath(paths[r], &handle) == OsSuccess);
+        }
+        else {
+            CHECK(LookupHandleByPathCached(paths[r], &cache, &handle) == OsSuccess);
+        }
+        CHECK(LookupHandleOfType(handle, HandleTypeGeneric) == &Resources[r]);
+        resolved++;
+    }
+    return resolved;
+}
+
+static size_t run_path_bench(void)
+{
+    static char     paths[MAXIMUM_PATHS][32];
+    const char*     methodNames[] = { "list", "hash", "cached" };
+    size_t          pathCounts[]  = { 16, 256, 4096, MAXIMUM_PATHS };
+    element_t*      elements      = calloc(MAXIMUM_PATHS, sizeof(element_t));
+    size_t          destroyed     = 0;
+    struct timespec start;
+    UUId_t          handle;
+    int             method;
+    size_t          i;
+    int             j;
+
+    CHECK(elements != NULL);
+    printf("handlebench: path    count, million sends per second\n");
+    for (j = 0; j < 4; j++) {
+        size_t count = pathCounts[j];
+        list_t list;
+
+        list_construct_cmp(&list, list_cmp_string);
+        for (i = 0; i < count; i++) {
+            snprintf(&paths[i][0], sizeof(paths[i]), "/service/%zu", i);
+            Handles[i] = CreateHandle(HandleTypeGeneric, destroy_resource, &Resources[i]);
+            CHECK(Handles[i] != UUID_INVALID);
+            CHECK(RegisterHandlePath(Handles[i], paths[i]) == OsSuccess);
+            ELEMENT_INIT(&elements[i], paths[i], LookupSafeHandleInstance(Handles[i]));
+            list_append(&list, &elements[i]);
+        }
+        CHECK(RegisterHandlePath(Handles[0], "/service/other") == OsExists);
+        CHECK(count < 2 || RegisterHandlePath(Handles[1], paths[0]) == OsExists);
+
+        for (method = 0; method < 3; method++) {
+            // Walking the list of 64K paths a million times takes too long
+            if (method == 0 && count > 4096) {
+                printf("handlebench: %-6s %6zu,       -\n", methodNames[method], count);
+                continue;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            resolve_paths(paths, count, method, &list);
+            printf("handlebench: %-6s %6zu, %7.2f\n", methodNames[method], count,
+                (double)PATH_SENDS / elapsed_since(&start) / 1000000.0);
+        }
+
+        for (i = 0; i < count; i++) {
+            DestroyHandle(Handles[i]);
+            CHECK(LookupHandleByPath(paths[i], &handle) == OsDoesNotExist);
+        }
+        destroyed += count;
+    }
+    free(elements);
+    return destroyed;
+}
+
+// Destroyed handles must stay invalid once their slots are reused by new handles
+static void check_stale_handles(void)
+{
+    UUId_t stale[64];
+    UUId_t fresh[64];
+    size_t destroyed = atomic_load(&DestroyedCount);
+    void*  resource;
+    int    i, j;
+
+    for (i = 0; i < 64; i++) {
+        stale[i] = CreateHandle(HandleTypeGeneric, destroy_resource, &Resources[i]);
+        CHECK(stale[i] != UUID_INVALID);
+        CHECK(AcquireHandle(stale[i], &resource) == OsSuccess && resource == &Resources[i]);
+        DestroyHandle(stale[i]);
+        DestroyHandle(stale[i]);
+    }
+    wait_for_janitor(destroyed + 64);
+
+    // Cycle through every free slot, so the slots of the stale handles are reused
+    for (j = 0; j < 4; j++) {
+        for (i = 0; i < 64; i++) {
+            fresh[i] = CreateHandle(HandleTypeGeneric, destroy_resource, &Resources[64 + i]);
+        }
+        for (i = 0; i < 64; i++) {
+            CHECK(LookupHandle(stale[i]) == NULL);
+            CHECK(AcquireHandle(stale[i], &resource) == OsDoesNotExist);
+            CHECK(LookupHandle(fresh[i]) == &Resources[64 + i]);
+            CHECK(LookupHandleOfType(fresh[i], HandleTypeThread) == NULL);
+            DestroyHandle(fresh[i]);
+        }
+    }
+    wait_for_janitor(destroyed + 64 + (4 * 64));
+}
+
+int main(int argc, char **argv)
+{
+    int    threadCounts[] = { 1, 2, 4, 8 };
+    size_t liveCounts[]   = { 1024, 64 * 1024, MAXIMUM_HANDLES };
+    int    maxThreads     = MAXIMUM_THREADS;
+    size_t destroyed      = 0;
+    struct timespec start;
+    int    mode;
+    int    errors;
+    int    i, j;
+    size_t k;
+
+    if (argc > 1) {
+        maxThreads = MIN(atoi(argv[1]), MAXIMUM_THREADS);
+    }
+
+    Handles   = malloc(MAXIMUM_HANDLES * sizeof(UUId_t));
+    Resources = malloc(MAXIMUM_HANDLES);
+    CHECK(Handles != NULL && Resources != NULL);
+    CHECK(InitializeHandles() == OsSuccess && InitializeHandleJanitor() == OsSuccess);
+    check_stale_handles();
+    destroyed = atomic_load(&DestroyedCount);
+    destroyed += run_path_bench();
+    wait_for_janitor(destroyed);
+
+    printf("handlebench: million operations per second\n");
+    printf("handlebench: mode       live,  create, list");
+    for (i = 0; i < 4 && threadCounts[i] <= maxThreads; i++) {
+        printf(", %7i", threadCounts[i]);
+    }
+    printf("\n");
+
+    for (j = 0; j < 3; j++) {
+        size_t live = liveCounts[j];
+        double createRate;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (k = 0; k < live; k++) {
+            Handles[k] = CreateHandle(HandleTypeGeneric, destroy_resource, &Resources[k]);
+            CHECK(Handles[k] != UUID_INVALID);
+        }
+        createRate = (double)live / elapsed_since(&start) / 1000000.0;
+
+        for (mode = MODE_LOOKUP; mode <= MODE_CHURN; mode++) {
+            printf("handlebench: %-7s %7zu, %7.2f", modeNames[mode], live, createRate);
+            if (mode == MODE_LOOKUP && live <= 64 * 1024) {
+                printf(", %5.2f", run_baseline(live));
+            }
+            else {
+                printf(",     -");
+            }
+            fflush(stdout);
+
+            for (i = 0; i < 4 && threadCounts[i] <= maxThreads; i++) {
+                double rate = run_bench(mode, threadCounts[i], live, &errors);
+                if (errors) {
+                    printf("\nhandlebench: %i failed operations\n", errors);
+                    return 1;
+                }
+                if (mode == MODE_CHURN) {
+                    destroyed += (OPERATIONS_PER_RUN / threadCounts[i] / 8) * threadCounts[i];
+                }
+                printf(", %7.2f", rate);
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+
+        for (k = 0; k < live; k++) {
+            DestroyHandle(Handles[k]);
+        }
+        destroyed += live;
+        wait_for_janitor(destroyed);
+        for (k = 0; k < live; k++) {
+            CHECK(LookupHandle(Handles[k]) == NULL);
+        }
+    }
+    printf("handlebench: every resource was destroyed once, stale handles stayed invalid, paths were removed\n");
+    return 0;
+}
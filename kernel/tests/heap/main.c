@@ -0,0 +1,652 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Kernel Heap Benchmark (host)
+ *  - Measures kmalloc/kfree throughput with 1 to 64 threads, where every thread acts
+ *    as a core of its own, and compares it against a cache without magazines, which
+ *    allocates every object through the slab layer.
+ *  - Measures kmalloc/kfree with the allocation profiler sampling every 64th
+ *    allocation, to compare against the unsampled kmalloc.
+ *  - Verifies that objects are never handed out twice, that objects freed by other
+ *    cores and domains find their way back, that the cache statistics and profiler
+ *    samples add up, and that destroying caches returns all of their memory.
+ *  - Pages come from a stub page provider on top of a reserved host range, which acts
+ *    as the global access memory.
+ *  Builds on the host against the kernel sources:
+ *
+ *  cc -O2 -pthread -I../../include -I../../arch/include -I../../../librt/libds/include \
+ *     -idirafter ../../../librt/libc/include -idirafter ../../../librt/libddk/include \
+ *     -o heap_bench main.c
+ *  ./heap_bench [maximum threads]
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// heap sources need
+#define __OS_DEFINITIONS__
+#define __VALI_IRQ_SPINLOCK_H__
+#define __VALI_ARCH_INTERRUPT_H__
+#define __SYSTEM_INTERFACE_UTILS_H__
+#define __DDK_IO_H__
+#define _DEBUG_H_
+#define __VALI_MUTEX_H__
+#define __VALI_MACHINE__
+#define __COMPONENT_DOMAIN__
+#define __MEMORY_SPACE_INTERFACE__
+#define __DS_DSDEFS_H__
+#define __LIBDS_KERNEL__
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define _In_
+#define _Out_
+#define _InOut_
+#define KERNELAPI
+#define KERNELABI
+#define DSDECL(ReturnType, Function) ReturnType Function
+#define DIVUP(a, b)         ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define LODWORD(l)          ((uint32_t)(uint64_t)(l))
+#define MIN(a, b)           ((a) < (b) ? (a) : (b))
+#define MAX(a, b)           ((a) > (b) ? (a) : (b))
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+#define PRIuIN              "zu"
+#define PRIiIN              "zi"
+#define PRIxIN              "zx"
+#define TRACE(...)
+#define ERROR(...)          (printf("error: " __VA_ARGS__), printf("\n"))
+#define WARNING(...)        (printf("warning: " __VA_ARGS__), printf("\n"))
+#define WRITELINE(...)      (printf(__VA_ARGS__), printf("\n"))
+#define FATAL(Scope, ...)   (printf("fatal: " __VA_ARGS__), printf("\n"), abort())
+#define FATAL_SCOPE_KERNEL  1
+#define _CRT_UNUSED(x)      (void)(x)
+#define smp_wmb()           atomic_thread_fence(memory_order_release)
+#define UUID_INVALID        0
+
+typedef unsigned int UUId_t;
+typedef unsigned int IntStatus_t;
+typedef uintptr_t    VirtualAddress_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsExists,
+    OsDoesNotExist,
+    OsInvalidParameters,
+    OsOutOfMemory,
+    OsBusy
+} OsStatus_t;
+
+// The locks are as small as the kernel locks, as the size of the cache structure decides
+// whether the slabs of the cache of caches fit on-site. Waiters yield while they spin,
+// as holders of kernel spinlocks can't be preempted, but host threads can.
+static _Thread_local char ThreadSelf;
+
+static void LockAcquire(_Atomic(uintptr_t)* Owner)
+{
+    uintptr_t Expected = 0;
+    while (!atomic_compare_exchange_weak_explicit(Owner, &Expected, (uintptr_t)&ThreadSelf,
+        memory_order_acquire, memory_order_relaxed)) {
+        Expected = 0;
+        sched_yield();
+    }
+}
+
+static void LockRelease(_Atomic(uintptr_t)* Owner)
+{
+    atomic_store_explicit(Owner, 0, memory_order_release);
+}
+
+typedef struct IrqSpinlock {
+    _Atomic(uintptr_t) Owner;
+} IrqSpinlock_t;
+
+#define OS_IRQ_SPINLOCK_INIT { 0 }
+
+void IrqSpinlockConstruct(IrqSpinlock_t* Spinlock) { atomic_store(&Spinlock->Owner, 0); }
+void IrqSpinlockAcquire(IrqSpinlock_t* Spinlock) { LockAcquire(&Spinlock->Owner); }
+void IrqSpinlockRelease(IrqSpinlock_t* Spinlock) { LockRelease(&Spinlock->Owner); }
+
+// Mutex definitions from mutex.h
+#define MUTEX_PLAIN     0
+#define MUTEX_RECURSIVE 0x1
+
+typedef struct {
+    _Atomic(uintptr_t) Owner;
+    unsigned int       Configuration;
+    int                References;
+} Mutex_t;
+
+void MutexConstruct(Mutex_t* Mutex, unsigned int Configuration)
+{
+    atomic_store(&Mutex->Owner, 0);
+    Mutex->Configuration = Configuration;
+    Mutex->References    = 0;
+}
+
+void MutexLock(Mutex_t* Mutex)
+{
+    if ((Mutex->Configuration & MUTEX_RECURSIVE) &&
+        atomic_load_explicit(&Mutex->Owner, memory_order_relaxed) == (uintptr_t)&ThreadSelf) {
+        Mutex->References++;
+        return;
+    }
+    LockAcquire(&Mutex->Owner);
+    Mutex->References = 1;
+}
+
+OsStatus_t MutexTryLock(Mutex_t* Mutex)
+{
+    uintptr_t Expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&Mutex->Owner, &Expected, (uintptr_t)&ThreadSelf,
+        memory_order_acquire, memory_order_relaxed)) {
+        return OsBusy;
+    }
+    Mutex->References = 1;
+    return OsSuccess;
+}
+
+void MutexUnlock(Mutex_t* Mutex)
+{
+    if (!--Mutex->References) {
+        LockRelease(&Mutex->Owner);
+    }
+}
+
+// Memory space definitions from memoryspace.h
+#define MAPPING_DOMAIN         0x00000040
+#define MAPPING_COMMIT         0x00000080
+#define MAPPING_VIRTUAL_GLOBAL 0x00000002
+
+typedef struct SystemMemorySpace {
+    int Unused;
+} SystemMemorySpace_t;
+
+typedef struct StaticMemoryPool {
+    uintptr_t StartAddress;
+    size_t    Length;
+} StaticMemoryPool_t;
+
+typedef struct PageAllocator {
+    int Unused;
+} PageAllocator_t;
+
+typedef struct SystemMachine {
+    PageAllocator_t    PhysicalMemory;
+    StaticMemoryPool_t GlobalAccessMemory;
+} SystemMachine_t;
+
+typedef struct SystemDomain {
+    UUId_t Id;
+} SystemDomain_t;
+
+#define PAGE_SIZE        4096
+#define POOL_SIZE        (1024UL * 1024UL * 1024UL)
+#define POOL_PAGES       (POOL_SIZE / PAGE_SIZE)
+#define MAXIMUM_THREADS  64
+
+static SystemMachine_t          Machine;
+static SystemMemorySpace_t      Space;
+static SystemDomain_t           Domains[2] = { { 0 }, { 1 } };
+static _Thread_local UUId_t          ThreadCoreId;
+static _Thread_local SystemDomain_t* ThreadDomain;
+
+SystemMachine_t* GetMachine(void) { return &Machine; }
+SystemMemorySpace_t* GetCurrentMemorySpace(void) { return &Space; }
+SystemDomain_t* GetCurrentDomain(void) { return ThreadDomain; }
+size_t GetMemorySpacePageSize(void) { return PAGE_SIZE; }
+UUId_t ArchGetProcessorCoreId(void) { return ThreadCoreId; }
+
+// Every thread is a core of its own and never migrates, so interrupts don't need to
+// be disabled to keep the per-core state private
+IntStatus_t InterruptDisable(void) { return 0; }
+IntStatus_t InterruptRestoreState(IntStatus_t State) { return State; }
+int InterruptIsDisabled(void) { return 0; }
+
+// The pool is never short of pages, so there is nothing to reclaim
+#include <memory_reclaim.h>
+void MemoryReclaimRegisterShrinker(MemoryShrinker_t* Shrinker) { (void)Shrinker; }
+size_t MemoryReclaim(size_t PageCount, unsigned int Flags) { (void)PageCount; (void)Flags; return 0; }
+
+void PageAllocatorGetStatistics(PageAllocator_t* Allocator, size_t* PageCount, size_t* FreePages)
+{
+    (void)Allocator;
+    *PageCount = POOL_PAGES;
+    *FreePages = 0;
+}
+
+// The page provider hands out page runs from the pool, freed runs are kept on a list
+// per length so they can be reused
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static uintptr_t       PoolNext;
+static uintptr_t*      PoolFree[1025];
+static _Atomic(size_t) PoolMapped;
+
+OsStatus_t MemorySpaceMap(SystemMemorySpace_t* MemorySpace, VirtualAddress_t* Address,
+    uintptr_t* PhysicalAddressValues, size_t Length, unsigned int MemoryFlags, unsigned int PlacementFlags)
+{
+    size_t PageCount = Length / PAGE_SIZE;
+    (void)MemorySpace; (void)PhysicalAddressValues; (void)MemoryFlags;
+    assert(PlacementFlags == MAPPING_VIRTUAL_GLOBAL);
+    assert(PageCount && PageCount <= 1024);
+
+    pthread_mutex_lock(&PoolLock);
+    if (PoolFree[PageCount]) {
+        *Address = (uintptr_t)PoolFree[PageCount];
+        PoolFree[PageCount] = (uintptr_t*)*PoolFree[PageCount];
+    }
+    else if (PoolNext + Length <= Machine.GlobalAccessMemory.StartAddress + POOL_SIZE) {
+        *Address  = PoolNext;
+        PoolNext += Length;
+    }
+    else {
+        pthread_mutex_unlock(&PoolLock);
+        return OsOutOfMemory;
+    }
+    pthread_mutex_unlock(&PoolLock);
+    atomic_fetch_add(&PoolMapped, PageCount);
+    return OsSuccess;
+}
+
+OsStatus_t MemorySpaceUnmap(SystemMemorySpace_t* MemorySpace, VirtualAddress_t Address, size_t Size)
+{
+    size_t PageCount = Size / PAGE_SIZE;
+    (void)MemorySpace;
+
+    pthread_mutex_lock(&PoolLock);
+    *(uintptr_t**)Address = PoolFree[PageCount];
+    PoolFree[PageCount]   = (uintptr_t*)Address;
+    pthread_mutex_unlock(&PoolLock);
+    atomic_fetch_sub(&PoolMapped, PageCount);
+    return OsSuccess;
+}
+
+OsStatus_t GetMemorySpaceMapping(SystemMemorySpace_t* MemorySpace, VirtualAddress_t Address,
+    int PageCount, uintptr_t* DmaVectorOut)
+{
+    (void)MemorySpace; (void)PageCount;
+    *DmaVectorOut = Address;
+    return OsSuccess;
+}
+
+#include "../../../librt/libds/list.c"
+#undef __MODULE
+#include "../../memory/heap.c"
+
+#define OBJECTS_PER_ROUND  64
+#define OPERATIONS_PER_RUN (4 * 1024 * 1024)
+#define MODE_KMALLOC       0
+#define MODE_SLAB          1
+#define MODE_HANDOFF       2
+#define MODE_SAMPLED       3
+#define SAMPLE_INTERVAL    64
+
+struct bench_run {
+    int                mode;
+    int                threads;
+    size_t             size;
+    size_t             rounds;    // Per thread
+    MemoryCache_t*     cache;
+    pthread_barrier_t  barrier;
+    void*              objects[MAXIMUM_THREADS][OBJECTS_PER_ROUND];
+    _Atomic(int)       errors;
+};
+
+struct bench_thread {
+    struct bench_run* run;
+    int               index;
+};
+
+static const char* modeNames[] = { "kmalloc", "slab", "handoff", "sampled" };
+
+// Objects are filled with the owner and index of the object, so objects that are
+// handed out twice are detected when the owner checks them
+static void fill_object(void* object, size_t size, uint32_t tag)
+{
+    uint32_t* words = object;
+    words[0]                             = tag;
+    words[(size / sizeof(uint32_t)) - 1] = tag;
+}
+
+static int check_object(void* object, size_t size, uint32_t tag)
+{
+    uint32_t* words = object;
+    return words[0] == tag && words[(size / sizeof(uint32_t)) - 1] == tag;
+}
+
+static void* allocate_object(struct bench_run* run)
+{
+    if (run->mode == MODE_SLAB) {
+        return MemoryCacheAllocate(run->cache);
+    }
+    return kmalloc(run->size);
+}
+
+static void free_object(struct bench_run* run, void* object)
+{
+    if (run->mode == MODE_SLAB) {
+        MemoryCacheFree(run->cache, object);
+    }
+    else {
+        kfree(object);
+    }
+}
+
+static void* thread_main(void* context)
+{
+    struct bench_thread* thread  = context;
+    struct bench_run*    run     = thread->run;
+    void**               objects = &run->objects[thread->index][0];
+    void**               others  = &run->objects[(thread->index + 1) % run->threads][0];
+    size_t               i;
+    int                  j;
+
+    ThreadCoreId = (UUId_t)thread->index;
+    if (run->mode == MODE_HANDOFF) {
+        ThreadDomain = &Domains[thread->index % 2];
+    }
+
+    for (i = 0; i < run->rounds; i++) {
+        for (j = 0; j < OBJECTS_PER_ROUND; j++) {
+            objects[j] = allocate_object(run);
+            if (!objects[j]) {
+                atomic_fetch_add(&run->errors, 1);
+                return NULL;
+            }
+            fill_object(objects[j], run->size, ((uint32_t)thread->index << 16) | (uint32_t)j);
+        }
+
+        // Either free our own objects, or those of the next thread, which are freed
+        // on another core and possibly in another domain than they were allocated in
+        if (run->mode == MODE_HANDOFF) {
+            pthread_barrier_wait(&run->barrier);
+            for (j = 0; j < OBJECTS_PER_ROUND; j++) {
+                uint32_t owner = (uint32_t)((thread->index + 1) % run->threads);
+                if (!check_object(others[j], run->size, (owner << 16) | (uint32_t)j)) {
+                    atomic_fetch_add(&run->errors, 1);
+                }
+                free_object(run, others[j]);
+            }
+            pthread_barrier_wait(&run->barrier);
+        }
+        else {
+            for (j = 0; j < OBJECTS_PER_ROUND; j++) {
+                if (!check_object(objects[j], run->size, ((uint32_t)thread->index << 16) | (uint32_t)j)) {
+                    atomic_fetch_add(&run->errors, 1);
+                }
+                free_object(run, objects[j]);
+            }
+        }
+    }
+    return NULL;
+}
+
+static double run_bench(int mode, int threads, size_t size, int* errors)
+{
+    static struct bench_run run;
+    struct bench_thread     contexts[MAXIMUM_THREADS];
+    pthread_t               handles[MAXIMUM_THREADS];
+    struct timespec         start, end;
+    double                  elapsed;
+    int                     i;
+
+    run.mode    = mode;
+    run.threads = threads;
+    run.size    = size;
+    run.rounds  = OPERATIONS_PER_RUN / (threads * OBJECTS_PER_ROUND);
+    run.cache   = NULL;
+    if (mode == MODE_HANDOFF) {
+        run.rounds = MIN(run.rounds, 256);
+    }
+    if (mode == MODE_SLAB) {
+        run.cache = MemoryCacheCreate("bench_cache", size, size, 0,
+            HEAP_SLAB_NO_ATOMIC_CACHE, NULL, NULL);
+    }
+    if (mode == MODE_SAMPLED) {
+        MemoryCacheProfile(SAMPLE_INTERVAL, NULL, 0);
+    }
+    pthread_barrier_init(&run.barrier, NULL, (unsigned)threads);
+    atomic_store(&run.errors, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threads; i++) {
+        contexts[i].run   = &run;
+        contexts[i].index = i;
+        pthread_create(&handles[i], NULL, thread_main, &contexts[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (run.cache) {
+        MemoryCacheDestroy(run.cache);
+    }
+    if (mode == MODE_SAMPLED) {
+        MemoryCacheProfile(0, NULL, 0);
+    }
+    pthread_barrier_destroy(&run.barrier);
+    *errors = atomic_load(&run.errors);
+    elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    return (double)(run.rounds * threads * OBJECTS_PER_ROUND) / elapsed / 1000000.0;
+}
+
+static int print_bench(int mode, int threads, size_t size)
+{
+    int    errors;
+    double throughput = run_bench(mode, threads, size, &errors);
+    if (errors) {
+        printf("\nheapbench: %i corrupted or failed allocations\n", errors);
+        return -1;
+    }
+    printf(", %7.2f", throughput);
+    fflush(stdout);
+    return 0;
+}
+
+// Caches that are created and destroyed must give back every page they used, objects
+// that are still held by the magazines included
+static void create_and_destroy(void)
+{
+    size_t         sizes[4] = { 24, 200, 1000, 2048 };
+    MemoryCache_t* caches[4];
+    void*          objects[1024];
+    int            i, j;
+
+    for (i = 0; i < 4; i++) {
+        caches[i] = MemoryCacheCreate("destroy_cache", sizes[i], 0, 0, 0, NULL, NULL);
+        for (j = 0; j < 1024; j++) {
+            objects[j] = MemoryCacheAllocate(caches[i]);
+        }
+        for (j = 0; j < 1024; j += 2) {
+            MemoryCacheFree(caches[i], objects[j]);
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        MemoryCacheDestroy(caches[i]);
+    }
+}
+
+static int check_destroy(void)
+{
+    size_t mapped;
+
+    // The first rounds warm up the caches that hold the cache and slab structures,
+    // and the magazines of those
+    ThreadCoreId = 0;
+    create_and_destroy();
+    create_and_destroy();
+    mapped = atomic_load(&PoolMapped);
+    create_and_destroy();
+    if (atomic_load(&PoolMapped) != mapped) {
+        printf("heapbench: %zu pages leaked by destroyed caches\n", atomic_load(&PoolMapped) - mapped);
+        return -1;
+    }
+    return 0;
+}
+
+static HeapCacheStatistics_t* find_statistics(HeapCacheStatistics_t* statistics, int count, const char* name)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        if (!strcmp(&statistics[i].Name[0], name)) {
+            return &statistics[i];
+        }
+    }
+    return NULL;
+}
+
+static __attribute__((noinline)) void* profiled_caller(size_t size)
+{
+    void* object = kmalloc(size);
+    __asm__ volatile("" ::: "memory");
+    return object;
+}
+
+// The counters of a cache must add up after a mix of magazine and slab allocations,
+// and the profiler must record the caller and size of the sampled allocations
+static int check_statistics(void)
+{
+    static HeapCacheStatistics_t statistics[64];
+    static HeapProfileSample_t   samples[HEAP_PROFILE_MAX_SAMPLES];
+    HeapCacheStatistics_t*       entry;
+    MemoryCache_t*               cache;
+    void*                        objects[1000];
+    int                          count, i;
+
+    ThreadCoreId = 0;
+    ThreadDomain = NULL;
+    cache = MemoryCacheCreate("statistics_cache", 100, 0, 0, 0, NULL, NULL);
+    for (i = 0; i < 1000; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+    }
+    for (i = 0; i < 500; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+    for (i = 0; i < 100; i++) {
+        objects[i] = MemoryCacheAllocate(cache);
+    }
+
+    count = MemoryCacheQuery(&statistics[0], 64);
+    entry = find_statistics(&statistics[0], MIN(count, 64), "statistics_cache");
+    if (!entry || entry->NumberOfAllocations != 1100 || entry->NumberOfFrees != 500 ||
+        entry->ObjectsInUse != 600 || entry->HighWaterMark != 1000 || 
+        entry->NumberOfSlabsCreated != entry->NumberOfSlabs || entry->ObjectSize != 100) {
+        printf("heapbench: statistics of the cache don't add up\n");
+        return -1;
+    }
+    for (i = 100; i < 1000; i++) {
+        if (i >= 500) {
+            MemoryCacheFree(cache, objects[i]);
+        }
+    }
+    for (i = 0; i < 100; i++) {
+        MemoryCacheFree(cache, objects[i]);
+    }
+    MemoryCacheDestroy(cache);
+    count = MemoryCacheQuery(&statistics[0], 64);
+    if (find_statistics(&statistics[0], MIN(count, 64), "statistics_cache")) {
+        printf("heapbench: destroyed cache is still listed\n");
+        return -1;
+    }
+
+    // Sample every third allocation, which must all come from the same call site
+    MemoryCacheProfile(3, NULL, 0);
+    for (i = 0; i < 3 * HEAP_PROFILE_MAX_SAMPLES; i++) {
+        objects[i % 1000] = profiled_caller(40);
+        kfree(objects[i % 1000]);
+    }
+    count = MemoryCacheProfile(0, &samples[0], HEAP_PROFILE_MAX_SAMPLES);
+    if (count != HEAP_PROFILE_MAX_SAMPLES) {
+        printf("heapbench: %i profiler samples, expected %i\n", count, HEAP_PROFILE_MAX_SAMPLES);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (samples[i].Size != 40 || samples[i].Caller < (uintptr_t)&profiled_caller ||
+            samples[i].Caller > (uintptr_t)&profiled_caller + 256) {
+            printf("heapbench: sample %i has caller 0x%zx size %zu\n", i,
+                (size_t)samples[i].Caller, samples[i].Size);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int    threadCounts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    size_t sizes[]        = { 32, 256, 4096 };
+    int    maxThreads     = MAXIMUM_THREADS;
+    void*  region;
+    int    mode;
+    int    i, j;
+
+    if (argc > 1) {
+        maxThreads = MIN(atoi(argv[1]), MAXIMUM_THREADS);
+    }
+
+    // Reserve the global access memory, pages are only backed once they are touched
+    region = mmap(NULL, POOL_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        printf("heapbench: failed to reserve %lu bytes\n", POOL_SIZE);
+        return 1;
+    }
+    Machine.GlobalAccessMemory.StartAddress = (uintptr_t)region;
+    Machine.GlobalAccessMemory.Length       = POOL_SIZE;
+    PoolNext                                = (uintptr_t)region;
+    MemoryCacheInitialize();
+
+    printf("heapbench: million allocations and frees per second\n");
+    printf("heapbench: mode       size");
+    for (i = 0; i < 7 && threadCounts[i] <= maxThreads; i++) {
+        printf(", %7i", threadCounts[i]);
+    }
+    printf("\n");
+
+    for (mode = MODE_KMALLOC; mode <= MODE_SAMPLED; mode++) {
+        for (j = 0; j < 3; j++) {
+            printf("heapbench: %-7s %7zu", modeNames[mode], sizes[j]);
+            for (i = 0; i < 7 && threadCounts[i] <= maxThreads; i++) {
+                if (print_bench(mode, threadCounts[i], sizes[j])) {
+                    return 1;
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    if (check_statistics()) {
+        return 1;
+    }
+    printf("heapbench: cache statistics and profiler samples add up\n");
+
+    if (check_destroy()) {
+        return 1;
+    }
+    printf("heapbench: destroyed caches returned all pages\n");
+    return 0;
+}
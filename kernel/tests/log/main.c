@@ -0,0 +1,603 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Log Ring Test (host)
+ *  - Runs the log sources on host threads, each thread acting as a core that appends
+ *    to its own ring, with timestamps from one shared counter like a synchronized TSC.
+ *  - Verifies that messages appended on many cores are merged in timestamp order.
+ *  - Runs concurrent producers against a consumer that merges and renders like the log
+ *    thread, including two cores without a ring that share the boot ring. Verifies
+ *    that every core's messages are rendered in order, and that every message is
+ *    either rendered or reported as lost.
+ *  - Runs the log thread against producers that leave it idle between messages, and
+ *    verifies that no message is left behind, that it stays asleep while the rings are
+ *    empty, and that a message appended with interrupts disabled waits for the tick.
+ *  - Verifies that a panic flush renders while the log lock is held by a halted core.
+ *  Builds on the host against the kernel sources:
+ *
+ *  cc -O2 -pthread -I../../include -I../../arch/include -I../../../librt/libds/include \
+ *     -idirafter ../../../librt/libc/include -idirafter ../../../librt/libddk/include \
+ *     -o log_test main.c
+ *  ./log_test
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// log sources need
+#define __OS_DEFINITIONS__
+#define __SPINLOCK_H__
+#define __VALI_ARCH_INTERRUPT_H__
+#define __VALI_OUTPUT_H__
+#define __ARCH_THREAD_H__
+#define __SYSTEM_INTERFACE_UTILS_H__
+#define __COMPONENT_CPU__
+#define __COMPONENT_DOMAIN__
+#define __DDK_IO_H__
+#define __DDK_BARRIERS_H__
+#define __HANDLE_H__
+#define __VALI_HEAP_H__
+#define __VALI_MACHINE__
+#define __VALI_SCHEDULER_H__
+#define __SEMAPHORE_H__
+#define __THREADING_H__
+#define _DEBUG_H_
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _In_
+#define _In_Opt_
+#define _Out_
+#define KERNELAPI
+#define KERNELABI
+#define _CRT_UNUSED(x)             (void)(x)
+#define READ_VOLATILE(var)         (*(volatile typeof(var)*)&(var))
+#define WRITE_VOLATILE(var, value) (*(volatile typeof(var)*)&(var) = (value))
+#define smp_mb()                   atomic_thread_fence(memory_order_seq_cst)
+#define smp_wmb()                  atomic_thread_fence(memory_order_release)
+#define PRIuIN                     "zu"
+#define UUID_INVALID               ((UUId_t)-1)
+#define ERROR(...)                 (printf("error: " __VA_ARGS__), printf("\n"))
+
+typedef unsigned int UUId_t;
+typedef int          IntStatus_t;
+typedef void(*ThreadEntry_t)(void*);
+typedef enum {
+    OsSuccess,
+    OsError
+} OsStatus_t;
+
+typedef enum {
+    spinlock_plain
+} spinlock_type_t;
+
+typedef enum {
+    spinlock_acquired = 0,
+    spinlock_busy     = 1
+} spinlock_status_t;
+
+typedef struct {
+    pthread_mutex_t Mutex;
+} spinlock_t;
+
+#define _SPN_INITIALIZER_NP(Type) { PTHREAD_MUTEX_INITIALIZER }
+
+static void spinlock_init(spinlock_t* Lock, spinlock_type_t Type) { (void)Type; pthread_mutex_init(&Lock->Mutex, NULL); }
+static void spinlock_acquire(spinlock_t* Lock) { pthread_mutex_lock(&Lock->Mutex); }
+static int spinlock_try_acquire(spinlock_t* Lock) { return pthread_mutex_trylock(&Lock->Mutex) ? spinlock_busy : spinlock_acquired; }
+static void spinlock_release(spinlock_t* Lock) { pthread_mutex_unlock(&Lock->Mutex); }
+
+// Interrupts only guard against preemption on the same core, which the host lacks. A
+// core can pretend to log with interrupts disabled, to take the deferred wake path.
+static _Thread_local int InterruptsOff;
+
+static IntStatus_t InterruptDisable(void) { return 0; }
+static void InterruptRestoreState(IntStatus_t State) { (void)State; }
+static int InterruptIsDisabled(void) { return InterruptsOff; }
+
+// The semaphore counts how often the log thread waited, to see that it stays asleep
+typedef struct Semaphore {
+    pthread_mutex_t Lock;
+    pthread_cond_t  Signal;
+    int             Value;
+    int             MaxValue;
+    int             Waiting;
+    int             Waits;
+} Semaphore_t;
+
+static void SemaphoreConstruct(Semaphore_t* Semaphore, int InitialValue, int MaximumValue)
+{
+    pthread_mutex_init(&Semaphore->Lock, NULL);
+    pthread_cond_init(&Semaphore->Signal, NULL);
+    Semaphore->Value    = InitialValue;
+    Semaphore->MaxValue = MaximumValue;
+}
+
+static OsStatus_t SemaphoreWait(Semaphore_t* Semaphore, size_t Timeout)
+{
+    (void)Timeout;
+    pthread_mutex_lock(&Semaphore->Lock);
+    Semaphore->Waiting = 1;
+    while (!Semaphore->Value) {
+        pthread_cond_wait(&Semaphore->Signal, &Semaphore->Lock);
+    }
+    Semaphore->Value--;
+    Semaphore->Waiting = 0;
+    Semaphore->Waits++;
+    pthread_mutex_unlock(&Semaphore->Lock);
+    return OsSuccess;
+}
+
+static OsStatus_t SemaphoreSignal(Semaphore_t* Semaphore, int Value)
+{
+    OsStatus_t Status = OsError;
+    pthread_mutex_lock(&Semaphore->Lock);
+    if (Semaphore->Value + Value <= Semaphore->MaxValue) {
+        Semaphore->Value += Value;
+        pthread_cond_signal(&Semaphore->Signal);
+        Status = OsSuccess;
+    }
+    pthread_mutex_unlock(&Semaphore->Lock);
+    return Status;
+}
+
+typedef struct BootTerminal {
+    uint32_t FgColor;
+} BootTerminal_t;
+
+typedef struct SystemCpuCore {
+    UUId_t                Id;
+    struct SystemCpuCore* Link;
+} SystemCpuCore_t;
+
+typedef struct SystemCpu {
+    SystemCpuCore_t* Cores;
+} SystemCpu_t;
+
+typedef struct SystemDomain {
+    SystemCpu_t CoreGroup;
+} SystemDomain_t;
+
+typedef struct SystemMachine {
+    int         SystemDomains;
+    SystemCpu_t Processor;
+} SystemMachine_t;
+
+typedef struct MCoreThread {
+    const char* Name;
+} MCoreThread_t;
+
+#define HandleTypeThread 0
+#define list_count(List) (*(List))
+#define foreach(i, List) for (struct { void* value; }* i = NULL; i != NULL; )
+
+static SystemMachine_t       Machine;
+static BootTerminal_t        Terminal;
+static _Atomic(uint64_t)     Clock;
+static _Thread_local UUId_t  CurrentCore;
+
+static SystemMachine_t* GetMachine(void) { return &Machine; }
+static BootTerminal_t* VideoGetTerminal(void) { return &Terminal; }
+static UUId_t ArchGetProcessorCoreId(void) { return CurrentCore; }
+static void ArchGetTimestamp(uint64_t* Timestamp) { *Timestamp = atomic_fetch_add(&Clock, 1) + 1; }
+static UUId_t GetCurrentThreadId(void) { return UUID_INVALID; }
+static void* LookupHandleOfType(UUId_t Handle, int Type) { (void)Handle; (void)Type; return NULL; }
+static void* kmalloc(size_t Size) { return malloc(Size); }
+static _Atomic(int) Sleeps;
+
+static void SchedulerSleep(size_t Milliseconds, clock_t* InterruptedAt)
+{
+    struct timespec Duration = { 0, (long)Milliseconds * 1000000L };
+    (void)InterruptedAt;
+    atomic_fetch_add(&Sleeps, 1);
+    nanosleep(&Duration, NULL);
+}
+
+static void ThreadingYield(void) { sched_yield(); }
+
+static OsStatus_t CreateThread(const char* Name, ThreadEntry_t Function, void* Arguments,
+    unsigned int Flags, UUId_t MemorySpaceHandle, UUId_t* Handle)
+{
+    (void)Name; (void)Function; (void)Arguments; (void)Flags; (void)MemorySpaceHandle;
+    *Handle = 1;
+    return OsSuccess;
+}
+
+// The rendered output is parsed line by line
+static void render_capture(const char* format, ...);
+
+#define printf render_capture
+#include "../../output/log.c"
+#undef printf
+
+#define MAXIMUM_CORES    8
+#define PRODUCERS        6
+#define BOOT_PRODUCERS   2
+#define MESSAGES         200000
+#define ORDER_MESSAGES   32
+#define WAKE_MESSAGES    2000
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("log: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+struct core_stats {
+    long   last;
+    size_t rendered;
+    size_t lost;
+};
+
+static SystemCpuCore_t   Cores[MAXIMUM_CORES];
+static struct core_stats Stats[LOG_MAXIMUM_CORES];
+static char              RenderLine[512];
+static size_t            RenderLength;
+static size_t            RenderedLines;
+
+static void parse_line(const char* line)
+{
+    unsigned int core;
+    unsigned int origin;
+    long         sequence;
+    size_t       lost;
+
+    RenderedLines++;
+    if (sscanf(line, "[debug-%u-boot] c%u s%ld", &core, &origin, &sequence) == 3) {
+        CHECK(core == origin && core < LOG_MAXIMUM_CORES);
+        CHECK(sequence > Stats[core].last);
+        Stats[core].last = sequence;
+        Stats[core].rendered++;
+    }
+    else if (sscanf(line, "[warn-%u-boot] %zu messages were lost", &core, &lost) == 2) {
+        CHECK(core < LOG_MAXIMUM_CORES);
+        Stats[core].lost += lost;
+    }
+}
+
+static void render_capture(const char* format, ...)
+{
+    va_list arguments;
+    char*   end;
+
+    va_start(arguments, format);
+    RenderLength += vsnprintf(&RenderLine[RenderLength], sizeof(RenderLine) - RenderLength,
+        format, arguments);
+    va_end(arguments);
+
+    end = strchr(&RenderLine[0], '\n');
+    if (end) {
+        *end = '\0';
+        parse_line(&RenderLine[0]);
+        RenderLength = 0;
+    }
+}
+
+static void reset_stats(void)
+{
+    int i;
+    for (i = 0; i < LOG_MAXIMUM_CORES; i++) {
+        Stats[i].last     = -1;
+        Stats[i].rendered = 0;
+        Stats[i].lost     = 0;
+    }
+    RenderedLines = 0;
+}
+
+// Appending on many cores, then merging, must give the order of the timestamps
+static _Atomic(int) OrderTurn;
+
+static void* order_producer(void* context)
+{
+    int core = (int)(intptr_t)context;
+    int i;
+
+    // Take turns so every core has lines that go between the lines of the others
+    CurrentCore = (UUId_t)core;
+    for (i = 0; i < ORDER_MESSAGES; i++) {
+        while (atomic_load(&OrderTurn) % PRODUCERS != core - 1) {
+            sched_yield();
+        }
+        LogAppendMessage(LOG_DEBUG, "c%u s%i", core, i);
+        atomic_fetch_add(&OrderTurn, 1);
+    }
+    return NULL;
+}
+
+static void verify_order(void)
+{
+    pthread_t threads[PRODUCERS];
+    uint64_t  last = 0;
+    int       index;
+    int       count = 0;
+    int       i;
+
+    reset_stats();
+    LogObject.AllowRender = 0;
+    for (i = 0; i < PRODUCERS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, order_producer, (void*)(intptr_t)(i + 1)) == 0);
+    }
+    for (i = 0; i < PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Nothing is rendered while rendering is off, the history keeps the lines
+    index = LogObject.RenderIndex;
+    LogFlushMessages();
+    CHECK(RenderedLines == 0);
+    while (index != LogObject.LineIndex) {
+        CHECK(LogObject.Lines[index].Timestamp > last);
+        last  = LogObject.Lines[index].Timestamp;
+        index = (index + 1) % LogObject.NumberOfLines;
+        count++;
+    }
+    CHECK(count == PRODUCERS * ORDER_MESSAGES);
+
+    LogSetRenderMode(1);
+    CHECK(RenderedLines == (size_t)count);
+    for (i = 1; i <= PRODUCERS; i++) {
+        CHECK(Stats[i].rendered == ORDER_MESSAGES && Stats[i].lost == 0);
+    }
+    printf("log: %i lines from %i cores merged in timestamp order\n", count, PRODUCERS);
+}
+
+// Concurrent producers against a consumer that drains like the log thread
+static _Atomic(int) ProducersLeft;
+
+static void* stress_producer(void* context)
+{
+    int  core = (int)(intptr_t)context;
+    long i;
+
+    CurrentCore = (UUId_t)core;
+    for (i = 0; i < MESSAGES; i++) {
+        LogAppendMessage(LOG_DEBUG, "c%u s%ld", core, i);
+        if (!(i % 1024)) {
+            sched_yield();
+        }
+    }
+    atomic_fetch_sub(&ProducersLeft, 1);
+    return NULL;
+}
+
+static void* stress_consumer(void* context)
+{
+    (void)context;
+    CurrentCore = 0;
+    while (atomic_load(&ProducersLeft)) {
+        LogFlushMessages();
+        sched_yield();
+    }
+    LogFlushMessages();
+    return NULL;
+}
+
+static void stress(void)
+{
+    pthread_t        producers[PRODUCERS + BOOT_PRODUCERS];
+    pthread_t        consumer;
+    SystemLogRing_t* ring;
+    size_t           lost = 0;
+    size_t           rendered = 0;
+    int              i;
+
+    reset_stats();
+    atomic_store(&ProducersLeft, PRODUCERS + BOOT_PRODUCERS);
+    CHECK(pthread_create(&consumer, NULL, stress_consumer, NULL) == 0);
+    for (i = 0; i < PRODUCERS; i++) {
+        CHECK(pthread_create(&producers[i], NULL, stress_producer, (void*)(intptr_t)(i + 1)) == 0);
+    }
+
+    // These cores have no ring of their own and share the boot ring
+    for (i = 0; i < BOOT_PRODUCERS; i++) {
+        CHECK(pthread_create(&producers[PRODUCERS + i], NULL, stress_producer,
+            (void*)(intptr_t)(100 + i)) == 0);
+    }
+    for (i = 0; i < PRODUCERS + BOOT_PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    pthread_join(consumer, NULL);
+
+    // Every message of a core with a ring is rendered or reported lost, and the losses
+    // match the counters of the rings
+    for (i = 1; i <= PRODUCERS; i++) {
+        ring = CoreRings[i];
+        CHECK(Stats[i].rendered + Stats[i].lost == MESSAGES);
+        CHECK(Stats[i].lost == atomic_load(&ring->Lost));
+        rendered += Stats[i].rendered;
+        lost     += Stats[i].lost;
+    }
+
+    // The losses of the boot ring are reported on the boot core, which only drains
+    CHECK(atomic_load(&CoreRings[0]->Lost) == 0);
+    CHECK(Stats[100].rendered + Stats[101].rendered + Stats[0].lost == 2 * MESSAGES);
+    CHECK(Stats[0].lost == atomic_load(&BootRing.Lost));
+    printf("log: %i cores and %i boot ring cores appended %i messages each\n",
+        PRODUCERS, BOOT_PRODUCERS, MESSAGES);
+    printf("log: %zu rendered in order, %zu reported lost, boot ring %zu rendered, %zu lost\n",
+        rendered, lost, Stats[100].rendered + Stats[101].rendered, Stats[0].lost);
+}
+
+// The log thread must render every message, even those appended right as it goes idle
+static void* log_thread(void* context)
+{
+    CurrentCore = 0;
+    LogThread(context);
+    return NULL;
+}
+
+static void* wake_producer(void* context)
+{
+    int          core = (int)(intptr_t)context;
+    unsigned int seed = (unsigned int)core;
+    int          i;
+
+    // Pause together now and then for long enough to let the log thread go idle, and
+    // resume at slightly different times, so appends race it going idle
+    CurrentCore = (UUId_t)core;
+    for (i = 0; i < WAKE_MESSAGES; i++) {
+        struct timespec gap = { 0, (i % 64) ? (long)(rand_r(&seed) % 50) * 1000L :
+            15000000L + (long)(rand_r(&seed) % 200) * 1000L };
+        LogAppendMessage(LOG_DEBUG, "c%u s%i", core, i);
+        nanosleep(&gap, NULL);
+    }
+    return NULL;
+}
+
+// Waits until the log thread has rendered the expected lines of the cores, the stats are
+// updated by the render, which holds the log lock
+static int wait_rendered(int first, int last, size_t expected, int milliseconds)
+{
+    struct timespec interval = { 0, 1000000L };
+    int             done = 0;
+    int             i;
+
+    while (!done && milliseconds--) {
+        nanosleep(&interval, NULL);
+        spinlock_acquire(&LogObject.SyncObject);
+        for (done = 1, i = first; i <= last; i++) {
+            done &= Stats[i].rendered + Stats[i].lost == expected;
+        }
+        spinlock_release(&LogObject.SyncObject);
+    }
+    return done;
+}
+
+static int wait_idle(void)
+{
+    struct timespec interval = { 0, 1000000L };
+    int             idle = 0;
+    int             i;
+
+    for (i = 0; i < 1000 && !idle; i++) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&LogObject.Signal.Lock);
+        idle = LogObject.Signal.Waiting && atomic_load(&LogObject.Idle);
+        pthread_mutex_unlock(&LogObject.Signal.Lock);
+    }
+    return idle;
+}
+
+static void verify_wakeup(void)
+{
+    struct timespec idle = { 0, 100000000L };
+    pthread_t       thread;
+    pthread_t       producers[PRODUCERS];
+    int             waits;
+    int             sleeps;
+    int             i;
+
+    reset_stats();
+    CHECK(pthread_create(&thread, NULL, log_thread, NULL) == 0);
+    pthread_detach(thread);
+    CHECK(wait_idle());
+
+    // An idle log thread is not woken while nothing is logged
+    pthread_mutex_lock(&LogObject.Signal.Lock);
+    waits = LogObject.Signal.Waits;
+    pthread_mutex_unlock(&LogObject.Signal.Lock);
+    sleeps = atomic_load(&Sleeps);
+    nanosleep(&idle, NULL);
+    pthread_mutex_lock(&LogObject.Signal.Lock);
+    CHECK(LogObject.Signal.Waits == waits && LogObject.Signal.Waiting);
+    pthread_mutex_unlock(&LogObject.Signal.Lock);
+    CHECK(atomic_load(&Sleeps) == sleeps);
+
+    for (i = 0; i < PRODUCERS; i++) {
+        CHECK(pthread_create(&producers[i], NULL, wake_producer, (void*)(intptr_t)(i + 1)) == 0);
+    }
+    for (i = 0; i < PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    CHECK(wait_rendered(1, PRODUCERS, WAKE_MESSAGES, 5000));
+    CHECK(wait_idle());
+    pthread_mutex_lock(&LogObject.Signal.Lock);
+    waits = LogObject.Signal.Waits - waits;
+    pthread_mutex_unlock(&LogObject.Signal.Lock);
+
+    // With interrupts disabled the thread is only woken by the tick
+    CurrentCore   = 1;
+    InterruptsOff = 1;
+    LogAppendMessage(LOG_DEBUG, "c%u s%i", 1, WAKE_MESSAGES);
+    InterruptsOff = 0;
+    nanosleep(&idle, NULL);
+    CHECK(atomic_load(&LogObject.WakePending) == 1);
+    CHECK(!wait_rendered(1, 1, WAKE_MESSAGES + 1, 1));
+    LogWakeDeferred();
+    CHECK(wait_rendered(1, 1, WAKE_MESSAGES + 1, 5000));
+    printf("log: log thread rendered %i messages from %i cores, woken %i times\n",
+        PRODUCERS * WAKE_MESSAGES, PRODUCERS, waits);
+}
+
+// A panic flush must render even though a halted core holds the log lock
+static void* panic_core(void* context)
+{
+    (void)context;
+    CurrentCore = 2;
+    LogAppendMessage(LOG_DEBUG, "c%u s%i", 2, 0);
+    LogFlush();
+    return NULL;
+}
+
+static void verify_panic(void)
+{
+    pthread_t thread;
+
+    reset_stats();
+    CurrentCore = 1;
+    spinlock_acquire(&LogObject.SyncObject);
+    CHECK(pthread_create(&thread, NULL, panic_core, NULL) == 0);
+    pthread_join(thread, NULL);
+    CHECK(Stats[2].rendered == 1);
+
+    // Every message is now rendered as it is appended
+    CurrentCore = 2;
+    LogAppendMessage(LOG_DEBUG, "c%u s%i", 2, 1);
+    CHECK(Stats[2].rendered == 2);
+    printf("log: panic flush rendered while the lock was held\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    (void)argc;
+    (void)argv;
+
+    LogInitialize();
+    for (i = 0; i < MAXIMUM_CORES; i++) {
+        Cores[i].Id   = (UUId_t)i;
+        Cores[i].Link = (i + 1 < MAXIMUM_CORES) ? &Cores[i + 1] : NULL;
+    }
+    Machine.Processor.Cores = &Cores[0];
+    LogInitializeFull();
+
+    // Defer like the log thread does once it runs
+    LogObject.Deferred = 1;
+    verify_order();
+    stress();
+    verify_wakeup();
+    verify_panic();
+    return 0;
+}
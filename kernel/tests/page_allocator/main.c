@@ -0,0 +1,525 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Physical Page Allocator Test & Benchmark (host)
+ *  - Feeds the allocator a synthetic memory map with holes and unaligned regions, checks
+ *    single, batched, contiguous and aligned allocations, and then runs threads that each
+ *    act as a core, allocating and freeing concurrently while ownership of every page is
+ *    tracked to catch pages handed out twice.
+ *  - Benchmarks the allocator against the previous design, a stack of free pages behind
+ *    one lock. Interrupts are no-ops and the core id is per thread.
+ *  Builds on the host against the kernel sources:
+ *
+ *  cc -O2 -pthread -I../../include -I../../arch/include -idirafter ../../../librt/libc/include \
+ *     -idirafter ../../../librt/libddk/include -o page_allocator_test main.c
+ *  ./page_allocator_test [maximum threads]
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// allocator needs
+#define __OS_DEFINITIONS__
+#define __VALI_IRQ_SPINLOCK_H__
+#define __VALI_ARCH_INTERRUPT_H__
+#define __SYSTEM_INTERFACE_UTILS_H__
+#define __DDK_IO_H__
+#define _DEBUG_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _In_
+#define _Out_
+#define KERNELAPI
+#define KERNELABI
+#define DIVUP(a, b)        ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define READ_VOLATILE(var) (*(volatile typeof(var)*)&(var))
+#define PRIuIN             "zu"
+#define TRACE(...)
+#define ERROR(...)
+
+typedef unsigned int UUId_t;
+typedef unsigned int IntStatus_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsOutOfMemory,
+    OsInvalidParameters
+} OsStatus_t;
+
+typedef struct IrqSpinlock {
+    pthread_mutex_t SyncObject;
+} IrqSpinlock_t;
+
+static __thread UUId_t CurrentCore;
+
+void IrqSpinlockConstruct(IrqSpinlock_t* Spinlock) { pthread_mutex_init(&Spinlock->SyncObject, NULL); }
+void IrqSpinlockAcquire(IrqSpinlock_t* Spinlock) { pthread_mutex_lock(&Spinlock->SyncObject); }
+void IrqSpinlockRelease(IrqSpinlock_t* Spinlock) { pthread_mutex_unlock(&Spinlock->SyncObject); }
+IntStatus_t InterruptDisable(void) { return 0; }
+IntStatus_t InterruptRestoreState(IntStatus_t State) { return State; }
+UUId_t ArchGetProcessorCoreId(void) { return CurrentCore; }
+
+#include "../../utils/page_allocator.c"
+
+#define PAGE_SIZE         0x1000
+#define MEMORY_SIZE       (512 * 1024 * 1024)
+#define PAGE_COUNT        (MEMORY_SIZE / PAGE_SIZE)
+#define MAXIMUM_THREADS   8
+#define STRESS_OPERATIONS 200000
+#define BENCH_OPERATIONS  2000000
+#define HELD_PAGES        512
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("pgtest: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+struct region {
+    uintptr_t Address;
+    size_t    Length;
+};
+
+// Low memory below the hole, and unaligned region boundaries like firmware maps have
+static const struct region MemoryMap[] = {
+    { 0x1000,     0x9E000 },
+    { 0x100000,   0x7F00000 },
+    { 0x8000800,  0x3FFF000 },
+    { 0xC100000,  0x13E00000 },
+    { 0x1FF00000, 0x200000 }    // Runs past the memory tracked
+};
+
+static PageAllocator_t Allocator;
+static size_t          UsablePages;
+static _Atomic(char)*  Owners;
+static _Atomic(int)    Errors;
+
+static void
+SetupAllocator(void)
+{
+    size_t i;
+
+    PageAllocatorConstruct(&Allocator, malloc(PageAllocatorCalculateSize(PAGE_COUNT)),
+        PAGE_SIZE, PAGE_COUNT);
+    for (i = 0; i < sizeof(MemoryMap) / sizeof(struct region); i++) {
+        PageAllocatorAddRange(&Allocator, MemoryMap[i].Address, MemoryMap[i].Length);
+    }
+}
+
+static int
+IsUsable(
+    _In_ uintptr_t Address)
+{
+    size_t i;
+    for (i = 0; i < sizeof(MemoryMap) / sizeof(struct region); i++) {
+        if (Address >= MemoryMap[i].Address &&
+            (Address + PAGE_SIZE) <= (MemoryMap[i].Address + MemoryMap[i].Length)) {
+            return Address < MEMORY_SIZE;
+        }
+    }
+    return 0;
+}
+
+static size_t
+CountUsablePages(void)
+{
+    size_t    Count = 0;
+    uintptr_t Address;
+
+    for (Address = 0; Address < MEMORY_SIZE; Address += PAGE_SIZE) {
+        Count += IsUsable(Address);
+    }
+    return Count;
+}
+
+static size_t
+GetFreePages(void)
+{
+    size_t PageCount, FreePages;
+    PageAllocatorGetStatistics(&Allocator, &PageCount, &FreePages);
+    return FreePages;
+}
+
+static void
+ClaimPage(
+    _In_ uintptr_t Address)
+{
+    char Expected = 0;
+    if (!IsUsable(Address) || !atomic_compare_exchange_strong(&Owners[Address / PAGE_SIZE], &Expected, 1)) {
+        printf("pgtest: page 0x%" PRIxPTR " is not usable or is already allocated\n", Address);
+        atomic_fetch_add(&Errors, 1);
+    }
+}
+
+static void
+ReleasePage(
+    _In_ uintptr_t Address)
+{
+    atomic_store(&Owners[Address / PAGE_SIZE], 0);
+}
+
+static void
+TestSinglePages(void)
+{
+    uintptr_t* Pages = malloc(UsablePages * sizeof(uintptr_t));
+    uintptr_t  Extra;
+    size_t     i;
+
+    CHECK(GetFreePages() == UsablePages);
+
+    // Exhaust memory one page at a time, and then in large batches
+    for (i = 0; i < UsablePages / 2; i++) {
+        CHECK(PageAllocatorAllocate(&Allocator, 1, &Pages[i]) == OsSuccess);
+        ClaimPage(Pages[i]);
+    }
+    CHECK(PageAllocatorAllocate(&Allocator, (int)(UsablePages - i), &Pages[i]) == OsSuccess);
+    for (; i < UsablePages; i++) {
+        ClaimPage(Pages[i]);
+    }
+    CHECK(GetFreePages() == 0);
+    CHECK(PageAllocatorAllocate(&Allocator, 1, &Extra) == OsOutOfMemory);
+    CHECK(PageAllocatorAllocateContiguous(&Allocator, 1, PAGE_SIZE, &Extra) == OsOutOfMemory);
+
+    for (i = 0; i < UsablePages; i++) {
+        ReleasePage(Pages[i]);
+    }
+    PageAllocatorFree(&Allocator, (int)UsablePages, Pages);
+    CHECK(GetFreePages() == UsablePages);
+    CHECK(atomic_load(&Errors) == 0);
+    free(Pages);
+}
+
+static void
+TestContiguous(void)
+{
+    uintptr_t Large[4];
+    uintptr_t Small[3];
+    uintptr_t Aligned;
+    size_t    i, j;
+
+    // 2MB pages, they must be aligned and not overlap anything else
+    for (i = 0; i < 4; i++) {
+        CHECK(PageAllocatorAllocateContiguous(&Allocator, 512, 0x200000, &Large[i]) == OsSuccess);
+        CHECK((Large[i] % 0x200000) == 0);
+        for (j = 0; j < 512; j++) {
+            ClaimPage(Large[i] + (j * PAGE_SIZE));
+        }
+    }
+
+    // Odd sizes only use the pages asked for, the rest of the block is returned
+    for (i = 0; i < 3; i++) {
+        CHECK(PageAllocatorAllocateContiguous(&Allocator, 3 + i * 2, PAGE_SIZE, &Small[i]) == OsSuccess);
+        for (j = 0; j < 3 + i * 2; j++) {
+            ClaimPage(Small[i] + (j * PAGE_SIZE));
+        }
+    }
+    CHECK(GetFreePages() == UsablePages - (4 * 512) - (3 + 5 + 7));
+
+    CHECK(PageAllocatorAllocateContiguous(&Allocator, 1, 0x10000, &Aligned) == OsSuccess);
+    CHECK((Aligned % 0x10000) == 0);
+    ClaimPage(Aligned);
+
+    // Larger than the largest order
+    CHECK(PageAllocatorAllocateContiguous(&Allocator, 2048, PAGE_SIZE, &Aligned) == OsInvalidParameters);
+    CHECK(PageAllocatorAllocateContiguous(&Allocator, 0, PAGE_SIZE, &Aligned) == OsInvalidParameters);
+    CHECK(atomic_load(&Errors) == 0);
+
+    // Runs can be freed in parts, and single pages of a run through the page interface
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 512; j++) {
+            ReleasePage(Large[i] + (j * PAGE_SIZE));
+        }
+        PageAllocatorFreeContiguous(&Allocator, Large[i], 256);
+        PageAllocatorFreeContiguous(&Allocator, Large[i] + (256 * PAGE_SIZE), 256);
+    }
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3 + i * 2; j++) {
+            ReleasePage(Small[i] + (j * PAGE_SIZE));
+            PageAllocatorFree(&Allocator, 1, &(uintptr_t){ Small[i] + (j * PAGE_SIZE) });
+        }
+    }
+    ReleasePage(Aligned);
+    PageAllocatorFreeContiguous(&Allocator, Aligned, 1);
+    CHECK(GetFreePages() == UsablePages);
+}
+
+// Every allocation is drawn from and returned to the memory map, so once the page
+// caches are drained the free blocks must have merged back into the initial layout
+static void
+TestCoalescing(
+    _In_ size_t* InitialBlocks)
+{
+    int i;
+
+    for (i = 0; i < PAGE_ALLOCATOR_MAX_CORES; i++) {
+        IrqSpinlockAcquire(&Allocator.SyncObject);
+        FreePages(&Allocator, Allocator.Caches[i].Count, &Allocator.Caches[i].Pages[0]);
+        Allocator.Caches[i].Count = 0;
+        IrqSpinlockRelease(&Allocator.SyncObject);
+    }
+    for (i = 0; i < PAGE_ALLOCATOR_ORDERS; i++) {
+        CHECK(Allocator.FreeBlocks[i] == InitialBlocks[i]);
+    }
+}
+
+struct stress_context {
+    UUId_t       CoreId;
+    unsigned int Seed;
+    size_t       Operations;
+};
+
+static void*
+StressMain(
+    _In_ void* Context)
+{
+    struct stress_context* Stress = Context;
+    uintptr_t              Held[HELD_PAGES];
+    int                    Count = 0;
+    size_t                 i;
+    int                    j;
+
+    CurrentCore = Stress->CoreId;
+    for (i = 0; i < Stress->Operations; i++) {
+        unsigned int Operation = rand_r(&Stress->Seed) % 8;
+        int          Batch     = 1 + (int)(rand_r(&Stress->Seed) % 48);
+
+        if (Operation < 3 && Count < HELD_PAGES) {
+            if (PageAllocatorAllocate(&Allocator, 1, &Held[Count]) == OsSuccess) {
+                ClaimPage(Held[Count++]);
+            }
+        }
+        else if (Operation < 5 && (Count + Batch) <= HELD_PAGES) {
+            if (PageAllocatorAllocate(&Allocator, Batch, &Held[Count]) == OsSuccess) {
+                for (j = 0; j < Batch; j++) {
+                    ClaimPage(Held[Count++]);
+                }
+            }
+        }
+        else if (Operation == 5) {
+            uintptr_t Run;
+            if (PageAllocatorAllocateContiguous(&Allocator, Batch, PAGE_SIZE, &Run) == OsSuccess) {
+                for (j = 0; j < Batch; j++) {
+                    ClaimPage(Run + (j * PAGE_SIZE));
+                }
+                for (j = 0; j < Batch; j++) {
+                    ReleasePage(Run + (j * PAGE_SIZE));
+                }
+                PageAllocatorFreeContiguous(&Allocator, Run, Batch);
+            }
+        }
+        else if (Count) {
+            Batch = Batch < Count ? Batch : Count;
+            for (j = Count - Batch; j < Count; j++) {
+                ReleasePage(Held[j]);
+            }
+            PageAllocatorFree(&Allocator, Batch, &Held[Count - Batch]);
+            Count -= Batch;
+        }
+    }
+
+    for (j = 0; j < Count; j++) {
+        ReleasePage(Held[j]);
+    }
+    PageAllocatorFree(&Allocator, Count, &Held[0]);
+    return NULL;
+}
+
+static void
+TestConcurrent(
+    _In_ int ThreadCount)
+{
+    pthread_t             Threads[MAXIMUM_THREADS + 1];
+    struct stress_context Contexts[MAXIMUM_THREADS + 1];
+    int                   i;
+
+    // The last thread has a core id without a page cache
+    for (i = 0; i <= ThreadCount; i++) {
+        Contexts[i].CoreId     = (i == ThreadCount) ? PAGE_ALLOCATOR_MAX_CORES + 1 : (UUId_t)i;
+        Contexts[i].Seed       = 0x1234 + i;
+        Contexts[i].Operations = STRESS_OPERATIONS;
+        pthread_create(&Threads[i], NULL, StressMain, &Contexts[i]);
+    }
+    for (i = 0; i <= ThreadCount; i++) {
+        pthread_join(Threads[i], NULL);
+    }
+    CHECK(atomic_load(&Errors) == 0);
+    CHECK(GetFreePages() == UsablePages);
+}
+
+// The previous design, a stack of every free page behind a single lock
+static pthread_mutex_t StackLock = PTHREAD_MUTEX_INITIALIZER;
+static uintptr_t*      Stack;
+static size_t          StackIndex;
+
+static void
+StackAllocate(
+    _In_ int        PageCount,
+    _In_ uintptr_t* Pages)
+{
+    int i;
+    pthread_mutex_lock(&StackLock);
+    for (i = 0; i < PageCount; i++) {
+        Pages[i] = Stack[--StackIndex];
+    }
+    pthread_mutex_unlock(&StackLock);
+}
+
+static void
+StackFree(
+    _In_ int        PageCount,
+    _In_ uintptr_t* Pages)
+{
+    int i;
+    pthread_mutex_lock(&StackLock);
+    for (i = 0; i < PageCount; i++) {
+        Stack[StackIndex++] = Pages[i];
+    }
+    pthread_mutex_unlock(&StackLock);
+}
+
+struct bench_context {
+    UUId_t CoreId;
+    int    Legacy;
+    int    Batch;
+    size_t Operations;
+};
+
+static void*
+BenchMain(
+    _In_ void* Context)
+{
+    struct bench_context* Bench = Context;
+    uintptr_t             Pages[64];
+    size_t                i;
+
+    CurrentCore = Bench->CoreId;
+    for (i = 0; i < Bench->Operations; i += Bench->Batch) {
+        if (Bench->Legacy) {
+            StackAllocate(Bench->Batch, &Pages[0]);
+            StackFree(Bench->Batch, &Pages[0]);
+        }
+        else {
+            PageAllocatorAllocate(&Allocator, Bench->Batch, &Pages[0]);
+            PageAllocatorFree(&Allocator, Bench->Batch, &Pages[0]);
+        }
+    }
+    return NULL;
+}
+
+static double
+RunBench(
+    _In_ int Legacy,
+    _In_ int ThreadCount,
+    _In_ int Batch)
+{
+    pthread_t            Threads[MAXIMUM_THREADS];
+    struct bench_context Contexts[MAXIMUM_THREADS];
+    struct timespec      Start, End;
+    double               Elapsed;
+    int                  i;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = 0; i < ThreadCount; i++) {
+        Contexts[i].CoreId     = (UUId_t)i;
+        Contexts[i].Legacy     = Legacy;
+        Contexts[i].Batch      = Batch;
+        Contexts[i].Operations = BENCH_OPERATIONS / ThreadCount;
+        pthread_create(&Threads[i], NULL, BenchMain, &Contexts[i]);
+    }
+    for (i = 0; i < ThreadCount; i++) {
+        pthread_join(Threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+
+    Elapsed = (double)(End.tv_sec - Start.tv_sec) + (double)(End.tv_nsec - Start.tv_nsec) / 1000000000.0;
+    return (Elapsed * 1000000000.0) / (double)BENCH_OPERATIONS;
+}
+
+static void
+RunContiguousBench(void)
+{
+    struct timespec Start, End;
+    uintptr_t       Run;
+    double          Elapsed;
+    int             i;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = 0; i < 100000; i++) {
+        PageAllocatorAllocateContiguous(&Allocator, 512, 0x200000, &Run);
+        PageAllocatorFreeContiguous(&Allocator, Run, 512);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+
+    Elapsed = (double)(End.tv_sec - Start.tv_sec) + (double)(End.tv_nsec - Start.tv_nsec) / 1000000000.0;
+    printf("pgtest: 2MB contiguous allocate/free %.1f ns\n", (Elapsed * 1000000000.0) / 100000.0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t    InitialBlocks[PAGE_ALLOCATOR_ORDERS];
+    int       Batches[3] = { 1, 16, 64 };
+    int       MaxThreads = 4;
+    uintptr_t Address;
+    int       Threads;
+    int       i;
+
+    if (argc > 1) {
+        MaxThreads = atoi(argv[1]);
+        MaxThreads = MaxThreads > MAXIMUM_THREADS ? MAXIMUM_THREADS : (MaxThreads < 1 ? 1 : MaxThreads);
+    }
+
+    Owners = calloc(PAGE_COUNT, 1);
+    SetupAllocator();
+    UsablePages = CountUsablePages();
+    memcpy(&InitialBlocks[0], &Allocator.FreeBlocks[0], sizeof(InitialBlocks));
+    printf("pgtest: %zu pages tracked, %zu usable, %zu bytes of bitmaps\n",
+        (size_t)PAGE_COUNT, UsablePages, PageAllocatorCalculateSize(PAGE_COUNT));
+
+    TestSinglePages();
+    TestContiguous();
+    TestCoalescing(&InitialBlocks[0]);
+    for (Threads = 1; Threads <= MaxThreads; Threads *= 2) {
+        TestConcurrent(Threads);
+        TestCoalescing(&InitialBlocks[0]);
+    }
+    printf("pgtest: all tests passed\n");
+
+    Stack = malloc(UsablePages * sizeof(uintptr_t));
+    for (Address = 0; Address < MEMORY_SIZE; Address += PAGE_SIZE) {
+        if (IsUsable(Address)) {
+            Stack[StackIndex++] = Address;
+        }
+    }
+
+    printf("pgtest: ns per page allocated and freed, legacy stack / page allocator\n");
+    printf("pgtest: threads, batch 1,             batch 16,           batch 64\n");
+    for (Threads = 1; Threads <= MaxThreads; Threads *= 2) {
+        printf("pgtest: %7i", Threads);
+        for (i = 0; i < 3; i++) {
+            printf(", %7.1f / %7.1f", RunBench(1, Threads, Batches[i]), RunBench(0, Threads, Batches[i]));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    RunContiguousBench();
+    return 0;
+}
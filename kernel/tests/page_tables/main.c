@@ -0,0 +1,604 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * X86-64 Page Table Test (host)
+ *  - Drives the x86-64 mmu layer through mapping, unmapping and protection changes, and
+ *    after every step walks the page-tables the way the hardware would, checking every
+ *    page against a reference model of what should be mapped. Covers 2mb pages being
+ *    used for aligned runs, and split up on partial unmaps and protection changes.
+ *  - Page-tables are allocated from the host heap and their physical address is their
+ *    host address, physical pages come from the page allocator and are never touched.
+ *  Builds on a x86-64 host against the kernel sources:
+ *
+ *  cc -O2 -Wno-address-of-packed-member -I../../include -I../../arch/include -I../../arch/x86 \
+ *     -I../../arch/x86/x64 -idirafter ../../../librt/libc/include \
+ *     -idirafter ../../../librt/libddk/include -o page_tables_test main.c
+ *  ./page_tables_test [iterations] [seed]
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// memory sources need
+#define __OS_DEFINITIONS__
+#define __CONTEXT_INTERFACE_H__
+#define __SPINLOCK_H__
+#define __VALI_IRQ_SPINLOCK_H__
+#define __VALI_ARCH_INTERRUPT_H__
+#define __SYSTEM_INTERFACE_UTILS_H__
+#define __DDK_IO_H__
+#define _DEBUG_H_
+#define __APIC_H__
+#define _x86_CPU_H_
+#define _GDT_H_
+#define __VALI_MACHINE__
+#define __MCORE_MULTIBOOT_H__
+#define __HANDLE_H__
+#define __VALI_HEAP_H__
+#define __MEMORY_SPACE_INTERFACE__
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _In_
+#define _Out_
+#define _InOut_
+#define KERNELAPI
+#define KERNELABI
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+#define DIVUP(a, b)         ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define READ_VOLATILE(var)  (*(volatile typeof(var)*)&(var))
+#define WRITE_VOLATILE(var, value) (*(volatile typeof(var)*)&(var)) = (value)
+#define PRIuIN              "zu"
+#define PRIiIN              "zi"
+#define PRIxIN              "zx"
+#define TRACE(...)
+#define ERROR(...)
+#define UUID_INVALID        0
+
+typedef unsigned int UUId_t;
+typedef unsigned int IntStatus_t;
+typedef uintptr_t    PhysicalAddress_t;
+typedef uintptr_t    VirtualAddress_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsExists,
+    OsDoesNotExist,
+    OsInvalidParameters,
+    OsOutOfMemory,
+    OsBusy,
+    OsIncomplete
+} OsStatus_t;
+
+typedef enum {
+    HandleTypeMemorySpace
+} HandleType_t;
+
+typedef struct IrqSpinlock {
+    int Unused;
+} IrqSpinlock_t;
+
+void IrqSpinlockConstruct(IrqSpinlock_t* Spinlock) { (void)Spinlock; }
+void IrqSpinlockAcquire(IrqSpinlock_t* Spinlock) { (void)Spinlock; }
+void IrqSpinlockRelease(IrqSpinlock_t* Spinlock) { (void)Spinlock; }
+IntStatus_t InterruptDisable(void) { return 0; }
+IntStatus_t InterruptRestoreState(IntStatus_t State) { return State; }
+UUId_t ArchGetProcessorCoreId(void) { return 0; }
+
+#include "../../utils/page_allocator.c"
+#include <arch.h>
+#include <memory.h>
+
+// Memory space definitions from memoryspace.h
+#define MEMORY_SPACE_APPLICATION 0x00000002
+#define MAPPING_USERSPACE        0x00000001
+#define MAPPING_NOCACHE          0x00000002
+#define MAPPING_READONLY         0x00000004
+#define MAPPING_EXECUTABLE       0x00000008
+#define MAPPING_ISDIRTY          0x00000010
+#define MAPPING_PERSISTENT       0x00000020
+#define MAPPING_COMMIT           0x00000080
+
+typedef struct SystemMemorySpace {
+    UUId_t       ParentHandle;
+    unsigned int Flags;
+    uintptr_t    Data[4];
+    void*        Context;
+} SystemMemorySpace_t;
+
+typedef struct SystemMachine {
+    PageAllocator_t PhysicalMemory;
+} SystemMachine_t;
+
+typedef struct Multiboot {
+    uint32_t MemoryLow;
+    uint32_t MemoryHigh;
+    uint32_t MemoryMapLength;
+    uint32_t MemoryMapAddress;
+} Multiboot_t;
+
+typedef struct SystemMemoryMapRegion {
+    uintptr_t Start;
+    size_t    Length;
+} SystemMemoryMapRegion_t;
+
+typedef struct SystemMemoryMap {
+    SystemMemoryMapRegion_t KernelRegion;
+    SystemMemoryMapRegion_t UserCode;
+    SystemMemoryMapRegion_t UserHeap;
+    SystemMemoryMapRegion_t ThreadRegion;
+} SystemMemoryMap_t;
+
+typedef struct StaticMemoryPool {
+    int Unused;
+} StaticMemoryPool_t;
+
+#define CPUID_FEAT_EDX_PGE (1 << 13)
+
+static SystemMachine_t     Machine;
+static SystemMemorySpace_t Space;
+static size_t              Invalidations;
+
+SystemMachine_t* GetMachine(void) { return &Machine; }
+SystemMemorySpace_t* GetCurrentMemorySpace(void) { return &Space; }
+SystemMemorySpace_t* GetDomainMemorySpace(void) { return &Space; }
+void* LookupHandleOfType(UUId_t Handle, HandleType_t Type) { (void)Handle; (void)Type; return NULL; }
+OsStatus_t CpuHasFeatures(unsigned int Ecx, unsigned int Edx) { (void)Ecx; (void)Edx; return OsError; }
+OsStatus_t TssEnableIo(UUId_t Cpu, uint16_t Port) { (void)Cpu; (void)Port; return OsSuccess; }
+OsStatus_t TssDisableIo(UUId_t Cpu, uint16_t Port) { (void)Cpu; (void)Port; return OsSuccess; }
+OsStatus_t CreateKernelVirtualMemorySpace(void) { return OsSuccess; }
+size_t StaticMemoryPoolCalculateSize(size_t Size, size_t BlockSize) { (void)Size; (void)BlockSize; return 0; }
+void StaticMemoryPoolConstruct(StaticMemoryPool_t* Pool, void* Storage, uintptr_t Address,
+    size_t Size, size_t BlockSize) { (void)Pool; (void)Storage; (void)Address; (void)Size; (void)BlockSize; }
+int IsPowerOfTwo(size_t Value) { return Value && !(Value & (Value - 1)); }
+size_t NextPowerOfTwo(size_t Value) { size_t Next = 1; while (Next < Value) Next <<= 1; return Next; }
+
+void memory_invalidate_addr(uintptr_t Address) { (void)Address; Invalidations++; }
+void memory_load_cr3(uintptr_t Address) { (void)Address; }
+void memory_reload_cr3(void) { }
+
+void* kmalloc_p(size_t Size, uintptr_t* DmaOut)
+{
+    void* Memory = aligned_alloc(PAGE_SIZE, Size);
+    *DmaOut = (uintptr_t)Memory;
+    return Memory;
+}
+
+void* kmalloc(size_t Size) { return malloc(Size); }
+void kfree(void* Object) { free(Object); }
+
+#undef __MODULE
+#include "../../arch/x86/x64/memory/vmem_api.c"
+#undef __MODULE
+#undef __TRACE
+#include "../../arch/x86/components/memory.c"
+
+#define PHYSICAL_SIZE    (256 * 1024 * 1024)
+#define PHYSICAL_PAGES   (PHYSICAL_SIZE / PAGE_SIZE)
+#define USABLE_PAGES     (PHYSICAL_PAGES - 1)
+#define WINDOW_BASE      MEMORY_LOCATION_RING3_HEAP
+#define WINDOW_PAGES     (32 * PAGES_PER_LARGE_PAGE)
+#define MAXIMUM_RUN      (4 * PAGES_PER_LARGE_PAGE + 100)
+#define USER_FLAGS       (MAPPING_COMMIT | MAPPING_USERSPACE)
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("pttest: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+struct model_page {
+    int          Mapped;
+    uintptr_t    Physical;
+    unsigned int Flags;
+};
+
+struct walk {
+    int       Present;
+    int       Large;
+    uintptr_t Physical;
+    uint64_t  Flags;     // Write and user are only set if every level allows it
+};
+
+static struct model_page Model[WINDOW_PAGES];
+static size_t            MappedPages;
+static size_t            LargePagesSeen;
+
+static uintptr_t
+PageAddress(
+    _In_ int Page)
+{
+    return WINDOW_BASE + ((uintptr_t)Page * PAGE_SIZE);
+}
+
+static size_t
+GetFreePages(void)
+{
+    size_t PageCount, FreePages;
+    PageAllocatorGetStatistics(&Machine.PhysicalMemory, &PageCount, &FreePages);
+    return FreePages;
+}
+
+// Translates an address the way the mmu does, only following the physical addresses
+// stored in the entries and never the shadow tables the kernel keeps next to them
+static void
+Walk(
+    _In_  uintptr_t    Address,
+    _Out_ struct walk* Result)
+{
+    uint64_t* Level = (uint64_t*)Space.Data[MEMORY_SPACE_CR3];
+    uint64_t  Entry;
+    int       Shift;
+
+    memset(Result, 0, sizeof(struct walk));
+    Result->Flags = PAGE_WRITE | PAGE_USER;
+    for (Shift = 39; Shift >= 12; Shift -= 9) {
+        Entry = Level[(Address >> Shift) & 0x1FF];
+        if (!(Entry & PAGE_PRESENT)) {
+            return;
+        }
+        Result->Flags &= Entry | ~((uint64_t)(PAGE_WRITE | PAGE_USER));
+
+        if (Shift == 21 && (Entry & PAGETABLE_LARGE)) {
+            Result->Present  = 1;
+            Result->Large    = 1;
+            Result->Physical = (Entry & LARGE_PAGE_MASK) + (Address & (LARGE_PAGE_SIZE - 1) & PAGE_MASK);
+            return;
+        }
+        if (Shift == 12) {
+            Result->Present  = 1;
+            Result->Physical = Entry & PAGE_MASK;
+            return;
+        }
+        Level = (uint64_t*)(uintptr_t)(Entry & PAGE_MASK);
+    }
+}
+
+static void
+Verify(void)
+{
+    struct walk  Result;
+    size_t       Mapped = 0;
+    size_t       Large  = 0;
+    uintptr_t    Physical;
+    unsigned int Attributes;
+    int          Count;
+    int          i;
+
+    for (i = 0; i < WINDOW_PAGES; i++) {
+        Walk(PageAddress(i), &Result);
+        if (!Model[i].Mapped) {
+            CHECK(!Result.Present);
+            continue;
+        }
+
+        CHECK(Result.Present);
+        CHECK(Result.Physical == Model[i].Physical);
+        CHECK(!(Result.Flags & PAGE_WRITE) == !!(Model[i].Flags & MAPPING_READONLY));
+        CHECK(!!(Result.Flags & PAGE_USER) == !!(Model[i].Flags & MAPPING_USERSPACE));
+        Mapped++;
+        Large += Result.Large;
+
+        // Sample the kernel's own lookups as well
+        if ((i % 61) == 0) {
+            CHECK(ArchMmuVirtualToPhysical(&Space, PageAddress(i) + 0x123, 1, &Physical, &Count) == OsSuccess);
+            CHECK(Count == 1 && Physical == Model[i].Physical + 0x123);
+            CHECK(ArchMmuGetPageAttributes(&Space, PageAddress(i), 1, &Attributes, &Count) == OsSuccess);
+            CHECK((Attributes & (USER_FLAGS | MAPPING_READONLY)) == Model[i].Flags);
+        }
+    }
+    CHECK(Mapped == MappedPages);
+    CHECK(GetFreePages() == USABLE_PAGES - MappedPages);
+    LargePagesSeen += Large / PAGES_PER_LARGE_PAGE;
+}
+
+static int
+CountLargePages(void)
+{
+    struct walk Result;
+    int         Count = 0;
+    int         i;
+
+    for (i = 0; i < WINDOW_PAGES; i += PAGES_PER_LARGE_PAGE) {
+        Walk(PageAddress(i), &Result);
+        Count += Result.Large;
+    }
+    return Count;
+}
+
+// Allocates physical pages the way MemorySpaceMap does, with aligned 2mb runs for
+// every 2mb virtual block the mapping covers
+static int
+AllocatePhysical(
+    _In_ int        Page,
+    _In_ int        PageCount,
+    _In_ uintptr_t* Pages)
+{
+    int Leading = (PAGES_PER_LARGE_PAGE - (Page % PAGES_PER_LARGE_PAGE)) % PAGES_PER_LARGE_PAGE;
+    int Index   = 0;
+    int i;
+
+    if (Leading + PAGES_PER_LARGE_PAGE <= PageCount) {
+        if (Leading && PageAllocatorAllocate(&Machine.PhysicalMemory, Leading, Pages) != OsSuccess) {
+            return 0;
+        }
+        Index = Leading;
+        while (Index + PAGES_PER_LARGE_PAGE <= PageCount &&
+               PageAllocatorAllocateContiguous(&Machine.PhysicalMemory, PAGES_PER_LARGE_PAGE,
+                   LARGE_PAGE_SIZE, &Pages[Index]) == OsSuccess) {
+            for (i = 1; i < PAGES_PER_LARGE_PAGE; i++) {
+                Pages[Index + i] = Pages[Index] + (i * PAGE_SIZE);
+            }
+            Index += PAGES_PER_LARGE_PAGE;
+        }
+    }
+    if (Index < PageCount && PageAllocatorAllocate(&Machine.PhysicalMemory,
+            PageCount - Index, &Pages[Index]) != OsSuccess) {
+        if (Index) {
+            PageAllocatorFree(&Machine.PhysicalMemory, Index, Pages);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+static void
+ModelMap(
+    _In_ int          Page,
+    _In_ int          PageCount,
+    _In_ uintptr_t*   Pages,
+    _In_ unsigned int Flags)
+{
+    int i;
+    for (i = 0; i < PageCount; i++) {
+        CHECK(!Model[Page + i].Mapped);
+        Model[Page + i].Mapped   = 1;
+        Model[Page + i].Physical = Pages[i];
+        Model[Page + i].Flags    = Flags;
+    }
+    MappedPages += PageCount;
+}
+
+static void
+Map(
+    _In_ int          Page,
+    _In_ int          PageCount,
+    _In_ unsigned int Flags)
+{
+    uintptr_t Pages[MAXIMUM_RUN];
+    int       Updated;
+
+    CHECK(AllocatePhysical(Page, PageCount, &Pages[0]));
+    CHECK(ArchMmuSetVirtualPages(&Space, PageAddress(Page), &Pages[0], PageCount, Flags, &Updated) == OsSuccess);
+    CHECK(Updated == PageCount);
+    ModelMap(Page, PageCount, &Pages[0], Flags);
+}
+
+static int
+MapContiguous(
+    _In_ int          Page,
+    _In_ int          PageCount,
+    _In_ unsigned int Flags)
+{
+    uintptr_t Pages[MAXIMUM_RUN];
+    uintptr_t Physical;
+    size_t    Alignment = (PageCount >= PAGES_PER_LARGE_PAGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    int       Updated;
+    int       i;
+
+    // Runs larger than the biggest buddy block are not available
+    if (PageAllocatorAllocateContiguous(&Machine.PhysicalMemory, PageCount, Alignment, &Physical) != OsSuccess) {
+        return 0;
+    }
+    CHECK(ArchMmuSetContiguousVirtualPages(&Space, PageAddress(Page), Physical, PageCount, Flags, &Updated) == OsSuccess);
+    CHECK(Updated == PageCount);
+
+    for (i = 0; i < PageCount; i++) {
+        Pages[i] = Physical + (i * PAGE_SIZE);
+    }
+    ModelMap(Page, PageCount, &Pages[0], Flags);
+    return 1;
+}
+
+static void
+Unmap(
+    _In_ int Page,
+    _In_ int PageCount)
+{
+    int Cleared;
+    int i;
+
+    CHECK(ArchMmuClearVirtualPages(&Space, PageAddress(Page), PageCount, &Cleared) == OsSuccess);
+    CHECK(Cleared == PageCount);
+    for (i = 0; i < PageCount; i++) {
+        CHECK(Model[Page + i].Mapped);
+        Model[Page + i].Mapped = 0;
+    }
+    MappedPages -= PageCount;
+}
+
+static void
+Protect(
+    _In_ int          Page,
+    _In_ int          PageCount,
+    _In_ unsigned int Flags)
+{
+    unsigned int Attributes = Flags;
+    int          Updated;
+    int          i;
+
+    CHECK(ArchMmuUpdatePageAttributes(&Space, PageAddress(Page), PageCount, &Attributes, &Updated) == OsSuccess);
+    CHECK(Updated == PageCount);
+    CHECK((Attributes & (USER_FLAGS | MAPPING_READONLY)) == Model[Page].Flags);
+    for (i = 0; i < PageCount; i++) {
+        CHECK(Model[Page + i].Mapped);
+        Model[Page + i].Flags = Flags;
+    }
+}
+
+static void
+TestLargePages(void)
+{
+    uintptr_t Physical[2];
+    int       Count;
+
+    // 8mb of aligned memory is mapped with four large pages
+    Map(0, 4 * PAGES_PER_LARGE_PAGE, USER_FLAGS);
+    Verify();
+    CHECK(CountLargePages() == 4);
+
+    // Translations keep the offset into the page and cross large pages
+    CHECK(ArchMmuVirtualToPhysical(&Space, PageAddress(PAGES_PER_LARGE_PAGE - 1) + 0x10, 2,
+        &Physical[0], &Count) == OsSuccess);
+    CHECK(Count == 2);
+    CHECK(Physical[0] == Model[PAGES_PER_LARGE_PAGE - 1].Physical + 0x10);
+    CHECK(Physical[1] == Model[PAGES_PER_LARGE_PAGE].Physical);
+
+    // Protecting part of a large page splits it, protecting all of one keeps it
+    Protect(100, 100, USER_FLAGS | MAPPING_READONLY);
+    Verify();
+    CHECK(CountLargePages() == 3);
+    Protect(2 * PAGES_PER_LARGE_PAGE, PAGES_PER_LARGE_PAGE, USER_FLAGS | MAPPING_READONLY);
+    Verify();
+    CHECK(CountLargePages() == 3);
+
+    // Unmapping part of a large page splits it and only frees that part, unmapping
+    // all of one frees the whole run
+    Unmap(PAGES_PER_LARGE_PAGE + 10, 10);
+    Verify();
+    CHECK(CountLargePages() == 2);
+    Unmap(3 * PAGES_PER_LARGE_PAGE, PAGES_PER_LARGE_PAGE);
+    Verify();
+    CHECK(CountLargePages() == 1);
+
+    // A range that starts inside one large page and ends inside another
+    Unmap(2 * PAGES_PER_LARGE_PAGE - 50, 100);
+    Verify();
+    CHECK(CountLargePages() == 0);
+
+    // Space that held a page-table is mapped with normal pages, free space with a large page
+    Unmap(0, PAGES_PER_LARGE_PAGE);
+    Map(0, PAGES_PER_LARGE_PAGE, USER_FLAGS);
+    CHECK(MapContiguous(3 * PAGES_PER_LARGE_PAGE, PAGES_PER_LARGE_PAGE, USER_FLAGS));
+    Verify();
+    CHECK(CountLargePages() == 1);
+
+    // Unaligned mappings only use large pages for the blocks they cover
+    Map(4 * PAGES_PER_LARGE_PAGE + 7, 2 * PAGES_PER_LARGE_PAGE, USER_FLAGS);
+    Verify();
+    CHECK(CountLargePages() == 2);
+}
+
+static int
+FindRun(
+    _In_  int  Mapped,
+    _In_  int  MaximumCount,
+    _Out_ int* Page)
+{
+    int Start = (rand() % 2) ? (rand() % WINDOW_PAGES) : ((rand() % 32) * PAGES_PER_LARGE_PAGE);
+    int Count = 0;
+
+    if (Model[Start].Mapped != Mapped) {
+        return 0;
+    }
+    while (Start + Count < WINDOW_PAGES && Count < MaximumCount && Model[Start + Count].Mapped == Mapped) {
+        Count++;
+    }
+    *Page = Start;
+    return Count;
+}
+
+static void
+TestRandom(
+    _In_ int Iterations)
+{
+    size_t Unmaps = 0, Protects = 0, Maps = 0;
+    int    Page, Count, Wanted;
+    int    i;
+
+    for (i = 0; i < Iterations; i++) {
+        int Operation = rand() % 3;
+        Wanted = (rand() % 2) ? (1 + rand() % 64) :
+            (((1 + rand() % 3) * PAGES_PER_LARGE_PAGE) + ((rand() % 2) ? rand() % 100 : 0));
+
+        if (Operation == 0) {
+            Count = FindRun(0, Wanted, &Page);
+            if (Count) {
+                unsigned int Flags = USER_FLAGS | ((rand() % 4) ? 0 : MAPPING_READONLY);
+                if ((rand() % 4) || !MapContiguous(Page, Count, Flags)) {
+                    Map(Page, Count, Flags);
+                }
+                Maps++;
+            }
+        }
+        else if (Operation == 1) {
+            Count = FindRun(1, Wanted, &Page);
+            if (Count) {
+                Unmap(Page, Count);
+                Unmaps++;
+            }
+        }
+        else {
+            Count = FindRun(1, Wanted, &Page);
+            if (Count) {
+                Protect(Page, Count, USER_FLAGS | ((rand() % 2) ? 0 : MAPPING_READONLY));
+                Protects++;
+            }
+        }
+        Verify();
+    }
+    printf("pttest: %i iterations, %zu maps, %zu unmaps, %zu protection changes, %zu large pages checked\n",
+        Iterations, Maps, Unmaps, Protects, LargePagesSeen);
+}
+
+int main(int argc, char **argv)
+{
+    uintptr_t Master;
+    int       Iterations = 4000;
+    unsigned  Seed       = 1;
+
+    if (argc > 1) {
+        Iterations = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        Seed = (unsigned)atoi(argv[2]);
+    }
+    srand(Seed);
+
+    PageAllocatorConstruct(&Machine.PhysicalMemory, malloc(PageAllocatorCalculateSize(PHYSICAL_PAGES)),
+        PAGE_SIZE, PHYSICAL_PAGES);
+    // Physical page 0 is never handed out, as a zero mapping means no page to the kernel
+    PageAllocatorAddRange(&Machine.PhysicalMemory, PAGE_SIZE, PHYSICAL_SIZE - PAGE_SIZE);
+
+    Space.ParentHandle                = UUID_INVALID;
+    Space.Data[MEMORY_SPACE_DIRECTORY] = (uintptr_t)kmalloc_p(sizeof(PageMasterTable_t), &Master);
+    Space.Data[MEMORY_SPACE_CR3]       = Master;
+    Space.Data[MEMORY_SPACE_IOMAP]     = (uintptr_t)kmalloc(GDT_IOMAP_SIZE);
+    memset((void*)Space.Data[MEMORY_SPACE_DIRECTORY], 0, sizeof(PageMasterTable_t));
+
+    TestLargePages();
+    TestRandom(Iterations);
+
+    // Tearing down the space returns every page, large or not
+    CHECK(DestroyVirtualSpace(&Space) == OsSuccess);
+    CHECK(GetFreePages() == USABLE_PAGES);
+    printf("pttest: ok\n");
+    return 0;
+}
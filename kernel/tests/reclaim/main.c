@@ -0,0 +1,506 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Memory Reclaim Stress Test (host)
+ *  - Runs the kernel heap on top of the physical page allocator with a small amount of
+ *    memory, and exhausts it while the reclaim thread is running. The free pages must
+ *    get back above the high watermark once the memory is freed again.
+ *  - Without the reclaim thread, memory freed in one cache must be usable by another
+ *    cache through direct reclaim from the failing allocation.
+ *  - The reclaim thread is a host thread that acts as a core of its own, and the heap
+ *    maps its slabs with pages from the page allocator into a reserved host range.
+ *  Builds on the host against the kernel sources:
+ *
+ *  cc -O2 -pthread -I../../include -I../../arch/include -I../../../librt/libds/include \
+ *     -idirafter ../../../librt/libc/include -idirafter ../../../librt/libddk/include \
+ *     -o reclaim_test main.c
+ *  ./reclaim_test
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// heap, page allocator and reclaim sources need
+#define __OS_DEFINITIONS__
+#define __VALI_IRQ_SPINLOCK_H__
+#define __VALI_ARCH_INTERRUPT_H__
+#define __SYSTEM_INTERFACE_UTILS_H__
+#define __DDK_IO_H__
+#define _DEBUG_H_
+#define __VALI_MUTEX_H__
+#define __VALI_MACHINE__
+#define __COMPONENT_DOMAIN__
+#define __MEMORY_SPACE_INTERFACE__
+#define __DS_DSDEFS_H__
+#define __LIBDS_KERNEL__
+#define __VALI_SCHEDULER_H__
+#define __SEMAPHORE_H__
+#define __THREADING_H__
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _In_
+#define _In_Opt_
+#define _Out_
+#define _InOut_
+#define KERNELAPI
+#define KERNELABI
+#define DSDECL(ReturnType, Function) ReturnType Function
+#define DIVUP(a, b)         ((a / b) + (((a % b) > 0) ? 1 : 0))
+#define LODWORD(l)          ((uint32_t)(uint64_t)(l))
+#define MIN(a, b)           ((a) < (b) ? (a) : (b))
+#define MAX(a, b)           ((a) > (b) ? (a) : (b))
+#define READ_VOLATILE(var)  (*(volatile typeof(var)*)&(var))
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+#define PRIuIN              "zu"
+#define PRIiIN              "zi"
+#define PRIxIN              "zx"
+#define TRACE(...)
+#define WARNING(...)
+#define WRITELINE(...)
+#define FATAL(Scope, ...)   (printf("fatal: " __VA_ARGS__), printf("\n"), abort())
+#define FATAL_SCOPE_KERNEL  1
+#define _CRT_UNUSED(x)      (void)(x)
+#define smp_wmb()           atomic_thread_fence(memory_order_release)
+#define UUID_INVALID        0
+
+// Running out of memory is expected here, so the errors of the heap are only counted
+static _Atomic(int) ErrorCount;
+#define ERROR(...)          atomic_fetch_add(&ErrorCount, 1)
+
+typedef unsigned int UUId_t;
+typedef unsigned int IntStatus_t;
+typedef uintptr_t    VirtualAddress_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsExists,
+    OsDoesNotExist,
+    OsInvalidParameters,
+    OsOutOfMemory,
+    OsBusy
+} OsStatus_t;
+
+// The locks are as small as the kernel locks, as the size of the cache structure decides
+// whether the slabs of the cache of caches fit on-site
+static _Thread_local char ThreadSelf;
+
+static void LockAcquire(_Atomic(uintptr_t)* Owner)
+{
+    uintptr_t Expected = 0;
+    while (!atomic_compare_exchange_weak_explicit(Owner, &Expected, (uintptr_t)&ThreadSelf,
+        memory_order_acquire, memory_order_relaxed)) {
+        Expected = 0;
+        sched_yield();
+    }
+}
+
+static void LockRelease(_Atomic(uintptr_t)* Owner)
+{
+    atomic_store_explicit(Owner, 0, memory_order_release);
+}
+
+typedef struct IrqSpinlock {
+    _Atomic(uintptr_t) Owner;
+} IrqSpinlock_t;
+
+void IrqSpinlockConstruct(IrqSpinlock_t* Spinlock) { atomic_store(&Spinlock->Owner, 0); }
+void IrqSpinlockAcquire(IrqSpinlock_t* Spinlock) { LockAcquire(&Spinlock->Owner); }
+void IrqSpinlockRelease(IrqSpinlock_t* Spinlock) { LockRelease(&Spinlock->Owner); }
+
+// Mutex definitions from mutex.h
+#define MUTEX_PLAIN          0
+#define MUTEX_RECURSIVE      0x1
+#define OS_MUTEX_INIT(Flags) { 0, Flags, 0 }
+
+typedef struct {
+    _Atomic(uintptr_t) Owner;
+    unsigned int       Configuration;
+    int                References;
+} Mutex_t;
+
+void MutexConstruct(Mutex_t* Mutex, unsigned int Configuration)
+{
+    atomic_store(&Mutex->Owner, 0);
+    Mutex->Configuration = Configuration;
+    Mutex->References    = 0;
+}
+
+void MutexLock(Mutex_t* Mutex)
+{
+    if ((Mutex->Configuration & MUTEX_RECURSIVE) &&
+        atomic_load_explicit(&Mutex->Owner, memory_order_relaxed) == (uintptr_t)&ThreadSelf) {
+        Mutex->References++;
+        return;
+    }
+    LockAcquire(&Mutex->Owner);
+    Mutex->References = 1;
+}
+
+OsStatus_t MutexTryLock(Mutex_t* Mutex)
+{
+    uintptr_t Expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&Mutex->Owner, &Expected, (uintptr_t)&ThreadSelf,
+        memory_order_acquire, memory_order_relaxed)) {
+        return OsBusy;
+    }
+    Mutex->References = 1;
+    return OsSuccess;
+}
+
+void MutexUnlock(Mutex_t* Mutex)
+{
+    if (!--Mutex->References) {
+        LockRelease(&Mutex->Owner);
+    }
+}
+
+// Semaphore, scheduler and threading definitions, the semaphore is only used to wake
+// the reclaim thread
+typedef struct Semaphore {
+    int             Value;
+    int             MaxValue;
+    pthread_mutex_t Lock;
+    pthread_cond_t  Signal;
+} Semaphore_t;
+
+#define SEMAPHORE_INIT(Value, MaxValue) { Value, MaxValue, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }
+
+OsStatus_t SemaphoreWait(Semaphore_t* Semaphore, size_t Timeout)
+{
+    assert(Timeout == 0);
+    pthread_mutex_lock(&Semaphore->Lock);
+    while (!Semaphore->Value) {
+        pthread_cond_wait(&Semaphore->Signal, &Semaphore->Lock);
+    }
+    Semaphore->Value--;
+    pthread_mutex_unlock(&Semaphore->Lock);
+    return OsSuccess;
+}
+
+void SemaphoreSignal(Semaphore_t* Semaphore, int Value)
+{
+    pthread_mutex_lock(&Semaphore->Lock);
+    Semaphore->Value = MIN(Semaphore->Value + Value, Semaphore->MaxValue);
+    pthread_cond_signal(&Semaphore->Signal);
+    pthread_mutex_unlock(&Semaphore->Lock);
+}
+
+int SchedulerSleep(size_t Milliseconds, clock_t* InterruptedAt)
+{
+    (void)InterruptedAt;
+    usleep((useconds_t)(Milliseconds * 1000));
+    return 0;
+}
+
+typedef void (*ThreadEntry_t)(void*);
+
+static _Thread_local UUId_t ThreadCoreId;
+
+struct thread_start {
+    ThreadEntry_t Function;
+    void*         Arguments;
+};
+
+static void* thread_start(void* Context)
+{
+    struct thread_start Start = *(struct thread_start*)Context;
+    free(Context);
+    ThreadCoreId = 1;
+    Start.Function(Start.Arguments);
+    return NULL;
+}
+
+// Threads created by the kernel run as the second core
+OsStatus_t CreateThread(const char* Name, ThreadEntry_t Function, void* Arguments,
+    unsigned int Flags, UUId_t MemorySpaceHandle, UUId_t* Handle)
+{
+    struct thread_start* Start = malloc(sizeof(struct thread_start));
+    pthread_t            Thread;
+    (void)Name; (void)Flags; (void)MemorySpaceHandle;
+
+    Start->Function  = Function;
+    Start->Arguments = Arguments;
+    if (pthread_create(&Thread, NULL, thread_start, Start)) {
+        free(Start);
+        return OsError;
+    }
+    pthread_detach(Thread);
+    *Handle = 1;
+    return OsSuccess;
+}
+
+// Every thread is a core of its own and never migrates, so interrupts don't need to
+// be disabled to keep the per-core state private
+IntStatus_t InterruptDisable(void) { return 0; }
+IntStatus_t InterruptRestoreState(IntStatus_t State) { return State; }
+int InterruptIsDisabled(void) { return 0; }
+UUId_t ArchGetProcessorCoreId(void) { return ThreadCoreId; }
+
+#include "../../utils/page_allocator.c"
+
+// Memory space definitions from memoryspace.h
+#define MAPPING_DOMAIN         0x00000040
+#define MAPPING_COMMIT         0x00000080
+#define MAPPING_VIRTUAL_GLOBAL 0x00000002
+
+typedef struct SystemMemorySpace {
+    int Unused;
+} SystemMemorySpace_t;
+
+typedef struct StaticMemoryPool {
+    uintptr_t StartAddress;
+    size_t    Length;
+} StaticMemoryPool_t;
+
+typedef struct SystemMachine {
+    PageAllocator_t    PhysicalMemory;
+    StaticMemoryPool_t GlobalAccessMemory;
+} SystemMachine_t;
+
+typedef struct SystemDomain {
+    UUId_t Id;
+} SystemDomain_t;
+
+#define PAGE_SIZE   4096
+#define PAGE_COUNT  4096
+#define POOL_SIZE   (64UL * 1024UL * 1024UL)
+#define POOL_PAGES  (POOL_SIZE / PAGE_SIZE)
+
+static SystemMachine_t     Machine;
+static SystemMemorySpace_t Space;
+
+SystemMachine_t* GetMachine(void) { return &Machine; }
+SystemMemorySpace_t* GetCurrentMemorySpace(void) { return &Space; }
+SystemDomain_t* GetCurrentDomain(void) { return NULL; }
+size_t GetMemorySpacePageSize(void) { return PAGE_SIZE; }
+
+// Virtual page runs come from the pool, where freed runs are kept on a list per length,
+// and every page is backed by a page from the page allocator. The physical pages are
+// remembered per virtual page, so they can be given back when the run is unmapped.
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static uintptr_t       PoolNext;
+static uintptr_t*      PoolFree[1025];
+static uintptr_t       PoolPhysical[POOL_PAGES];
+
+OsStatus_t MemorySpaceMap(SystemMemorySpace_t* MemorySpace, VirtualAddress_t* Address,
+    uintptr_t* PhysicalAddressValues, size_t Length, unsigned int MemoryFlags, unsigned int PlacementFlags)
+{
+    size_t PageCount = Length / PAGE_SIZE;
+    size_t First;
+    (void)MemorySpace; (void)MemoryFlags;
+    assert(PlacementFlags == MAPPING_VIRTUAL_GLOBAL);
+    assert(PageCount && PageCount <= 1024);
+
+    if (PageAllocatorAllocate(&Machine.PhysicalMemory, (int)PageCount, PhysicalAddressValues) != OsSuccess) {
+        return OsOutOfMemory;
+    }
+
+    pthread_mutex_lock(&PoolLock);
+    if (PoolFree[PageCount]) {
+        *Address = (uintptr_t)PoolFree[PageCount];
+        PoolFree[PageCount] = (uintptr_t*)*PoolFree[PageCount];
+    }
+    else {
+        assert(PoolNext + Length <= Machine.GlobalAccessMemory.StartAddress + POOL_SIZE);
+        *Address  = PoolNext;
+        PoolNext += Length;
+    }
+    First = (*Address - Machine.GlobalAccessMemory.StartAddress) / PAGE_SIZE;
+    memcpy(&PoolPhysical[First], PhysicalAddressValues, PageCount * sizeof(uintptr_t));
+    pthread_mutex_unlock(&PoolLock);
+    return OsSuccess;
+}
+
+OsStatus_t MemorySpaceUnmap(SystemMemorySpace_t* MemorySpace, VirtualAddress_t Address, size_t Size)
+{
+    size_t    PageCount = Size / PAGE_SIZE;
+    size_t    First     = (Address - Machine.GlobalAccessMemory.StartAddress) / PAGE_SIZE;
+    uintptr_t Pages[1024];
+    (void)MemorySpace;
+
+    pthread_mutex_lock(&PoolLock);
+    memcpy(&Pages[0], &PoolPhysical[First], PageCount * sizeof(uintptr_t));
+    *(uintptr_t**)Address = PoolFree[PageCount];
+    PoolFree[PageCount]   = (uintptr_t*)Address;
+    pthread_mutex_unlock(&PoolLock);
+    PageAllocatorFree(&Machine.PhysicalMemory, (int)PageCount, &Pages[0]);
+    return OsSuccess;
+}
+
+OsStatus_t GetMemorySpaceMapping(SystemMemorySpace_t* MemorySpace, VirtualAddress_t Address,
+    int PageCount, uintptr_t* DmaVectorOut)
+{
+    (void)MemorySpace; (void)PageCount;
+    *DmaVectorOut = Address;
+    return OsSuccess;
+}
+
+#include "../../../librt/libds/list.c"
+#undef __MODULE
+#include "../../memory/heap.c"
+#undef __MODULE
+#include "../../memory/memory_reclaim.c"
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("reclaimtest: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+static size_t get_free_pages(void)
+{
+    size_t pageCount, freePages;
+    PageAllocatorGetStatistics(&Machine.PhysicalMemory, &pageCount, &freePages);
+    return freePages;
+}
+
+static size_t allocate_all(size_t size, void** objects, size_t capacity)
+{
+    size_t count = 0;
+    while (count < capacity && (objects[count] = kmalloc(size)) != NULL) {
+        memset(objects[count], (int)count, size);
+        count++;
+    }
+    return count;
+}
+
+static void free_all(size_t size, void** objects, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++) {
+        CHECK(*(unsigned char*)objects[i] == (unsigned char)i);
+        CHECK(((unsigned char*)objects[i])[size - 1] == (unsigned char)i);
+        kfree(objects[i]);
+    }
+}
+
+// Objects are freed into the magazines, so the pages stay with the heap until the
+// reclaim thread is woken by an allocation below the low watermark
+static void test_background_reclaim(void** objects, size_t capacity)
+{
+    size_t lowWatermark, highWatermark, runs, reclaimed;
+    size_t count;
+    int    i;
+
+    count = allocate_all(256, objects, capacity);
+    CHECK(count > 0);
+    for (i = 0; i < 100; i++) {
+        MemoryReclaimGetStatistics(&lowWatermark, &highWatermark, &runs, &reclaimed);
+        if (runs) {
+            break;
+        }
+        usleep(10000);
+    }
+    CHECK(runs > 0);
+    printf("reclaimtest: %zu objects of 256 bytes before running out, reclaim ran %zu times\n", count, runs);
+
+    free_all(256, objects, count);
+    for (i = 0; i < 500 && get_free_pages() < highWatermark; i++) {
+        uintptr_t page;
+        if (PageAllocatorAllocate(&Machine.PhysicalMemory, 1, &page) == OsSuccess) {
+            PageAllocatorFree(&Machine.PhysicalMemory, 1, &page);
+        }
+        usleep(10000);
+    }
+    MemoryReclaimGetStatistics(&lowWatermark, &highWatermark, &runs, &reclaimed);
+    printf("reclaimtest: %zu pages free after %zu runs, %zu pages reclaimed, high watermark %zu\n",
+        get_free_pages(), runs, reclaimed, highWatermark);
+    CHECK(get_free_pages() >= highWatermark);
+    CHECK(reclaimed > 0);
+}
+
+// With the reclaim thread out of the way, memory held by the free slabs of one cache
+// must be reclaimed by the allocations of another cache when they run out
+static void test_direct_reclaim(void** objects, size_t capacity)
+{
+    static HeapCacheStatistics_t statistics[64];
+    HeapCacheStatistics_t*       entry = NULL;
+    size_t                       countA, countB;
+    int                          count, i;
+
+    PageAllocatorSetWatermark(&Machine.PhysicalMemory, 0, NULL);
+    usleep(200000);
+
+    countA = allocate_all(256, objects, capacity);
+    free_all(256, objects, countA);
+    countB = allocate_all(64, objects, capacity);
+    printf("reclaimtest: %zu objects of 256 bytes, then %zu objects of 64 bytes\n", countA, countB);
+    CHECK(countB * 64 >= (countA * 256 * 8) / 10);
+
+    count = MemoryCacheQuery(&statistics[0], 64);
+    for (i = 0; i < MIN(count, 64); i++) {
+        if (!strcmp(&statistics[i].Name[0], "size256_cache")) {
+            entry = &statistics[i];
+        }
+    }
+    CHECK(entry != NULL && entry->NumberOfSlabsReaped > 0);
+    free_all(64, objects, countB);
+}
+
+int main(void)
+{
+    size_t capacity = PAGE_COUNT * (PAGE_SIZE / 32);
+    void** objects  = malloc(capacity * sizeof(void*));
+    size_t lowWatermark, highWatermark, runs, reclaimed;
+    size_t freePages;
+    void*  region;
+    size_t size;
+
+    region = mmap(NULL, POOL_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    CHECK(region != MAP_FAILED && objects != NULL);
+    Machine.GlobalAccessMemory.StartAddress = (uintptr_t)region;
+    Machine.GlobalAccessMemory.Length       = POOL_SIZE;
+    PoolNext                                = (uintptr_t)region;
+
+    // The physical pages don't exist, only their numbers are handed out
+    PageAllocatorConstruct(&Machine.PhysicalMemory, malloc(PageAllocatorCalculateSize(PAGE_COUNT)),
+        PAGE_SIZE, PAGE_COUNT);
+    PageAllocatorAddRange(&Machine.PhysicalMemory, 0, PAGE_COUNT * PAGE_SIZE);
+    MemoryCacheInitialize();
+    MemoryReclaimInitialize();
+    MemoryReclaimGetStatistics(&lowWatermark, &highWatermark, &runs, &reclaimed);
+    CHECK(lowWatermark == 64 && highWatermark == 128);
+
+    // Create the fixed size caches up front, creating a cache while memory is exhausted
+    // is not something that can be recovered from
+    for (size = 32; size <= 2048; size *= 2) {
+        kfree(kmalloc(size));
+    }
+    CHECK(MemoryReclaimStart() == OsSuccess);
+
+    test_background_reclaim(objects, capacity);
+    test_direct_reclaim(objects, capacity);
+
+    freePages = get_free_pages();
+    MemoryCacheReap();
+    printf("reclaimtest: %zu pages free, %zu after reaping, of %i pages\n",
+        freePages, get_free_pages(), PAGE_COUNT);
+    CHECK(get_free_pages() >= (PAGE_COUNT * 9) / 10);
+    free(objects);
+    printf("reclaimtest: passed\n");
+    return 0;
+}
@@ -0,0 +1,459 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scheduler Trace Test (host)
+ *  - Records a known schedule through the kernel trace rings, drains it into a dump
+ *    and checks the histograms and Chrome trace the decoder makes of it.
+ *  - Checks that overwritten records are reported as lost, and that partial drains
+ *    return every record once and in order.
+ *  - Records from one thread per core while another core drains, and checks that
+ *    every record is either drained intact or reported as lost.
+ *  Builds on the host against the kernel sources and the decoder of the tool:
+ *
+ *  cc -O2 -pthread -I../../include -I../../arch/include \
+ *     -idirafter ../../../librt/libc/include -idirafter ../../../librt/libddk/include \
+ *     -o schedtrace_test main.c
+ *  ./schedtrace_test
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// trace sources need
+#define __OS_DEFINITIONS__
+#define __VALI_ARCH_INTERRUPT_H__
+#define __SYSTEM_INTERFACE_UTILS_H__
+#define __COMPONENT_DOMAIN__
+#define __COMPONENT_CPU__
+#define __DDK_BARRIERS_H__
+#define __VALI_HEAP_H__
+#define __VALI_MACHINE__
+#define __VALI_MUTEX_H__
+#define __VALI_TIMERS_H__
+#define _DEBUG_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _In_
+#define _Out_
+#define KERNELAPI
+#define KERNELABI
+#define MIN(a, b)        ((a) < (b) ? (a) : (b))
+#define smp_rmb()        atomic_thread_fence(memory_order_acquire)
+#define smp_wmb()        atomic_thread_fence(memory_order_release)
+#define UUID_INVALID     ((UUId_t)-1)
+#define ERROR(...)       (printf("error: " __VA_ARGS__), printf("\n"))
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+
+typedef unsigned int UUId_t;
+typedef int          IntStatus_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsOutOfMemory
+} OsStatus_t;
+
+#include <scheduler_trace.h>
+
+#define MAXIMUM_CORES 4
+#define TICKS_PER_US  3000 // A 3GHz timestamp counter
+#define TICKS_PER_MS  (TICKS_PER_US * 1000)
+
+typedef struct SystemScheduler {
+    SchedulerTraceRing_t* Trace;
+} SystemScheduler_t;
+
+typedef struct SystemCpuCore {
+    UUId_t                Id;
+    SystemScheduler_t     Scheduler;
+    struct SystemCpuCore* Link;
+} SystemCpuCore_t;
+
+typedef struct SystemCpu {
+    SystemCpuCore_t* Cores;
+} SystemCpu_t;
+
+typedef struct SystemDomain {
+    SystemCpu_t CoreGroup;
+} SystemDomain_t;
+
+typedef struct SystemMachine {
+    SystemCpu_t Processor;
+} SystemMachine_t;
+
+typedef struct {
+    pthread_mutex_t Lock;
+} Mutex_t;
+
+#define MUTEX_PLAIN          0
+#define OS_MUTEX_INIT(Flags) { PTHREAD_MUTEX_INITIALIZER }
+
+static SystemCpuCore_t   Cores[MAXIMUM_CORES];
+static SystemMachine_t   Machine;
+static _Thread_local int CurrentCore;
+
+// The timestamp counter only moves when the test says so, except in the stress test
+static _Atomic(uint64_t) Timestamp;
+static int               TimestampTicking;
+
+static void MutexLock(Mutex_t* Mutex) { pthread_mutex_lock(&Mutex->Lock); }
+static void MutexUnlock(Mutex_t* Mutex) { pthread_mutex_unlock(&Mutex->Lock); }
+static void* kmalloc(size_t Size) { return malloc(Size); }
+static void kfree(void* Object) { free(Object); }
+static IntStatus_t InterruptDisable(void) { return 0; }
+static IntStatus_t InterruptRestoreState(IntStatus_t State) { return State; }
+static SystemDomain_t* GetCurrentDomain(void) { return NULL; }
+static SystemMachine_t* GetMachine(void) { return &Machine; }
+static SystemCpuCore_t* GetCurrentProcessorCore(void) { return &Cores[CurrentCore]; }
+
+static void ArchGetTimestamp(uint64_t* Value)
+{
+    *Value = TimestampTicking ? atomic_fetch_add(&Timestamp, 1) : atomic_load(&Timestamp);
+}
+
+static OsStatus_t TimersGetSystemTick(clock_t* SystemTick)
+{
+    *SystemTick = (clock_t)(atomic_load(&Timestamp) / TICKS_PER_MS);
+    return OsSuccess;
+}
+
+#include "../../scheduling/scheduler_trace.c"
+#include "../../../tests/schedtrace/schedtrace.c"
+
+#define STRESS_RECORDS (2 * 1000 * 1000)
+#define DUMP_RECORDS   (16 * 1024)
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("schedtrace: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+static SchedulerTraceRecord_t Dump[DUMP_RECORDS];
+static size_t                 DumpCount;
+
+static void setup_cores(int count)
+{
+    int i;
+
+    memset(&Cores[0], 0, sizeof(Cores));
+    for (i = 0; i < count; i++) {
+        Cores[i].Id   = (UUId_t)i;
+        Cores[i].Link = (i + 1 < count) ? &Cores[i + 1] : NULL;
+    }
+    Machine.Processor.Cores = &Cores[0];
+}
+
+static void release_cores(void)
+{
+    int i;
+    for (i = 0; i < MAXIMUM_CORES; i++) {
+        if (Cores[i].Scheduler.Trace) {
+            kfree(Cores[i].Scheduler.Trace->Slots);
+            kfree(Cores[i].Scheduler.Trace);
+            Cores[i].Scheduler.Trace = NULL;
+        }
+    }
+    atomic_store(&TraceEnabled, 0);
+}
+
+static void at(int core, double us)
+{
+    CurrentCore = core;
+    atomic_store(&Timestamp, (uint64_t)(us * TICKS_PER_US));
+}
+
+static void drain_all(void)
+{
+    int count;
+    do {
+        count = SchedulerTraceDrain(&Dump[DumpCount], 64);
+        DumpCount += count;
+        CHECK(DumpCount < DUMP_RECORDS);
+    } while (count == 64);
+}
+
+static size_t count_events(int event)
+{
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < DumpCount; i++) {
+        count += Dump[i].Event == event;
+    }
+    return count;
+}
+
+static size_t count_occurrences(const char* text, const char* pattern)
+{
+    size_t count = 0;
+    while ((text = strstr(text, pattern)) != NULL) {
+        count++;
+        text++;
+    }
+    return count;
+}
+
+// Two threads on two cores. Thread 10 waits 5us in queue 0 on core 0 and then runs
+// 2us later, while thread 20 sleeps on core 1, times out and waits 40us in queue 3.
+static void test_schedule(void)
+{
+    struct schedtrace_stats* stats = calloc(1, sizeof(struct schedtrace_stats));
+    SchedulerTraceRecord_t*  records;
+    char*                    json;
+    size_t                   count, length;
+    FILE*                    file;
+    int                      round;
+
+    CHECK(stats != NULL);
+    setup_cores(2);
+    DumpCount = 0;
+
+    // Nothing is recorded while disabled
+    at(0, 0);
+    SchedulerTraceRecord(SCHEDULER_TRACE_ENQUEUE, 10, 0, 1, 0);
+    CHECK(SchedulerTraceDrain(&Dump[0], DUMP_RECORDS) == 0);
+
+    CHECK(SchedulerTraceControl(1) == OsSuccess);
+    for (round = 0; round < 100; round++) {
+        double base = 1000.0 + round * 200.0;
+
+        at(0, base);        SchedulerTraceRecord(SCHEDULER_TRACE_WAKE, 10, 0, 0, SCHEDULER_TRACE_WAKE_QUEUE);
+        at(0, base);        SchedulerTraceRecord(SCHEDULER_TRACE_ENQUEUE, 10, 0, 1, 0);
+        at(0, base + 5);    SchedulerTraceRecord(SCHEDULER_TRACE_DEQUEUE, 10, 0, 0, 0);
+        at(0, base + 7);    SchedulerTraceRecord(SCHEDULER_TRACE_SWITCH, 10, 0, 0, UUID_INVALID);
+        at(0, base + 50);   SchedulerTraceRecord(SCHEDULER_TRACE_SLEEP, 10, 0, 0, 0);
+        at(0, base + 50);   SchedulerTraceRecord(SCHEDULER_TRACE_SWITCH, UUID_INVALID,
+                                SCHEDULER_TRACE_QUEUE_NONE, 0, 10);
+
+        at(1, base + 1);    SchedulerTraceRecord(SCHEDULER_TRACE_SLEEP, 20, 3, 0, 100);
+        at(1, base + 101);  SchedulerTraceRecord(SCHEDULER_TRACE_WAKE, 20, 3, 0, SCHEDULER_TRACE_WAKE_TIMEOUT);
+        at(1, base + 101);  SchedulerTraceRecord(SCHEDULER_TRACE_ENQUEUE, 20, 3, 2, 0);
+        at(1, base + 141);  SchedulerTraceRecord(SCHEDULER_TRACE_DEQUEUE, 20, 3, 1, 0);
+        at(1, base + 141);  SchedulerTraceRecord(SCHEDULER_TRACE_SWITCH, 20, 3, 1, UUID_INVALID);
+    }
+
+    // The drain adds a clock record 20ms in, which gives the frequency
+    at(0, 20000);
+    drain_all();
+    CHECK(DumpCount == 2 + 100 * 11 && count_events(SCHEDULER_TRACE_CLOCK) == 2);
+
+    // Round trip through a dump file
+    file = tmpfile();
+    CHECK(file != NULL);
+    CHECK(schedtrace_write_header(file) == 0);
+    CHECK(schedtrace_write(file, &Dump[0], DumpCount) == 0);
+    rewind(file);
+    records = schedtrace_load(file, &count);
+    fclose(file);
+    CHECK(records != NULL && count == DumpCount);
+    for (size_t i = 1; i < count; i++) {
+        CHECK(records[i].Timestamp >= records[i - 1].Timestamp);
+    }
+    CHECK(schedtrace_frequency(records, count) > TICKS_PER_US - 1.0 &&
+          schedtrace_frequency(records, count) < TICKS_PER_US + 1.0);
+
+    CHECK(schedtrace_analyze(records, count, TICKS_PER_US, stats) == 0);
+    CHECK(stats->queue_wait[0].count == 100 && stats->queue_wait[0].buckets[3] == 100); // 4-8us
+    CHECK(stats->queue_wait[3].count == 100 && stats->queue_wait[3].buckets[6] == 100); // 32-64us
+    CHECK(stats->queue_wait[0].max_us > 4.99 && stats->queue_wait[0].max_us < 5.01);
+    CHECK(stats->wake_latency[SCHEDULER_TRACE_WAKE_QUEUE].count == 100);
+    CHECK(stats->wake_latency[SCHEDULER_TRACE_WAKE_QUEUE].buckets[3] == 100);   // 7us
+    CHECK(stats->wake_latency[SCHEDULER_TRACE_WAKE_TIMEOUT].count == 100);
+    CHECK(stats->wake_latency[SCHEDULER_TRACE_WAKE_TIMEOUT].buckets[6] == 100); // 40us
+    CHECK(stats->cores[0].enqueues == 100 && stats->cores[0].queued_max == 1);
+    CHECK(stats->cores[1].enqueues == 100 && stats->cores[1].queued_max == 2);
+    CHECK(stats->cores[0].switches == 200 && stats->cores[1].switches == 100);
+    schedtrace_print(stdout, stats);
+
+    // Each thread runs once per round, and the ones still running are closed at the end
+    file = tmpfile();
+    CHECK(file != NULL);
+    CHECK(schedtrace_chrome_json(file, records, count, TICKS_PER_US) == 0);
+    length = (size_t)ftell(file);
+    rewind(file);
+    json = calloc(1, length + 1);
+    CHECK(json != NULL && fread(json, 1, length, file) == length);
+    fclose(file);
+    CHECK(!strncmp(json, "{\"displayTimeUnit\"", 18) && !strcmp(json + length - 4, "\n]}\n"));
+    CHECK(count_occurrences(json, "{") == count_occurrences(json, "}"));
+    CHECK(count_occurrences(json, "\"name\":\"thread 10\",\"ph\":\"X\"") == 100);
+    CHECK(count_occurrences(json, "\"name\":\"thread 20\",\"ph\":\"X\"") == 100);
+    CHECK(count_occurrences(json, "\"name\":\"queued\",\"ph\":\"X\"") == 200);
+    CHECK(count_occurrences(json, "\"name\":\"asleep\",\"ph\":\"X\"") == 199);
+    CHECK(count_occurrences(json, "\"reason\":\"timeout\"") == 100);
+
+    // A dump of another version is rejected
+    file = tmpfile();
+    CHECK(file != NULL);
+    CHECK(fwrite("STRC\x02\x00\x18\x00", 1, 8, file) == 8);
+    rewind(file);
+    CHECK(schedtrace_load(file, &count) == NULL);
+    fclose(file);
+
+    free(json);
+    free(records);
+    free(stats);
+    release_cores();
+    printf("schedtrace: schedule decoded\n");
+}
+
+static void test_overflow(void)
+{
+    uint32_t next = 0;
+    size_t   lost = 0;
+    size_t   i;
+
+    setup_cores(1);
+    at(0, 0);
+    CHECK(SchedulerTraceControl(1) == OsSuccess);
+    for (i = 0; i < SCHEDULER_TRACE_RING_SIZE + 100; i++) {
+        SchedulerTraceRecord(SCHEDULER_TRACE_ENQUEUE, 1, 0, 0, (uint32_t)i);
+    }
+
+    // The clock record of enabling and the oldest records don't fit, the rest arrives
+    // in small drains without duplicates
+    DumpCount = 0;
+    drain_all();
+    CHECK(Dump[0].Event == SCHEDULER_TRACE_LOST);
+    lost = Dump[0].Data;
+    CHECK(lost == 101);
+    for (i = 1; i < DumpCount; i++) {
+        if (Dump[i].Event != SCHEDULER_TRACE_ENQUEUE) {
+            continue;
+        }
+        if (!next) {
+            next = Dump[i].Data;
+        }
+        CHECK(Dump[i].Data == next);
+        next++;
+    }
+    CHECK(next == SCHEDULER_TRACE_RING_SIZE + 100);
+    CHECK(count_events(SCHEDULER_TRACE_ENQUEUE) == SCHEDULER_TRACE_RING_SIZE);
+    CHECK(count_events(SCHEDULER_TRACE_LOST) == 1);
+
+    // Disabled tracing keeps the ring but records nothing
+    CHECK(SchedulerTraceControl(0) == OsSuccess);
+    SchedulerTraceRecord(SCHEDULER_TRACE_ENQUEUE, 1, 0, 0, 0);
+    CHECK(SchedulerTraceDrain(&Dump[0], DUMP_RECORDS) == 0);
+    release_cores();
+    printf("schedtrace: overflow reported %zu lost records\n", lost);
+}
+
+static _Atomic(int) WritersDone;
+
+static void* stress_writer(void* Context)
+{
+    uint32_t i;
+
+    CurrentCore = (int)(intptr_t)Context;
+    for (i = 0; i < STRESS_RECORDS; i++) {
+        SchedulerTraceRecord(SCHEDULER_TRACE_ENQUEUE, (UUId_t)CurrentCore, 1, 2, i);
+    }
+    atomic_fetch_add(&WritersDone, 1);
+    return NULL;
+}
+
+static void test_stress(void)
+{
+    SchedulerTraceRecord_t* records = malloc(4096 * sizeof(SchedulerTraceRecord_t));
+    pthread_t               writers[MAXIMUM_CORES];
+    uint64_t                received[MAXIMUM_CORES] = { 0 };
+    uint64_t                skipped[MAXIMUM_CORES] = { 0 };
+    uint64_t                lost[MAXIMUM_CORES] = { 0 };
+    int64_t                 last[MAXIMUM_CORES];
+    struct timespec         start, end;
+    double                  seconds;
+    int                     count, i, j, done;
+
+    CHECK(records != NULL);
+    setup_cores(MAXIMUM_CORES);
+    TimestampTicking = 1;
+    CHECK(SchedulerTraceControl(1) == OsSuccess);
+
+    for (i = 0; i < MAXIMUM_CORES; i++) {
+        last[i] = -1;
+    }
+
+    // Only the owning core records in a ring, so this thread drains from core 0 and
+    // the writers record on the other cores
+    CurrentCore = 0;
+    atomic_store(&WritersDone, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 1; i < MAXIMUM_CORES; i++) {
+        CHECK(pthread_create(&writers[i], NULL, stress_writer, (void*)(intptr_t)i) == 0);
+    }
+
+    // Drain while the writers run, and once more after they are done
+    do {
+        done  = atomic_load(&WritersDone) == MAXIMUM_CORES - 1;
+        count = SchedulerTraceDrain(records, 4096);
+        for (j = 0; j < count; j++) {
+            SchedulerTraceRecord_t* record = &records[j];
+            if (record->Event == SCHEDULER_TRACE_LOST) {
+                lost[record->Core] += record->Data;
+                continue;
+            }
+            if (record->Event != SCHEDULER_TRACE_ENQUEUE) {
+                continue;
+            }
+
+            // Records of a core arrive in order, and are never torn
+            CHECK(record->Thread == record->Core && record->Queue == 1 && record->QueueLength == 2);
+            CHECK((int64_t)record->Data > last[record->Core]);
+            skipped[record->Core] += record->Data - (uint32_t)(last[record->Core] + 1);
+            last[record->Core]  = record->Data;
+            received[record->Core]++;
+        }
+    } while (!done || count);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 1; i < MAXIMUM_CORES; i++) {
+        pthread_join(writers[i], NULL);
+        CHECK(received[i] > 0 && last[i] == STRESS_RECORDS - 1);
+    }
+
+    seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    for (i = 1; i < MAXIMUM_CORES; i++) {
+        printf("schedtrace: core %i wrote %i, drained %llu, skipped %llu, reported lost %llu\n",
+            i, STRESS_RECORDS, (unsigned long long)received[i], (unsigned long long)skipped[i],
+            (unsigned long long)lost[i]);
+
+        // Every record that was overwritten before it could be drained is reported
+        CHECK(received[i] + skipped[i] == STRESS_RECORDS && lost[i] == skipped[i]);
+    }
+    printf("schedtrace: %.1f million records per second per core while draining\n",
+        STRESS_RECORDS / seconds / 1e6);
+
+    TimestampTicking = 0;
+    release_cores();
+    free(records);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    test_schedule();
+    test_overflow();
+    test_stress();
+    return 0;
+}
@@ -0,0 +1,537 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scheduler Load Balancing Simulation (host)
+ *  - Runs the scheduler of every core in lock step, one millisecond per step, and
+ *    delivers the messages between cores at the next step of the receiving core.
+ *    Threads are synthetic workloads that run for bursts and then sleep or exit.
+ *  - Reports the makespan, the number of migrations and how often an object moved
+ *    back to the core it left within a second, with and without balancing.
+ *  - Verifies that every thread completes its work, that bound threads never leave
+ *    their core, and that the queued counts match the queues.
+ *  Builds on the host against the kernel sources:
+ *
+ *  cc -O2 -I../../include -I../../arch/include -I../../../librt/libds/include \
+ *     -idirafter ../../../librt/libc/include -idirafter ../../../librt/libddk/include \
+ *     -o scheduler_sim main.c
+ *  ./scheduler_sim
+ */
+
+// The kernel headers can't be used on the host, so provide the few definitions the
+// scheduler sources need
+#define __OS_DEFINITIONS__
+#define __SPINLOCK_H__
+#define __VALI_IRQ_SPINLOCK_H__
+#define __SYSTEM_INTERFACE_TIME_H__
+#define __ARCH_THREAD_H__
+#define __VALI_ARCH_INTERRUPT_H__
+#define __SYSTEM_INTERFACE_UTILS_H__
+#define __COMPONENT_DOMAIN__
+#define __COMPONENT_CPU__
+#define __DDK_IO_H__
+#define __DDK_BARRIERS_H__
+#define __VALI_HEAP_H__
+#define __VALI_MACHINE__
+#define __VALI_TIMERS_H__
+#define __THREADING_H__
+#define _DEBUG_H_
+#define __DS_DSDEFS_H__
+#define __LIBDS_KERNEL__
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _In_
+#define _In_Opt_
+#define _Out_
+#define _InOut_
+#define KERNELAPI
+#define KERNELABI
+#define DSDECL(ReturnType, Function) ReturnType Function
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+#define SIZEOF_ARRAY(Array)        (sizeof(Array) / sizeof((Array)[0]))
+#define READ_VOLATILE(var)         (*(volatile typeof(var)*)&(var))
+#define WRITE_VOLATILE(var, value) (*(volatile typeof(var)*)&(var) = (value))
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+#define smp_mb()                   atomic_thread_fence(memory_order_seq_cst)
+#define smp_rmb()                  atomic_thread_fence(memory_order_acquire)
+#define smp_wmb()                  atomic_thread_fence(memory_order_release)
+#define PRIuIN                     "zu"
+#define PRIxIN                     "zx"
+#define __MASK                     SIZE_MAX
+#define UUID_INVALID               ((UUId_t)-1)
+#define TRACE(...)
+#define WARNING(...)
+#define ERROR(...)                 (printf("error: " __VA_ARGS__), printf("\n"))
+#define FATAL(Scope, ...)          (printf("fatal: " __VA_ARGS__), printf("\n"), exit(1))
+
+typedef unsigned int UUId_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsExists,
+    OsDoesNotExist,
+    OsInvalidParameters,
+    OsOutOfMemory,
+    OsTimeout,
+    OsInterrupted
+} OsStatus_t;
+
+// Every core runs on the same host thread, so the locks only need to exist
+typedef struct IrqSpinlock {
+    int Owner;
+} IrqSpinlock_t;
+
+#define OS_IRQ_SPINLOCK_INIT { 0 }
+
+static void IrqSpinlockConstruct(IrqSpinlock_t* Spinlock) { Spinlock->Owner = 0; }
+static void IrqSpinlockAcquire(IrqSpinlock_t* Spinlock) { assert(!Spinlock->Owner); Spinlock->Owner = 1; }
+static void IrqSpinlockRelease(IrqSpinlock_t* Spinlock) { Spinlock->Owner = 0; }
+
+static void* kmalloc(size_t Size) { return malloc(Size); }
+static void kfree(void* Object) { free(Object); }
+
+#include <scheduler.h>
+#include "../../../librt/libds/list.c"
+#include "../../../librt/libds/timerwheel.c"
+
+#define THREADING_IDLE 0x00000008
+#define MAXIMUM_CORES  8
+
+typedef enum SystemCpuState {
+    CpuStateUnavailable = 0x0,
+    CpuStateRunning     = 0x2
+} SystemCpuState_t;
+
+typedef enum SystemCpuFunctionType {
+    CpuFunctionHalt,
+    CpuFunctionCustom
+} SystemCpuFunctionType_t;
+
+typedef void(*TxuFunction_t)(void*);
+
+typedef struct MCoreThread {
+    UUId_t             Handle;
+    const char*        Name;
+    unsigned int       Flags;
+    SchedulerObject_t* SchedulerObject;
+} MCoreThread_t;
+
+typedef struct SystemCpuCore {
+    UUId_t                Id;
+    SystemCpuState_t      State;
+    MCoreThread_t         IdleThread;
+    SystemScheduler_t     Scheduler;
+    MCoreThread_t*        CurrentThread;
+    struct SystemCpuCore* Link;
+} SystemCpuCore_t;
+
+typedef struct SystemCpu {
+    int              NumberOfCores;
+    SystemCpuCore_t* Cores;
+} SystemCpu_t;
+
+typedef struct SystemDomain {
+    SystemCpu_t CoreGroup;
+} SystemDomain_t;
+
+typedef struct SystemMachine {
+    SystemCpu_t Processor;
+} SystemMachine_t;
+
+struct message {
+    TxuFunction_t function;
+    void*         argument;
+};
+
+static SystemMachine_t Machine;
+static SystemCpuCore_t Cores[MAXIMUM_CORES];
+static UUId_t          CurrentCore;
+static clock_t         CurrentTime;
+static int             BalancingEnabled;
+static int             YieldPending[MAXIMUM_CORES];
+static struct message  Messages[MAXIMUM_CORES][4096];
+static int             MessageCount[MAXIMUM_CORES];
+
+static SystemMachine_t* GetMachine(void) { return &Machine; }
+static SystemDomain_t* GetCurrentDomain(void) { return NULL; }
+static SystemCpuCore_t* GetProcessorCore(UUId_t CoreId) { return &Cores[CoreId]; }
+static SystemCpuCore_t* GetCurrentProcessorCore(void) { return &Cores[CurrentCore]; }
+static UUId_t ArchGetProcessorCoreId(void) { return CurrentCore; }
+static void ArchStallProcessorCore(size_t Milliseconds) { (void)Milliseconds; }
+static void TimersGetSystemTick(clock_t* Tick) { *Tick = CurrentTime; }
+static void ThreadingYield(void) { YieldPending[CurrentCore] = 1; }
+
+static int ThreadingIsCurrentTaskIdle(UUId_t CoreId)
+{
+    return Cores[CoreId].CurrentThread == &Cores[CoreId].IdleThread;
+}
+
+static void StealOnCoreFunction(void* Context);
+
+static OsStatus_t TxuMessageSend(UUId_t CoreId, SystemCpuFunctionType_t Type,
+    TxuFunction_t Function, void* Argument, int Asynchronous)
+{
+    (void)Type; (void)Asynchronous;
+
+    // Without balancing the steal requests are never delivered
+    if (!BalancingEnabled && Function == StealOnCoreFunction) {
+        return OsError;
+    }
+    assert(MessageCount[CoreId] < 4096);
+    Messages[CoreId][MessageCount[CoreId]].function = Function;
+    Messages[CoreId][MessageCount[CoreId]].argument = Argument;
+    MessageCount[CoreId]++;
+    return OsSuccess;
+}
+
+// The scheduler trace has its own test
+void
+SchedulerTraceRecord(
+    _In_ int      Event,
+    _In_ UUId_t   Thread,
+    _In_ int      Queue,
+    _In_ int      QueueLength,
+    _In_ uint32_t Data)
+{
+    (void)Event; (void)Thread; (void)Queue; (void)QueueLength; (void)Data;
+}
+
+#include "../../scheduling/scheduler.c"
+
+#define MAXIMUM_THREADS 256
+#define SIMULATION_LIMIT (10 * 60 * 1000)
+
+struct sim_thread {
+    MCoreThread_t thread;
+    int           active;
+    int           bound;
+    size_t        work;        // Milliseconds of work left
+    size_t        burst;       // Milliseconds to run before sleeping, 0 runs until done
+    size_t        sleep;
+    size_t        burst_left;
+    clock_t       start_at;
+    UUId_t        core;        // Core the thread was last seen running on
+    UUId_t        left_core;   // Core it left in its last migration
+    clock_t       left_at;
+};
+
+struct sim_core {
+    size_t since_advance;
+    size_t deadline;
+    size_t busy;
+};
+
+struct sim_result {
+    clock_t makespan;
+    size_t  migrations;
+    size_t  returns;
+    size_t  busy[MAXIMUM_CORES];
+};
+
+static struct sim_thread Threads[MAXIMUM_THREADS];
+static struct sim_core   SimCores[MAXIMUM_CORES];
+static int               ThreadCount;
+static int               CoreCount;
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("schedsim: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+static inline uint32_t next_random(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void setup(int cores, int online)
+{
+    int i;
+
+    memset(&Cores[0], 0, sizeof(Cores));
+    memset(&SimCores[0], 0, sizeof(SimCores));
+    memset(&Threads[0], 0, sizeof(Threads));
+    memset(&MessageCount[0], 0, sizeof(MessageCount));
+    memset(&YieldPending[0], 0, sizeof(YieldPending));
+    CoreCount   = cores;
+    ThreadCount = 0;
+    CurrentTime = 1;
+
+    for (i = 0; i < cores; i++) {
+        Cores[i].Id                  = i;
+        Cores[i].State               = (i < online) ? CpuStateRunning : CpuStateUnavailable;
+        Cores[i].IdleThread.Name     = "idle";
+        Cores[i].IdleThread.Flags    = THREADING_IDLE;
+        Cores[i].CurrentThread       = &Cores[i].IdleThread;
+        Cores[i].Link                = (i + 1 < cores) ? &Cores[i + 1] : NULL;
+    }
+    Machine.Processor.NumberOfCores = cores;
+    Machine.Processor.Cores         = &Cores[0];
+}
+
+static void add_thread(size_t work, size_t burst, size_t sleep, clock_t startAt, int bound)
+{
+    struct sim_thread* thread = &Threads[ThreadCount++];
+
+    assert(ThreadCount <= MAXIMUM_THREADS);
+    thread->thread.Name = "worker";
+    thread->work        = work;
+    thread->burst       = burst;
+    thread->sleep       = sleep;
+    thread->burst_left  = burst;
+    thread->start_at    = startAt;
+    thread->bound       = bound;
+    thread->core        = UUID_INVALID;
+    thread->left_core   = UUID_INVALID;
+}
+
+// Creates the threads that start now, from core 0 like the services started by the
+// boot core
+static void start_threads(void)
+{
+    int i;
+
+    CurrentCore = 0;
+    for (i = 0; i < ThreadCount; i++) {
+        struct sim_thread* thread = &Threads[i];
+        if (!thread->active && thread->work && thread->start_at == CurrentTime) {
+            thread->thread.SchedulerObject = SchedulerCreateObject(&thread->thread, 0);
+            CHECK(thread->thread.SchedulerObject != NULL);
+            if (thread->bound) {
+                WRITE_VOLATILE(thread->thread.SchedulerObject->Flags, SCHEDULER_FLAG_BOUND);
+            }
+            thread->active = 1;
+            CHECK(SchedulerQueueObject(thread->thread.SchedulerObject) == OsSuccess);
+        }
+    }
+}
+
+static struct sim_thread* get_sim_thread(MCoreThread_t* thread)
+{
+    return (struct sim_thread*)((uint8_t*)thread - offsetof(struct sim_thread, thread));
+}
+
+// Does what the thread switch of the kernel does around the scheduler
+static void advance_core(int core, int preemptive, int exited)
+{
+    SystemCpuCore_t*   Core    = &Cores[core];
+    SchedulerObject_t* Current = NULL;
+    MCoreThread_t*     Next;
+
+    if (Core->CurrentThread != &Core->IdleThread && !exited) {
+        Current = Core->CurrentThread->SchedulerObject;
+    }
+
+    Next = SchedulerAdvance(Current, preemptive, SimCores[core].since_advance, &SimCores[core].deadline);
+    SimCores[core].since_advance = 0;
+    YieldPending[core]           = 0;
+    Core->CurrentThread          = Next ? Next : &Core->IdleThread;
+}
+
+static void verify_queues(void)
+{
+    int i, j;
+
+    for (i = 0; i < CoreCount; i++) {
+        SystemScheduler_t* Scheduler = &Cores[i].Scheduler;
+        int                Queued    = 0;
+        for (j = 0; j < SCHEDULER_LEVEL_COUNT; j++) {
+            SchedulerObject_t* Object = Scheduler->Queues[j].Head;
+            while (Object) {
+                CHECK(Object->CoreId == (UUId_t)i);
+                Queued++;
+                Object = Object->Link;
+            }
+        }
+        CHECK(Queued == atomic_load(&Scheduler->QueuedCount));
+    }
+}
+
+static void run_simulation(int balancing, int online, struct sim_result* result)
+{
+    int remaining;
+    int i, j;
+
+    memset(result, 0, sizeof(struct sim_result));
+    BalancingEnabled = balancing;
+
+    for (CurrentTime = 1; CurrentTime < SIMULATION_LIMIT; CurrentTime++) {
+        // The other cores boot shortly after the services were started
+        if (CurrentTime == 2) {
+            for (i = online; i < CoreCount; i++) {
+                Cores[i].State = CpuStateRunning;
+            }
+        }
+        start_threads();
+
+        for (i = 0; i < CoreCount; i++) {
+            SystemCpuCore_t*   Core = &Cores[i];
+            struct sim_thread* thread;
+            int                count;
+
+            CurrentCore = i;
+            count = MessageCount[i];
+            MessageCount[i] = 0;
+            for (j = 0; j < count; j++) {
+                Messages[i][j].function(Messages[i][j].argument);
+            }
+
+            // Track where threads run to count migrations and returns
+            if (Core->CurrentThread != &Core->IdleThread) {
+                thread = get_sim_thread(Core->CurrentThread);
+                if (thread->core != UUID_INVALID && thread->core != (UUId_t)i) {
+                    CHECK(!thread->bound);
+                    result->migrations++;
+                    if (thread->left_core == (UUId_t)i && (CurrentTime - thread->left_at) < 1000) {
+                        result->returns++;
+                    }
+                    thread->left_core = thread->core;
+                    thread->left_at   = CurrentTime;
+                }
+                thread->core = i;
+
+                // Run the thread for a millisecond
+                thread->work--;
+                SimCores[i].busy++;
+                SimCores[i].since_advance++;
+                if (!thread->work) {
+                    thread->active = 0;
+                    SchedulerDestroyObject(thread->thread.SchedulerObject);
+                    advance_core(i, 0, 1);
+                    continue;
+                }
+                if (thread->burst && !--thread->burst_left) {
+                    clock_t Unused;
+                    thread->burst_left = thread->burst;
+                    SchedulerSleep(thread->sleep, &Unused);
+                    advance_core(i, 0, 0);
+                    continue;
+                }
+            }
+            else {
+                SimCores[i].since_advance++;
+            }
+
+            if (YieldPending[i] || (SimCores[i].deadline && SimCores[i].since_advance >= SimCores[i].deadline) ||
+                (Core->CurrentThread == &Core->IdleThread && Core->State == CpuStateRunning &&
+                 SimCores[i].since_advance >= SCHEDULER_BALANCE_INTERVAL)) {
+                advance_core(i, Core->CurrentThread != &Core->IdleThread, 0);
+            }
+        }
+        verify_queues();
+
+        remaining = 0;
+        for (i = 0; i < ThreadCount; i++) {
+            remaining += (Threads[i].work != 0);
+        }
+        if (!remaining) {
+            break;
+        }
+    }
+
+    CHECK(CurrentTime < SIMULATION_LIMIT);
+    result->makespan = CurrentTime;
+    for (i = 0; i < CoreCount; i++) {
+        result->busy[i] = SimCores[i].busy;
+    }
+}
+
+// Services that are all started by the boot core before the other cores are online
+static void workload_boot(int bound)
+{
+    int i;
+    setup(4, 1);
+    for (i = 0; i < 16; i++) {
+        add_thread(2000, 0, 0, 1, bound && (i % 2) == 0);
+    }
+}
+
+// Service workers that run in short bursts and sleep in between, started over time
+static void workload_services(int bound)
+{
+    uint32_t state = 12345;
+    int      i;
+    setup(4, 4);
+    for (i = 0; i < 64; i++) {
+        add_thread(200 + next_random(&state) % 800, 1 + next_random(&state) % 20,
+            1 + next_random(&state) % 40, 1 + next_random(&state) % 2000, bound && (i % 4) == 0);
+    }
+}
+
+// A few long running threads next to a stream of short ones
+static void workload_mixed(int bound)
+{
+    uint32_t state = 777;
+    int      i;
+    setup(8, 8);
+    for (i = 0; i < 6; i++) {
+        add_thread(10000, 0, 0, 1, 0);
+    }
+    for (i = 0; i < 200; i++) {
+        add_thread(20 + next_random(&state) % 200, 0, 0, 1 + next_random(&state) % 8000, bound && (i % 8) == 0);
+    }
+}
+
+static void report(const char* name, void (*workload)(int), int bound)
+{
+    struct sim_result results[2];
+    int               balancing;
+    int               i;
+
+    for (balancing = 0; balancing < 2; balancing++) {
+        workload(bound);
+        run_simulation(balancing, (workload == workload_boot) ? 1 : CoreCount, &results[balancing]);
+    }
+
+    for (balancing = 0; balancing < 2; balancing++) {
+        struct sim_result* result = &results[balancing];
+        printf("schedsim: %-9s %-5s %-3s %8lu %10zu %8zu   ", name, bound ? "bound" : "free",
+            balancing ? "on" : "off", (unsigned long)result->makespan, result->migrations, result->returns);
+        for (i = 0; i < CoreCount; i++) {
+            printf(" %5zu", result->busy[i]);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    printf("schedsim: workload  kind  bal makespan migrations returns    busy ms per core\n");
+    report("boot", workload_boot, 0);
+    report("boot", workload_boot, 1);
+    report("services", workload_services, 0);
+    report("services", workload_services, 1);
+    report("mixed", workload_mixed, 0);
+    report("mixed", workload_mixed, 1);
+    printf("schedsim: all work completed, bound threads stayed on their core\n");
+    return 0;
+}
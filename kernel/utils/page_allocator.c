@@ -0,0 +1,515 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Physical Page Allocator
+ * - Buddy allocator for physical page frames, kept as one free bitmap per order. Single
+ *   pages are served from per-core page caches, which only take the allocator lock when
+ *   they need to be refilled or drained.
+ */
+#define __MODULE "page_allocator"
+
+#include <arch/interrupts.h>
+#include <arch/utils.h>
+#include <assert.h>
+#include <ddk/io.h>
+#include <debug.h>
+#include <utils/page_allocator.h>
+#include <string.h>
+
+#define BITS_PER_WORD         64
+#define BLOCK_PAGES(Order)    ((size_t)1 << (Order))
+
+static inline size_t
+BitmapWords(
+    _In_ size_t PageCount,
+    _In_ int    Order)
+{
+    size_t Blocks = PageCount >> Order;
+    return Blocks ? DIVUP(Blocks, BITS_PER_WORD) : 1;
+}
+
+static inline void
+BitmapSet(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              Order,
+    _In_ size_t           Index)
+{
+    size_t Word = Index / BITS_PER_WORD;
+    Allocator->Bitmaps[Order][Word]                   |= 1ULL << (Index % BITS_PER_WORD);
+    Allocator->Summaries[Order][Word / BITS_PER_WORD] |= 1ULL << (Word % BITS_PER_WORD);
+}
+
+static inline void
+BitmapClear(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              Order,
+    _In_ size_t           Index)
+{
+    size_t Word = Index / BITS_PER_WORD;
+    Allocator->Bitmaps[Order][Word] &= ~(1ULL << (Index % BITS_PER_WORD));
+    if (!Allocator->Bitmaps[Order][Word]) {
+        Allocator->Summaries[Order][Word / BITS_PER_WORD] &= ~(1ULL << (Word % BITS_PER_WORD));
+    }
+}
+
+static inline int
+BitmapTest(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              Order,
+    _In_ size_t           Index)
+{
+    return (Allocator->Bitmaps[Order][Index / BITS_PER_WORD] >> (Index % BITS_PER_WORD)) & 1;
+}
+
+// Returns the lowest free block of the order, the summary words are scanned so only
+// one bitmap word is touched
+static size_t
+BitmapFindFree(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              Order)
+{
+    uint64_t* Summary = Allocator->Summaries[Order];
+    size_t    Word;
+    size_t    i;
+
+    for (i = 0; i < Allocator->SummaryWords[Order]; i++) {
+        if (Summary[i]) {
+            Word = (i * BITS_PER_WORD) + __builtin_ctzll(Summary[i]);
+            return (Word * BITS_PER_WORD) + __builtin_ctzll(Allocator->Bitmaps[Order][Word]);
+        }
+    }
+    assert(0);
+    return 0;
+}
+
+// Allocates a block of the given order by splitting the smallest larger block available,
+// the allocator lock must be held.
+static OsStatus_t
+BuddyAllocate(
+    _In_  PageAllocator_t* Allocator,
+    _In_  int              Order,
+    _Out_ size_t*          Page)
+{
+    int    Current = Order;
+    size_t Index;
+
+    while (Current < PAGE_ALLOCATOR_ORDERS && !Allocator->FreeBlocks[Current]) {
+        Current++;
+    }
+    if (Current == PAGE_ALLOCATOR_ORDERS) {
+        return OsOutOfMemory;
+    }
+
+    Index = BitmapFindFree(Allocator, Current);
+    BitmapClear(Allocator, Current, Index);
+    Allocator->FreeBlocks[Current]--;
+
+    // Keep the lower half of every split, and free the upper half
+    while (Current > Order) {
+        Current--;
+        Index <<= 1;
+        BitmapSet(Allocator, Current, Index + 1);
+        Allocator->FreeBlocks[Current]++;
+    }
+
+    Allocator->FreePages -= BLOCK_PAGES(Order);
+    *Page = Index << Order;
+    return OsSuccess;
+}
+
+// Frees a block, merging it with its buddy for as long as the buddy is free as well,
+// the allocator lock must be held.
+static void
+BuddyFree(
+    _In_ PageAllocator_t* Allocator,
+    _In_ size_t           Page,
+    _In_ int              Order)
+{
+    size_t Index = Page >> Order;
+    size_t Buddy;
+
+    assert(!BitmapTest(Allocator, Order, Index));
+    Allocator->FreePages += BLOCK_PAGES(Order);
+    while (Order < (PAGE_ALLOCATOR_ORDERS - 1)) {
+        Buddy = Index ^ 1;
+        if (Buddy >= (Allocator->PageCount >> Order) || !BitmapTest(Allocator, Order, Buddy)) {
+            break;
+        }
+
+        BitmapClear(Allocator, Order, Buddy);
+        Allocator->FreeBlocks[Order]--;
+        Index >>= 1;
+        Order++;
+    }
+    BitmapSet(Allocator, Order, Index);
+    Allocator->FreeBlocks[Order]++;
+}
+
+// Frees a range of pages as the largest naturally aligned blocks it consists of
+static void
+FreeRange(
+    _In_ PageAllocator_t* Allocator,
+    _In_ size_t           Page,
+    _In_ size_t           PageCount)
+{
+    int Order;
+
+    while (PageCount) {
+        Order = 0;
+        while ((Order + 1) < PAGE_ALLOCATOR_ORDERS && !(Page & (BLOCK_PAGES(Order + 1) - 1)) &&
+               BLOCK_PAGES(Order + 1) <= PageCount) {
+            Order++;
+        }
+
+        BuddyFree(Allocator, Page, Order);
+        Page      += BLOCK_PAGES(Order);
+        PageCount -= BLOCK_PAGES(Order);
+    }
+}
+
+// Allocates individual pages, out of blocks as large as the request allows so the
+// bitmaps are searched once per block instead of once per page. Returns the number of
+// pages that could be allocated, the allocator lock must be held.
+static int
+AllocatePages(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              PageCount,
+    _In_ uintptr_t*       Pages)
+{
+    int    Order     = PAGE_ALLOCATOR_ORDERS - 1;
+    int    Allocated = 0;
+    size_t Page;
+    size_t i;
+
+    while (Allocated < PageCount) {
+        while (Order && BLOCK_PAGES(Order) > (size_t)(PageCount - Allocated)) {
+            Order--;
+        }
+
+        if (BuddyAllocate(Allocator, Order, &Page) != OsSuccess) {
+            if (!Order) {
+                break;
+            }
+            Order--;
+            continue;
+        }
+
+        for (i = 0; i < BLOCK_PAGES(Order); i++) {
+            Pages[Allocated++] = (Page + i) * Allocator->PageSize;
+        }
+    }
+    return Allocated;
+}
+
+static void
+FreePages(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              PageCount,
+    _In_ uintptr_t*       Pages)
+{
+    int i;
+    for (i = 0; i < PageCount; i++) {
+        assert((Pages[i] / Allocator->PageSize) < Allocator->PageCount);
+        BuddyFree(Allocator, Pages[i] / Allocator->PageSize, 0);
+    }
+}
+
+static inline void
+CheckWatermark(
+    _In_ PageAllocator_t* Allocator)
+{
+    PageAllocatorWatermarkFn Handler = READ_VOLATILE(Allocator->WatermarkHandler);
+    if (Handler && READ_VOLATILE(Allocator->FreePages) < READ_VOLATILE(Allocator->Watermark)) {
+        Handler(Allocator);
+    }
+}
+
+size_t
+PageAllocatorCalculateSize(
+    _In_ size_t PageCount)
+{
+    size_t Words = 0;
+    size_t BitmapWordCount;
+    int    Order;
+
+    for (Order = 0; Order < PAGE_ALLOCATOR_ORDERS; Order++) {
+        BitmapWordCount = BitmapWords(PageCount, Order);
+        Words          += BitmapWordCount + DIVUP(BitmapWordCount, BITS_PER_WORD);
+    }
+    return Words * sizeof(uint64_t);
+}
+
+void
+PageAllocatorConstruct(
+    _In_ PageAllocator_t* Allocator,
+    _In_ void*            Storage,
+    _In_ size_t           PageSize,
+    _In_ size_t           PageCount)
+{
+    uint64_t* Words = (uint64_t*)Storage;
+    size_t    BitmapWordCount;
+    int       Order;
+
+    assert(Allocator != NULL);
+    assert(Storage != NULL);
+    TRACE("[page_allocator] construct %" PRIuIN " pages", PageCount);
+
+    memset(Allocator, 0, sizeof(PageAllocator_t));
+    memset(Storage, 0, PageAllocatorCalculateSize(PageCount));
+    Allocator->PageSize  = PageSize;
+    Allocator->PageCount = PageCount;
+    IrqSpinlockConstruct(&Allocator->SyncObject);
+
+    for (Order = 0; Order < PAGE_ALLOCATOR_ORDERS; Order++) {
+        BitmapWordCount                  = BitmapWords(PageCount, Order);
+        Allocator->Bitmaps[Order]        = Words;
+        Words                           += BitmapWordCount;
+        Allocator->SummaryWords[Order]   = DIVUP(BitmapWordCount, BITS_PER_WORD);
+        Allocator->Summaries[Order]      = Words;
+        Words                           += Allocator->SummaryWords[Order];
+    }
+}
+
+void
+PageAllocatorAddRange(
+    _In_ PageAllocator_t* Allocator,
+    _In_ uintptr_t        Address,
+    _In_ size_t           Length)
+{
+    size_t Start = DIVUP(Address, Allocator->PageSize);
+    size_t End   = (Address + Length) / Allocator->PageSize;
+
+    if (End > Allocator->PageCount) {
+        End = Allocator->PageCount;
+    }
+    if (Start >= End) {
+        return;
+    }
+
+    IrqSpinlockAcquire(&Allocator->SyncObject);
+    FreeRange(Allocator, Start, End - Start);
+    IrqSpinlockRelease(&Allocator->SyncObject);
+}
+
+OsStatus_t
+PageAllocatorAllocate(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              PageCount,
+    _In_ uintptr_t*       Pages)
+{
+    PageCache_t* Cache;
+    IntStatus_t  State;
+    UUId_t       CoreId;
+    int          Allocated = 0;
+    int          Locked    = 0;
+
+    assert(Allocator != NULL);
+    assert(Pages != NULL);
+
+    // With interrupts disabled nothing else can run on this core, which makes the
+    // page cache of the core ours
+    State  = InterruptDisable();
+    CoreId = ArchGetProcessorCoreId();
+    if (CoreId < PAGE_ALLOCATOR_MAX_CORES) {
+        Cache = &Allocator->Caches[CoreId];
+        if (!Cache->Count && PageCount < PAGE_ALLOCATOR_CACHE_BATCH) {
+            IrqSpinlockAcquire(&Allocator->SyncObject);
+            Cache->Count = AllocatePages(Allocator, PAGE_ALLOCATOR_CACHE_BATCH, &Cache->Pages[0]);
+            IrqSpinlockRelease(&Allocator->SyncObject);
+            Locked = 1;
+        }
+
+        while (Allocated < PageCount && Cache->Count) {
+            Pages[Allocated++] = Cache->Pages[--Cache->Count];
+        }
+    }
+
+    if (Allocated < PageCount) {
+        IrqSpinlockAcquire(&Allocator->SyncObject);
+        Allocated += AllocatePages(Allocator, PageCount - Allocated, &Pages[Allocated]);
+        IrqSpinlockRelease(&Allocator->SyncObject);
+        Locked = 1;
+    }
+    InterruptRestoreState(State);
+
+    // The watermark is only checked when the free pages were touched
+    if (Locked) {
+        CheckWatermark(Allocator);
+    }
+
+    if (Allocated < PageCount) {
+        ERROR("[page_allocator] out of memory, %i/%i pages allocated", Allocated, PageCount);
+        PageAllocatorFree(Allocator, Allocated, Pages);
+        return OsOutOfMemory;
+    }
+    return OsSuccess;
+}
+
+void
+PageAllocatorFree(
+    _In_ PageAllocator_t* Allocator,
+    _In_ int              PageCount,
+    _In_ uintptr_t*       Pages)
+{
+    PageCache_t* Cache;
+    IntStatus_t  State;
+    UUId_t       CoreId;
+    int          i = 0;
+
+    assert(Allocator != NULL);
+    assert(Pages != NULL);
+
+    State  = InterruptDisable();
+    CoreId = ArchGetProcessorCoreId();
+    if (CoreId >= PAGE_ALLOCATOR_MAX_CORES) {
+        IrqSpinlockAcquire(&Allocator->SyncObject);
+        FreePages(Allocator, PageCount, Pages);
+        IrqSpinlockRelease(&Allocator->SyncObject);
+        InterruptRestoreState(State);
+        return;
+    }
+
+    // If the pages don't fit, drain the cache down to one batch and return the pages
+    // that still don't fit directly, so large frees take the lock once
+    Cache = &Allocator->Caches[CoreId];
+    if ((Cache->Count + PageCount) > PAGE_ALLOCATOR_CACHE_SIZE) {
+        IrqSpinlockAcquire(&Allocator->SyncObject);
+        if (Cache->Count > PAGE_ALLOCATOR_CACHE_BATCH) {
+            FreePages(Allocator, Cache->Count - PAGE_ALLOCATOR_CACHE_BATCH,
+                &Cache->Pages[PAGE_ALLOCATOR_CACHE_BATCH]);
+            Cache->Count = PAGE_ALLOCATOR_CACHE_BATCH;
+        }
+        if (PageCount > (PAGE_ALLOCATOR_CACHE_SIZE - Cache->Count)) {
+            i = PageCount - (PAGE_ALLOCATOR_CACHE_SIZE - Cache->Count);
+            FreePages(Allocator, i, Pages);
+        }
+        IrqSpinlockRelease(&Allocator->SyncObject);
+    }
+
+    for (; i < PageCount; i++) {
+        Cache->Pages[Cache->Count++] = Pages[i];
+    }
+    InterruptRestoreState(State);
+}
+
+OsStatus_t
+PageAllocatorAllocateContiguous(
+    _In_  PageAllocator_t* Allocator,
+    _In_  size_t           PageCount,
+    _In_  size_t           Alignment,
+    _Out_ uintptr_t*       Address)
+{
+    OsStatus_t Status;
+    size_t     Page;
+    int        Order = 0;
+
+    assert(Allocator != NULL);
+    assert(Address != NULL);
+
+    // Blocks are naturally aligned, so the order covers both the size and the alignment
+    while (Order < PAGE_ALLOCATOR_ORDERS && (BLOCK_PAGES(Order) < PageCount ||
+           (BLOCK_PAGES(Order) * Allocator->PageSize) < Alignment)) {
+        Order++;
+    }
+    if (!PageCount || Order == PAGE_ALLOCATOR_ORDERS) {
+        return OsInvalidParameters;
+    }
+
+    IrqSpinlockAcquire(&Allocator->SyncObject);
+    Status = BuddyAllocate(Allocator, Order, &Page);
+    if (Status == OsSuccess) {
+        FreeRange(Allocator, Page + PageCount, BLOCK_PAGES(Order) - PageCount);
+    }
+    IrqSpinlockRelease(&Allocator->SyncObject);
+    CheckWatermark(Allocator);
+
+    if (Status == OsSuccess) {
+        *Address = Page * Allocator->PageSize;
+    }
+    return Status;
+}
+
+void
+PageAllocatorFreeContiguous(
+    _In_ PageAllocator_t* Allocator,
+    _In_ uintptr_t        Address,
+    _In_ size_t           PageCount)
+{
+    assert(Allocator != NULL);
+    assert(((Address / Allocator->PageSize) + PageCount) <= Allocator->PageCount);
+
+    IrqSpinlockAcquire(&Allocator->SyncObject);
+    FreeRange(Allocator, Address / Allocator->PageSize, PageCount);
+    IrqSpinlockRelease(&Allocator->SyncObject);
+}
+
+void
+PageAllocatorSetWatermark(
+    _In_ PageAllocator_t*         Allocator,
+    _In_ size_t                   Watermark,
+    _In_ PageAllocatorWatermarkFn Handler)
+{
+    assert(Allocator != NULL);
+
+    IrqSpinlockAcquire(&Allocator->SyncObject);
+    Allocator->Watermark        = Watermark;
+    Allocator->WatermarkHandler = Handler;
+    IrqSpinlockRelease(&Allocator->SyncObject);
+}
+
+void
+PageAllocatorDrainCache(
+    _In_ PageAllocator_t* Allocator)
+{
+    PageCache_t* Cache;
+    IntStatus_t  State;
+    UUId_t       CoreId;
+
+    assert(Allocator != NULL);
+
+    State  = InterruptDisable();
+    CoreId = ArchGetProcessorCoreId();
+    if (CoreId < PAGE_ALLOCATOR_MAX_CORES) {
+        Cache = &Allocator->Caches[CoreId];
+        IrqSpinlockAcquire(&Allocator->SyncObject);
+        FreePages(Allocator, Cache->Count, &Cache->Pages[0]);
+        Cache->Count = 0;
+        IrqSpinlockRelease(&Allocator->SyncObject);
+    }
+    InterruptRestoreState(State);
+}
+
+void
+PageAllocatorGetStatistics(
+    _In_  PageAllocator_t* Allocator,
+    _Out_ size_t*          PageCount,
+    _Out_ size_t*          FreePages)
+{
+    size_t Free;
+    int    i;
+
+    // The counters are read without the lock, so the result is a snapshot
+    Free = READ_VOLATILE(Allocator->FreePages);
+    for (i = 0; i < PAGE_ALLOCATOR_MAX_CORES; i++) {
+        Free += READ_VOLATILE(Allocator->Caches[i].Count);
+    }
+
+    *PageCount = Allocator->PageCount;
+    *FreePages = Free;
+}
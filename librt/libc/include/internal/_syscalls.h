@@ -109,5 +109,8 @@ _CODE_END
 #define Syscall_SystemPerformanceFrequency(Frequency)                      (OsStatus_t)syscall1(71, SCPARAM(Frequency))
 #define Syscall_SystemPerformanceTime(Value)                               (OsStatus_t)syscall1(72, SCPARAM(Value))
 #define Syscall_SystemTime(Time)                                           (OsStatus_t)syscall1(73, SCPARAM(Time))
+#define Syscall_HeapQuery(Statistics, Count)                               (OsStatus_t)syscall2(74, SCPARAM(Statistics), SCPARAM(Count))
+#define Syscall_HeapProfile(SampleInterval, Samples, Count)                (OsStatus_t)syscall3(75, SCPARAM(SampleInterval), SCPARAM(Samples), SCPARAM(Count))
+#define Syscall_SchedulerTrace(Mode, Records, Count)                       (OsStatus_t)syscall3(76, SCPARAM(Mode), SCPARAM(Records), SCPARAM(Count))
 
 #endif //!__INTERNAL_CRT_SYSCALLS__
@@ -23,7 +23,7 @@
 #define FUTEX_OP_CMP_GE     5  /* if (oldval >= cmparg) wake */
 
 #define FUTEX_OP(op, oparg, cmp, cmparg) \
-                   (((op & 0xf) << 28) | \
+                   (int)((((unsigned int)(op) & 0xf) << 28) | \
                    ((cmp & 0xf) << 24) | \
                    ((oparg & 0xfff) << 12) | \
                    (cmparg & 0xfff))
@@ -32,6 +32,7 @@
 #define FUTEX_WAIT_OP           0x2
 #define FUTEX_WAKE_PRIVATE      0x4
 #define FUTEX_WAKE_OP           0x8
+#define FUTEX_WAKE_REQUEUE      0x10
 
 //int futex(int *uaddr, int op, int val, const struct timespec *timeout,
 //          int *uaddr2, int val3);
@@ -26,8 +26,10 @@
 
 #include <os/osdefs.h>
 #include <os/types/file.h>
+#include <os/types/heap.h>
 #include <os/types/storage.h>
 #include <os/types/path.h>
+#include <os/types/scheduler_trace.h>
 #include <time.h>
 
 // Memory Allocation Definitions
@@ -49,6 +51,10 @@ PACKED_TYPESTRUCT(SystemDescriptor, {
     size_t PagesUsed;
     size_t PageSizeBytes;
     size_t AllocationGranularityBytes;
+
+    size_t   TlbShootdownsSent;
+    size_t   TlbPagesInvalidated;
+    uint64_t TlbShootdownWaitNs;
 });
 
 PACKED_TYPESTRUCT(SystemTime, {
@@ -84,6 +90,9 @@ CRTDECL(OsStatus_t, GetSystemTick(int TickBase, LargeUInteger_t* Tick));
 CRTDECL(OsStatus_t, QueryPerformanceFrequency(LargeInteger_t* Frequency));
 CRTDECL(OsStatus_t, QueryPerformanceTimer(LargeInteger_t* Value));
 CRTDECL(OsStatus_t, FlushHardwareCache(int Cache, void* Start, size_t Length));
+CRTDECL(OsStatus_t, HeapQuery(HeapCacheStatistics_t* Statistics, int* Count));
+CRTDECL(OsStatus_t, HeapProfile(int SampleInterval, HeapProfileSample_t* Samples, int* Count));
+CRTDECL(OsStatus_t, SchedulerTrace(int Mode, SchedulerTraceRecord_t* Records, int* Count));
 
 /*******************************************************************************
  * Threading Extensions
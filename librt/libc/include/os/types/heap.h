@@ -0,0 +1,57 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Kernel Heap Type Definitions & Structures
+ * - This header describes the statistics and profiling samples that can be
+ *   queried from the kernel heap
+ */
+
+#ifndef __TYPES_HEAP_H__
+#define __TYPES_HEAP_H__
+
+#include <os/osdefs.h>
+
+#define HEAP_CACHE_NAME_LENGTH   32
+#define HEAP_PROFILE_MAX_SAMPLES 256 // The most recent samples are kept
+
+// Objects in use is the number of allocations minus the number of frees, while the
+// high-water mark is the peak number of objects taken out of the slabs, which includes
+// the objects that are held in the per-core magazines.
+PACKED_TYPESTRUCT(HeapCacheStatistics, {
+    char     Name[HEAP_CACHE_NAME_LENGTH];
+    size_t   ObjectSize;
+    size_t   ObjectsPerSlab;
+    size_t   PagesPerSlab;
+    size_t   NumberOfSlabs;
+
+    uint64_t NumberOfAllocations;
+    uint64_t NumberOfFrees;
+    size_t   NumberOfSlabsCreated;
+    size_t   NumberOfSlabsReaped;
+    size_t   ObjectsInUse;
+    size_t   HighWaterMark;
+});
+
+// Size is the requested size for kmalloc, and the object size for cache allocations
+PACKED_TYPESTRUCT(HeapProfileSample, {
+    uintptr_t Caller;
+    size_t    Size;
+});
+
+#endif //!__TYPES_HEAP_H__
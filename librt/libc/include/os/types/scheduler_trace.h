@@ -0,0 +1,74 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scheduler Trace Type Definitions & Structures
+ * - This header describes the binary records of the scheduler trace, which are
+ *   drained from the kernel, and the header of a trace dump. A dump is the header
+ *   followed by the records in the order they were drained.
+ */
+
+#ifndef __TYPES_SCHEDULER_TRACE_H__
+#define __TYPES_SCHEDULER_TRACE_H__
+
+#include <os/osdefs.h>
+
+#define SCHEDULER_TRACE_MAGIC      0x43525453 // "STRC"
+#define SCHEDULER_TRACE_VERSION    1
+
+#define SCHEDULER_TRACE_DISABLE    0
+#define SCHEDULER_TRACE_ENABLE     1
+#define SCHEDULER_TRACE_DRAIN      2
+
+// Thread is the handle of the thread the event is about, and Data depends on the event.
+// QueueLength is the number of threads queued on the core after the event.
+#define SCHEDULER_TRACE_ENQUEUE    1 // Queued on Queue
+#define SCHEDULER_TRACE_DEQUEUE    2 // Taken from Queue to run next
+#define SCHEDULER_TRACE_SWITCH     3 // Thread starts running, Data is the previous thread
+#define SCHEDULER_TRACE_SLEEP      4 // Thread blocked, Data is the timeout in ms, 0 is infinite
+#define SCHEDULER_TRACE_WAKE       5 // Thread woken up, Data is the reason
+#define SCHEDULER_TRACE_MIGRATE    6 // Thread moved from Core to core Data
+#define SCHEDULER_TRACE_CLOCK      7 // Data is the system tick in ms at Timestamp
+#define SCHEDULER_TRACE_LOST       8 // Data records of Core were overwritten before a drain
+
+#define SCHEDULER_TRACE_WAKE_QUEUE     0 // Queued by another thread, or started
+#define SCHEDULER_TRACE_WAKE_TIMEOUT   1
+#define SCHEDULER_TRACE_WAKE_INTERRUPT 2
+
+#define SCHEDULER_TRACE_QUEUE_NONE 0xFF // The idle thread runs outside the queues
+
+// Timestamps are in cpu timestamp counter ticks, and only comparable between cores
+// that share a constant rate counter
+PACKED_TYPESTRUCT(SchedulerTraceRecord, {
+    uint64_t Timestamp;
+    uint32_t Thread;
+    uint32_t Data;
+    uint16_t QueueLength;
+    uint8_t  Event;
+    uint8_t  Core;
+    uint8_t  Queue;
+    uint8_t  Reserved[3];
+});
+
+PACKED_TYPESTRUCT(SchedulerTraceHeader, {
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t RecordSize;
+});
+
+#endif //!__TYPES_SCHEDULER_TRACE_H__
@@ -84,3 +84,38 @@ FlushHardwareCache(
 {
     return Syscall_FlushHardwareCache(Cache, Start, Length);
 }
+
+OsStatus_t
+HeapQuery(
+    _In_ HeapCacheStatistics_t* Statistics,
+    _In_ int*                   Count)
+{
+    if (Count == NULL || (Statistics == NULL && *Count != 0)) {
+        return OsInvalidParameters;
+    }
+    return Syscall_HeapQuery(Statistics, Count);
+}
+
+OsStatus_t
+HeapProfile(
+    _In_ int                  SampleInterval,
+    _In_ HeapProfileSample_t* Samples,
+    _In_ int*                 Count)
+{
+    if (Count == NULL || (Samples == NULL && *Count != 0)) {
+        return OsInvalidParameters;
+    }
+    return Syscall_HeapProfile(SampleInterval, Samples, Count);
+}
+
+OsStatus_t
+SchedulerTrace(
+    _In_ int                     Mode,
+    _In_ SchedulerTraceRecord_t* Records,
+    _In_ int*                    Count)
+{
+    if (Mode == SCHEDULER_TRACE_DRAIN && (Count == NULL || (Records == NULL && *Count != 0))) {
+        return OsInvalidParameters;
+    }
+    return Syscall_SchedulerTrace(Mode, Records, Count);
+}
@@ -38,7 +38,7 @@ __CrtInitialize(
 void __CrtServiceEntry(void)
 {
     thread_storage_t              tls;
-    gracht_server_configuration_t config;
+    gracht_server_configuration_t config = { 0 };
     struct ipmsg_addr             addr = { .type = IPMSG_ADDRESS_HANDLE };
     int                           status;
 
@@ -17,43 +17,400 @@
  *
  *
  * - Generic Hash Table Implementation
- *  The hash-table uses chained indices to solve the possibility of collision.
- *  The hash table runs in O(1 + a) time, where a = size/capacity assuming
- *  optimal hash-distribution. All list sizes should be <a>
+ *  The hash-table uses open addressing with SwissTable style groups. The hash of
+ *  a key is split in H1, which selects the group the probing starts at, and H2, the
+ *  lower 7 bits which are stored in the control byte of the slot. A probe matches
+ *  H2 against a full group of control bytes at once, and only the keys of matching
+ *  slots are compared. Groups are probed in triangular steps, which visits every
+ *  group once as the capacity is a power of two.
  */
 
 #include <ds/hashtable.h>
 #include <assert.h>
 #include <string.h>
 
-static size_t 
-GetDefaultHashValue(const char* Value, size_t Length)
+#if defined(__SSE2__) && !defined(__LIBDS_KERNEL__)
+#include <emmintrin.h>
+#define HASHTABLE_GROUP_SSE2
+#define GROUP_WIDTH             16
+#else
+#define GROUP_WIDTH             8
+#endif
+
+#define CONTROL_EMPTY           0x80
+#define CONTROL_DELETED         0xFE
+#define CONTROL_IS_FULL(Control) (((Control) & 0x80) == 0)
+
+#define HASH_H1(Hash)           ((size_t)((Hash) >> 7))
+#define HASH_H2(Hash)           ((uint8_t)((Hash) & 0x7F))
+
+// Number of slots migrated from the previous storage for each modification while
+// a resize is in progress. Must be large enough that the migration completes before
+// the new storage reaches the load factor again.
+#define HASHTABLE_MIGRATE_STEP  32
+
+#define HASHTABLE_MAXIMUM_LOADFACTOR 90
+
+#ifdef HASHTABLE_GROUP_SSE2
+typedef uint32_t GroupMask_t;
+#define GROUP_MASK_INDEX(Mask)  ((size_t)__builtin_ctz(Mask))
+
+static inline GroupMask_t
+GroupMatch(
+    _In_ const uint8_t* Control,
+    _In_ uint8_t        Hash)
+{
+    __m128i Group = _mm_loadu_si128((const __m128i*)Control);
+    return (GroupMask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8((char)Hash), Group));
+}
+
+static inline GroupMask_t
+GroupMatchEmpty(
+    _In_ const uint8_t* Control)
+{
+    return GroupMatch(Control, CONTROL_EMPTY);
+}
+
+static inline GroupMask_t
+GroupMatchEmptyOrDeleted(
+    _In_ const uint8_t* Control)
+{
+    __m128i Group = _mm_loadu_si128((const __m128i*)Control);
+    return (GroupMask_t)_mm_movemask_epi8(Group);
+}
+#else
+// Without SSE2 a group is matched as a 64 bit word, where each matching control byte
+// gets its top bit set in the mask. The match of H2 can report false positives in the
+// bytes following a real match, which is fine as the keys are compared anyway.
+typedef uint64_t GroupMask_t;
+#define GROUP_MASK_INDEX(Mask)  ((size_t)(__builtin_ctzll(Mask) >> 3))
+#define GROUP_LSBS              0x0101010101010101ULL
+#define GROUP_MSBS              0x8080808080808080ULL
+
+static inline uint64_t
+GroupLoad(
+    _In_ const uint8_t* Control)
+{
+    uint64_t Group;
+    memcpy(&Group, Control, sizeof(uint64_t));
+    return Group;
+}
+
+static inline GroupMask_t
+GroupMatch(
+    _In_ const uint8_t* Control,
+    _In_ uint8_t        Hash)
+{
+    uint64_t Group = GroupLoad(Control) ^ (GROUP_LSBS * Hash);
+    return (Group - GROUP_LSBS) & ~Group & GROUP_MSBS;
+}
+
+static inline GroupMask_t
+GroupMatchEmpty(
+    _In_ const uint8_t* Control)
+{
+    // Empty is the only control value with the top bit set and bit 1 cleared
+    uint64_t Group = GroupLoad(Control);
+    return Group & (~Group << 6) & GROUP_MSBS;
+}
+
+static inline GroupMask_t
+GroupMatchEmptyOrDeleted(
+    _In_ const uint8_t* Control)
+{
+    return GroupLoad(Control) & GROUP_MSBS;
+}
+#endif
+
+static size_t
+GetDefaultHashValue(
+    _In_ const char* Value,
+    _In_ size_t      Length)
+{
+    // FNV-1a
+    uint64_t Hash = 0xCBF29CE484222325ULL;
+    size_t   i;
+    for (i = 0; i < Length; i++) {
+        Hash ^= (uint8_t)Value[i];
+        Hash *= 0x100000001B3ULL;
+    }
+    return (size_t)Hash;
+}
+
+static inline uint64_t
+MixHashValue(
+    _In_ uint64_t Value)
+{
+    Value ^= Value >> 33;
+    Value *= 0xFF51AFD7ED558CCDULL;
+    Value ^= Value >> 33;
+    Value *= 0xC4CEB9FE1A85EC53ULL;
+    Value ^= Value >> 33;
+    return Value;
+}
+
+static inline size_t
+GetStringLength(
+    _In_ DataKey_t* Key)
+{
+    return Key->Value.String.Length != 0 ? Key->Value.String.Length : strlen(Key->Value.String.Pointer);
+}
+
+static uint64_t
+GetKeyHash(
+    _In_ HashTable_t* HashTable,
+    _In_ DataKey_t*   Key)
+{
+    switch (HashTable->KeyType) {
+        case KeyInteger:
+            return MixHashValue((uint64_t)(unsigned int)Key->Value.Integer);
+        case KeyId:
+            return MixHashValue((uint64_t)Key->Value.Id);
+        case KeyPointer:
+            return MixHashValue((uint64_t)(uintptr_t)Key->Value.Pointer);
+        case KeyString:
+            return MixHashValue((uint64_t)HashTable->GetHashCode(
+                Key->Value.String.Pointer, GetStringLength(Key)));
+    }
+    return 0;
+}
+
+static int
+KeysEqual(
+    _In_ KeyType_t  KeyType,
+    _In_ DataKey_t* Key1,
+    _In_ DataKey_t* Key2)
+{
+    switch (KeyType) {
+        case KeyInteger:
+            return Key1->Value.Integer == Key2->Value.Integer;
+        case KeyId:
+            return Key1->Value.Id == Key2->Value.Id;
+        case KeyPointer:
+            return Key1->Value.Pointer == Key2->Value.Pointer;
+        case KeyString: {
+            size_t Length = GetStringLength(Key1);
+            return Length == GetStringLength(Key2) &&
+                !memcmp(Key1->Value.String.Pointer, Key2->Value.String.Pointer, Length);
+        }
+    }
+    return 0;
+}
+
+static int
+StorageConstruct(
+    _In_ HashTableStorage_t* Storage,
+    _In_ size_t              Capacity)
 {
+    // Entries and control bytes share one allocation, the entries come first to
+    // keep them aligned
+    size_t   EntriesLength = Capacity * sizeof(HashTableEntry_t);
+    uint8_t* Memory        = (uint8_t*)dsalloc(EntriesLength + Capacity + GROUP_WIDTH);
+    if (!Memory) {
+        return -1;
+    }
+
+    Storage->Entries    = (HashTableEntry_t*)Memory;
+    Storage->Control    = Memory + EntriesLength;
+    Storage->Capacity   = Capacity;
+    Storage->Size       = 0;
+    Storage->Tombstones = 0;
+    memset(Storage->Control, CONTROL_EMPTY, Capacity + GROUP_WIDTH);
     return 0;
 }
 
+static void
+StorageDestroy(
+    _In_ HashTableStorage_t* Storage)
+{
+    if (Storage->Entries) {
+        dsfree(Storage->Entries);
+    }
+    memset(Storage, 0, sizeof(HashTableStorage_t));
+}
+
+static inline void
+StorageSetControl(
+    _In_ HashTableStorage_t* Storage,
+    _In_ size_t              Index,
+    _In_ uint8_t             Control)
+{
+    // The first group is mirrored after the last slot, so a group can always be
+    // loaded without wrapping around
+    Storage->Control[Index] = Control;
+    if (Index < GROUP_WIDTH) {
+        Storage->Control[Storage->Capacity + Index] = Control;
+    }
+}
+
+static HashTableEntry_t*
+StorageFind(
+    _In_  HashTable_t*        HashTable,
+    _In_  HashTableStorage_t* Storage,
+    _In_  DataKey_t*          Key,
+    _In_  uint64_t            Hash,
+    _Out_ size_t*             IndexOut)
+{
+    size_t  Mask     = Storage->Capacity - 1;
+    size_t  Position = HASH_H1(Hash) & Mask;
+    size_t  Step     = 0;
+    uint8_t H2       = HASH_H2(Hash);
+
+    if (!Storage->Capacity) {
+        return NULL;
+    }
+
+    while (1) {
+        const uint8_t* Group   = &Storage->Control[Position];
+        GroupMask_t    Matches = GroupMatch(Group, H2);
+        while (Matches) {
+            size_t Index = (Position + GROUP_MASK_INDEX(Matches)) & Mask;
+            if (KeysEqual(HashTable->KeyType, &Storage->Entries[Index].Key, Key)) {
+                *IndexOut = Index;
+                return &Storage->Entries[Index];
+            }
+            Matches &= Matches - 1;
+        }
+
+        if (GroupMatchEmpty(Group)) {
+            return NULL;
+        }
+
+        Step    += GROUP_WIDTH;
+        Position = (Position + Step) & Mask;
+    }
+}
+
+static void
+StoragePlace(
+    _In_ HashTableStorage_t* Storage,
+    _In_ DataKey_t*          Key,
+    _In_ void*               Data,
+    _In_ uint64_t            Hash)
+{
+    size_t Mask     = Storage->Capacity - 1;
+    size_t Position = HASH_H1(Hash) & Mask;
+    size_t Step     = 0;
+    size_t Index;
+
+    while (1) {
+        GroupMask_t Free = GroupMatchEmptyOrDeleted(&Storage->Control[Position]);
+        if (Free) {
+            Index = (Position + GROUP_MASK_INDEX(Free)) & Mask;
+            break;
+        }
+        Step    += GROUP_WIDTH;
+        Position = (Position + Step) & Mask;
+    }
+
+    if (Storage->Control[Index] == CONTROL_DELETED) {
+        Storage->Tombstones--;
+    }
+    StorageSetControl(Storage, Index, HASH_H2(Hash));
+    Storage->Entries[Index].Key  = *Key;
+    Storage->Entries[Index].Data = Data;
+    Storage->Size++;
+}
+
+static void
+StorageErase(
+    _In_ HashTableStorage_t* Storage,
+    _In_ size_t              Index)
+{
+    // Slots are left as tombstones so probe sequences that passed them stay intact,
+    // they are reclaimed by inserts or when the storage is rehashed
+    StorageSetControl(Storage, Index, CONTROL_DELETED);
+    Storage->Size--;
+    Storage->Tombstones++;
+}
+
+/* HashTableMigrate
+ * Moves up to <Count> slots of the previous storage into the current storage, and
+ * releases the previous storage once all of it has been migrated. */
+static void
+HashTableMigrate(
+    _In_ HashTable_t* HashTable,
+    _In_ size_t       Count)
+{
+    HashTableStorage_t* Previous = &HashTable->Previous;
+    if (!Previous->Capacity) {
+        return;
+    }
+
+    while (Count-- && HashTable->MigrateIndex < Previous->Capacity) {
+        size_t Index = HashTable->MigrateIndex++;
+        if (CONTROL_IS_FULL(Previous->Control[Index])) {
+            HashTableEntry_t* Entry = &Previous->Entries[Index];
+            StoragePlace(&HashTable->Storage, &Entry->Key, Entry->Data,
+                GetKeyHash(HashTable, &Entry->Key));
+            StorageErase(Previous, Index);
+        }
+    }
+
+    if (HashTable->MigrateIndex == Previous->Capacity) {
+        StorageDestroy(Previous);
+        HashTable->MigrateIndex = 0;
+    }
+}
+
+/* HashTableResize
+ * Starts a resize of the table. The storage doubles in size, unless most of the used
+ * slots are tombstones, in which case it is rehashed at the same size. */
+static void
+HashTableResize(
+    _In_ HashTable_t* HashTable)
+{
+    HashTableStorage_t* Storage  = &HashTable->Storage;
+    size_t              Capacity = Storage->Capacity;
+
+    HashTableMigrate(HashTable, (size_t)-1);
+    if (Storage->Size * 200 >= Capacity * HashTable->LoadFactor) {
+        Capacity *= 2;
+    }
+
+    HashTable->Previous     = *Storage;
+    HashTable->MigrateIndex = 0;
+    if (StorageConstruct(Storage, Capacity)) {
+        // Keep using the current storage, as long as it still has free slots
+        *Storage = HashTable->Previous;
+        memset(&HashTable->Previous, 0, sizeof(HashTableStorage_t));
+        assert(Storage->Size + Storage->Tombstones + 1 < Storage->Capacity);
+    }
+}
+
 /* HashTableCreate
- * Initializes a new hash table structure of the desired capacity, and load factor.
- * The load factor defaults to HASHTABLE_DEFAULT_LOADFACTOR. */
+ * Initializes a new hash table structure for the given key type, of the desired capacity,
+ * and load factor. The load factor defaults to HASHTABLE_DEFAULT_LOADFACTOR. */
 HashTable_t*
 HashTableCreate(
-    _In_ size_t Capacity,
-    _In_ size_t LoadFactor)
+    _In_ KeyType_t KeyType,
+    _In_ size_t    Capacity,
+    _In_ size_t    LoadFactor)
 {
     HashTable_t* HashTable = (HashTable_t*)dsalloc(sizeof(HashTable_t));
+    size_t       ActualCapacity = HASHTABLE_MINIMUM_CAPACITY;
     assert(HashTable != NULL);
+    memset(HashTable, 0, sizeof(HashTable_t));
+
+    if (!LoadFactor) {
+        LoadFactor = HASHTABLE_DEFAULT_LOADFACTOR;
+    }
+    else if (LoadFactor > HASHTABLE_MAXIMUM_LOADFACTOR) {
+        LoadFactor = HASHTABLE_MAXIMUM_LOADFACTOR;
+    }
+
+    // Make room for the requested capacity without exceeding the load factor
+    while (ActualCapacity * LoadFactor < Capacity * 100) {
+        ActualCapacity <<= 1;
+    }
 
-    HashTable->Array = (Collection_t*)dsalloc(sizeof(Collection_t) * Capacity);
-    assert(HashTable->Array != NULL);
-    memset(HashTable->Array, 0, sizeof(sizeof(Collection_t) * Capacity));
-    for (size_t i = 0; i < Capacity; i++) {
-        HashTable->Array[i].KeyType = KeyId;
+    if (StorageConstruct(&HashTable->Storage, ActualCapacity)) {
+        assert(0);
     }
 
-    HashTable->Size         = 0;
-    HashTable->Capacity     = Capacity;
-    HashTable->LoadFactor   = LoadFactor;
-    HashTable->GetHashCode  = GetDefaultHashValue;
+    HashTable->KeyType     = KeyType;
+    HashTable->LoadFactor  = LoadFactor;
+    HashTable->GetHashCode = GetDefaultHashValue;
 	return HashTable;
 }
 
@@ -65,15 +422,13 @@ HashTableDestroy(
     _In_ HashTable_t* HashTable)
 {
     assert(HashTable != NULL);
-    for (size_t i = 0; i < HashTable->Capacity; i++) {
-        CollectionClear(&HashTable->Array[i]);
-    }
-    dsfree(HashTable->Array);
+    StorageDestroy(&HashTable->Previous);
+    StorageDestroy(&HashTable->Storage);
     dsfree(HashTable);
 }
 
 /* HashTableSetHashFunction
- * Overrides the default hash function with a user provided hash function. To
+ * Overrides the default hash function for string keys with a user provided hash function. To
  * reset this set with NULL. */
 void
 HashTableSetHashFunction(
@@ -81,42 +436,82 @@ HashTableSetHashFunction(
     _In_ HashFn         Fn)
 {
     assert(HashTable != NULL);
-    HashTable->GetHashCode = Fn;
+    assert(HashTable->Size == 0);
+    HashTable->GetHashCode = Fn != NULL ? Fn : GetDefaultHashValue;
 }
 
 /* HashTableInsert
- * Inserts or overwrites the existing key in the hashtable. */
-void
+ * Inserts or overwrites the existing key in the hashtable. Returns the data previously
+ * stored for the key. */
+void*
 HashTableInsert(
     _In_ HashTable_t*   HashTable,
     _In_ DataKey_t      Key,
     _In_ void*          Data)
 {
+    HashTableStorage_t* Storage;
+    HashTableEntry_t*   Entry;
+    uint64_t            Hash;
+    size_t              Index;
+    void*               Previous = NULL;
     assert(HashTable != NULL);
-    size_t              ArrayIndex  = GetDefaultHashValue(Key.Value.String.Pointer, Key.Value.String.Length) % HashTable->Capacity;
-    Collection_t*       Array       = &HashTable->Array[ArrayIndex];
-    DataKey_t           ArrayKey    = { .Value.Id = ArrayIndex };
-    CollectionItem_t*   Existing    = CollectionGetNodeByKey(Array, ArrayKey, 0);
-    if (Existing == NULL) {
-        CollectionAppend(Array, CollectionCreateNode(ArrayKey, Data));
+
+    Hash    = GetKeyHash(HashTable, &Key);
+    Storage = &HashTable->Storage;
+    HashTableMigrate(HashTable, HASHTABLE_MIGRATE_STEP);
+
+    Entry = StorageFind(HashTable, Storage, &Key, Hash, &Index);
+    if (Entry) {
+        Previous    = Entry->Data;
+        Entry->Data = Data;
+        return Previous;
     }
-    else {
-        Existing->Data = Data;
+
+    // The key may not have been migrated yet, in that case it moves now
+    Entry = StorageFind(HashTable, &HashTable->Previous, &Key, Hash, &Index);
+    if (Entry) {
+        Previous = Entry->Data;
+        StorageErase(&HashTable->Previous, Index);
+        HashTable->Size--;
+    }
+
+    if ((Storage->Size + Storage->Tombstones + 1) * 100 > Storage->Capacity * HashTable->LoadFactor) {
+        HashTableResize(HashTable);
     }
+    StoragePlace(Storage, &Key, Data, Hash);
+    HashTable->Size++;
+    return Previous;
 }
 
-/* HashTableRemove 
- * Removes the entry with the matching key from the hashtable. */
-void
+/* HashTableRemove
+ * Removes the entry with the matching key from the hashtable. Returns the data that was
+ * stored for the key. */
+void*
 HashTableRemove(
     _In_ HashTable_t*   HashTable,
     _In_ DataKey_t      Key)
 {
+    HashTableStorage_t* Storages[2];
+    uint64_t            Hash;
+    int                 i;
     assert(HashTable != NULL);
-    size_t              ArrayIndex  = GetDefaultHashValue(Key.Value.String.Pointer, Key.Value.String.Length) % HashTable->Capacity;
-    Collection_t*       Array       = &HashTable->Array[ArrayIndex];
-    DataKey_t           ArrayKey    = { .Value.Id = ArrayIndex };
-    CollectionRemoveByKey(Array, ArrayKey);
+
+    Hash        = GetKeyHash(HashTable, &Key);
+    Storages[0] = &HashTable->Storage;
+    Storages[1] = &HashTable->Previous;
+    HashTableMigrate(HashTable, HASHTABLE_MIGRATE_STEP);
+
+    for (i = 0; i < 2; i++) {
+        size_t            Index;
+        HashTableEntry_t* Entry = StorageFind(HashTable, Storages[i], &Key, Hash, &Index);
+        if (Entry) {
+            void* Data = Entry->Data;
+            StorageErase(Storages[i], Index);
+            HashTable->Size--;
+            return Data;
+        }
+    }
+    return NULL;
 }
 
 /* HashTableGetValue
@@ -126,9 +521,41 @@ HashTableGetValue(
     _In_ HashTable_t*   HashTable,
     _In_ DataKey_t      Key)
 {
+    HashTableEntry_t* Entry;
+    uint64_t          Hash;
+    size_t            Index;
+    assert(HashTable != NULL);
+
+    Hash  = GetKeyHash(HashTable, &Key);
+    Entry = StorageFind(HashTable, &HashTable->Storage, &Key, Hash, &Index);
+    if (!Entry) {
+        Entry = StorageFind(HashTable, &HashTable->Previous, &Key, Hash, &Index);
+    }
+	return Entry != NULL ? Entry->Data : NULL;
+}
+
+/* HashTableEnumerate
+ * Calls the function for every entry in the hashtable. The table must not be modified
+ * while it is being enumerated. */
+void
+HashTableEnumerate(
+    _In_ HashTable_t*         HashTable,
+    _In_ HashTableEnumerateFn Fn,
+    _In_ void*                Context)
+{
+    HashTableStorage_t* Storages[2];
+    int                 i;
+    size_t              j;
     assert(HashTable != NULL);
-    size_t              ArrayIndex  = GetDefaultHashValue(Key.Value.String.Pointer, Key.Value.String.Length) % HashTable->Capacity;
-    Collection_t*       Array       = &HashTable->Array[ArrayIndex];
-    DataKey_t           ArrayKey    = { .Value.Id = ArrayIndex };
-	return CollectionGetDataByKey(Array, ArrayKey, 0);
+    assert(Fn != NULL);
+
+    Storages[0] = &HashTable->Storage;
+    Storages[1] = &HashTable->Previous;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < Storages[i]->Capacity; j++) {
+            if (CONTROL_IS_FULL(Storages[i]->Control[j])) {
+                Fn(Storages[i]->Entries[j].Key, Storages[i]->Entries[j].Data, Context);
+            }
+        }
+    }
 }
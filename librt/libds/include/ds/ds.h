@@ -28,8 +28,9 @@ typedef struct FutexParameters FutexParameters_t;
 
 typedef struct {
     union {
-        int     Integer;
-        UUId_t  Id;
+        int         Integer;
+        UUId_t      Id;
+        const void* Pointer;
         struct {
             const char* Pointer;
             size_t      Length;
@@ -40,7 +41,8 @@ typedef struct {
 typedef enum {
     KeyInteger,
     KeyId,
-    KeyString
+    KeyString,
+    KeyPointer
 } KeyType_t;
 
 typedef struct {
@@ -17,9 +17,11 @@
  *
  *
  * - Generic Hash Table Implementation
- *  The hash-table uses chained indices to solve the possibility of collision.
- *  The hash table runs in O(1 + a) time, where a = size/capacity assuming
- *  optimal hash-distribution. All list sizes should be <a>
+ *  The hash-table uses open addressing with SwissTable style groups. Each slot has a
+ *  control byte holding 7 bits of the hash, and lookups match a full group of control
+ *  bytes at once, using SSE2 when available and 64 bit words otherwise. Entries are
+ *  stored inline, and the table is resized incrementally to keep the cost of an
+ *  insert bounded.
  */
 
 #ifndef __GENERIC_HASHTABLE_H__
@@ -27,30 +29,50 @@
 
 #include <os/osdefs.h>
 #include <ds/ds.h>
-#include <ds/collection.h>
 
 #define HASHTABLE_DEFAULT_LOADFACTOR    75 // Equals 75 percent
+#define HASHTABLE_MINIMUM_CAPACITY      16
 
+// String keys are hashed with the hash function of the table, the string is not copied
+// and must stay valid while it is in the table. A length of 0 means the string is
+// null-terminated.
 typedef size_t(*HashFn)(const char*, size_t);
+typedef void(*HashTableEnumerateFn)(DataKey_t Key, void* Data, void* Context);
+
+typedef struct HashTableEntry {
+    DataKey_t Key;
+    void*     Data;
+} HashTableEntry_t;
+
+typedef struct HashTableStorage {
+    HashTableEntry_t* Entries;
+    uint8_t*          Control;    // Capacity control bytes, followed by a copy of the first group
+    size_t            Capacity;   // Power of two
+    size_t            Size;
+    size_t            Tombstones;
+} HashTableStorage_t;
 
 typedef struct _HashTable {
-    size_t          Capacity;
-    size_t          Size;
-    size_t          LoadFactor;
-    HashFn          GetHashCode;
-    Collection_t*   Array;
+    KeyType_t          KeyType;
+    size_t             Size;
+    size_t             LoadFactor;
+    HashFn             GetHashCode;
+    HashTableStorage_t Storage;
+    HashTableStorage_t Previous;      // Storage being migrated during a resize
+    size_t             MigrateIndex;
 } HashTable_t;
 
 /* HashTableCreate
- * Initializes a new hash table structure of the desired capacity, and load factor.
- * The load factor defaults to HASHTABLE_DEFAULT_LOADFACTOR. */
+ * Initializes a new hash table structure for the given key type, of the desired capacity,
+ * and load factor. The load factor defaults to HASHTABLE_DEFAULT_LOADFACTOR. */
 CRTDECL(HashTable_t*,
 HashTableCreate(
-    _In_ size_t Capacity,
-    _In_ size_t LoadFactor));
+    _In_ KeyType_t KeyType,
+    _In_ size_t    Capacity,
+    _In_ size_t    LoadFactor));
 
 /* HashTableSetHashFunction
- * Overrides the default hash function with a user provided hash function. To
+ * Overrides the default hash function for string keys with a user provided hash function. To
  * reset this set with NULL. */
 CRTDECL(void,
 HashTableSetHashFunction(
@@ -65,16 +87,18 @@ HashTableDestroy(
     _In_ HashTable_t* HashTable));
 
 /* HashTableInsert
- * Inserts or overwrites the existing key in the hashtable. */
-CRTDECL(void,
+ * Inserts or overwrites the existing key in the hashtable. Returns the data previously
+ * stored for the key. */
+CRTDECL(void*,
 HashTableInsert(
     _In_ HashTable_t*   HashTable,
     _In_ DataKey_t      Key,
     _In_ void*          Data));
 
 /* HashTableRemove 
- * Removes the entry with the matching key from the hashtable. */
-CRTDECL(void,
+ * Removes the entry with the matching key from the hashtable. Returns the data that was
+ * stored for the key. */
+CRTDECL(void*,
 HashTableRemove(
     _In_ HashTable_t*   HashTable, 
     _In_ DataKey_t      Key));
@@ -86,4 +110,13 @@ HashTableGetValue(
     _In_ HashTable_t*   HashTable, 
     _In_ DataKey_t      Key));
 
+/* HashTableEnumerate
+ * Calls the function for every entry in the hashtable. The table must not be modified
+ * while it is being enumerated. */
+CRTDECL(void,
+HashTableEnumerate(
+    _In_ HashTable_t*         HashTable,
+    _In_ HashTableEnumerateFn Fn,
+    _In_ void*                Context));
+
 #endif //!_HASHTABLE_H_
@@ -33,6 +33,7 @@
 #define STREAMBUFFER_GLOBAL               0x4
 #define STREAMBUFFER_OVERWRITE_ENABLED    0x8
 #define STREAMBUFFER_DISABLED             0x10
+#define STREAMBUFFER_POW2_CAPACITY        0x20 // Set by construct, indices are masked instead of divided
 
 // Options for reads and writes
 #define STREAMBUFFER_NO_BLOCK      0x1
@@ -47,13 +48,22 @@ typedef struct streambuffer {
     _Atomic(int)          consumer_count;
     _Atomic(unsigned int) consumer_index;
     _Atomic(unsigned int) consumer_comitted_index;
+    _Atomic(int)          consumer_commit_waiters; // Readers sleeping until it is their turn to commit
     _Atomic(int)          producer_count;
     _Atomic(unsigned int) producer_index;
     _Atomic(unsigned int) producer_comitted_index;
+    _Atomic(int)          producer_commit_waiters; // Writers sleeping until it is their turn to commit
     
     uint8_t buffer[];
 } streambuffer_t;
 
+// A reserved range of the buffer is at most split in two segments, when it
+// wraps around the end of the buffer
+typedef struct streambuffer_segment {
+    uint8_t* data;
+    size_t   length;
+} streambuffer_segment_t;
+
 DSDECL(void,
 streambuffer_construct(
     _In_ streambuffer_t* stream,
@@ -98,6 +108,27 @@ streambuffer_stream_out(
     _In_ size_t          length,
     _In_ unsigned int    options));
 
+/**
+ * streambuffer_write_reserve
+ * * Reserves up to <length> bytes of the stream for writing, the reserved bytes must be
+ * * filled through streambuffer_get_segments and then made readable by streambuffer_write_commit.
+ * @param base_out  [Out] The start of the reservation, which is also the initial state.
+ * @return          The number of bytes reserved, this is only less than length if
+ *                  STREAMBUFFER_ALLOW_PARTIAL was specified.
+ */
+DSDECL(size_t,
+streambuffer_write_reserve(
+    _In_  streambuffer_t* stream,
+    _In_  size_t          length,
+    _In_  unsigned int    options,
+    _Out_ unsigned int*   base_out));
+
+DSDECL(void,
+streambuffer_write_commit(
+    _In_ streambuffer_t* stream,
+    _In_ unsigned int    base,
+    _In_ size_t          length));
+
 DSDECL(size_t,
 streambuffer_write_packet_start(
     _In_  streambuffer_t* stream,
@@ -126,6 +157,26 @@ streambuffer_stream_in(
     _In_ size_t          length,
     _In_ unsigned int    options));
 
+/**
+ * streambuffer_read_reserve
+ * * Reserves up to <length> readable bytes of the stream, the reserved bytes can be read in place
+ * * through streambuffer_get_segments and are released by streambuffer_read_commit.
+ * @param base_out  [Out] The start of the reservation, which is also the initial state.
+ * @return          The number of bytes reserved.
+ */
+DSDECL(size_t,
+streambuffer_read_reserve(
+    _In_  streambuffer_t* stream,
+    _In_  size_t          length,
+    _In_  unsigned int    options,
+    _Out_ unsigned int*   base_out));
+
+DSDECL(void,
+streambuffer_read_commit(
+    _In_ streambuffer_t* stream,
+    _In_ unsigned int    base,
+    _In_ size_t          length));
+
 DSDECL(size_t,
 streambuffer_read_packet_start(
     _In_  streambuffer_t* stream,
@@ -146,4 +197,19 @@ streambuffer_read_packet_end(
     _In_ unsigned int    base,
     _In_ size_t          length));
 
+/**
+ * streambuffer_get_segments
+ * * Retrieves direct pointers to the next <length> bytes of a reservation or packet, so they
+ * * can be filled or drained in place, and advances the state past them.
+ * @param state    [In/Out] The state returned by the reserve or packet_start functions.
+ * @param segments [Out]    Receives up to two segments covering the bytes.
+ * @return         The number of segments used.
+ */
+DSDECL(int,
+streambuffer_get_segments(
+    _In_    streambuffer_t*        stream,
+    _In_    size_t                 length,
+    _InOut_ unsigned int*          state,
+    _Out_   streambuffer_segment_t segments[2]));
+
 #endif //!__RINGBUFFER_H__
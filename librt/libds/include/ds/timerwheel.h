@@ -0,0 +1,112 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Timer Wheel Type Definitions & Structures
+ *  A hierarchical timer wheel of absolute deadlines in ticks. Each level has 64 slots,
+ *  a slot on level N spans 64^N ticks, and a timer is stored on the level of the
+ *  highest bit its deadline differs from the current time in. When the time reaches
+ *  a slot on a higher level, its timers are cascaded to the lower levels, and the
+ *  timers of a slot on the first level expire. Deadlines further away than the last
+ *  level are kept on an overflow list, which is sorted out every 64^4 ticks.
+ *  Timers are embedded in the structure that owns them, so nothing is allocated,
+ *  and the wheel is not synchronized.
+ */
+
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <ds/dsdefs.h>
+
+#define TIMERWHEEL_LEVELS      4
+#define TIMERWHEEL_LEVEL_BITS  6
+#define TIMERWHEEL_LEVEL_SLOTS (1 << TIMERWHEEL_LEVEL_BITS)
+
+typedef struct TimerWheelEntry {
+    struct TimerWheelEntry*  Link;
+    struct TimerWheelEntry** Previous; // NULL when the timer is not in a wheel
+    uint64_t                 Deadline;
+    unsigned int             Slot;
+} TimerWheelEntry_t;
+
+typedef void (*TimerWheelExpireFn)(TimerWheelEntry_t* Entry, void* Context);
+
+// The wheel is valid when zero initialized, and the time then starts at 0
+typedef struct TimerWheel {
+    uint64_t           Time;
+    size_t             Count;
+    uint64_t           Occupied[TIMERWHEEL_LEVELS];
+    TimerWheelEntry_t* Slots[TIMERWHEEL_LEVELS][TIMERWHEEL_LEVEL_SLOTS];
+    TimerWheelEntry_t* Overflow;
+} TimerWheel_t;
+
+#define TIMERWHEEL_INIT { 0 }
+
+/* TimerWheelConstruct
+ * Initializes the wheel with the given current time. */
+DSDECL(void,
+TimerWheelConstruct(
+    _In_ TimerWheel_t* Wheel,
+    _In_ uint64_t      Time));
+
+/* TimerWheelAdd
+ * Adds the timer with an absolute deadline, a deadline that already passed expires on
+ * the next tick. The timer must not be in a wheel already. */
+DSDECL(void,
+TimerWheelAdd(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ TimerWheelEntry_t* Entry,
+    _In_ uint64_t           Deadline));
+
+/* TimerWheelRemove
+ * Removes the timer from the wheel, does nothing if the timer is not in the wheel.
+ * Returns OsDoesNotExist in that case. */
+DSDECL(OsStatus_t,
+TimerWheelRemove(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ TimerWheelEntry_t* Entry));
+
+/* TimerWheelAdvance
+ * Advances the time of the wheel, and invokes the callback for each timer that expired,
+ * after it has been removed from the wheel. The callback may add and remove timers.
+ * Returns the number of timers that expired. */
+DSDECL(size_t,
+TimerWheelAdvance(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ uint64_t           Time,
+    _In_ TimerWheelExpireFn ExpireFn,
+    _In_ void*              Context));
+
+/* TimerWheelNextDeadline
+ * Returns the time of the next event of the wheel, which is either the deadline of the
+ * next timer or the time its timers are cascaded, so it is never later than the next
+ * deadline. Returns 0 when the wheel is empty. */
+DSDECL(uint64_t,
+TimerWheelNextDeadline(
+    _In_ TimerWheel_t* Wheel));
+
+/* TimerWheelIsActive
+ * Returns whether the timer is currently in a wheel. */
+static inline int
+TimerWheelIsActive(
+    _In_ TimerWheelEntry_t* Entry)
+{
+    return Entry->Previous != NULL;
+}
+
+#endif //!__TIMERWHEEL_H__
@@ -45,6 +45,15 @@
 #define STREAMBUFFER_WAIT_FLAGS(stream)           ((stream->options & STREAMBUFFER_GLOBAL) ? 0 : FUTEX_WAIT_PRIVATE)
 #define STREAMBUFFER_WAKE_FLAGS(stream)           ((stream->options & STREAMBUFFER_GLOBAL) ? 0 : FUTEX_WAKE_PRIVATE)
 
+// Number of times a commit polls for its turn before it goes to sleep
+#define STREAMBUFFER_COMMIT_SPINS 64
+
+#if defined(__i386__) || defined(__x86_64__)
+#define STREAMBUFFER_RELAX() __asm__ __volatile__("pause")
+#else
+#define STREAMBUFFER_RELAX()
+#endif
+
 typedef struct sb_packethdr {
     size_t packet_len;
 } sb_packethdr_t;
@@ -71,7 +80,10 @@ streambuffer_construct(
 {
     memset(stream, 0, sizeof(streambuffer_t));
     stream->capacity = capacity;
-    stream->options  = options;
+    stream->options  = options & ~(STREAMBUFFER_POW2_CAPACITY);
+    if (capacity && !(capacity & (capacity - 1))) {
+        stream->options |= STREAMBUFFER_POW2_CAPACITY;
+    }
 }
 
 OsStatus_t
@@ -152,6 +164,120 @@ bytes_readable(
     return write_index - read_index;
 }
 
+static inline unsigned int
+streambuffer_offset(
+    _In_ streambuffer_t* stream,
+    _In_ unsigned int    index)
+{
+    if (stream->options & STREAMBUFFER_POW2_CAPACITY) {
+        return index & (unsigned int)(stream->capacity - 1);
+    }
+    return index % (unsigned int)stream->capacity;
+}
+
+int
+streambuffer_get_segments(
+    _In_    streambuffer_t*        stream,
+    _In_    size_t                 length,
+    _InOut_ unsigned int*          state,
+    _Out_   streambuffer_segment_t segments[2])
+{
+    unsigned int offset      = streambuffer_offset(stream, *state);
+    size_t       first_chunk = MIN(length, stream->capacity - offset);
+    int          count       = 0;
+
+    if (first_chunk) {
+        segments[count].data   = &stream->buffer[offset];
+        segments[count].length = first_chunk;
+        count++;
+    }
+
+    if (length > first_chunk) {
+        segments[count].data   = &stream->buffer[0];
+        segments[count].length = length - first_chunk;
+        count++;
+    }
+
+    offset += (unsigned int)length;
+    if (offset >= stream->capacity) {
+        offset -= (unsigned int)stream->capacity;
+    }
+    *state = offset;
+    return count;
+}
+
+static void
+streambuffer_copy_in(
+    _In_    streambuffer_t* stream,
+    _In_    const void*     buffer,
+    _In_    size_t          length,
+    _InOut_ unsigned int*   state)
+{
+    const uint8_t*         casted_ptr = (const uint8_t*)buffer;
+    streambuffer_segment_t segments[2];
+    int                    count = streambuffer_get_segments(stream, length, state, segments);
+    int                    i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(segments[i].data, casted_ptr, segments[i].length);
+        casted_ptr += segments[i].length;
+    }
+}
+
+static void
+streambuffer_copy_out(
+    _In_    streambuffer_t* stream,
+    _In_    void*           buffer,
+    _In_    size_t          length,
+    _InOut_ unsigned int*   state)
+{
+    uint8_t*               casted_ptr = (uint8_t*)buffer;
+    streambuffer_segment_t segments[2];
+    int                    count = streambuffer_get_segments(stream, length, state, segments);
+    int                    i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(casted_ptr, segments[i].data, segments[i].length);
+        casted_ptr += segments[i].length;
+    }
+}
+
+/**
+ * streambuffer_wait_commit_turn
+ * * Commits must happen in the order the ranges were reserved. The previous reservation is
+ * * usually about to commit, so poll for a short while before sleeping on the comitted index,
+ * * which keeps a preempted writer from making everyone behind it burn their timeslice.
+ */
+static void
+streambuffer_wait_commit_turn(
+    _In_ streambuffer_t*        stream,
+    _In_ _Atomic(unsigned int)* comitted_index,
+    _In_ _Atomic(int)*          waiter_count,
+    _In_ unsigned int           base)
+{
+    FutexParameters_t parameters;
+    unsigned int      current_commit = atomic_load(comitted_index);
+    int               spins          = 0;
+
+    while (current_commit != base) {
+        if (spins < STREAMBUFFER_COMMIT_SPINS) {
+            STREAMBUFFER_RELAX();
+            spins++;
+        }
+        else {
+            // The committer increases the index before it reads the waiter count, so
+            // either it sees us or the wait returns immediately
+            parameters._futex0  = (atomic_int*)comitted_index;
+            parameters._val0    = (int)current_commit;
+            parameters._timeout = 0;
+            parameters._flags   = STREAMBUFFER_WAIT_FLAGS(stream);
+            atomic_fetch_add(waiter_count, 1);
+            dswait(&parameters);
+        }
+        current_commit = atomic_load(comitted_index);
+    }
+}
+
 static void
 streambuffer_try_truncate(
     _In_ streambuffer_t* stream,
@@ -166,7 +292,6 @@ streambuffer_try_truncate(
     size_t       bytes_available = MIN(
         bytes_readable(stream->capacity, read_index, write_index), 
         length);
-    size_t       bytes_comitted  = bytes_available;
     if (!STREAMBUFFER_CAN_READ(options, bytes_available, length)) {
         // should not happen but abort if this occurs
         return;
@@ -178,17 +303,7 @@ streambuffer_try_truncate(
             &read_index, read_index + bytes_available)) {
         return;
     }
-    
-    // Synchronize with other consumers, we must wait for our turn to increament
-    // the comitted index, otherwise we could end up telling writers that the wrong
-    // index is writable. This can be skipped for single reader
-    if (STREAMBUFFER_HAS_MULTIPLE_READERS(stream)) {
-        unsigned int current_commit = atomic_load(&stream->consumer_comitted_index);
-        while (current_commit < (read_index - bytes_comitted)) {
-            current_commit = atomic_load(&stream->consumer_comitted_index);
-        }
-    }
-    atomic_fetch_add(&stream->consumer_comitted_index, bytes_comitted);
+    streambuffer_read_commit(stream, read_index, bytes_available);
 }
 
 void
@@ -214,31 +329,26 @@ streambuffer_get_bytes_available_out(
 }
 
 size_t
-streambuffer_stream_out(
-    _In_ streambuffer_t* stream,
-    _In_ void*           buffer,
-    _In_ size_t          length,
-    _In_ unsigned int    options)
+streambuffer_write_reserve(
+    _In_  streambuffer_t* stream,
+    _In_  size_t          length,
+    _In_  unsigned int    options,
+    _Out_ unsigned int*   base_out)
 {
-    const uint8_t*    casted_ptr    = (const uint8_t*)buffer;
-    size_t            bytes_written = 0;
     FutexParameters_t parameters;
-    dstrace("[streambuffer_stream_out] 0x%" PRIxIN ", length %" PRIuIN ", options 0x%x",
-        buffer, length, options);
-    //streambuffer_dump(stream);
-    
+
     // Has the streambuffer been disabled?
     if (stream->options & STREAMBUFFER_DISABLED) {
         return 0;
     }
-    
-    // Guard against bad lengths
+
+    // Guard against bad lengths, larger writes are streamed in chunks
     if (!length) {
         return 0;
     }
+    length = MIN(length, stream->capacity);
 
-    // Make sure we write all the bytes
-    while (bytes_written < length) {
+    while (1) {
         // when we check, we must check how many bytes are actually allocated, not committed
         // as we have to take into account current writers. The read index however
         // we have to only take into account how many bytes are actually read
@@ -246,11 +356,10 @@ streambuffer_stream_out(
         unsigned int read_index      = atomic_load(&stream->consumer_comitted_index);
         size_t       bytes_available = MIN(
             bytes_writable(stream->capacity, read_index, write_index),
-            length - bytes_written);
-        size_t       bytes_comitted  = bytes_available;
-        if (!STREAMBUFFER_CAN_STREAM(stream, options, bytes_available, (length - bytes_written))) {
+            length);
+        if (!STREAMBUFFER_CAN_STREAM(stream, options, bytes_available, length)) {
             if (!STREAMBUFFER_CAN_BLOCK(options)) {
-                break;
+                return 0;
             }
             
             parameters._futex0  = (atomic_int*)&stream->consumer_comitted_index;
@@ -263,8 +372,8 @@ streambuffer_stream_out(
         }
         
         // Handle overwrite, empty the queue by an the needed amount of bytes
-        if (bytes_available < (length - bytes_written)) {
-            streambuffer_try_truncate(stream, options, (length - bytes_written));
+        if (bytes_available < length && STREAMBUFFER_CAN_OVERWRITE(stream)) {
+            streambuffer_try_truncate(stream, options, length);
             continue;
         }
         
@@ -274,29 +383,67 @@ streambuffer_stream_out(
             continue;
         }
 
-        // Write the data to the internal buffer
-        while (bytes_available--) {
-            // (write_index++ & (stream->capacity - 1))
-            stream->buffer[(write_index++ % stream->capacity)] = casted_ptr[bytes_written++];
-        }
-        
-        // Synchronize with other producers, we must wait for our turn to increament
-        // the comitted index, otherwise we could end up telling readers that the wrong
-        // index is readable. This can be skipped for single writer
-        if (STREAMBUFFER_HAS_MULTIPLE_WRITERS(stream)) {
-            unsigned int current_commit = atomic_load(&stream->producer_comitted_index);
-            while (current_commit < (write_index - bytes_comitted)) {
-                current_commit = atomic_load(&stream->producer_comitted_index);
-            }
-        }
+        *base_out = write_index;
+        return bytes_available;
+    }
+}
+
+void
+streambuffer_write_commit(
+    _In_ streambuffer_t* stream,
+    _In_ unsigned int    base,
+    _In_ size_t          length)
+{
+    FutexParameters_t parameters;
+
+    // Synchronize with other producers, we must wait for our turn to increament
+    // the comitted index, otherwise we could end up telling readers that the wrong
+    // index is readable. This can be skipped for single writer
+    if (STREAMBUFFER_HAS_MULTIPLE_WRITERS(stream)) {
+        streambuffer_wait_commit_turn(stream, &stream->producer_comitted_index,
+            &stream->producer_commit_waiters, base);
+    }
+
+    // Both readers and writers waiting for their turn sleep on the comitted index
+    atomic_fetch_add(&stream->producer_comitted_index, length);
+    parameters._val0 = atomic_exchange(&stream->consumer_count, 0);
+    if (STREAMBUFFER_HAS_MULTIPLE_WRITERS(stream)) {
+        parameters._val0 += atomic_exchange(&stream->producer_commit_waiters, 0);
+    }
+    if (parameters._val0 != 0) {
+        parameters._futex0 = (atomic_int*)&stream->producer_comitted_index;
+        parameters._flags  = STREAMBUFFER_WAKE_FLAGS(stream);
+        dswake(&parameters);
+    }
+}
+
+size_t
+streambuffer_stream_out(
+    _In_ streambuffer_t* stream,
+    _In_ void*           buffer,
+    _In_ size_t          length,
+    _In_ unsigned int    options)
+{
+    const uint8_t* casted_ptr    = (const uint8_t*)buffer;
+    size_t         bytes_written = 0;
+    dstrace("[streambuffer_stream_out] 0x%" PRIxIN ", length %" PRIuIN ", options 0x%x",
+        buffer, length, options);
+    //streambuffer_dump(stream);
 
-        atomic_fetch_add(&stream->producer_comitted_index, bytes_comitted);
-        parameters._val0 = atomic_exchange(&stream->consumer_count, 0);
-        if (parameters._val0 != 0) {
-            parameters._futex0 = (atomic_int*)&stream->producer_comitted_index;
-            parameters._flags  = STREAMBUFFER_WAKE_FLAGS(stream);
-            dswake(&parameters);
+    // Make sure we write all the bytes
+    while (bytes_written < length) {
+        unsigned int base;
+        unsigned int state;
+        size_t       bytes_reserved = streambuffer_write_reserve(stream,
+            length - bytes_written, options, &base);
+        if (!bytes_reserved) {
+            break;
         }
+
+        state = base;
+        streambuffer_copy_in(stream, &casted_ptr[bytes_written], bytes_reserved, &state);
+        streambuffer_write_commit(stream, base, bytes_reserved);
+        bytes_written += bytes_reserved;
     }
     return bytes_written;
 }
@@ -359,7 +506,7 @@ streambuffer_write_packet_start(
         
         // Store base before writing the packet header
         *base_out = write_index;
-        streambuffer_write_packet_data(stream, &header, sizeof(sb_packethdr_t), &write_index);
+        streambuffer_copy_in(stream, &header, sizeof(sb_packethdr_t), &write_index);
         
         *state_out      = write_index;
         bytes_allocated = header.packet_len;
@@ -369,24 +516,12 @@ streambuffer_write_packet_start(
 
 void
 streambuffer_write_packet_data(
-    _In_  streambuffer_t* stream,
-    _In_  void*           buffer,
-    _In_  size_t          length,
-    _Out_ unsigned int*   state)
+    _In_    streambuffer_t* stream,
+    _In_    void*           buffer,
+    _In_    size_t          length,
+    _InOut_ unsigned int*   state)
 {
-    uint8_t*     casted_ptr    = (uint8_t*)buffer;
-    unsigned int write_index   = (*state % stream->capacity);
-    size_t       bytes_written = 0;
-    
-    while (length--) {
-        // write_index++ & (stream->capacity - 1)
-        stream->buffer[write_index++] = casted_ptr[bytes_written++];
-        if (write_index == stream->capacity) {
-            write_index = 0;
-        }
-    }
-    
-    *state = write_index;
+    streambuffer_copy_in(stream, buffer, length, state);
 }
 
 void
@@ -395,51 +530,28 @@ streambuffer_write_packet_end(
     _In_ unsigned int    base,
     _In_ size_t          length)
 {
-    FutexParameters_t parameters;
-    size_t            adjusted_length;
-    
-    // Synchronize with other producers, we must wait for our turn to increament
-    // the comitted index, otherwise we could end up telling readers that the wrong
-    // index is readable. This can be skipped for single writer
-    if (STREAMBUFFER_HAS_MULTIPLE_WRITERS(stream)) {
-        unsigned int write_index    = base;
-        unsigned int current_commit = atomic_load(&stream->producer_comitted_index);
-        while (current_commit < write_index) {
-            current_commit = atomic_load(&stream->producer_comitted_index);
-        }
-    }
-
-    adjusted_length = length + sizeof(sb_packethdr_t);
-    atomic_fetch_add(&stream->producer_comitted_index, adjusted_length);
-    parameters._val0 = atomic_exchange(&stream->consumer_count, 0);
-    if (parameters._val0 != 0) {
-        parameters._futex0 = (atomic_int*)&stream->producer_comitted_index;
-        parameters._flags  = STREAMBUFFER_WAKE_FLAGS(stream);
-        dswake(&parameters);
-    }
+    streambuffer_write_commit(stream, base, length + sizeof(sb_packethdr_t));
 }
 
 size_t
-streambuffer_stream_in(
-    _In_ streambuffer_t* stream,
-    _In_ void*           buffer,
-    _In_ size_t          length,
-    _In_  unsigned int   options)
+streambuffer_read_reserve(
+    _In_  streambuffer_t* stream,
+    _In_  size_t          length,
+    _In_  unsigned int    options,
+    _Out_ unsigned int*   base_out)
 {
-    uint8_t*          casted_ptr = (uint8_t*)buffer;
-    size_t            bytes_read = 0;
     FutexParameters_t parameters;
-    dstrace("[streambuffer_stream_in] 0x%" PRIxIN ", length %" PRIuIN ", options 0x%x",
-        buffer, length, options);
-    //streambuffer_dump(stream);
-    
+
     // Has the streambuffer been disabled?
     if (stream->options & STREAMBUFFER_DISABLED) {
         return 0;
     }
 
-    // Make sure there are bytes to read
-    while (bytes_read < length) {
+    if (!length) {
+        return 0;
+    }
+
+    while (1) {
         // when we check, we must check how many bytes are actually allocated, not currently comitted
         // as we have to take into account current readers. The write index however
         // we have to only take into account how many bytes are actually comitted
@@ -447,11 +559,10 @@ streambuffer_stream_in(
         unsigned int read_index      = atomic_load(&stream->consumer_index);
         size_t       bytes_available = MIN(
             bytes_readable(stream->capacity, read_index, write_index), 
-            length - bytes_read);
-        size_t       bytes_comitted  = bytes_available;
-        if (!STREAMBUFFER_CAN_READ(options, bytes_available, (length - bytes_read))) {
+            length);
+        if (!STREAMBUFFER_CAN_READ(options, bytes_available, length)) {
             if (!STREAMBUFFER_CAN_BLOCK(options)) {
-                break;
+                return 0;
             }
             
             parameters._futex0  = (atomic_int*)&stream->producer_comitted_index;
@@ -468,31 +579,60 @@ streambuffer_stream_in(
                 &read_index, read_index + bytes_available)) {
             continue;
         }
-        
-        // Write the data to the provided buffer
-        while (bytes_available--) {
-            // read_index++ & (stream->capacity - 1)
-            casted_ptr[bytes_read++] = stream->buffer[(read_index++ % stream->capacity)];
-        }
-        
-        // Synchronize with other consumers, we must wait for our turn to increament
-        // the comitted index, otherwise we could end up telling writers that the wrong
-        // index is writable. This can be skipped for single reader
-        if (STREAMBUFFER_HAS_MULTIPLE_READERS(stream)) {
-            unsigned int current_commit = atomic_load(&stream->consumer_comitted_index);
-            while (current_commit < (read_index - bytes_comitted)) {
-                current_commit = atomic_load(&stream->consumer_comitted_index);
-            }
-        }
 
-        atomic_fetch_add(&stream->consumer_comitted_index, bytes_comitted);
-        parameters._val0 = atomic_exchange(&stream->producer_count, 0);
-        if (parameters._val0 != 0) {
-            parameters._futex0 = (atomic_int*)&stream->consumer_comitted_index;
-            parameters._flags  = STREAMBUFFER_WAKE_FLAGS(stream);
-            dswake(&parameters);
-        }
-        break;
+        *base_out = read_index;
+        return bytes_available;
+    }
+}
+
+void
+streambuffer_read_commit(
+    _In_ streambuffer_t* stream,
+    _In_ unsigned int    base,
+    _In_ size_t          length)
+{
+    FutexParameters_t parameters;
+
+    // Synchronize with other consumers, we must wait for our turn to increament
+    // the comitted index, otherwise we could end up telling writers that the wrong
+    // index is writable. This can be skipped for single reader
+    if (STREAMBUFFER_HAS_MULTIPLE_READERS(stream)) {
+        streambuffer_wait_commit_turn(stream, &stream->consumer_comitted_index,
+            &stream->consumer_commit_waiters, base);
+    }
+
+    // Both writers and readers waiting for their turn sleep on the comitted index
+    atomic_fetch_add(&stream->consumer_comitted_index, length);
+    parameters._val0 = atomic_exchange(&stream->producer_count, 0);
+    if (STREAMBUFFER_HAS_MULTIPLE_READERS(stream)) {
+        parameters._val0 += atomic_exchange(&stream->consumer_commit_waiters, 0);
+    }
+    if (parameters._val0 != 0) {
+        parameters._futex0 = (atomic_int*)&stream->consumer_comitted_index;
+        parameters._flags  = STREAMBUFFER_WAKE_FLAGS(stream);
+        dswake(&parameters);
+    }
+}
+
+size_t
+streambuffer_stream_in(
+    _In_ streambuffer_t* stream,
+    _In_ void*           buffer,
+    _In_ size_t          length,
+    _In_  unsigned int   options)
+{
+    unsigned int base;
+    unsigned int state;
+    size_t       bytes_read;
+    dstrace("[streambuffer_stream_in] 0x%" PRIxIN ", length %" PRIuIN ", options 0x%x",
+        buffer, length, options);
+    //streambuffer_dump(stream);
+
+    bytes_read = streambuffer_read_reserve(stream, length, options, &base);
+    if (bytes_read) {
+        state = base;
+        streambuffer_copy_out(stream, buffer, bytes_read, &state);
+        streambuffer_read_commit(stream, base, bytes_read);
     }
     return bytes_read;
 }
@@ -572,19 +712,7 @@ streambuffer_read_packet_data(
     _In_    size_t          length,
     _InOut_ unsigned int*   state)
 {
-    uint8_t*     casted_ptr = (uint8_t*)buffer;
-    unsigned int read_index = (*state % stream->capacity);
-    size_t       bytes_read = 0;
-    
-    // Write the data to the provided buffer
-    while (length--) {
-        casted_ptr[bytes_read++] = stream->buffer[read_index++];
-        if (read_index == stream->capacity) {
-            read_index = 0;
-        }
-    }
-    
-    *state = read_index;
+    streambuffer_copy_out(stream, buffer, length, state);
 }
 
 void
@@ -593,29 +721,8 @@ streambuffer_read_packet_end(
     _In_ unsigned int    base,
     _In_ size_t          length)
 {
-    FutexParameters_t parameters;
-
-    // Synchronize with other consumers, we must wait for our turn to increament
-    // the comitted index, otherwise we could end up telling writers that the wrong
-    // index is writable. This can be skipped for single reader
-    if (STREAMBUFFER_HAS_MULTIPLE_READERS(stream)) {
-        unsigned int read_index     = base;
-        unsigned int current_commit = atomic_load(&stream->consumer_comitted_index);
-        while (current_commit < read_index) {
-            current_commit = atomic_load(&stream->consumer_comitted_index);
-        }
-    }
-
     // Take into account an invisible instance of sb_packethdr_t
-    length += sizeof(sb_packethdr_t);
-    
-    atomic_fetch_add(&stream->consumer_comitted_index, length);
-    parameters._val0 = atomic_exchange(&stream->producer_count, 0);
-    if (parameters._val0 != 0) {
-        parameters._futex0 = (atomic_int*)&stream->consumer_comitted_index;
-        parameters._flags  = STREAMBUFFER_WAKE_FLAGS(stream);
-        dswake(&parameters);
-    }
+    streambuffer_read_commit(stream, base, length + sizeof(sb_packethdr_t));
 }
 
 #if 0
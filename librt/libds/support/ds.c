@@ -161,48 +161,61 @@ void dserror(const char* fmt, ...)
 
 int dsmatchkey(KeyType_t type, DataKey_t key1, DataKey_t key2)
 {
-	switch (type) {
+    switch (type) {
         case KeyId: {
-			if (key1.Value.Id == key2.Value.Id) {
+            if (key1.Value.Id == key2.Value.Id) {
                 return 0;
             }
         } break;
-		case KeyInteger: {
-			if (key1.Value.Integer == key2.Value.Integer) {
+        case KeyInteger: {
+            if (key1.Value.Integer == key2.Value.Integer) {
                 return 0;
             }
-		} break;
-		case KeyString: {
-			return strcmp(key1.Value.String.Pointer, key2.Value.String.Pointer);
-		} break;
-	}
-	return -1;
+        } break;
+        case KeyString: {
+            return strcmp(key1.Value.String.Pointer, key2.Value.String.Pointer);
+        } break;
+        case KeyPointer: {
+            if (key1.Value.Pointer == key2.Value.Pointer) {
+                return 0;
+            }
+        } break;
+    }
+    return -1;
 }
 
 int dssortkey(KeyType_t type, DataKey_t key1, DataKey_t key2)
 {
-	switch (type) {
+    switch (type) {
         case KeyId: {
-			if (key1.Value.Id == key2.Value.Id)
-				return 0;
-			else if (key1.Value.Id > key2.Value.Id)
-				return 1;
-			else
-				return -1;
+            if (key1.Value.Id == key2.Value.Id)
+                return 0;
+            else if (key1.Value.Id > key2.Value.Id)
+                return 1;
+            else
+                return -1;
         } break;
-		case KeyInteger: {
-			if (key1.Value.Integer == key2.Value.Integer)
-				return 0;
-			else if (key1.Value.Integer > key2.Value.Integer)
-				return 1;
-			else
-				return -1;
-		} break;
-		case KeyString: {
-			return strcmp(key1.Value.String.Pointer, key2.Value.String.Pointer);
-		} break;
-	}
-	return 0;
+        case KeyInteger: {
+            if (key1.Value.Integer == key2.Value.Integer)
+                return 0;
+            else if (key1.Value.Integer > key2.Value.Integer)
+                return 1;
+            else
+                return -1;
+        } break;
+        case KeyString: {
+            return strcmp(key1.Value.String.Pointer, key2.Value.String.Pointer);
+        } break;
+        case KeyPointer: {
+            if (key1.Value.Pointer == key2.Value.Pointer)
+                return 0;
+            else if ((uintptr_t)key1.Value.Pointer > (uintptr_t)key2.Value.Pointer)
+                return 1;
+            else
+                return -1;
+        } break;
+    }
+    return 0;
 }
 
 /*******************************************************************************
@@ -0,0 +1,344 @@
+/* MollenOS
+ *
+ * Copyright 2018, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * - Hash Table Benchmark (host)
+ *  Verifies the hash table and compares it to the previous implementation, which
+ *  chained every key into a single Collection_t as its hash function always
+ *  returned 0. The previous implementation is quadratic, so it is only run up to
+ *  LEGACY_MAXIMUM_ENTRIES. Builds on the host against the libds sources:
+ *
+ *  cc -O2 -I../../include -idirafter ../../../libc/include -idirafter ../../../libddk/include
+ *     -o hashtable_bench main.c
+ *  Adding -mno-sse2 benchmarks the 64 bit group matching used by the kernel.
+ */
+
+// The Vali headers can't be used on the host, so provide the few definitions the
+// libds sources need
+#define __OS_DEFINITIONS__
+#define __DS_DSDEFS_H__
+#define __DDK_IO_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _In_
+#define _Out_
+#define _CODE_BEGIN
+#define _CODE_END
+#define CRTDECL(ReturnType, Function) ReturnType Function
+#define DSDECL(ReturnType, Function)  ReturnType Function
+#define MIN(a, b)                     ((a) < (b) ? (a) : (b))
+#define smp_rmb()                     atomic_thread_fence(memory_order_acquire)
+#define smp_wmb()                     atomic_thread_fence(memory_order_release)
+
+typedef unsigned int UUId_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsDoesNotExist,
+    OsInvalidParameters
+} OsStatus_t;
+
+#include "../../collection.c"
+#include "../../hashtable.c"
+
+#define MAXIMUM_ENTRIES        (10 * 1000 * 1000)
+#define LEGACY_MAXIMUM_ENTRIES (16 * 1024)
+#define STRING_KEY_LENGTH      16
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+void  dslock(SafeMemoryLock_t* lock) { }
+void  dsunlock(SafeMemoryLock_t* lock) { }
+
+int dsmatchkey(KeyType_t type, DataKey_t key1, DataKey_t key2)
+{
+    switch (type) {
+        case KeyInteger: return key1.Value.Integer == key2.Value.Integer ? 0 : -1;
+        case KeyId:      return key1.Value.Id == key2.Value.Id ? 0 : -1;
+        case KeyString:  return strcmp(key1.Value.String.Pointer, key2.Value.String.Pointer);
+        case KeyPointer: return key1.Value.Pointer == key2.Value.Pointer ? 0 : -1;
+    }
+    return -1;
+}
+
+// The previous implementation, keyed by the real key so it stays correct
+typedef struct {
+    Collection_t Bucket;
+} LegacyHashTable_t;
+
+static void LegacyInsert(LegacyHashTable_t* HashTable, DataKey_t Key, void* Data)
+{
+    CollectionItem_t* Existing = CollectionGetNodeByKey(&HashTable->Bucket, Key, 0);
+    if (Existing == NULL) {
+        // The collection owns string keys
+        if (HashTable->Bucket.KeyType == KeyString) {
+            Key.Value.String.Pointer = strdup(Key.Value.String.Pointer);
+        }
+        CollectionAppend(&HashTable->Bucket, CollectionCreateNode(Key, Data));
+    }
+    else {
+        Existing->Data = Data;
+    }
+}
+
+static void* LegacyGetValue(LegacyHashTable_t* HashTable, DataKey_t Key)
+{
+    return CollectionGetDataByKey(&HashTable->Bucket, Key, 0);
+}
+
+static void LegacyRemove(LegacyHashTable_t* HashTable, DataKey_t Key)
+{
+    CollectionRemoveByKey(&HashTable->Bucket, Key);
+}
+
+struct BenchResult {
+    double Insert;
+    double Hit;
+    double Miss;
+    double Remove;
+    double MaxInsert;
+};
+
+static char*       StringKeys;
+static size_t      EnumerateCount;
+
+static double ElapsedNs(struct timespec* Start, struct timespec* End)
+{
+    return (double)(End->tv_sec - Start->tv_sec) * 1000000000.0 + (double)(End->tv_nsec - Start->tv_nsec);
+}
+
+static DataKey_t MakeKey(KeyType_t KeyType, size_t Index)
+{
+    DataKey_t Key = { { 0 } };
+    if (KeyType == KeyString) {
+        Key.Value.String.Pointer = &StringKeys[Index * STRING_KEY_LENGTH];
+    }
+    else {
+        // Spread the keys a little, sequential ids are the easy case
+        Key.Value.Id = (UUId_t)(Index * 2654435761U);
+    }
+    return Key;
+}
+
+static void CountEntry(DataKey_t Key, void* Data, void* Context)
+{
+    EnumerateCount++;
+}
+
+static int RunHashTable(KeyType_t KeyType, size_t Count, struct BenchResult* Result)
+{
+    HashTable_t*    HashTable = HashTableCreate(KeyType, 0, 0);
+    struct timespec Start, End, Previous, Now;
+    size_t          i;
+
+    Result->MaxInsert = 0.0;
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    Previous = Start;
+    for (i = 0; i < Count; i++) {
+        if (HashTableInsert(HashTable, MakeKey(KeyType, i), (void*)(i + 1)) != NULL) {
+            printf("hashtable: insert of %zu reported an existing entry\n", i);
+            return -1;
+        }
+        if ((i & 63) == 63) {
+            double Elapsed;
+            clock_gettime(CLOCK_MONOTONIC, &Now);
+            Elapsed = ElapsedNs(&Previous, &Now) / 64.0;
+            if (Elapsed > Result->MaxInsert) {
+                Result->MaxInsert = Elapsed;
+            }
+            Previous = Now;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Result->Insert = ElapsedNs(&Start, &End) / Count;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = 0; i < Count; i++) {
+        if (HashTableGetValue(HashTable, MakeKey(KeyType, i)) != (void*)(i + 1)) {
+            printf("hashtable: lookup of %zu failed\n", i);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Result->Hit = ElapsedNs(&Start, &End) / Count;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = Count; i < 2 * Count; i++) {
+        if (HashTableGetValue(HashTable, MakeKey(KeyType, i)) != NULL) {
+            printf("hashtable: lookup of missing %zu succeeded\n", i);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Result->Miss = ElapsedNs(&Start, &End) / Count;
+
+    EnumerateCount = 0;
+    HashTableEnumerate(HashTable, CountEntry, NULL);
+    if (EnumerateCount != Count || HashTable->Size != Count) {
+        printf("hashtable: enumerated %zu of %zu entries\n", EnumerateCount, Count);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = 0; i < Count; i++) {
+        if (HashTableRemove(HashTable, MakeKey(KeyType, i)) != (void*)(i + 1)) {
+            printf("hashtable: remove of %zu failed\n", i);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Result->Remove = ElapsedNs(&Start, &End) / Count;
+
+    if (HashTable->Size != 0 || HashTableGetValue(HashTable, MakeKey(KeyType, 0)) != NULL) {
+        printf("hashtable: table not empty after removing all entries\n");
+        return -1;
+    }
+    HashTableDestroy(HashTable);
+    return 0;
+}
+
+static int RunLegacy(KeyType_t KeyType, size_t Count, struct BenchResult* Result)
+{
+    LegacyHashTable_t HashTable;
+    struct timespec   Start, End;
+    size_t            i;
+
+    CollectionConstruct(&HashTable.Bucket, KeyType);
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = 0; i < Count; i++) {
+        LegacyInsert(&HashTable, MakeKey(KeyType, i), (void*)(i + 1));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Result->Insert = ElapsedNs(&Start, &End) / Count;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = 0; i < Count; i++) {
+        if (LegacyGetValue(&HashTable, MakeKey(KeyType, i)) != (void*)(i + 1)) {
+            printf("hashtable: legacy lookup of %zu failed\n", i);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Result->Hit = ElapsedNs(&Start, &End) / Count;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = Count; i < 2 * Count; i++) {
+        LegacyGetValue(&HashTable, MakeKey(KeyType, i));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Result->Miss = ElapsedNs(&Start, &End) / Count;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for (i = 0; i < Count; i++) {
+        LegacyRemove(&HashTable, MakeKey(KeyType, i));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Result->Remove = ElapsedNs(&Start, &End) / Count;
+    return 0;
+}
+
+static int RunChurn(void)
+{
+    // Interleaved inserts and removes keep the size constant, which exercises the
+    // reuse of tombstones and the same size rehashing
+    HashTable_t* HashTable = HashTableCreate(KeyId, 0, 0);
+    size_t       i;
+
+    for (i = 0; i < 1000000; i++) {
+        HashTableInsert(HashTable, MakeKey(KeyId, i), (void*)(i + 1));
+        if (i >= 1000) {
+            if (HashTableRemove(HashTable, MakeKey(KeyId, i - 1000)) != (void*)(i - 999)) {
+                printf("hashtable: churn remove of %zu failed\n", i - 1000);
+                return -1;
+            }
+        }
+    }
+
+    if (HashTable->Size != 1000 || HashTable->Storage.Capacity > 4096) {
+        printf("hashtable: churn left %zu entries in %zu slots\n", HashTable->Size, HashTable->Storage.Capacity);
+        return -1;
+    }
+    HashTableDestroy(HashTable);
+    return 0;
+}
+
+static void PrintResult(const char* Name, size_t Count, struct BenchResult* Result)
+{
+    printf("hashtable: %-8s %9zu, %8.1f, %8.1f, %8.1f, %8.1f", Name, Count,
+        Result->Insert, Result->Hit, Result->Miss, Result->Remove);
+    if (Result->MaxInsert > 0.0) {
+        printf(", %8.1f", Result->MaxInsert);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    KeyType_t KeyTypes[2] = { KeyId, KeyString };
+    size_t    Count;
+    size_t    i;
+    int       j;
+
+    StringKeys = malloc(2 * (size_t)MAXIMUM_ENTRIES * STRING_KEY_LENGTH);
+    if (!StringKeys) {
+        printf("hashtable: failed to allocate keys\n");
+        return 1;
+    }
+    for (i = 0; i < 2 * (size_t)MAXIMUM_ENTRIES; i++) {
+        snprintf(&StringKeys[i * STRING_KEY_LENGTH], STRING_KEY_LENGTH, "key-%zu", i);
+    }
+
+#ifdef HASHTABLE_GROUP_SSE2
+    printf("hashtable: %i slot groups, SSE2\n", GROUP_WIDTH);
+#else
+    printf("hashtable: %i slot groups, SWAR\n", GROUP_WIDTH);
+#endif
+    if (RunChurn()) {
+        return 1;
+    }
+
+    printf("hashtable: ns per operation, max insert is the slowest run of 64 inserts\n");
+    printf("hashtable: table      entries,   insert,      hit,     miss,   remove,  max ins\n");
+    for (j = 0; j < 2; j++) {
+        printf("hashtable: %s keys\n", KeyTypes[j] == KeyId ? "id" : "string");
+        for (Count = 1000; Count <= MAXIMUM_ENTRIES; Count *= 10) {
+            struct BenchResult Result = { 0 };
+            if (RunHashTable(KeyTypes[j], Count, &Result)) {
+                return 1;
+            }
+            PrintResult("swiss", Count, &Result);
+
+            if (Count <= LEGACY_MAXIMUM_ENTRIES) {
+                memset(&Result, 0, sizeof(Result));
+                RunLegacy(KeyTypes[j], Count, &Result);
+                PrintResult("legacy", Count, &Result);
+            }
+        }
+    }
+
+    free(StringKeys);
+    return 0;
+}
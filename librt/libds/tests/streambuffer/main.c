@@ -0,0 +1,331 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Streambuffer Benchmark (host)
+ *  - Measures the throughput of 1, 2 and N producers and consumers at message sizes
+ *    from 16B to 64KB, through the stream, packet and in-place reserve/commit
+ *    interfaces. dswait/dswake are mapped onto Linux futexes.
+ *  - The contention runs use four times as many writers as there are cores, so
+ *    writers are preempted while others wait for their turn to commit.
+ *  Builds on the host against the libds sources:
+ *
+ *  cc -O2 -pthread -I../../include -idirafter ../../../libc/include -o streambuffer_bench main.c
+ *  ./streambuffer_bench [maximum threads]
+ */
+
+// The Vali headers can't be used on the host, so provide the few definitions the
+// libds sources need
+#define __OS_DEFINITIONS__
+#define __DS_DSDEFS_H__
+#define __INTERNAL_UTILS__
+#define __OS_FUTEX_H__
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _In_
+#define _Out_
+#define _InOut_
+#define DSDECL(ReturnType, Function) ReturnType Function
+#define MIN(a, b)                    ((a) < (b) ? (a) : (b))
+
+typedef unsigned int UUId_t;
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsOutOfMemory
+} OsStatus_t;
+
+typedef struct FutexParameters {
+    _Atomic(int)* _futex0;
+    _Atomic(int)* _futex1;
+    int           _val0;
+    int           _val1;
+    int           _val2;
+    int           _flags;
+    size_t        _timeout;
+} FutexParameters_t;
+
+#include "../../streambuffer.c"
+
+#define BUFFER_CAPACITY   (256 * 1024)
+#define BYTES_PER_RUN     (32 * 1024 * 1024)
+#define MAXIMUM_MESSAGES  (128 * 1024)
+#define MAXIMUM_THREADS   4
+#define MAXIMUM_WRITERS   64
+#define MODE_STREAM       0
+#define MODE_PACKET       1
+#define MODE_RESERVE      2
+
+void* dsalloc(size_t size) { return malloc(size); }
+void  dsfree(void* pointer) { free(pointer); }
+
+void dswait(FutexParameters_t* params)
+{
+    syscall(SYS_futex, params->_futex0, FUTEX_WAIT_PRIVATE, params->_val0, NULL, NULL, 0);
+}
+
+void dswake(FutexParameters_t* params)
+{
+    syscall(SYS_futex, params->_futex0, FUTEX_WAKE_PRIVATE, params->_val0, NULL, NULL, 0);
+}
+
+struct bench_run {
+    streambuffer_t* stream;
+    int             mode;
+    size_t          message_size;
+    size_t          messages;          // Per producer
+    size_t          consumer_messages; // Per consumer
+    _Atomic(int)    errors;
+};
+
+static const char* modeNames[] = { "stream", "packet", "reserve" };
+
+// Messages start with their sequence number, and every other byte holds the low
+// byte of it, so torn or interleaved messages are detected
+static void fill_message(uint8_t* buffer, size_t length, uint32_t sequence)
+{
+    memset(buffer, (uint8_t)sequence, length);
+    memcpy(buffer, &sequence, sizeof(uint32_t));
+}
+
+static int check_message(const uint8_t* buffer, size_t length)
+{
+    uint32_t sequence;
+    memcpy(&sequence, buffer, sizeof(uint32_t));
+    return buffer[length - 1] == (uint8_t)sequence && buffer[length / 2] == (uint8_t)sequence;
+}
+
+static void fill_segments(streambuffer_segment_t* segments, int count, uint32_t sequence)
+{
+    uint8_t header[sizeof(uint32_t)];
+    size_t  copied = 0;
+    int     i;
+
+    memcpy(&header[0], &sequence, sizeof(uint32_t));
+    for (i = 0; i < count; i++) {
+        size_t header_bytes = copied < sizeof(header) ? MIN(sizeof(header) - copied, segments[i].length) : 0;
+        memcpy(segments[i].data, &header[copied], header_bytes);
+        memset(segments[i].data + header_bytes, (uint8_t)sequence, segments[i].length - header_bytes);
+        copied += segments[i].length;
+    }
+}
+
+static uint8_t segments_byte(streambuffer_segment_t* segments, size_t index)
+{
+    if (index < segments[0].length) {
+        return segments[0].data[index];
+    }
+    return segments[1].data[index - segments[0].length];
+}
+
+static int check_segments(streambuffer_segment_t* segments, size_t length)
+{
+    uint32_t sequence = 0;
+    size_t   i;
+
+    for (i = 0; i < sizeof(uint32_t); i++) {
+        sequence |= (uint32_t)segments_byte(segments, i) << (i * 8);
+    }
+    return segments_byte(segments, length - 1) == (uint8_t)sequence &&
+        segments_byte(segments, length / 2) == (uint8_t)sequence;
+}
+
+static void* producer_main(void* context)
+{
+    struct bench_run* run    = context;
+    uint8_t*          buffer = malloc(run->message_size);
+    uint32_t          i;
+
+    for (i = 0; i < run->messages; i++) {
+        streambuffer_segment_t segments[2];
+        unsigned int           base, state;
+        size_t                 length;
+        int                    count;
+
+        if (run->mode == MODE_STREAM) {
+            fill_message(buffer, run->message_size, i);
+            streambuffer_stream_out(run->stream, buffer, run->message_size, 0);
+        }
+        else if (run->mode == MODE_PACKET) {
+            fill_message(buffer, run->message_size, i);
+            length = streambuffer_write_packet_start(run->stream, run->message_size, 0, &base, &state);
+            streambuffer_write_packet_data(run->stream, buffer, length, &state);
+            streambuffer_write_packet_end(run->stream, base, length);
+        }
+        else {
+            length = streambuffer_write_reserve(run->stream, run->message_size, 0, &base);
+            state  = base;
+            count  = streambuffer_get_segments(run->stream, length, &state, segments);
+            fill_segments(segments, count, i);
+            streambuffer_write_commit(run->stream, base, length);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void* consumer_main(void* context)
+{
+    struct bench_run* run    = context;
+    uint8_t*          buffer = malloc(run->message_size);
+    size_t            i;
+
+    for (i = 0; i < run->consumer_messages; i++) {
+        streambuffer_segment_t segments[2];
+        unsigned int           base, state;
+        size_t                 length;
+        int                    valid;
+
+        if (run->mode == MODE_STREAM) {
+            length = streambuffer_stream_in(run->stream, buffer, run->message_size, 0);
+            valid  = length == run->message_size && check_message(buffer, length);
+        }
+        else if (run->mode == MODE_PACKET) {
+            length = streambuffer_read_packet_start(run->stream, 0, &base, &state);
+            streambuffer_read_packet_data(run->stream, buffer, length, &state);
+            streambuffer_read_packet_end(run->stream, base, length);
+            valid = length == run->message_size && check_message(buffer, length);
+        }
+        else {
+            length = streambuffer_read_reserve(run->stream, run->message_size, 0, &base);
+            state  = base;
+            streambuffer_get_segments(run->stream, length, &state, segments);
+            valid = length == run->message_size && check_segments(segments, length);
+            streambuffer_read_commit(run->stream, base, length);
+        }
+
+        if (!valid) {
+            atomic_fetch_add(&run->errors, 1);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static double run_bench(int mode, int writers, int readers, size_t message_size, int* errors)
+{
+    pthread_t        producers[MAXIMUM_WRITERS];
+    pthread_t        consumers[MAXIMUM_WRITERS];
+    struct bench_run run;
+    struct timespec  start, end;
+    double           elapsed;
+    unsigned int     options = 0;
+    int              i;
+
+    if (writers > 1) {
+        options |= STREAMBUFFER_MULTIPLE_WRITERS;
+    }
+    if (readers > 1) {
+        options |= STREAMBUFFER_MULTIPLE_READERS;
+    }
+
+    // The total is rounded so it splits evenly between the readers
+    streambuffer_create(BUFFER_CAPACITY, options, &run.stream);
+    run.mode              = mode;
+    run.message_size      = message_size;
+    run.messages          = MIN(BYTES_PER_RUN / message_size, MAXIMUM_MESSAGES) / (writers * readers) * readers;
+    run.consumer_messages = (run.messages * writers) / readers;
+    atomic_store(&run.errors, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < writers; i++) {
+        pthread_create(&producers[i], NULL, producer_main, &run);
+    }
+    for (i = 0; i < readers; i++) {
+        pthread_create(&consumers[i], NULL, consumer_main, &run);
+    }
+    for (i = 0; i < writers; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    for (i = 0; i < readers; i++) {
+        pthread_join(consumers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    dsfree(run.stream);
+    *errors = atomic_load(&run.errors);
+    elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    return (double)(run.messages * writers * message_size) / elapsed / (1024.0 * 1024.0);
+}
+
+static int print_bench(int mode, int writers, int readers, size_t message_size)
+{
+    int    errors;
+    double throughput = run_bench(mode, writers, readers, message_size, &errors);
+    if (errors) {
+        printf("\nsbbench: %i corrupted messages\n", errors);
+        return -1;
+    }
+    printf(", %8.1f", throughput);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int    threadCounts[3] = { 1, 2, MAXIMUM_THREADS };
+    int    maxThreads      = MAXIMUM_THREADS;
+    int    cores           = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int    writers         = MIN(4 * cores, MAXIMUM_WRITERS);
+    size_t message_size;
+    int    mode;
+    int    i;
+
+    if (argc > 1) {
+        maxThreads = MIN(atoi(argv[1]), MAXIMUM_THREADS);
+    }
+
+    printf("sbbench: capacity %i bytes, MB/s for producers/consumers\n", BUFFER_CAPACITY);
+    printf("sbbench: mode       size,      1/1,      2/2,      %i/%i\n", MAXIMUM_THREADS, MAXIMUM_THREADS);
+    for (mode = MODE_STREAM; mode <= MODE_RESERVE; mode++) {
+        for (message_size = 16; message_size <= 64 * 1024; message_size *= 4) {
+            printf("sbbench: %-7s %6zu", modeNames[mode], message_size);
+            for (i = 0; i < 3 && threadCounts[i] <= maxThreads; i++) {
+                if (print_bench(mode, threadCounts[i], threadCounts[i], message_size)) {
+                    return 1;
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    printf("sbbench: contention on %i cores, MB/s for writers/readers\n", cores);
+    printf("sbbench: mode       size,    %3i/1,  %3i/%-3i\n", writers, writers, writers);
+    for (mode = MODE_STREAM; mode <= MODE_RESERVE; mode++) {
+        for (message_size = 16; message_size <= 4096; message_size *= 16) {
+            printf("sbbench: %-7s %6zu", modeNames[mode], message_size);
+            if (print_bench(mode, writers, 1, message_size) ||
+                print_bench(mode, writers, writers, message_size)) {
+                return 1;
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,299 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * - Timer Wheel Test & Benchmark (host)
+ *  Verifies that every timer expires exactly at its deadline, under random adds,
+ *  removes and advances of any length, and that the next deadline is never later than
+ *  the first timer that expires. Then measures add, remove and per tick cost with 100K
+ *  timers against the previous scheduler sleep queue, a list of sleepers whose time
+ *  left is decremented on every tick. Builds on the host against the libds sources:
+ *
+ *  cc -O2 -I../../include -idirafter ../../../libc/include -idirafter ../../../libddk/include
+ *     -o timerwheel_bench main.c
+ */
+
+// The Vali headers can't be used on the host, so provide the few definitions the
+// libds sources need
+#define __OS_DEFINITIONS__
+#define __DS_DSDEFS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _In_
+#define _Out_
+#define DSDECL(ReturnType, Function) ReturnType Function
+
+typedef enum {
+    OsSuccess,
+    OsError,
+    OsDoesNotExist,
+    OsInvalidParameters
+} OsStatus_t;
+
+#include "../../timerwheel.c"
+
+#define TIMER_COUNT      (100 * 1000)
+#define VERIFY_TIMERS    4096
+#define VERIFY_STEPS     (200 * 1000)
+#define BENCH_TICKS      10000
+
+#define CHECK(Expression) do { if (!(Expression)) { \
+    printf("timerwheel: %s:%i: check failed: %s\n", __FILE__, __LINE__, #Expression); exit(1); } } while (0)
+
+struct timer {
+    TimerWheelEntry_t entry;
+    uint64_t          deadline;
+    int               active;
+    size_t            expired;
+};
+
+// The previous sleep queue, which decremented the time left of every sleeper
+struct sleeper {
+    struct sleeper* link;
+    size_t          time_left;
+};
+
+static struct timer Timers[TIMER_COUNT];
+static size_t       ExpireCount;
+
+static inline uint64_t next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static double elapsed_since(struct timespec* start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start->tv_sec) + (double)(end.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+static void verify_expire(TimerWheelEntry_t* entry, void* context)
+{
+    struct timer* timer = (struct timer*)entry;
+    TimerWheel_t* wheel = context;
+
+    CHECK(timer->active);
+    CHECK(wheel->Time == timer->deadline);
+    CHECK(!TimerWheelIsActive(entry));
+    timer->active = 0;
+    timer->expired++;
+    ExpireCount++;
+}
+
+// Picks a deadline on any level of the wheel, including the overflow list
+static uint64_t random_deadline(uint64_t* state, uint64_t now)
+{
+    switch (next_random(state) % 6) {
+        case 0:  return now;
+        case 1:  return now + 1 + next_random(state) % 64;
+        case 2:  return now + 1 + next_random(state) % 4096;
+        case 3:  return now + 1 + next_random(state) % (1 << 18);
+        case 4:  return now + 1 + next_random(state) % (1 << 24);
+        default: return now + 1 + next_random(state) % (UINT64_C(1) << 28);
+    }
+}
+
+static void verify(void)
+{
+    TimerWheel_t wheel;
+    uint64_t     state = 0x2545F4914F6CDD1DULL;
+    size_t       active = 0;
+    size_t       step;
+    size_t       i;
+
+    TimerWheelConstruct(&wheel, 12345);
+    memset(&Timers[0], 0, sizeof(Timers));
+
+    for (step = 0; step < VERIFY_STEPS; step++) {
+        uint64_t       action = next_random(&state) % 16;
+        struct timer*  timer  = &Timers[next_random(&state) % VERIFY_TIMERS];
+
+        if (action < 8) {
+            if (timer->active) {
+                continue;
+            }
+            timer->deadline = random_deadline(&state, wheel.Time);
+            TimerWheelAdd(&wheel, &timer->entry, timer->deadline);
+            if (timer->deadline <= wheel.Time) {
+                timer->deadline = wheel.Time + 1;
+            }
+            timer->active = 1;
+            active++;
+        }
+        else if (action < 11) {
+            CHECK(TimerWheelRemove(&wheel, &timer->entry) == (timer->active ? OsSuccess : OsDoesNotExist));
+            if (timer->active) {
+                timer->active = 0;
+                active--;
+            }
+        }
+        else {
+            uint64_t earliest = UINT64_MAX;
+            uint64_t next     = TimerWheelNextDeadline(&wheel);
+            uint64_t target;
+
+            for (i = 0; i < VERIFY_TIMERS; i++) {
+                if (Timers[i].active && Timers[i].deadline < earliest) {
+                    earliest = Timers[i].deadline;
+                }
+            }
+            CHECK(active == wheel.Count);
+            CHECK(active ? (next > wheel.Time && next <= earliest) : next == 0);
+
+            // Mostly short steps like the scheduler, sometimes a long idle period
+            if (action < 15) {
+                target = wheel.Time + next_random(&state) % 32;
+            }
+            else {
+                target = wheel.Time + next_random(&state) % (UINT64_C(1) << 26);
+            }
+
+            ExpireCount = 0;
+            TimerWheelAdvance(&wheel, target, verify_expire, &wheel);
+            CHECK(wheel.Time == target);
+            active -= ExpireCount;
+            for (i = 0; i < VERIFY_TIMERS; i++) {
+                CHECK(!Timers[i].active || Timers[i].deadline > target);
+            }
+        }
+    }
+
+    // Everything still active must expire when the wheel is run to the end
+    ExpireCount = 0;
+    TimerWheelAdvance(&wheel, UINT64_MAX >> 1, verify_expire, &wheel);
+    CHECK(ExpireCount == active && wheel.Count == 0);
+    printf("timerwheel: %i random operations verified\n", VERIFY_STEPS);
+}
+
+static void bench_expire(TimerWheelEntry_t* entry, void* context)
+{
+    (void)entry;
+    (void)context;
+    ExpireCount++;
+}
+
+static void bench_wheel(uint64_t spread)
+{
+    TimerWheel_t    wheel;
+    uint64_t        state = 88172645463325252ULL;
+    struct timespec start;
+    double          addTime, removeTime, tickTime;
+    size_t          i;
+
+    TimerWheelConstruct(&wheel, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < TIMER_COUNT; i++) {
+        TimerWheelAdd(&wheel, &Timers[i].entry, 1 + next_random(&state) % spread);
+    }
+    addTime = elapsed_since(&start);
+
+    // One tick at a time, like the scheduler advances the wheel
+    ExpireCount = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 1; i <= BENCH_TICKS; i++) {
+        TimerWheelAdvance(&wheel, i, bench_expire, NULL);
+        (void)TimerWheelNextDeadline(&wheel);
+    }
+    tickTime = elapsed_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < TIMER_COUNT; i++) {
+        TimerWheelRemove(&wheel, &Timers[i].entry);
+    }
+    removeTime = elapsed_since(&start);
+    CHECK(wheel.Count == 0);
+
+    printf("timerwheel: wheel %8llu, %7.1f, %7.1f, %9.1f, %6zu\n", (unsigned long long)spread,
+        addTime * 1e9 / TIMER_COUNT, removeTime * 1e9 / TIMER_COUNT,
+        tickTime * 1e9 / BENCH_TICKS, ExpireCount);
+}
+
+static void bench_list(uint64_t spread)
+{
+    struct sleeper* sleepers = calloc(TIMER_COUNT, sizeof(struct sleeper));
+    struct sleeper* head     = NULL;
+    uint64_t        state    = 88172645463325252ULL;
+    struct timespec start;
+    double          addTime, tickTime;
+    size_t          ticks = BENCH_TICKS / 10;
+    size_t          i;
+
+    CHECK(sleepers != NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < TIMER_COUNT; i++) {
+        sleepers[i].time_left = 1 + next_random(&state) % spread;
+        sleepers[i].link      = head;
+        head                  = &sleepers[i];
+    }
+    addTime = elapsed_since(&start);
+
+    ExpireCount = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 1; i <= ticks; i++) {
+        struct sleeper* sleeper = head;
+        size_t          next    = SIZE_MAX;
+        while (sleeper) {
+            if (sleeper->time_left) {
+                sleeper->time_left--;
+                if (!sleeper->time_left) {
+                    ExpireCount++;
+                }
+            }
+            if (sleeper->time_left && sleeper->time_left < next) {
+                next = sleeper->time_left;
+            }
+            sleeper = sleeper->link;
+        }
+    }
+    tickTime = elapsed_since(&start);
+
+    // Removing walks the list to find the previous sleeper, measured on the average
+    printf("timerwheel: list  %8llu, %7.1f, %7s, %9.1f, %6zu (%zu ticks)\n", (unsigned long long)spread,
+        addTime * 1e9 / TIMER_COUNT, "O(n)", tickTime * 1e9 / ticks, ExpireCount, ticks);
+    free(sleepers);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t spreads[] = { 1000, 60000, 3600000 };
+    int      i;
+    (void)argc;
+    (void)argv;
+
+    verify();
+
+    printf("timerwheel: %i timers, nanoseconds per add, remove and tick, timers expired\n", TIMER_COUNT);
+    printf("timerwheel: type    spread,     add,  remove,      tick, expired\n");
+    for (i = 0; i < 3; i++) {
+        bench_wheel(spreads[i]);
+        bench_list(spreads[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,235 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * - Hierarchical Timer Wheel Implementation
+ *  A timer on level N has a deadline that only differs from the current time in the
+ *  bits of level N and below, so its slot is always ahead of the current slot of that
+ *  level. The occupied slots of each level are tracked in a bitmap, which finds the
+ *  next event of a level without looking at the slots, and lets the wheel skip
+ *  directly to the next event when advancing instead of stepping through every tick.
+ */
+
+#include <ds/timerwheel.h>
+#include <string.h>
+
+#define LEVEL_SHIFT(Level)  ((Level) * TIMERWHEEL_LEVEL_BITS)
+#define LEVEL_MASK(Level)   ((UINT64_C(1) << LEVEL_SHIFT(Level)) - 1)
+#define SLOT_INDEX(Time, Level) (unsigned int)(((Time) >> LEVEL_SHIFT(Level)) & (TIMERWHEEL_LEVEL_SLOTS - 1))
+#define OVERFLOW_SLOT       (TIMERWHEEL_LEVELS * TIMERWHEEL_LEVEL_SLOTS)
+#define OVERFLOW_SHIFT      LEVEL_SHIFT(TIMERWHEEL_LEVELS)
+
+static TimerWheelEntry_t**
+GetSlotHead(
+    _In_ TimerWheel_t* Wheel,
+    _In_ unsigned int  Slot)
+{
+    if (Slot == OVERFLOW_SLOT) {
+        return &Wheel->Overflow;
+    }
+    return &Wheel->Slots[Slot / TIMERWHEEL_LEVEL_SLOTS][Slot % TIMERWHEEL_LEVEL_SLOTS];
+}
+
+static void
+LinkEntry(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ TimerWheelEntry_t* Entry,
+    _In_ unsigned int       Slot)
+{
+    TimerWheelEntry_t** Head = GetSlotHead(Wheel, Slot);
+
+    Entry->Slot     = Slot;
+    Entry->Link     = *Head;
+    Entry->Previous = Head;
+    if (*Head) {
+        (*Head)->Previous = &Entry->Link;
+    }
+    *Head = Entry;
+
+    if (Slot != OVERFLOW_SLOT) {
+        Wheel->Occupied[Slot / TIMERWHEEL_LEVEL_SLOTS] |= UINT64_C(1) << (Slot % TIMERWHEEL_LEVEL_SLOTS);
+    }
+}
+
+static void
+UnlinkEntry(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ TimerWheelEntry_t* Entry)
+{
+    *Entry->Previous = Entry->Link;
+    if (Entry->Link) {
+        Entry->Link->Previous = Entry->Previous;
+    }
+    Entry->Link     = NULL;
+    Entry->Previous = NULL;
+
+    if (Entry->Slot != OVERFLOW_SLOT && *GetSlotHead(Wheel, Entry->Slot) == NULL) {
+        Wheel->Occupied[Entry->Slot / TIMERWHEEL_LEVEL_SLOTS] &=
+            ~(UINT64_C(1) << (Entry->Slot % TIMERWHEEL_LEVEL_SLOTS));
+    }
+}
+
+// Stores the timer on the level of the highest bit its deadline differs from the time,
+// the deadline must not be before the current time
+static void
+PlaceEntry(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ TimerWheelEntry_t* Entry)
+{
+    uint64_t     Difference = Entry->Deadline ^ Wheel->Time;
+    unsigned int Level      = 0;
+
+    if (Difference) {
+        Level = (unsigned int)(63 - __builtin_clzll(Difference)) / TIMERWHEEL_LEVEL_BITS;
+    }
+
+    if (Level >= TIMERWHEEL_LEVELS) {
+        LinkEntry(Wheel, Entry, OVERFLOW_SLOT);
+    }
+    else {
+        LinkEntry(Wheel, Entry, (Level * TIMERWHEEL_LEVEL_SLOTS) + SLOT_INDEX(Entry->Deadline, Level));
+    }
+}
+
+static void
+CascadeSlot(
+    _In_ TimerWheel_t* Wheel,
+    _In_ unsigned int  Slot)
+{
+    TimerWheelEntry_t** Head = GetSlotHead(Wheel, Slot);
+    TimerWheelEntry_t*  Entry;
+    TimerWheelEntry_t*  Next;
+
+    // Detach the slot first, timers on the overflow list can end up there again
+    Entry = *Head;
+    *Head = NULL;
+    if (Slot != OVERFLOW_SLOT) {
+        Wheel->Occupied[Slot / TIMERWHEEL_LEVEL_SLOTS] &= ~(UINT64_C(1) << (Slot % TIMERWHEEL_LEVEL_SLOTS));
+    }
+
+    while (Entry) {
+        Next = Entry->Link;
+        PlaceEntry(Wheel, Entry);
+        Entry = Next;
+    }
+}
+
+void
+TimerWheelConstruct(
+    _In_ TimerWheel_t* Wheel,
+    _In_ uint64_t      Time)
+{
+    memset(Wheel, 0, sizeof(TimerWheel_t));
+    Wheel->Time = Time;
+}
+
+void
+TimerWheelAdd(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ TimerWheelEntry_t* Entry,
+    _In_ uint64_t           Deadline)
+{
+    // The slot of the current time has already expired
+    Entry->Deadline = (Deadline > Wheel->Time) ? Deadline : Wheel->Time + 1;
+    PlaceEntry(Wheel, Entry);
+    Wheel->Count++;
+}
+
+OsStatus_t
+TimerWheelRemove(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ TimerWheelEntry_t* Entry)
+{
+    if (!Entry->Previous) {
+        return OsDoesNotExist;
+    }
+
+    UnlinkEntry(Wheel, Entry);
+    Wheel->Count--;
+    return OsSuccess;
+}
+
+uint64_t
+TimerWheelNextDeadline(
+    _In_ TimerWheel_t* Wheel)
+{
+    unsigned int Level;
+    unsigned int Current;
+    uint64_t     Occupied;
+
+    if (!Wheel->Count) {
+        return 0;
+    }
+
+    // Every event of a level is before the events of the levels above it, as those
+    // are in the slots after the current slot of their level
+    for (Level = 0; Level < TIMERWHEEL_LEVELS; Level++) {
+        Current  = SLOT_INDEX(Wheel->Time, Level);
+        Occupied = (Current == (TIMERWHEEL_LEVEL_SLOTS - 1)) ? 0 : Wheel->Occupied[Level] >> (Current + 1);
+        if (Occupied) {
+            uint64_t Slot = Current + 1 + (unsigned int)__builtin_ctzll(Occupied);
+            return (Wheel->Time & ~LEVEL_MASK(Level + 1)) | (Slot << LEVEL_SHIFT(Level));
+        }
+    }
+    return ((Wheel->Time >> OVERFLOW_SHIFT) + 1) << OVERFLOW_SHIFT;
+}
+
+size_t
+TimerWheelAdvance(
+    _In_ TimerWheel_t*      Wheel,
+    _In_ uint64_t           Time,
+    _In_ TimerWheelExpireFn ExpireFn,
+    _In_ void*              Context)
+{
+    TimerWheelEntry_t** Head;
+    TimerWheelEntry_t*  Entry;
+    size_t              Expired = 0;
+    uint64_t            Next;
+    int                 Level;
+
+    while (Wheel->Time < Time) {
+        Next = TimerWheelNextDeadline(Wheel);
+        if (!Next || Next > Time) {
+            Wheel->Time = Time;
+            break;
+        }
+        Wheel->Time = Next;
+
+        // Cascade every slot that starts now, from the top so timers can move down
+        // several levels at once
+        if (!(Wheel->Time & LEVEL_MASK(TIMERWHEEL_LEVELS))) {
+            CascadeSlot(Wheel, OVERFLOW_SLOT);
+        }
+        for (Level = TIMERWHEEL_LEVELS - 1; Level > 0; Level--) {
+            if (!(Wheel->Time & LEVEL_MASK(Level))) {
+                CascadeSlot(Wheel, (Level * TIMERWHEEL_LEVEL_SLOTS) + SLOT_INDEX(Wheel->Time, Level));
+            }
+        }
+
+        // Timers added by the callback expire on a later tick, so this terminates
+        Head = GetSlotHead(Wheel, SLOT_INDEX(Wheel->Time, 0));
+        while (*Head) {
+            Entry = *Head;
+            UnlinkEntry(Wheel, Entry);
+            Wheel->Count--;
+            Expired++;
+            ExpireFn(Entry, Context);
+        }
+    }
+    return Expired;
+}
@@ -26,49 +26,114 @@
 #include <errno.h>
 #include "include/gracht/client.h"
 #include "include/gracht/crc.h"
+#include "include/gracht/dispatch.h"
 #include "include/gracht/list.h"
 #include "include/gracht/debug.h"
 #include "include/gracht/threads.h"
 #include <string.h>
 #include <stdlib.h>
 
+#define GRACHT_CLIENT_DESCRIPTOR_COUNT 16
+#define GRACHT_CLIENT_AWAITER_COUNT    4
+#define GRACHT_CLIENT_AWAITER_IDS      8
+
 struct gracht_message_awaiter {
     struct gracht_object_header header;
     unsigned int                flags;
+    int                         pooled;
     cnd_t                       event;
     int                         id_count;
-    uint32_t                    ids[];
+    uint32_t*                   ids;
+    uint32_t                    inline_ids[GRACHT_CLIENT_AWAITER_IDS];
 };
 
 // descriptor | message | params
 struct gracht_message_descriptor {
-    gracht_object_header_t header;
-    int                    status;
-    struct gracht_message  message;
+    gracht_object_header_t         header;
+    int                            status;
+    int                            pooled;
+    gracht_client_callback_t       callback;
+    void*                          callback_context;
+    struct gracht_message_context* context;
+    size_t                         size;    // bytes available for the response
+    struct gracht_message          message;
+};
+
+// Responses up to the default message size fit a pooled descriptor, larger ones
+// get a descriptor allocated for the size of the expected response
+#define GRACHT_DESCRIPTOR_SLOT_SIZE ((sizeof(struct gracht_message_descriptor) + GRACHT_MAX_MESSAGE_SIZE + 7) & ~7)
+
+// Open addressed table of the outstanding descriptors, keyed by message id. The ids
+// are sequential, so they are used directly as the hash
+struct gracht_message_table {
+    struct gracht_message_descriptor** entries;
+    uint32_t                           capacity;
+    uint32_t                           count;
 };
 
 typedef struct gracht_client {
-    int                     iod;
-    uint32_t                current_message_id;
-    struct client_link_ops* ops;
-    struct gracht_list      protocols;
-    struct gracht_list      awaiters;
-    struct gracht_list      messages;
-    mtx_t                   sync_object;
-    mtx_t                   wait_object;
+    int                               iod;
+    uint32_t                          current_message_id;
+    struct client_link_ops*           ops;
+    struct gracht_dispatch_table      protocols;
+    struct gracht_list                awaiters;
+    struct gracht_message_table       messages;
+    struct gracht_message_descriptor* single;
+    struct gracht_object_header*      free_descriptors;
+    struct gracht_object_header*      free_awaiters;
+    char*                             descriptor_storage;
+    struct gracht_message_awaiter*    awaiter_storage;
+    mtx_t                             sync_object;
+    mtx_t                             wait_object;
 } gracht_client_t;
 
 // static methods
-static uint32_t get_message_id(gracht_client_t*);
-static void     mark_awaiters(gracht_client_t*, uint32_t);
-static int      check_awaiter_condition(gracht_client_t*, struct gracht_message_awaiter*, struct gracht_message_context**, int);
+static uint32_t                          get_message_id(gracht_client_t*);
+static void                              mark_awaiters(gracht_client_t*, uint32_t);
+static int                               check_awaiter_condition(gracht_client_t*, struct gracht_message_awaiter*, struct gracht_message_context**, int);
+static struct gracht_message_descriptor* descriptor_lookup(gracht_client_t*, uint32_t);
+static int                               descriptor_insert(gracht_client_t*, struct gracht_message_descriptor*);
+static void                              descriptor_remove(gracht_client_t*, struct gracht_message_descriptor*);
 
 // extern methods
-extern int client_invoke_action(struct gracht_list*, struct gracht_message*);
+extern int client_invoke_action(struct gracht_dispatch_table*, struct gracht_message*);
+
+// Takes a descriptor from the pool if the response fits, otherwise one is allocated.
+// Must be called with the sync_object held.
+static struct gracht_message_descriptor* descriptor_acquire(gracht_client_t* client, size_t length)
+{
+    struct gracht_message_descriptor* descriptor;
+
+    if (length <= GRACHT_DESCRIPTOR_SLOT_SIZE && client->free_descriptors) {
+        descriptor = (struct gracht_message_descriptor*)client->free_descriptors;
+        client->free_descriptors = descriptor->header.link;
+        descriptor->pooled = 1;
+        descriptor->size   = GRACHT_DESCRIPTOR_SLOT_SIZE - offsetof(struct gracht_message_descriptor, message);
+        return descriptor;
+    }
+
+    descriptor = malloc(length);
+    if (descriptor) {
+        descriptor->pooled = 0;
+        descriptor->size   = length - offsetof(struct gracht_message_descriptor, message);
+    }
+    return descriptor;
+}
+
+static void descriptor_release(gracht_client_t* client, struct gracht_message_descriptor* descriptor)
+{
+    if (descriptor->pooled) {
+        descriptor->header.link  = client->free_descriptors;
+        client->free_descriptors = &descriptor->header;
+    }
+    else {
+        free(descriptor);
+    }
+}
 
 // allocated => list_header, message_id, output_buffer
-int gracht_client_invoke(gracht_client_t* client, struct gracht_message_context* context,
-    struct gracht_message* message)
+static int client_invoke(gracht_client_t* client, struct gracht_message_context* context,
+    struct gracht_message* message, gracht_client_callback_t callback, void* callbackContext)
 {
     struct gracht_message_descriptor* descriptor = NULL;
     int status;
@@ -77,6 +142,12 @@ int gracht_client_invoke(gracht_client_t* client, struct gracht_message_context*
         errno = (EINVAL);
         return -1;
     }
+
+    // only sync messages have a response to complete
+    if (callback && MESSAGE_FLAG_TYPE(message->header.flags) != MESSAGE_FLAG_SYNC) {
+        errno = (EINVAL);
+        return -1;
+    }
     
     // fill in some message details
     message->header.id = get_message_id(client);
@@ -97,30 +168,91 @@ int gracht_client_invoke(gracht_client_t* client, struct gracht_message_context*
             }
         }
         
-        context->message_id = message->header.id;
-        context->descriptor = malloc(bufferLength);
-        if (!context->descriptor) {
+        mtx_lock(&client->sync_object);
+        descriptor = descriptor_acquire(client, bufferLength);
+        if (!descriptor) {
+            mtx_unlock(&client->sync_object);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        // the response can arrive before send returns, so the descriptor must be
+        // marked in progress before the message is sent
+        descriptor->header.id        = (int)message->header.id;
+        descriptor->header.link      = NULL;
+        descriptor->status           = GRACHT_MESSAGE_INPROGRESS;
+        descriptor->callback         = callback;
+        descriptor->callback_context = callbackContext;
+        descriptor->context          = context;
+        if (descriptor_insert(client, descriptor)) {
+            descriptor_release(client, descriptor);
+            mtx_unlock(&client->sync_object);
             errno = ENOMEM;
             return -1;
         }
-        
-        descriptor = context->descriptor;
-        descriptor->header.id   = (int)message->header.id;
-        descriptor->header.link = NULL;
-        descriptor->status      = GRACHT_MESSAGE_CREATED;
-        
-        mtx_lock(&client->sync_object);
-        gracht_list_append(&client->messages, &descriptor->header);
         mtx_unlock(&client->sync_object);
+
+        context->message_id = message->header.id;
+        context->descriptor = descriptor;
     }
     
     status = client->ops->send(client->ops, message, context);
-    if (descriptor) {
+    if (descriptor && status == GRACHT_MESSAGE_ERROR) {
+        mtx_lock(&client->sync_object);
         descriptor->status = status;
+        mtx_unlock(&client->sync_object);
     }
     return status == GRACHT_MESSAGE_ERROR ? -1 : 0;
 }
 
+int gracht_client_invoke(gracht_client_t* client, struct gracht_message_context* context,
+    struct gracht_message* message)
+{
+    return client_invoke(client, context, message, NULL, NULL);
+}
+
+int gracht_client_invoke_async(gracht_client_t* client, struct gracht_message_context* context,
+    struct gracht_message* message, gracht_client_callback_t callback, void* callbackContext)
+{
+    return client_invoke(client, context, message, callback, callbackContext);
+}
+
+// Awaiters are taken from the pool when possible, so a wait does not need to
+// allocate or initialize a condition. Must be called with the sync_object held.
+static struct gracht_message_awaiter* awaiter_acquire(gracht_client_t* client, int contextCount)
+{
+    struct gracht_message_awaiter* awaiter;
+
+    if (contextCount <= GRACHT_CLIENT_AWAITER_IDS && client->free_awaiters) {
+        awaiter = (struct gracht_message_awaiter*)client->free_awaiters;
+        client->free_awaiters = awaiter->header.link;
+        awaiter->ids = &awaiter->inline_ids[0];
+        return awaiter;
+    }
+
+    awaiter = malloc(sizeof(struct gracht_message_awaiter) + (sizeof(uint32_t) * contextCount));
+    if (!awaiter) {
+        return NULL;
+    }
+
+    cnd_init(&awaiter->event);
+    awaiter->pooled = 0;
+    awaiter->ids    = (uint32_t*)(awaiter + 1);
+    return awaiter;
+}
+
+static void awaiter_release(gracht_client_t* client, struct gracht_message_awaiter* awaiter)
+{
+    if (awaiter->pooled) {
+        awaiter->header.link  = client->free_awaiters;
+        client->free_awaiters = &awaiter->header;
+    }
+    else {
+        cnd_destroy(&awaiter->event);
+        free(awaiter);
+    }
+}
+
 int gracht_client_await_multiple(gracht_client_t* client,
     struct gracht_message_context** contexts, int contextCount, unsigned int flags)
 {
@@ -132,13 +264,14 @@ int gracht_client_await_multiple(gracht_client_t* client,
         return -1;
     }
     
-    awaiter = malloc(sizeof(struct gracht_message_awaiter) + (sizeof(uint32_t) * contextCount));
+    mtx_lock(&client->sync_object);
+    awaiter = awaiter_acquire(client, contextCount);
     if (!awaiter) {
+        mtx_unlock(&client->sync_object);
         errno = (ENOMEM);
         return -1;
     }
     
-    cnd_init(&awaiter->event);
     awaiter->header.id   = 0;
     awaiter->header.link = NULL;
     awaiter->flags       = flags;
@@ -148,15 +281,13 @@ int gracht_client_await_multiple(gracht_client_t* client,
     }
     
     // do not add the awaiter if the condition is success
-    mtx_lock(&client->sync_object);
     if (check_awaiter_condition(client, awaiter, contexts, contextCount)) {
         gracht_list_append(&client->awaiters, &awaiter->header);
         cnd_wait(&awaiter->event, &client->sync_object);
         gracht_list_remove(&client->awaiters, &awaiter->header);
     }
+    awaiter_release(client, awaiter);
     mtx_unlock(&client->sync_object);
-    
-    free(awaiter);
     return 0;
 }
 
@@ -193,7 +324,7 @@ int gracht_client_status(gracht_client_t* client, struct gracht_message_context*
     
     if (descriptor->status == GRACHT_MESSAGE_COMPLETED || 
         descriptor->status == GRACHT_MESSAGE_ERROR) {
-        gracht_list_remove(&client->messages, &descriptor->header);
+        descriptor_remove(client, descriptor);
         pointer = (char*)&descriptor->message.params[descriptor->message.header.param_in];
     }
     mtx_unlock(&client->sync_object);
@@ -227,12 +358,76 @@ int gracht_client_status(gracht_client_t* client, struct gracht_message_context*
             }
         }
         
-        free(context->descriptor);
+        mtx_lock(&client->sync_object);
+        descriptor_release(client, descriptor);
+        mtx_unlock(&client->sync_object);
+        context->descriptor = NULL;
     }
     
     return status;
 }
 
+// The link decides whether the message was received into the message buffer or
+// into resources of its own, which it then releases
+static inline void release_message(gracht_client_t* client, void* messageBuffer, struct gracht_message* message)
+{
+    if (client->ops->release) {
+        client->ops->release(client->ops, messageBuffer, message);
+    }
+}
+
+static int client_handle_message(gracht_client_t* client, struct gracht_message* message)
+{
+    struct gracht_message_descriptor* descriptor;
+    gracht_client_callback_t          callback;
+    struct gracht_message_context*    context;
+    void*                             callbackContext;
+
+    // if the message is not an event, then do not invoke any actions
+    TRACE("[gracht] [client] invoking message type %u - %u/%u",
+        message->header.flags, message->header.protocol, message->header.action);
+    if (MESSAGE_FLAG_TYPE(message->header.flags) == MESSAGE_FLAG_EVENT) {
+        return client_invoke_action(&client->protocols, message);
+    }
+    else if (MESSAGE_FLAG_TYPE(message->header.flags) != MESSAGE_FLAG_RESPONSE) {
+        return 0;
+    }
+
+    mtx_lock(&client->sync_object);
+    descriptor = descriptor_lookup(client, message->header.id);
+    mtx_unlock(&client->sync_object);
+    if (!descriptor) {
+        // what the heck?
+        ERROR("[gracht_client_wait_message] descriptor %u was not found", message->header.id);
+        errno = ENOENT;
+        return -1;
+    }
+    
+    // copy data over to message, a response larger than expected can't be unpacked
+    if (message->header.length <= descriptor->size) {
+        memcpy(&descriptor->message, message, message->header.length);
+    }
+    else {
+        ERROR("[gracht_client_wait_message] response %u is larger than expected", message->header.id);
+    }
+    
+    // set status, and iterate awaiters and mark those that contain this message. The
+    // callback is read before unlocking, as the descriptor can be released once it is completed
+    mtx_lock(&client->sync_object);
+    descriptor->status = message->header.length <= descriptor->size ?
+        GRACHT_MESSAGE_COMPLETED : GRACHT_MESSAGE_ERROR;
+    callback           = descriptor->callback;
+    context            = descriptor->context;
+    callbackContext    = descriptor->callback_context;
+    mark_awaiters(client, message->header.id);
+    mtx_unlock(&client->sync_object);
+
+    if (callback) {
+        callback(client, context, callbackContext);
+    }
+    return 0;
+}
+
 int gracht_client_wait_message(
         gracht_client_t*               client,
         struct gracht_message_context* context,
@@ -272,36 +467,108 @@ int gracht_client_wait_message(
     if (status) {
         return status;
     }
-    
-    // if the message is not an event, then do not invoke any actions
-    TRACE("[gracht] [client] invoking message type %u - %u/%u",
-        message->header.flags, message->header.protocol, message->header.action);
-    if (MESSAGE_FLAG_TYPE(message->header.flags) == MESSAGE_FLAG_EVENT) {
-        return client_invoke_action(&client->protocols, message);
+
+    status = client_handle_message(client, message);
+    release_message(client, messageBuffer, message);
+    return status;
+}
+
+int gracht_client_poll(gracht_client_t* client, void* messageBuffer, unsigned int flags)
+{
+    struct gracht_message* message;
+    int                    count = 0;
+
+    if (!client || !messageBuffer) {
+        errno = (EINVAL);
+        return -1;
     }
-    else if (MESSAGE_FLAG_TYPE(message->header.flags) == MESSAGE_FLAG_RESPONSE) {
-        struct gracht_message_descriptor* descriptor = (struct gracht_message_descriptor*)
-            gracht_list_lookup(&client->messages, (int)message->header.id);
-        if (!descriptor) {
-            // what the heck?
-            ERROR("[gracht_client_wait_message] descriptor %u was not found", message->header.id);
+
+    if (flags & GRACHT_WAIT_BLOCK) {
+        if (mtx_lock(&client->wait_object) != thrd_success) {
             return -1;
         }
-        
-        // copy data over to message
-        memcpy(&descriptor->message, message, message->header.length);
-        
-        // set status
-        descriptor->status = GRACHT_MESSAGE_COMPLETED;
-        
-        // iterate awaiters and mark those that contain this message
-        mtx_lock(&client->sync_object);
-        mark_awaiters(client, message->header.id);
-        mtx_unlock(&client->sync_object);
+    }
+    else if (mtx_trylock(&client->wait_object) != thrd_success) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // only the first receive is allowed to block, after that everything that is
+    // already available is handled. The wait object is released while handling the
+    // message, so completion callbacks are free to use the client
+    while (1) {
+        int status = client->ops->recv(client->ops, messageBuffer, count ? 0 : flags, &message);
+        mtx_unlock(&client->wait_object);
+        if (status) {
+            break;
+        }
+
+        client_handle_message(client, message);
+        release_message(client, messageBuffer, message);
+        count++;
+
+        if (mtx_trylock(&client->wait_object) != thrd_success) {
+            break;
+        }
+    }
+    return count ? count : -1;
+}
+
+static int pools_create(gracht_client_t* client)
+{
+    int i;
+
+    client->descriptor_storage = malloc(GRACHT_CLIENT_DESCRIPTOR_COUNT * GRACHT_DESCRIPTOR_SLOT_SIZE);
+    client->awaiter_storage    = malloc(GRACHT_CLIENT_AWAITER_COUNT * sizeof(struct gracht_message_awaiter));
+    client->messages.entries   = calloc(2 * GRACHT_CLIENT_DESCRIPTOR_COUNT, sizeof(struct gracht_message_descriptor*));
+    if (!client->descriptor_storage || !client->awaiter_storage || !client->messages.entries) {
+        return -1;
+    }
+    client->messages.capacity = 2 * GRACHT_CLIENT_DESCRIPTOR_COUNT;
+
+    for (i = GRACHT_CLIENT_DESCRIPTOR_COUNT - 1; i >= 0; i--) {
+        struct gracht_message_descriptor* descriptor = (struct gracht_message_descriptor*)
+            (client->descriptor_storage + (i * GRACHT_DESCRIPTOR_SLOT_SIZE));
+        descriptor->header.link  = client->free_descriptors;
+        client->free_descriptors = &descriptor->header;
+    }
+
+    for (i = GRACHT_CLIENT_AWAITER_COUNT - 1; i >= 0; i--) {
+        struct gracht_message_awaiter* awaiter = &client->awaiter_storage[i];
+        cnd_init(&awaiter->event);
+        awaiter->pooled       = 1;
+        awaiter->header.link  = client->free_awaiters;
+        client->free_awaiters = &awaiter->header;
     }
     return 0;
 }
 
+static void pools_destroy(gracht_client_t* client)
+{
+    struct gracht_object_header* item;
+    uint32_t                     i;
+
+    // descriptors that were never checked are still owned by the client
+    if (client->single) {
+        descriptor_release(client, client->single);
+    }
+    for (i = 0; i < client->messages.capacity; i++) {
+        if (client->messages.entries[i]) {
+            descriptor_release(client, client->messages.entries[i]);
+        }
+    }
+
+    item = client->free_awaiters;
+    while (item) {
+        cnd_destroy(&((struct gracht_message_awaiter*)item)->event);
+        item = item->link;
+    }
+
+    free(client->messages.entries);
+    free(client->awaiter_storage);
+    free(client->descriptor_storage);
+}
+
 int gracht_client_create(gracht_client_configuration_t* config, gracht_client_t** clientOut)
 {
     gracht_client_t* client;
@@ -323,6 +590,13 @@ int gracht_client_create(gracht_client_configuration_t* config, gracht_client_t*
     mtx_init(&client->sync_object, mtx_plain);
     mtx_init(&client->wait_object, mtx_plain);
 
+    if (pools_create(client)) {
+        ERROR("gracht_client: failed to allocate memory for client pools\n");
+        gracht_client_shutdown(client);
+        errno = (ENOMEM);
+        return -1;
+    }
+
     client->ops = config->link;
     client->iod = client->ops->connect(client->ops);
     if (client->iod < 0) {
@@ -346,6 +620,8 @@ int gracht_client_shutdown(gracht_client_t* client)
         client->ops->destroy(client->ops);
     }
     
+    gracht_dispatch_clear(&client->protocols);
+    pools_destroy(client);
     mtx_destroy(&client->sync_object);
     mtx_destroy(&client->wait_object);
     free(client);
@@ -368,8 +644,7 @@ int gracht_client_register_protocol(gracht_client_t* client, gracht_protocol_t*
         return -1;
     }
     
-    gracht_list_append(&client->protocols, &protocol->header);
-    return 0;
+    return gracht_dispatch_add(&client->protocols, protocol);
 }
 
 int gracht_client_unregister_protocol(gracht_client_t* client, gracht_protocol_t* protocol)
@@ -379,8 +654,7 @@ int gracht_client_unregister_protocol(gracht_client_t* client, gracht_protocol_t
         return -1;
     }
     
-    gracht_list_remove(&client->protocols, &protocol->header);
-    return 0;
+    return gracht_dispatch_remove(&client->protocols, protocol);
 }
 
 static void mark_awaiters(gracht_client_t* client, uint32_t messageId)
@@ -424,8 +698,7 @@ static int check_awaiter_condition(gracht_client_t* client,
     int i;
     
     for (i = 0; i < contextCount; i++) {
-        struct gracht_message_descriptor* descriptor =  (struct gracht_message_descriptor*)
-            gracht_list_lookup(&client->messages, (int)contexts[i]->message_id);
+        struct gracht_message_descriptor* descriptor = descriptor_lookup(client, contexts[i]->message_id);
         if (descriptor && ( 
                 descriptor->status == GRACHT_MESSAGE_INPROGRESS ||
                 descriptor->status == GRACHT_MESSAGE_CREATED)) {
@@ -448,3 +721,105 @@ static uint32_t get_message_id(gracht_client_t* client)
 {
     return client->current_message_id++;
 }
+
+// The common case is a single outstanding call, which is kept outside the table
+static struct gracht_message_descriptor* descriptor_lookup(gracht_client_t* client, uint32_t messageId)
+{
+    uint32_t mask = client->messages.capacity - 1;
+    uint32_t index;
+
+    if (client->single && (uint32_t)client->single->header.id == messageId) {
+        return client->single;
+    }
+
+    if (!client->messages.count) {
+        return NULL;
+    }
+
+    for (index = messageId & mask; client->messages.entries[index]; index = (index + 1) & mask) {
+        if ((uint32_t)client->messages.entries[index]->header.id == messageId) {
+            return client->messages.entries[index];
+        }
+    }
+    return NULL;
+}
+
+static void table_place(struct gracht_message_descriptor** entries, uint32_t capacity,
+    struct gracht_message_descriptor* descriptor)
+{
+    uint32_t mask  = capacity - 1;
+    uint32_t index = (uint32_t)descriptor->header.id & mask;
+
+    while (entries[index]) {
+        index = (index + 1) & mask;
+    }
+    entries[index] = descriptor;
+}
+
+static int descriptor_insert(gracht_client_t* client, struct gracht_message_descriptor* descriptor)
+{
+    if (!client->single) {
+        client->single = descriptor;
+        return 0;
+    }
+
+    // keep the load factor at or below one half
+    if ((client->messages.count + 1) * 2 > client->messages.capacity) {
+        uint32_t                           capacity = client->messages.capacity * 2;
+        struct gracht_message_descriptor** entries;
+        uint32_t                           i;
+
+        entries = calloc(capacity, sizeof(struct gracht_message_descriptor*));
+        if (!entries) {
+            return -1;
+        }
+
+        for (i = 0; i < client->messages.capacity; i++) {
+            if (client->messages.entries[i]) {
+                table_place(entries, capacity, client->messages.entries[i]);
+            }
+        }
+        free(client->messages.entries);
+        client->messages.entries  = entries;
+        client->messages.capacity = capacity;
+    }
+
+    table_place(client->messages.entries, client->messages.capacity, descriptor);
+    client->messages.count++;
+    return 0;
+}
+
+// Removal shifts the following entries of the probe sequence back, so lookups
+// never need tombstones
+static void descriptor_remove(gracht_client_t* client, struct gracht_message_descriptor* descriptor)
+{
+    uint32_t mask = client->messages.capacity - 1;
+    uint32_t index;
+    uint32_t next;
+
+    if (client->single == descriptor) {
+        client->single = NULL;
+        return;
+    }
+
+    for (index = (uint32_t)descriptor->header.id & mask; client->messages.entries[index] != descriptor;
+         index = (index + 1) & mask) {
+        if (!client->messages.entries[index]) {
+            return;
+        }
+    }
+
+    client->messages.entries[index] = NULL;
+    client->messages.count--;
+    for (next = (index + 1) & mask; client->messages.entries[next]; next = (next + 1) & mask) {
+        struct gracht_message_descriptor* entry = client->messages.entries[next];
+        uint32_t                          home  = (uint32_t)entry->header.id & mask;
+
+        // move the entry into the hole if its home slot is not between the hole and its position
+        if (((next - home) & mask) >= ((next - index) & mask)) {
+            client->messages.entries[index] = entry;
+            client->messages.entries[next]  = NULL;
+            index = next;
+        }
+    }
+}
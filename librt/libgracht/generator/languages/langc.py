@@ -170,6 +170,87 @@ def get_parameter_string(protocol, params, case):
     return ", ".join(parameters_valid)
 
 
+# Value types the generated decoders can assign directly from the wire value,
+# functions using other value types are left to the generic unpacking
+SCALAR_TYPENAMES = [
+    "char", "signed char", "unsigned char", "short", "unsigned short", "int", "unsigned int",
+    "unsigned", "long", "unsigned long", "long long", "unsigned long long", "bool", "_Bool",
+    "int8_t", "uint8_t", "int16_t", "uint16_t", "int32_t", "uint32_t", "int64_t", "uint64_t",
+    "size_t", "ssize_t", "intptr_t", "uintptr_t", "off_t", "UUId_t", "OsStatus_t"
+]
+
+
+def get_protocol_server_invoke_name(protocol, func):
+    return protocol.get_namespace() + "_" + protocol.get_name() + "_" + func.get_name() + "_invoke"
+
+
+def get_protocol_server_invokers_name(protocol):
+    return protocol.get_namespace() + "_" + protocol.get_name() + "_server_invokers"
+
+
+def get_protocol_server_invoker_count(protocol):
+    invoker_count = 0
+    for func in protocol.get_functions():
+        invoker_count = max(invoker_count, int(func.get_id(), 0) + 1)
+    return invoker_count
+
+
+def is_param_decodable(param):
+    if not param.is_value():
+        return True
+    if param.get_count() != "1":
+        return False
+    return param.get_enum_ref() is not None or param.get_typename().endswith("*") \
+        or param.get_typename() in SCALAR_TYPENAMES
+
+
+def is_function_decodable(func):
+    return all(is_param_decodable(param) for param in func.get_request_params())
+
+
+def define_invoke_body(protocol, func, outfile):
+    params = func.get_request_params()
+    struct_name = "struct " + get_input_struct_name(protocol, func)
+    uses_storage = any(param.is_buffer() or param.is_string() for param in params)
+
+    if len(params) > 0:
+        width = len(struct_name) + 1
+        outfile.write("    " + "struct gracht_param*".ljust(width) + "__params  = message->params;\n")
+        if uses_storage:
+            outfile.write("    " + "char*".ljust(width) + "__storage = (char*)message->params + "
+                          "(message->param_count * sizeof(struct gracht_param));\n")
+        outfile.write("    " + struct_name.ljust(width) + "__args;\n\n")
+
+    outfile.write("    if (message->param_in != " + str(len(params)) + ") {\n")
+    outfile.write("        return -1;\n")
+    outfile.write("    }\n\n")
+
+    last_storage_index = max([index for index, param in enumerate(params)
+                              if param.is_buffer() or param.is_string()], default=-1)
+    for index, param in enumerate(params):
+        param_access = "__params[" + str(index) + "]"
+        member = "    __args." + param.get_name() + " = "
+        if param.is_value():
+            outfile.write(member + "(" + get_param_typename(protocol, param, CONST.TYPENAME_CASE_SIZEOF) + ")"
+                          + param_access + ".data.value;\n")
+        elif param.is_shm():
+            outfile.write(member + param_access + ".data.buffer;\n")
+        else:
+            # the links may move buffers out of line, those arrive as shm parameters
+            outfile.write(member + "(" + param_access + ".type == GRACHT_PARAM_SHM) ? "
+                          + param_access + ".data.buffer : (" + param_access + ".length ? (void*)__storage : NULL);\n")
+            if index != last_storage_index:
+                outfile.write("    __storage += (" + param_access + ".type == GRACHT_PARAM_BUFFER) ? "
+                              + param_access + ".length : 0;\n")
+
+    if len(params) > 0:
+        outfile.write("    ((void (*)(struct gracht_recv_message*, " + struct_name + "*))address)(message, &__args);\n")
+    else:
+        outfile.write("    ((void (*)(struct gracht_recv_message*))address)(message);\n")
+    outfile.write("    return 0;\n")
+    return
+
+
 def get_protocol_server_response_name(protocol, func):
     return protocol.get_namespace() + "_" + protocol.get_name() + "_" + func.get_name() + "_response"
 
@@ -383,6 +464,15 @@ def define_function_body(protocol, func, outfile):
     return
 
 
+def define_function_async_body(protocol, func, outfile):
+    flags = get_message_flags_func(func)
+    define_message_struct(protocol, func.get_id(), func.get_request_params(), func.get_response_params(),
+                          flags, CONST.TYPENAME_CASE_FUNCTION_CALL, outfile)
+    outfile.write("    return gracht_client_invoke_async(client, context, (struct gracht_message*)&__message, "
+                  "callback, callback_context);\n")
+    return
+
+
 def define_status_body(protocol, func, outfile):
     define_status_struct(protocol, func.get_response_params(),
                          CONST.TYPENAME_CASE_FUNCTION_STATUS, outfile)
@@ -529,6 +619,28 @@ class CGenerator:
 
         return function_prototype + input_parameters + output_parameters + ")"
 
+    def get_function_async_prototype(self, protocol, func, case):
+        function_prototype = "int " + protocol.get_namespace().lower() + "_" \
+                             + protocol.get_name().lower() + "_" + func.get_name() + "_async"
+        function_client_param = get_param_typename(protocol, Parameter("client", "gracht_client_t*"), case)
+        function_context_param = get_param_typename(protocol,
+                                                    Parameter("context", "struct gracht_message_context*"), case)
+        function_callback_param = get_param_typename(protocol,
+                                                     Parameter("callback", "gracht_client_callback_t"), case)
+        function_callback_context_param = get_param_typename(protocol,
+                                                             Parameter("callback_context", "void*"), case)
+        function_prototype = function_prototype + "(" + function_client_param + ", " + function_context_param \
+            + ", " + function_callback_param + ", " + function_callback_context_param
+        input_parameters = get_parameter_string(protocol, func.get_request_params(), case)
+        output_parameters = get_parameter_string(protocol, func.get_response_params(), case)
+
+        if input_parameters != "":
+            input_parameters = ", " + input_parameters
+        if output_parameters != "":
+            output_parameters = ", " + output_parameters
+
+        return function_prototype + input_parameters + output_parameters + ")"
+
     def get_function_status_prototype(self, protocol, func, case):
         function_prototype = "int " + protocol.get_namespace().lower() + "_" \
                              + protocol.get_name().lower() + "_" + func.get_name() + "_result"
@@ -549,6 +661,8 @@ class CGenerator:
             outfile.write("    " +
                           self.get_function_prototype(protocol, func, CONST.TYPENAME_CASE_FUNCTION_CALL) + ";\n")
             if len(func.get_response_params()) > 0:
+                outfile.write("    " + self.get_function_async_prototype(protocol, func,
+                                                                         CONST.TYPENAME_CASE_FUNCTION_CALL) + ";\n")
                 outfile.write("    " + self.get_function_status_prototype(protocol, func,
                                                                           CONST.TYPENAME_CASE_FUNCTION_STATUS) + ";\n")
         outfile.write("\n")
@@ -607,6 +721,12 @@ class CGenerator:
             outfile.write("}\n\n")
 
             if len(func.get_response_params()) > 0:
+                outfile.write(
+                    self.get_function_async_prototype(protocol, func, CONST.TYPENAME_CASE_FUNCTION_CALL) + "\n")
+                outfile.write("{\n")
+                define_function_async_body(protocol, func, outfile)
+                outfile.write("}\n\n")
+
                 outfile.write(
                     self.get_function_status_prototype(protocol, func, CONST.TYPENAME_CASE_FUNCTION_STATUS) + "\n")
                 outfile.write("{\n")
@@ -622,6 +742,25 @@ class CGenerator:
                 define_response_body(protocol, func, "MESSAGE_FLAG_RESPONSE", outfile)
                 outfile.write("}\n\n")
 
+    def define_server_invokers(self, protocol, outfile):
+        if len(protocol.get_functions()) == 0:
+            return
+
+        decodable = [func for func in protocol.get_functions() if is_function_decodable(func)]
+        for func in decodable:
+            outfile.write("static int " + get_protocol_server_invoke_name(protocol, func)
+                          + "(void* address, struct gracht_recv_message* message)\n")
+            outfile.write("{\n")
+            define_invoke_body(protocol, func, outfile)
+            outfile.write("}\n\n")
+
+        outfile.write("const gracht_protocol_invoke_t " + get_protocol_server_invokers_name(protocol)
+                      + "[" + str(get_protocol_server_invoker_count(protocol)) + "] = {\n")
+        for func in decodable:
+            outfile.write("    [" + func.get_id() + "] = " + get_protocol_server_invoke_name(protocol, func) + ",\n")
+        outfile.write("};\n\n")
+        return
+
     def define_events(self, protocol, outfile):
         for evt in protocol.get_events():
             outfile.write(
@@ -690,8 +829,10 @@ class CGenerator:
         return
 
     def write_server_protocol_prototypes(self, protocol, outfile):
-        # write response prototypes
+        # write response prototypes and the decoder table
         if len(protocol.get_functions()) > 0:
+            outfile.write("    extern const gracht_protocol_invoke_t " + get_protocol_server_invokers_name(protocol)
+                          + "[" + str(get_protocol_server_invoker_count(protocol)) + "];\n")
             for func in protocol.get_functions():
                 if len(func.get_response_params()) > 0:
                     outfile.write("    " + self.get_response_prototype(
@@ -726,12 +867,14 @@ class CGenerator:
             outfile.write(" * };\n")
             outfile.write(" */\n\n")
 
+            invoker_count = str(get_protocol_server_invoker_count(protocol))
             outfile.write("#define DEFINE_" + protocol.get_namespace().upper() + "_" + protocol.get_name().upper())
             outfile.write("_SERVER_PROTOCOL(cbTable, cbCount) gracht_protocol_t ")
             outfile.write(protocol.get_namespace() + "_" + protocol.get_name() + "_server_protocol = ")
-            outfile.write("GRACHT_PROTOCOL_INIT(" + protocol.get_id() + ", \""
+            outfile.write("GRACHT_PROTOCOL_INIT_INVOKERS(" + protocol.get_id() + ", \""
                           + protocol.get_namespace().lower() + "_" + protocol.get_name().lower()
-                          + "\", cbCount, cbTable)\n\n")
+                          + "\", cbCount, cbTable, " + invoker_count + ", "
+                          + get_protocol_server_invokers_name(protocol) + ")\n\n")
         return
 
     def generate_shared_header(self, protocol, directory):
@@ -803,6 +946,7 @@ class CGenerator:
                 "<string.h>"], f)
             self.define_server_responses(protocol, f)
             self.define_events(protocol, f)
+            self.define_server_invokers(protocol, f)
         return
 
     def generate_shared_files(self, out, protocols, include_protocols):
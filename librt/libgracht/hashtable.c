@@ -0,0 +1,184 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Hashtable Implementation
+ * - Chained hashtable of object headers keyed by id, with a power of two
+ *   bucket count that doubles when the load factor passes 3/4
+ */
+
+#include <errno.h>
+#include "include/gracht/hashtable.h"
+#include <stdlib.h>
+
+#define HASHTABLE_MIN_BUCKETS 16
+
+// Fibonacci hashing, ids are either sequential descriptors or crc32 values
+// of addresses, so spread the bits before masking
+static inline size_t get_bucket_index(struct gracht_hashtable* hashtable, int id)
+{
+    return (size_t)(((uint32_t)id * 2654435769u) >> 8) & (hashtable->bucket_count - 1);
+}
+
+static int resize_table(struct gracht_hashtable* hashtable, size_t bucketCount)
+{
+    struct gracht_object_header** buckets;
+    size_t                        oldCount = hashtable->bucket_count;
+    size_t                        i;
+
+    buckets = calloc(bucketCount, sizeof(struct gracht_object_header*));
+    if (!buckets) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    hashtable->bucket_count = bucketCount;
+    for (i = 0; i < oldCount; i++) {
+        struct gracht_object_header* item = hashtable->buckets[i];
+        while (item) {
+            struct gracht_object_header* next  = item->link;
+            size_t                       index = get_bucket_index(hashtable, item->id);
+            item->link     = buckets[index];
+            buckets[index] = item;
+            item           = next;
+        }
+    }
+
+    free(hashtable->buckets);
+    hashtable->buckets = buckets;
+    return 0;
+}
+
+int gracht_hashtable_construct(struct gracht_hashtable* hashtable, size_t capacity)
+{
+    size_t bucketCount = HASHTABLE_MIN_BUCKETS;
+
+    if (!hashtable) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (bucketCount < capacity) {
+        bucketCount <<= 1;
+    }
+
+    hashtable->buckets = calloc(bucketCount, sizeof(struct gracht_object_header*));
+    if (!hashtable->buckets) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    hashtable->bucket_count  = bucketCount;
+    hashtable->element_count = 0;
+    return 0;
+}
+
+void gracht_hashtable_destroy(struct gracht_hashtable* hashtable)
+{
+    if (!hashtable) {
+        return;
+    }
+
+    free(hashtable->buckets);
+    hashtable->buckets       = NULL;
+    hashtable->bucket_count  = 0;
+    hashtable->element_count = 0;
+}
+
+int gracht_hashtable_insert(struct gracht_hashtable* hashtable, struct gracht_object_header* item)
+{
+    size_t index;
+
+    if (!hashtable || !hashtable->buckets || !item) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // keep the load factor below 3/4, a failed resize is not fatal as the
+    // table keeps working with longer chains
+    if ((hashtable->element_count + 1) * 4 > hashtable->bucket_count * 3) {
+        (void)resize_table(hashtable, hashtable->bucket_count << 1);
+    }
+
+    index = get_bucket_index(hashtable, item->id);
+    item->link = hashtable->buckets[index];
+    hashtable->buckets[index] = item;
+    hashtable->element_count++;
+    return 0;
+}
+
+struct gracht_object_header* gracht_hashtable_get(struct gracht_hashtable* hashtable, int id)
+{
+    struct gracht_object_header* item;
+
+    if (!hashtable || !hashtable->buckets) {
+        return NULL;
+    }
+
+    item = hashtable->buckets[get_bucket_index(hashtable, id)];
+    while (item) {
+        if (item->id == id) {
+            return item;
+        }
+        item = item->link;
+    }
+    return NULL;
+}
+
+struct gracht_object_header* gracht_hashtable_remove(struct gracht_hashtable* hashtable, int id)
+{
+    struct gracht_object_header** itr;
+
+    if (!hashtable || !hashtable->buckets) {
+        return NULL;
+    }
+
+    itr = &hashtable->buckets[get_bucket_index(hashtable, id)];
+    while (*itr) {
+        struct gracht_object_header* item = *itr;
+        if (item->id == id) {
+            *itr       = item->link;
+            item->link = NULL;
+            hashtable->element_count--;
+            return item;
+        }
+        itr = &item->link;
+    }
+    return NULL;
+}
+
+void gracht_hashtable_enumerate(struct gracht_hashtable* hashtable,
+    gracht_hashtable_enumerate_fn callback, void* context)
+{
+    size_t i;
+
+    if (!hashtable || !hashtable->buckets || !callback) {
+        return;
+    }
+
+    // the link is read before invoking the callback, which allows the callback
+    // to free the item as long as it does not modify the table
+    for (i = 0; i < hashtable->bucket_count; i++) {
+        struct gracht_object_header* item = hashtable->buckets[i];
+        while (item) {
+            struct gracht_object_header* next = item->link;
+            callback(item, context);
+            item = next;
+        }
+    }
+}
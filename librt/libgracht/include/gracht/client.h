@@ -34,6 +34,10 @@ typedef struct gracht_client_configuration {
 
 typedef struct gracht_client gracht_client_t;
 
+// Invoked when the response to an asynchronously invoked message has arrived, the
+// result must be read from the context with the matching result function.
+typedef void (*gracht_client_callback_t)(gracht_client_t*, struct gracht_message_context*, void*);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,6 +54,16 @@ int gracht_client_iod(gracht_client_t*);
 int gracht_client_wait_message(gracht_client_t *client, struct gracht_message_context *context, void *messageBuffer,
                                unsigned int flags);
 int gracht_client_invoke(gracht_client_t*, struct gracht_message_context*, struct gracht_message*);
+
+// Pipelined requests. The context must stay valid until the response has been read,
+// and the callback is invoked by whichever thread receives the response. Without a
+// callback the context can be awaited like a future.
+int gracht_client_invoke_async(gracht_client_t*, struct gracht_message_context*, struct gracht_message*,
+                               gracht_client_callback_t, void*);
+
+// Handles all messages that are available, the first receive blocks if GRACHT_WAIT_BLOCK
+// is set. Returns the number of messages handled, or -1 if none were.
+int gracht_client_poll(gracht_client_t*, void* messageBuffer, unsigned int flags);
 int gracht_client_await(gracht_client_t*, struct gracht_message_context*);
 int gracht_client_await_multiple(gracht_client_t*, struct gracht_message_context**, int, unsigned int);
 int gracht_client_status(gracht_client_t*, struct gracht_message_context*, struct gracht_param*);
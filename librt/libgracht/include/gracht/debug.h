@@ -32,7 +32,11 @@
 #elif defined(__linux__)
 #include <stdio.h>
 
+#ifdef __TRACE
 #define TRACE(...)   printf(__VA_ARGS__)
+#else
+#define TRACE(...)
+#endif
 #define WARNING(...) printf(__VA_ARGS__)
 #define ERROR(...)   printf(__VA_ARGS__)
 
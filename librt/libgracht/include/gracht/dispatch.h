@@ -0,0 +1,66 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Dispatch Type Definitions & Structures
+ * - This header describes the base dispatch-structure, prototypes
+ *   and functionality, refer to the individual things for descriptions
+ */
+
+#ifndef __GRACHT_DISPATCH_H__
+#define __GRACHT_DISPATCH_H__
+
+#include "types.h"
+
+#define GRACHT_DISPATCH_MAX_PROTOCOLS 256
+
+// Each registered protocol gets an entry that maps the action id directly
+// to the function, the table is sized to the highest action id in the protocol
+struct gracht_dispatch_entry {
+    gracht_protocol_t*          protocol;
+    int                         action_count;
+    gracht_protocol_function_t* actions[];
+};
+
+typedef struct gracht_dispatch_table {
+    struct gracht_dispatch_entry* entries[GRACHT_DISPATCH_MAX_PROTOCOLS];
+} gracht_dispatch_table_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  gracht_dispatch_add(struct gracht_dispatch_table*, gracht_protocol_t*);
+int  gracht_dispatch_remove(struct gracht_dispatch_table*, gracht_protocol_t*);
+void gracht_dispatch_clear(struct gracht_dispatch_table*);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline gracht_protocol_function_t*
+gracht_dispatch_lookup(struct gracht_dispatch_table* table, uint8_t protocol_id, uint8_t action_id)
+{
+    struct gracht_dispatch_entry* entry = table->entries[protocol_id];
+    if (!entry || action_id >= entry->action_count) {
+        return NULL;
+    }
+    return entry->actions[action_id];
+}
+
+#endif // !__GRACHT_DISPATCH_H__
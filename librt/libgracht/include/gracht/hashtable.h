@@ -0,0 +1,58 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Hashtable Type Definitions & Structures
+ * - This header describes the base hashtable-structure, prototypes
+ *   and functionality, refer to the individual things for descriptions
+ */
+
+#ifndef __GRACHT_HASHTABLE_H__
+#define __GRACHT_HASHTABLE_H__
+
+#include "types.h"
+
+// The hashtable is intrusive, objects are keyed by their header id and
+// chained through the header link. An object can therefore only be a member
+// of one list or hashtable at the time.
+typedef struct gracht_hashtable {
+    struct gracht_object_header** buckets;
+    size_t                        bucket_count;
+    size_t                        element_count;
+} gracht_hashtable_t;
+
+typedef void (*gracht_hashtable_enumerate_fn)(struct gracht_object_header*, void*);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hashtable API
+// Insert, lookup and removal are O(1) on average, the table doubles its bucket
+// count when the load factor exceeds 3/4.
+int                          gracht_hashtable_construct(struct gracht_hashtable*, size_t capacity);
+void                         gracht_hashtable_destroy(struct gracht_hashtable*);
+int                          gracht_hashtable_insert(struct gracht_hashtable*, struct gracht_object_header*);
+struct gracht_object_header* gracht_hashtable_get(struct gracht_hashtable*, int id);
+struct gracht_object_header* gracht_hashtable_remove(struct gracht_hashtable*, int id);
+void                         gracht_hashtable_enumerate(struct gracht_hashtable*, gracht_hashtable_enumerate_fn, void*);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // !__GRACHT_HASHTABLE_H__
@@ -38,6 +38,7 @@ struct gracht_server_client {
     struct gracht_object_header header;
     uint32_t                    subscriptions[8]; // 32 bytes to cover 255 bits
     int                         iod;
+    int                         references; // managed by the server
 };
 
 struct server_link_ops;
@@ -47,11 +48,14 @@ typedef int (*server_create_client_fn)(struct server_link_ops*, struct gracht_re
 typedef int (*server_recv_client_fn)(struct gracht_server_client*, struct gracht_recv_message*, unsigned int flags);
 typedef int (*server_send_client_fn)(struct gracht_server_client*, struct gracht_message*, unsigned int flags);
 typedef int (*server_destroy_client_fn)(struct gracht_server_client*);
+typedef int (*server_queue_client_fn)(struct gracht_server_client*, struct gracht_message*, unsigned int flags);
+typedef int (*server_release_client_fn)(struct gracht_server_client*, struct gracht_recv_message*);
 
 typedef int  (*server_link_listen_fn)(struct server_link_ops*, int mode);
 typedef int  (*server_link_accept_fn)(struct server_link_ops*, struct gracht_server_client**);
 typedef int  (*server_link_recv_packet_fn)(struct server_link_ops*, struct gracht_recv_message*, unsigned int flags);
 typedef int  (*server_link_respond_fn)(struct server_link_ops*, struct gracht_recv_message*, struct gracht_message*);
+typedef int  (*server_link_flush_fn)(struct server_link_ops*);
 typedef void (*server_link_destroy_fn)(struct server_link_ops*);
 
 struct server_link_ops {
@@ -59,23 +63,28 @@ struct server_link_ops {
     server_destroy_client_fn destroy_client;
     server_recv_client_fn    recv_client;
     server_send_client_fn    send_client;
+    server_queue_client_fn   queue_client;   // optional, used for coalescing events
+    server_release_client_fn release_client; // optional, called once a received message has been handled
 
     server_link_listen_fn      listen;
     server_link_accept_fn      accept;
     server_link_recv_packet_fn recv_packet;
     server_link_respond_fn     respond;
+    server_link_flush_fn       flush;      // optional, sends all queued messages
     server_link_destroy_fn     destroy;
 };
 
 typedef int  (*client_link_connect_fn)(struct client_link_ops*);
 typedef int  (*client_link_recv_fn)(struct client_link_ops*, void* messageBuffer, unsigned int flags, struct gracht_message**);
 typedef int  (*client_link_send_fn)(struct client_link_ops*, struct gracht_message*, void* messageContext);
+typedef void (*client_link_release_fn)(struct client_link_ops*, void* messageBuffer, struct gracht_message*);
 typedef void (*client_link_destroy_fn)(struct client_link_ops*);
 
 struct client_link_ops {
     client_link_connect_fn connect;
     client_link_recv_fn    recv;
     client_link_send_fn    send;
+    client_link_release_fn release; // optional, called once a received message has been handled
     client_link_destroy_fn destroy;
 };
 
@@ -0,0 +1,96 @@
+/* MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Shared Memory Link Type Definitions & Structures
+ * - This header describes the base link-structure, prototypes
+ *   and functionality, refer to the individual things for descriptions
+ */
+
+#ifndef __GRACHT_LINK_SHM_H__
+#define __GRACHT_LINK_SHM_H__
+
+#if !defined(__linux__)
+#error "The shared memory link is only supported on linux"
+#endif
+
+#include "socket.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define GRACHT_SHM_MAGIC              0x4D485347 // GSHM
+#define GRACHT_SHM_HEADER_SIZE        4096
+#define GRACHT_SHM_RECORD_ALIGN       64
+#define GRACHT_SHM_DEFAULT_RING_SIZE  (4 * 1024 * 1024)
+#define GRACHT_SHM_DEFAULT_THRESHOLD  256
+
+#define GRACHT_SHM_RECORD_FREE 0
+#define GRACHT_SHM_RECORD_USED 1
+
+// The shm link is a socket link that moves buffer parameters through a memfd
+// ring owned by the client. The client allocates records in the ring and passes
+// them as GRACHT_PARAM_SHM parameters carrying the offset of the record data,
+// the server marks the records free again once the message has been handled.
+// The socket only carries the control traffic.
+struct gracht_shm_ring_header {
+    uint32_t    magic;
+    uint32_t    size;
+    atomic_uint released; // incremented by the server, used as the futex word
+    atomic_uint waiters;  // set by the client while waiting for free space
+};
+
+struct gracht_shm_record {
+    atomic_uint state;
+    uint32_t    span;    // total size of the record including this header
+};
+
+// Sent by the client as the first data on the connection, with the memfd
+// attached as SCM_RIGHTS.
+struct gracht_shm_handshake {
+    uint32_t magic;
+    uint32_t size;
+};
+
+struct shm_client_configuration {
+    struct socket_client_configuration socket;
+    size_t                             ring_size; // power of two, 0 for default
+    size_t                             threshold; // smallest buffer moved to the ring, 0 for default
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Link API
+int gracht_link_shm_server_create(struct server_link_ops** linkOut,
+    struct socket_server_configuration* configuration);
+int gracht_link_shm_client_create(struct client_link_ops** linkOut,
+    struct shm_client_configuration* configuration);
+
+/**
+ * gracht_link_shm_client_alloc
+ * * Allocates a buffer in the ring of a connected shm client link. Buffers passed
+ * * as parameters are sent without being copied, and are released by the server once
+ * * the message has been handled. Buffers that are not sent must be freed.
+ */
+void* gracht_link_shm_client_alloc(struct client_link_ops* link, size_t length);
+void  gracht_link_shm_client_free(struct client_link_ops* link, void* buffer);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // !__GRACHT_LINK_SHM_H__
@@ -37,18 +37,25 @@
 #include "link.h"
 #include "../client.h"
 
+// Stream connections accept messages up to max_message_size, which can be raised
+// above GRACHT_MAX_MESSAGE_SIZE. Messages larger than that are reassembled in a
+// buffer of their own, so the receive buffers keep their default size. Packets
+// are always limited to GRACHT_MAX_MESSAGE_SIZE.
 struct socket_server_configuration {
     struct sockaddr_storage server_address;
     socklen_t               server_address_length;
     
     struct sockaddr_storage dgram_address;
     socklen_t               dgram_address_length;
+
+    size_t                  max_message_size; // 0 for GRACHT_MAX_MESSAGE_SIZE
 };
 
 struct socket_client_configuration {
     enum gracht_link_type   type;
     struct sockaddr_storage address;
     socklen_t               address_length;
+    size_t                  max_message_size; // 0 for GRACHT_MAX_MESSAGE_SIZE
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,81 @@
+/* MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Stream Reader Type Definitions & Structures
+ * - This header describes the base stream-structure, prototypes
+ *   and functionality, refer to the individual things for descriptions
+ */
+
+#ifndef __GRACHT_LINK_STREAM_H__
+#define __GRACHT_LINK_STREAM_H__
+
+#include "../types.h"
+
+struct msghdr;
+
+#define GRACHT_STREAM_BUFFER_SIZE (8 * GRACHT_MAX_MESSAGE_SIZE)
+
+// The stream reader pulls as much data as is available from the socket, and
+// hands out one framed message at the time. This means a burst of messages
+// only costs one recv call instead of two per message. Messages larger than
+// GRACHT_MAX_MESSAGE_SIZE arrive in many pieces, they are reassembled in a buffer
+// allocated for that message only, so idle streams only pay for the small buffer.
+struct gracht_stream_reader {
+    char*  data;
+    size_t offset;
+    size_t length;
+    size_t max_length;   // largest message accepted, 0 for GRACHT_MAX_MESSAGE_SIZE
+    char*  large;        // message being reassembled
+    size_t large_length; // bytes of the message received so far
+    int    broken;       // the stream went out of sync and was shut down
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * gracht_stream_reader_destroy
+ * * Frees the buffers of the reader, and any partially received message.
+ */
+void gracht_stream_reader_destroy(struct gracht_stream_reader* reader);
+
+/**
+ * gracht_stream_reader_read
+ * * Reads the next full message into messageBuffer, which must be able to hold
+ * * GRACHT_MAX_MESSAGE_SIZE bytes. Larger messages are returned in a buffer that
+ * * is owned by the caller, which is any message not located in messageBuffer.
+ * * Returns -1 with errno ENODATA if no full message is available, any partial
+ * * message is kept for the next call. A frame with an invalid length means the
+ * * stream is out of sync, the socket is then shut down and -1 is returned with
+ * * errno EPIPE, for this and any later call.
+ */
+int gracht_stream_reader_read(struct gracht_stream_reader* reader, int iod,
+    void* messageBuffer, int flags, void** messageOut);
+
+/**
+ * gracht_stream_send
+ * * Sends the full message described by msg. Large messages do not fit the socket
+ * * buffer, so they leave in several pieces, the iovecs of msg are advanced as data is sent.
+ */
+int gracht_stream_send(int iod, struct msghdr* msg, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // !__GRACHT_LINK_STREAM_H__
@@ -34,22 +34,7 @@ typedef struct gracht_list {
 #define GRACHT_LIST_HEAD(list) (list)->head
 #define GRACHT_LIST_LINK(elem) (elem)->link
 
-static struct gracht_object_header*
-gracht_list_lookup(struct gracht_list* list, int id)
-{
-    struct gracht_object_header* item;
-    
-    item = list->head;
-    while (item) {
-        if (item->id == id) {
-            return item;
-        }
-        item = item->link;
-    }
-    return NULL;
-}
-
-static void
+static inline void
 gracht_list_append(struct gracht_list* list, struct gracht_object_header* item)
 {
     if (!list->head) {
@@ -64,7 +49,7 @@ gracht_list_append(struct gracht_list* list, struct gracht_object_header* item)
     }
 }
 
-static void
+static inline void
 gracht_list_remove(struct gracht_list* list, struct gracht_object_header* item)
 {
     if (list->head == item) {
@@ -28,8 +28,16 @@
 
 typedef struct gracht_client gracht_client_t;
 
+// Set max_dispatchers to a value above 0 to enable handling of messages in a pool of
+// worker threads. Messages from the same client are always handled by the same worker,
+// which keeps the requests of each client in order.
+// Set coalesce_events to queue broadcasted events per client, they are then sent together
+// once the current batch of messages has been handled, or when gracht_server_flush_events
+// is called. Links that do not support queueing send the events immediately.
 typedef struct gracht_server_configuration {
     struct server_link_ops* link;
+    int                     max_dispatchers;
+    int                     coalesce_events;
 } gracht_server_configuration_t;
 
 #ifdef __cplusplus
@@ -53,6 +61,7 @@ int gracht_server_get_dgram_iod(void);
 int gracht_server_respond(struct gracht_recv_message*, struct gracht_message*);
 int gracht_server_send_event(int, struct gracht_message*, unsigned int);
 int gracht_server_broadcast_event(struct gracht_message*, unsigned int);
+int gracht_server_flush_events(void);
 
 #ifdef __cplusplus
 }
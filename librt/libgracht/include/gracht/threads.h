@@ -28,10 +28,29 @@
 #include <threads.h>
 #elif defined(__linux__)
 #include <pthread.h>
+#include <stdint.h>
 
+typedef pthread_t       thrd_t;
 typedef pthread_mutex_t mtx_t;
+typedef int (*thrd_start_t)(void*);
 
 #define thrd_success 0
+#define thrd_error   2
+
+static inline int thrd_create(thrd_t* thr, thrd_start_t func, void* arg) {
+    return pthread_create(thr, NULL, (void* (*)(void*))func, arg) == 0 ? thrd_success : thrd_error;
+}
+
+static inline int thrd_join(thrd_t thr, int* res) {
+    void* result;
+    if (pthread_join(thr, &result)) {
+        return thrd_error;
+    }
+    if (res) {
+        *res = (int)(intptr_t)result;
+    }
+    return thrd_success;
+}
 
 #define mtx_plain NULL
 
@@ -47,6 +66,7 @@ typedef pthread_cond_t cnd_t;
 #define cnd_destroy   pthread_cond_destroy
 #define cnd_wait      pthread_cond_wait
 #define cnd_signal    pthread_cond_signal
+#define cnd_broadcast pthread_cond_broadcast
 
 #else
 #error "Undefined platform for threads"
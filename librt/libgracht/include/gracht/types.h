@@ -46,6 +46,8 @@
 #define MESSAGE_FLAG_EVENT    0x00000002
 #define MESSAGE_FLAG_RESPONSE 0x00000003
 
+// Size of the message buffers, stream links can be configured to accept larger
+// messages, which are then received into buffers of their own
 #define GRACHT_MAX_MESSAGE_SIZE 512
 
 #define GRACHT_PARAM_VALUE  0
@@ -115,14 +117,23 @@ typedef struct gracht_protocol_function {
     void*   address;
 } gracht_protocol_function_t;
 
+// Generated per-function decoders, they unpack the message directly into the
+// argument structure of the function and call it. Returns -1 if the message does
+// not have the layout of the function, the generic unpacking is used instead.
+typedef int (*gracht_protocol_invoke_t)(void* address, struct gracht_recv_message* message);
+
 typedef struct gracht_protocol {
-    gracht_object_header_t      header;
-    uint8_t                     id;
-    char*                       name;
-    uint8_t                     num_functions;
-    gracht_protocol_function_t* functions;
+    gracht_object_header_t          header;
+    uint8_t                         id;
+    char*                           name;
+    uint8_t                         num_functions;
+    gracht_protocol_function_t*     functions;
+    uint8_t                         num_invokers;
+    const gracht_protocol_invoke_t* invokers;
 } gracht_protocol_t;
 
-#define GRACHT_PROTOCOL_INIT(id, name, num_functions, functions) { { id, NULL }, id, name, num_functions, functions }
+#define GRACHT_PROTOCOL_INIT(id, name, num_functions, functions) { { id, NULL }, id, name, num_functions, functions, 0, NULL }
+#define GRACHT_PROTOCOL_INIT_INVOKERS(id, name, num_functions, functions, num_invokers, invokers) \
+    { { id, NULL }, id, name, num_functions, functions, num_invokers, invokers }
 
 #endif // !__GRACHT_TYPES_H__
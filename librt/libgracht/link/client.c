@@ -21,9 +21,9 @@
  *   and functionality, refer to the individual things for descriptions
  */
 
-#include <assert.h>
 #include <errno.h>
 #include "../include/gracht/link/socket.h"
+#include "../include/gracht/link/stream.h"
 #include "../include/gracht/debug.h"
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +32,7 @@ struct socket_link_manager {
     struct client_link_ops             ops;
     struct socket_client_configuration config;
     int                                iod;
+    struct gracht_stream_reader        reader;
 };
 
 static int socket_link_send_stream(struct socket_link_manager* linkManager,
@@ -39,7 +40,6 @@ static int socket_link_send_stream(struct socket_link_manager* linkManager,
 {
     struct iovec  iov[1 + message->header.param_in];
     int           i;
-    intmax_t      byteCount;
     struct msghdr msg = {
         .msg_name = NULL,
         .msg_namelen = 0,
@@ -57,21 +57,19 @@ static int socket_link_send_stream(struct socket_link_manager* linkManager,
     
     // Prepare the parameters
     for (i = 0; i < message->header.param_in; i++) {
-        if (message->params[i].type == GRACHT_PARAM_BUFFER) {
+        // the socket link has no shared memory, so those are sent inline
+        if (message->params[i].type == GRACHT_PARAM_BUFFER ||
+            message->params[i].type == GRACHT_PARAM_SHM) {
+            message->params[i].type      = GRACHT_PARAM_BUFFER;
             iov[msg.msg_iovlen].iov_len  = message->params[i].length;
             iov[msg.msg_iovlen].iov_base = message->params[i].data.buffer;
             msg.msg_iovlen++;
         }
-        else if (message->params[i].type == GRACHT_PARAM_SHM) {
-            // NO SUPPORT
-            assert(0);
-        }
     }
 
-    byteCount = sendmsg(linkManager->iod, &msg, 0);
-    if (byteCount != message->header.length) {
-        ERROR("link_client: failed to send message, bytes sent: %li, expected: %u (%i)\n",
-              byteCount, message->header.length, errno);
+    if (gracht_stream_send(linkManager->iod, &msg, message->header.length)) {
+        ERROR("link_client: failed to send message of %u bytes (%i)\n",
+              message->header.length, errno);
         errno = (EPIPE);
         return GRACHT_MESSAGE_ERROR;
     }
@@ -82,40 +80,27 @@ static int socket_link_send_stream(struct socket_link_manager* linkManager,
 static int socket_link_recv_stream(struct socket_link_manager* linkManager,
     void* messageBuffer, unsigned int flags, struct gracht_message** messageOut)
 {
-    struct gracht_message* message = messageBuffer;
-    char*                  params_storage;
-    size_t                 bytes_read;
-    
-    TRACE("[gracht_connection_recv_stream] reading message header\n");
-    bytes_read = recv(linkManager->iod, message, sizeof(struct gracht_message), flags);
-    if (bytes_read != sizeof(struct gracht_message)) {
-        if (bytes_read == 0) {
-            errno = (ENODATA);
-        }
-        else {
-            errno = (EPIPE);
+    TRACE("[gracht_connection_recv_stream] reading message\n");
+    if (gracht_stream_reader_read(&linkManager->reader, linkManager->iod,
+            messageBuffer, (int)flags, (void**)messageOut)) {
+        if (errno == EPIPE) {
+            ERROR("link_client: stream is out of sync, connection was shut down\n");
         }
         return -1;
     }
-    
-    if (message->header.param_in) {
-        TRACE("[gracht_connection_recv_stream] reading message payload\n");
-        
-        params_storage = (char*)messageBuffer + sizeof(struct gracht_message);
-        bytes_read     = recv(linkManager->iod, params_storage, message->header.length - sizeof(struct gracht_message), MSG_WAITALL);
-        if (bytes_read != message->header.length - sizeof(struct gracht_message)) {
-            // do not process incomplete requests
-            ERROR("[gracht_connection_recv_message] did not read full amount of bytes (%u, expected %u)",
-                  (uint32_t)bytes_read, (uint32_t)(message->header.length - sizeof(struct gracht_message)));
-            errno = (EPIPE);
-            return -1; 
-        }
-    }
-    
-    *messageOut = message;
     return 0;
 }
 
+// Messages too large for the message buffer are reassembled by the stream reader
+// in a buffer of their own
+static void socket_link_release(struct socket_link_manager* linkManager,
+    void* messageBuffer, struct gracht_message* message)
+{
+    if ((void*)message != messageBuffer) {
+        free(message);
+    }
+}
+
 static int socket_link_send_packet(struct socket_link_manager* linkManager, struct gracht_message* message)
 {
     struct iovec  iov[1 + message->header.param_in];
@@ -141,15 +126,14 @@ static int socket_link_send_packet(struct socket_link_manager* linkManager, stru
     
     // Prepare the parameters
     for (i = 0; i < message->header.param_in; i++) {
-        if (message->params[i].type == GRACHT_PARAM_BUFFER) {
+        // the socket link has no shared memory, so those are sent inline
+        if (message->params[i].type == GRACHT_PARAM_BUFFER ||
+            message->params[i].type == GRACHT_PARAM_SHM) {
+            message->params[i].type      = GRACHT_PARAM_BUFFER;
             iov[msg.msg_iovlen].iov_len  = message->params[i].length;
             iov[msg.msg_iovlen].iov_base = message->params[i].data.buffer;
             msg.msg_iovlen++;
         }
-        else if (message->params[i].type == GRACHT_PARAM_SHM) {
-            // NO SUPPORT
-            assert(0);
-        }
     }
     
     byteCount = sendmsg(linkManager->iod, &msg, 0);
@@ -186,8 +170,8 @@ static int socket_link_recv_packet(struct socket_link_manager* linkManager,
     // the use of MSG_WAITALL here.
     TRACE("[gracht_connection_recv_stream] reading full message");
     intmax_t bytes_read = recvmsg(linkManager->iod, &msg, flags);
-    if (bytes_read < sizeof(struct gracht_message)) {
-        if (bytes_read == 0) {
+    if (bytes_read < (intmax_t)sizeof(struct gracht_message)) {
+        if (bytes_read == 0 || (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
             errno = (ENODATA);
         }
         else {
@@ -226,14 +210,21 @@ static int socket_link_recv(struct socket_link_manager* linkManager,
 {
     unsigned int convertedFlags = 0;
     
-    if (flags & GRACHT_WAIT_BLOCK) {
-        convertedFlags |= MSG_WAITALL;
-    }
-    
     if (linkManager->config.type == gracht_link_stream_based) {
+        // the stream reader reads whatever is available, so never wait for the
+        // full buffer to be filled
+        if (!(flags & GRACHT_WAIT_BLOCK)) {
+            convertedFlags |= MSG_DONTWAIT;
+        }
         return socket_link_recv_stream(linkManager, messageBuffer, convertedFlags, messageOut);
     }
     else if (linkManager->config.type == gracht_link_packet_based) {
+        if (flags & GRACHT_WAIT_BLOCK) {
+            convertedFlags |= MSG_WAITALL;
+        }
+        else {
+            convertedFlags |= MSG_DONTWAIT;
+        }
         return socket_link_recv_packet(linkManager, messageBuffer, convertedFlags, messageOut);
     }
     
@@ -244,8 +235,10 @@ static int socket_link_recv(struct socket_link_manager* linkManager,
 static int socket_link_send(struct socket_link_manager* linkManager,
     struct gracht_message* message, void* messageContext)
 {
-    // perform length check before sending
-    if (message->header.length > GRACHT_MAX_MESSAGE_SIZE) {
+    // perform length check before sending, packets can't be split
+    size_t maxLength = linkManager->config.type == gracht_link_stream_based ?
+        linkManager->config.max_message_size : GRACHT_MAX_MESSAGE_SIZE;
+    if (message->header.length > maxLength) {
         errno = (E2BIG);
         return GRACHT_MESSAGE_ERROR;
     }
@@ -273,6 +266,7 @@ static void socket_link_destroy(struct socket_link_manager* linkManager)
         close(linkManager->iod);
     }
     
+    gracht_stream_reader_destroy(&linkManager->reader);
     free(linkManager);
 }
 
@@ -289,10 +283,15 @@ int gracht_link_socket_client_create(struct client_link_ops** linkOut,
     
     memset(linkManager, 0, sizeof(struct socket_link_manager));
     memcpy(&linkManager->config, configuration, sizeof(struct socket_client_configuration));
+    if (!linkManager->config.max_message_size) {
+        linkManager->config.max_message_size = GRACHT_MAX_MESSAGE_SIZE;
+    }
+    linkManager->reader.max_length = linkManager->config.max_message_size;
 
     linkManager->ops.connect     = (client_link_connect_fn)socket_link_connect;
     linkManager->ops.recv        = (client_link_recv_fn)socket_link_recv;
     linkManager->ops.send        = (client_link_send_fn)socket_link_send;
+    linkManager->ops.release     = (client_link_release_fn)socket_link_release;
     linkManager->ops.destroy     = (client_link_destroy_fn)socket_link_destroy;
     
     *linkOut = &linkManager->ops;
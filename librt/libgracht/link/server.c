@@ -21,17 +21,45 @@
  *   and functionality, refer to the individual things for descriptions
  */
 
-#include <assert.h>
+#if defined(__linux__)
+#define _GNU_SOURCE // recvmmsg/sendmmsg
+#endif
+
 #include <errno.h>
 #include "../include/gracht/link/socket.h"
+#include "../include/gracht/link/stream.h"
 #include "../include/gracht/debug.h"
+#include "../include/gracht/threads.h"
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <gracht/crc.h>
 
+#define SOCKET_LINK_SEND_BUFFER_SIZE (8 * GRACHT_MAX_MESSAGE_SIZE)
+#define SOCKET_LINK_BATCH_SIZE       16
+
+struct socket_link_manager;
+
 struct socket_link_client {
     struct gracht_server_client base;
     struct sockaddr_storage     address;
+    struct socket_link_manager* manager;
+    int                         packet_based;
+    struct gracht_stream_reader reader;
+
+    // writes to the client are serialized, so queued messages go out before
+    // anything sent after them, and messages on a stream are never interleaved
+    mtx_t                       send_lock;
+    atomic_int                  broken;
+
+    // queued messages that are sent on the next flush, protected by the pending lock.
+    // A pending client is either on the pending list or on the list of a flush
+    struct socket_link_client*  pending_link;
+    int                         pending;
+    int                         flushing;
+    int                         destroyed; // freed by the flush once it is done
+    char*                       send_buffer;
+    size_t                      send_length;
 };
 
 struct socket_link_manager {
@@ -40,14 +68,60 @@ struct socket_link_manager {
     
     int client_socket;
     int dgram_socket;
+
+    mtx_t                      pending_lock;
+    struct socket_link_client* pending;
+
+#if defined(__linux__)
+    // packets are received in batches, and handed out one at the time
+    char*          dgram_storage;
+    struct mmsghdr dgram_messages[SOCKET_LINK_BATCH_SIZE];
+    struct iovec   dgram_iovs[SOCKET_LINK_BATCH_SIZE];
+    int            dgram_index;
+    int            dgram_count;
+#endif
 };
 
+static int flush_client(struct socket_link_client*);
+
+// The socket link has no shared memory, so those parameters are sent inline as
+// buffers. The message belongs to the caller, so the type is changed in a copy
+// of the header, which must be able to hold the header and its parameters.
+static int prepare_message(struct gracht_message* message, struct gracht_message* header, struct iovec* iov)
+{
+    size_t headerLength = sizeof(struct gracht_message) + (
+        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param));
+    int    count = 1;
+    int    i;
+
+    iov[0].iov_base = message;
+    iov[0].iov_len  = headerLength;
+    for (i = 0; i < message->header.param_in; i++) {
+        if (message->params[i].type == GRACHT_PARAM_SHM) {
+            if (iov[0].iov_base == message) {
+                memcpy(header, message, headerLength);
+                iov[0].iov_base = header;
+            }
+            header->params[i].type = GRACHT_PARAM_BUFFER;
+        }
+
+        if (message->params[i].type == GRACHT_PARAM_BUFFER ||
+            message->params[i].type == GRACHT_PARAM_SHM) {
+            iov[count].iov_len  = message->params[i].length;
+            iov[count].iov_base = message->params[i].data.buffer;
+            count++;
+        }
+    }
+    return count;
+}
+
 static int socket_link_send_client(struct socket_link_client* client,
     struct gracht_message* message, unsigned int flags)
 {
+    char          header[sizeof(struct gracht_message) + (
+        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param))];
     struct iovec  iov[1 + message->header.param_in];
-    int           i;
-    intmax_t      bytesWritten;
+    int           status;
     struct msghdr msg = {
         .msg_name = NULL,
         .msg_namelen = 0,
@@ -57,64 +131,58 @@ static int socket_link_send_client(struct socket_link_client* client,
         .msg_controllen = 0,
         .msg_flags = 0
     };
-    
-    // Prepare the header
-    iov[0].iov_base = message;
-    iov[0].iov_len  = sizeof(struct gracht_message) + (
-        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param));
-    
-    // Prepare the parameters
-    for (i = 0; i < message->header.param_in; i++) {
-        if (message->params[i].type == GRACHT_PARAM_BUFFER) {
-            iov[msg.msg_iovlen].iov_len  = message->params[i].length;
-            iov[msg.msg_iovlen].iov_base = message->params[i].data.buffer;
-            msg.msg_iovlen++;
-        }
-        else if (message->params[i].type == GRACHT_PARAM_SHM) {
-            // NO SUPPORT
-            assert(0);
-        }
-    }
 
-    TRACE("[socket_link_send] sending message\n");
-    bytesWritten = sendmsg(client->base.iod, &msg, 0);
-    if (bytesWritten != message->header.length) {
+    // messages queued for the client must go out first to keep the order
+    mtx_lock(&client->send_lock);
+    status = flush_client(client);
+    if (status || atomic_load(&client->broken)) {
+        mtx_unlock(&client->send_lock);
+        errno = (EPIPE);
         return -1;
     }
 
-    return 0;
+    // packet based clients share the dgram socket, so they must be addressed
+    if (client->packet_based) {
+        msg.msg_name    = &client->address;
+        msg.msg_namelen = client->manager->config.dgram_address_length;
+    }
+    msg.msg_iovlen = prepare_message(message, (struct gracht_message*)&header[0], &iov[0]);
+
+    TRACE("[socket_link_send] sending message\n");
+    if (client->packet_based) {
+        intmax_t bytesWritten = sendmsg(client->base.iod, &msg, 0);
+        status = bytesWritten == message->header.length ? 0 : -1;
+    }
+    else {
+        status = gracht_stream_send(client->base.iod, &msg, message->header.length);
+        if (status) {
+            atomic_store(&client->broken, 1);
+            shutdown(client->base.iod, SHUT_RDWR);
+        }
+    }
+    mtx_unlock(&client->send_lock);
+    return status;
 }
 
 static int socket_link_recv_client(struct socket_link_client* client,
     struct gracht_recv_message* context, unsigned int flags)
 {
-    struct gracht_message* message        = context->storage;
+    struct gracht_message* message;
     char*                  params_storage = NULL;
-    intmax_t               bytes_read;
     
-    TRACE("[gracht_connection_recv_stream] reading message header\n");
-    bytes_read = recv(client->base.iod, message, sizeof(struct gracht_message), flags);
-    if (bytes_read != sizeof(struct gracht_message)) {
-        if (bytes_read == 0) {
-            errno = (ENODATA);
+    TRACE("[gracht_connection_recv_stream] reading message\n");
+    if (gracht_stream_reader_read(&client->reader, client->base.iod,
+            context->storage, (int)flags, (void**)&message)) {
+        if (errno == EPIPE) {
+            atomic_store(&client->broken, 1);
         }
         return -1;
     }
     
-    if (message->header.param_in) {
-        intmax_t bytesToRead = message->header.length - sizeof(struct gracht_message);
-
-        TRACE("[gracht_connection_recv_stream] reading message payload\n");
-        params_storage = (char*)context->storage + sizeof(struct gracht_message);
-        bytes_read     = recv(client->base.iod, params_storage, (size_t)bytesToRead, MSG_WAITALL);
-        if (bytes_read != bytesToRead) {
-            // do not process incomplete requests
-            // TODO error code / handling
-            ERROR("[gracht_connection_recv_message] did not read full amount of bytes (%u, expected %u)\n",
-                  (uint32_t)bytes_read, (uint32_t)(message->header.length - sizeof(struct gracht_message)));
-            errno = (EPIPE);
-            return -1;
-        }
+    // large messages are not located in the storage, but in a buffer of their own,
+    // the parameter pointer is what lets the release find it again
+    if (message->header.param_in || (void*)message != context->storage) {
+        params_storage = (char*)message + sizeof(struct gracht_message);
     }
 
     context->message_id  = message->header.id;
@@ -128,6 +196,253 @@ static int socket_link_recv_client(struct socket_link_client* client,
     return 0;
 }
 
+// Messages that were too large for the storage are freed once they have been handled
+static int socket_link_release_client(struct socket_link_client* client, struct gracht_recv_message* context)
+{
+    char* message;
+
+    if (!context->params) {
+        return 0;
+    }
+
+    message = (char*)context->params - sizeof(struct gracht_message);
+    if (message != (char*)context->storage) {
+        free(message);
+    }
+    return 0;
+}
+
+// Event coalescing
+// Messages are serialized into the send buffer of the client, and all clients with
+// queued messages are sent in one go on flush. Stream clients get one send for all
+// their messages, packet clients are sent with one sendmmsg per batch.
+#if defined(__linux__)
+static void flush_packets(struct socket_link_manager* linkManager, struct mmsghdr* messages, int count)
+{
+    int sent = 0;
+    while (sent < count) {
+        int status = sendmmsg(linkManager->dgram_socket, &messages[sent], (unsigned int)(count - sent), 0);
+        if (status <= 0) {
+            ERROR("link_server: failed to send queued packets (%i)\n", errno);
+            break;
+        }
+        sent += status;
+    }
+}
+#endif
+
+// Sends the messages queued for the client, the caller must hold the send lock of
+// the client. The buffer is taken under the pending lock, and sent without it, so
+// messages can be queued to a new buffer in the meantime. A stream that could not be
+// fully written is out of sync, so the socket is shut down, which makes the server
+// see a disconnect and destroy the client.
+static int flush_client(struct socket_link_client* client)
+{
+    struct socket_link_manager* linkManager = client->manager;
+    char*                       buffer;
+    size_t                      length;
+    int                         status = 0;
+
+    mtx_lock(&linkManager->pending_lock);
+    buffer = client->send_buffer;
+    length = client->send_length;
+    if (length) {
+        client->send_buffer = NULL;
+        client->send_length = 0;
+    }
+    mtx_unlock(&linkManager->pending_lock);
+
+    if (!length) {
+        return 0;
+    }
+
+    if (client->packet_based) {
+#if defined(__linux__)
+        struct mmsghdr messages[SOCKET_LINK_BATCH_SIZE];
+        struct iovec   iovs[SOCKET_LINK_BATCH_SIZE];
+        size_t         offset = 0;
+        int            count  = 0;
+
+        while (offset < length) {
+            struct gracht_message* message = (struct gracht_message*)(buffer + offset);
+
+            iovs[count].iov_base = message;
+            iovs[count].iov_len  = message->header.length;
+            memset(&messages[count], 0, sizeof(struct mmsghdr));
+            messages[count].msg_hdr.msg_name    = &client->address;
+            messages[count].msg_hdr.msg_namelen = linkManager->config.dgram_address_length;
+            messages[count].msg_hdr.msg_iov     = &iovs[count];
+            messages[count].msg_hdr.msg_iovlen  = 1;
+
+            offset += message->header.length;
+            if (++count == SOCKET_LINK_BATCH_SIZE) {
+                flush_packets(linkManager, &messages[0], count);
+                count = 0;
+            }
+        }
+
+        if (count) {
+            flush_packets(linkManager, &messages[0], count);
+        }
+#else
+        size_t offset = 0;
+        while (offset < length) {
+            struct gracht_message* message = (struct gracht_message*)(buffer + offset);
+            sendto(client->base.iod, message, message->header.length, 0,
+                (const struct sockaddr*)&client->address, linkManager->config.dgram_address_length);
+            offset += message->header.length;
+        }
+#endif
+    }
+    else {
+        struct iovec  iov = { buffer, length };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+        status = gracht_stream_send(client->base.iod, &msg, length);
+        if (status) {
+            ERROR("link_server: failed to send %lu queued bytes (%i)\n",
+                (unsigned long)length, errno);
+            atomic_store(&client->broken, 1);
+            shutdown(client->base.iod, SHUT_RDWR);
+        }
+    }
+
+    // keep the buffer for the next messages, unless a new one was needed meanwhile
+    mtx_lock(&linkManager->pending_lock);
+    if (!client->send_buffer) {
+        client->send_buffer = buffer;
+        buffer              = NULL;
+    }
+    mtx_unlock(&linkManager->pending_lock);
+    free(buffer);
+    return status;
+}
+
+static void remove_pending(struct socket_link_manager* linkManager, struct socket_link_client* client)
+{
+    struct socket_link_client** itr = &linkManager->pending;
+    while (*itr) {
+        if (*itr == client) {
+            *itr = client->pending_link;
+            break;
+        }
+        itr = &(*itr)->pending_link;
+    }
+    client->pending_link = NULL;
+}
+
+static int socket_link_queue_client(struct socket_link_client* client,
+    struct gracht_message* message, unsigned int flags)
+{
+    struct socket_link_manager* linkManager = client->manager;
+    struct gracht_message*      queued;
+    size_t                      headerLength;
+    char*                       pointer;
+    int                         i;
+
+    if (atomic_load(&client->broken)) {
+        errno = (EPIPE);
+        return -1;
+    }
+
+    mtx_lock(&linkManager->pending_lock);
+    if (!client->send_buffer) {
+        client->send_buffer = malloc(SOCKET_LINK_SEND_BUFFER_SIZE);
+    }
+
+    // messages that don't fit are sent right away, after the ones queued before them
+    if (!client->send_buffer ||
+        client->send_length + message->header.length > SOCKET_LINK_SEND_BUFFER_SIZE) {
+        mtx_unlock(&linkManager->pending_lock);
+        return socket_link_send_client(client, message, flags);
+    }
+
+    // serialize the message the same way it is written by sendmsg
+    headerLength = sizeof(struct gracht_message) + (
+        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param));
+    pointer = client->send_buffer + client->send_length;
+    queued  = (struct gracht_message*)pointer;
+    memcpy(pointer, message, headerLength);
+    pointer += headerLength;
+    
+    // the socket link has no shared memory, so those are sent inline
+    for (i = 0; i < message->header.param_in; i++) {
+        if (message->params[i].type == GRACHT_PARAM_BUFFER ||
+            message->params[i].type == GRACHT_PARAM_SHM) {
+            queued->params[i].type = GRACHT_PARAM_BUFFER;
+            memcpy(pointer, message->params[i].data.buffer, message->params[i].length);
+            pointer += message->params[i].length;
+        }
+    }
+
+    if (!client->pending) {
+        client->pending      = 1;
+        client->pending_link = linkManager->pending;
+        linkManager->pending = client;
+    }
+    client->send_length += message->header.length;
+    mtx_unlock(&linkManager->pending_lock);
+    return 0;
+}
+
+static void free_client(struct socket_link_client* client)
+{
+    // packet based clients share the dgram socket of the link
+    if (!client->packet_based) {
+        close(client->base.iod);
+    }
+
+    gracht_stream_reader_destroy(&client->reader);
+    mtx_destroy(&client->send_lock);
+    free(client->send_buffer);
+    free(client);
+}
+
+// The pending list is taken under the lock, and the clients are sent to without it.
+// Clients that are destroyed while being flushed are freed once the flush is done
+// with them, and clients that were queued to again are put back on the pending list.
+static int socket_link_flush(struct socket_link_manager* linkManager)
+{
+    struct socket_link_client* client;
+    struct socket_link_client* itr;
+
+    mtx_lock(&linkManager->pending_lock);
+    client = linkManager->pending;
+    linkManager->pending = NULL;
+    for (itr = client; itr; itr = itr->pending_link) {
+        itr->flushing = 1;
+    }
+    mtx_unlock(&linkManager->pending_lock);
+
+    while (client) {
+        struct socket_link_client* next = client->pending_link;
+        int                        destroyed;
+
+        mtx_lock(&client->send_lock);
+        flush_client(client);
+        mtx_unlock(&client->send_lock);
+
+        mtx_lock(&linkManager->pending_lock);
+        client->flushing     = 0;
+        client->pending_link = NULL;
+        destroyed            = client->destroyed;
+        if (!destroyed && client->send_length) {
+            client->pending_link = linkManager->pending;
+            linkManager->pending = client;
+        }
+        else {
+            client->pending = 0;
+        }
+        mtx_unlock(&linkManager->pending_lock);
+
+        if (destroyed) {
+            free_client(client);
+        }
+        client = next;
+    }
+    return 0;
+}
+
 static int socket_link_create_client(struct socket_link_manager* linkManager, struct gracht_recv_message* message,
     struct socket_link_client** clientOut)
 {
@@ -146,11 +461,14 @@ static int socket_link_create_client(struct socket_link_manager* linkManager, st
     }
 
     memset(client, 0, sizeof(struct socket_link_client));
+    mtx_init(&client->send_lock, mtx_plain);
     client->base.header.id = message->client;
-    client->base.iod = linkManager->dgram_socket;
+    client->base.iod       = linkManager->dgram_socket;
+    client->manager        = linkManager;
+    client->packet_based   = 1;
 
     address = (struct sockaddr_storage*)message->storage;
-    memcpy(&client->address, address, (size_t)linkManager->config.server_address_length);
+    memcpy(&client->address, address, (size_t)linkManager->config.dgram_address_length);
     
     *clientOut = client;
     return 0;
@@ -158,16 +476,25 @@ static int socket_link_create_client(struct socket_link_manager* linkManager, st
 
 static int socket_link_destroy_client(struct socket_link_client* client)
 {
-    int status;
-    
     if (!client) {
         errno = (EINVAL);
         return -1;
     }
-    
-    status = close(client->base.iod);
-    free(client);
-    return status;
+
+    mtx_lock(&client->manager->pending_lock);
+    if (client->flushing) {
+        client->destroyed = 1;
+        mtx_unlock(&client->manager->pending_lock);
+        return 0;
+    }
+
+    if (client->pending) {
+        remove_pending(client->manager, client);
+    }
+    mtx_unlock(&client->manager->pending_lock);
+
+    free_client(client);
+    return 0;
 }
 
 static int socket_link_listen(struct socket_link_manager* linkManager, int mode)
@@ -220,7 +547,7 @@ static int socket_link_listen(struct socket_link_manager* linkManager, int mode)
 static int socket_link_accept(struct socket_link_manager* linkManager, struct gracht_server_client** clientOut)
 {
     struct socket_link_client* client;
-    socklen_t                  address_length;
+    socklen_t                  address_length = sizeof(struct sockaddr_storage);
     TRACE("[socket_link_accept]\n");
 
     client = (struct socket_link_client*)malloc(sizeof(struct socket_link_client));
@@ -239,12 +566,58 @@ static int socket_link_accept(struct socket_link_manager* linkManager, struct gr
         free(client);
         return -1;
     }
-    client->base.header.id = client->base.iod;
+    mtx_init(&client->send_lock, mtx_plain);
+    client->base.header.id    = client->base.iod;
+    client->manager           = linkManager;
+    client->reader.max_length = linkManager->config.max_message_size;
     
     *clientOut = &client->base;
     return 0;
 }
 
+#if defined(__linux__)
+static int fill_packet_batch(struct socket_link_manager* linkManager, unsigned int flags)
+{
+    size_t addressLength = (size_t)linkManager->config.dgram_address_length;
+    int    status;
+    int    i;
+
+    if (!linkManager->dgram_storage) {
+        linkManager->dgram_storage = malloc(SOCKET_LINK_BATCH_SIZE * GRACHT_MAX_MESSAGE_SIZE);
+        if (!linkManager->dgram_storage) {
+            errno = (ENOMEM);
+            return -1;
+        }
+    }
+
+    // each slot is laid out like the receive storage, address first then the message
+    for (i = 0; i < SOCKET_LINK_BATCH_SIZE; i++) {
+        char* slot = linkManager->dgram_storage + (i * GRACHT_MAX_MESSAGE_SIZE);
+
+        linkManager->dgram_iovs[i].iov_base = slot + addressLength;
+        linkManager->dgram_iovs[i].iov_len  = GRACHT_MAX_MESSAGE_SIZE - addressLength;
+        memset(&linkManager->dgram_messages[i], 0, sizeof(struct mmsghdr));
+        linkManager->dgram_messages[i].msg_hdr.msg_name    = slot;
+        linkManager->dgram_messages[i].msg_hdr.msg_namelen = (socklen_t)addressLength;
+        linkManager->dgram_messages[i].msg_hdr.msg_iov     = &linkManager->dgram_iovs[i];
+        linkManager->dgram_messages[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    status = recvmmsg(linkManager->dgram_socket, &linkManager->dgram_messages[0],
+        SOCKET_LINK_BATCH_SIZE, (int)flags, NULL);
+    if (status <= 0) {
+        if (status == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+            errno = (ENODATA);
+        }
+        return -1;
+    }
+
+    linkManager->dgram_index = 0;
+    linkManager->dgram_count = status;
+    return 0;
+}
+#endif
+
 static int socket_link_recv_packet(struct socket_link_manager* linkManager, 
     struct gracht_recv_message* context, unsigned int flags)
 {
@@ -252,7 +625,22 @@ static int socket_link_recv_packet(struct socket_link_manager* linkManager,
         (char*)context->storage + linkManager->config.dgram_address_length);
     void*                  params_storage = NULL;
     uint32_t               addressCrc;
+    socklen_t              addressLength;
 
+#if defined(__linux__)
+    struct mmsghdr* packet;
+    
+    if (linkManager->dgram_index == linkManager->dgram_count) {
+        if (fill_packet_batch(linkManager, flags)) {
+            return -1;
+        }
+    }
+
+    packet = &linkManager->dgram_messages[linkManager->dgram_index++];
+    addressLength = packet->msg_hdr.msg_namelen;
+    memcpy(context->storage, packet->msg_hdr.msg_name,
+        linkManager->config.dgram_address_length + packet->msg_len);
+#else
     struct iovec iov[1] = { {
             .iov_base = message,
             .iov_len  = (size_t)(GRACHT_MAX_MESSAGE_SIZE - linkManager->config.dgram_address_length)
@@ -273,17 +661,18 @@ static int socket_link_recv_packet(struct socket_link_manager* linkManager,
     // the use of MSG_WAITALL here.
     intmax_t bytes_read = recvmsg(linkManager->dgram_socket, &msg, flags);
     if (bytes_read <= 0) {
-        if (bytes_read == 0) {
+        if (bytes_read == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
             errno = (ENODATA);
         }
         return -1;
     }
-
-    addressCrc = crc32_generate((const unsigned char*)msg.msg_name, (size_t)msg.msg_namelen);
-    TRACE("[gracht_connection_recv_stream] read [%u/%u] addr bytes, %p\n",
-            msg.msg_namelen, linkManager->config.dgram_address_length,
-            msg.msg_name);
+    addressLength = msg.msg_namelen;
     TRACE("[gracht_connection_recv_stream] read %lu bytes, %u\n", bytes_read, msg.msg_flags);
+#endif
+
+    addressCrc = crc32_generate((const unsigned char*)context->storage, (size_t)addressLength);
+    TRACE("[gracht_connection_recv_stream] read [%u/%u] addr bytes\n",
+            addressLength, linkManager->config.dgram_address_length);
     TRACE("[gracht_connection_recv_stream] parameter offset %lu\n", (uintptr_t)&message->params[0] - (uintptr_t)message);
     if (message->header.param_in) {
         params_storage = &message->params[0];
@@ -303,8 +692,9 @@ static int socket_link_recv_packet(struct socket_link_manager* linkManager,
 static int socket_link_respond(struct socket_link_manager* linkManager,
     struct gracht_recv_message* messageContext, struct gracht_message* message)
 {
+    char          header[sizeof(struct gracht_message) + (
+        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param))];
     struct iovec  iov[1 + message->header.param_in];
-    int           i;
     intmax_t      bytesWritten;
     struct msghdr msg = {
         .msg_name = messageContext->storage,
@@ -316,23 +706,7 @@ static int socket_link_respond(struct socket_link_manager* linkManager,
         .msg_flags = 0
     };
 
-    // Prepare the header
-    iov[0].iov_base = message;
-    iov[0].iov_len  = sizeof(struct gracht_message) + (
-        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param));
-    
-    // Prepare the parameters
-    for (i = 0; i < message->header.param_in; i++) {
-        if (message->params[i].type == GRACHT_PARAM_BUFFER) {
-            iov[msg.msg_iovlen].iov_len  = message->params[i].length;
-            iov[msg.msg_iovlen].iov_base = message->params[i].data.buffer;
-            msg.msg_iovlen++;
-        }
-        else if (message->params[i].type == GRACHT_PARAM_SHM) {
-            // NO SUPPORT
-            assert(0);
-        }
-    }
+    msg.msg_iovlen = prepare_message(message, (struct gracht_message*)&header[0], &iov[0]);
     
     bytesWritten = sendmsg(linkManager->dgram_socket, &msg, MSG_WAITALL);
     if (bytesWritten != message->header.length) {
@@ -359,7 +733,11 @@ static void socket_link_destroy(struct socket_link_manager* linkManager)
     if (linkManager->client_socket > 0) {
         close(linkManager->client_socket);
     }
-    
+
+#if defined(__linux__)
+    free(linkManager->dgram_storage);
+#endif
+    mtx_destroy(&linkManager->pending_lock);
     free(linkManager);
 }
 
@@ -376,17 +754,24 @@ int gracht_link_socket_server_create(struct server_link_ops** linkOut,
     
     memset(linkManager, 0, sizeof(struct socket_link_manager));
     memcpy(&linkManager->config, configuration, sizeof(struct socket_server_configuration));
+    if (!linkManager->config.max_message_size) {
+        linkManager->config.max_message_size = GRACHT_MAX_MESSAGE_SIZE;
+    }
+    mtx_init(&linkManager->pending_lock, mtx_plain);
     
     linkManager->ops.create_client  = (server_create_client_fn)socket_link_create_client;
     linkManager->ops.destroy_client = (server_destroy_client_fn)socket_link_destroy_client;
 
     linkManager->ops.recv_client = (server_recv_client_fn)socket_link_recv_client;
     linkManager->ops.send_client = (server_send_client_fn)socket_link_send_client;
+    linkManager->ops.queue_client = (server_queue_client_fn)socket_link_queue_client;
+    linkManager->ops.release_client = (server_release_client_fn)socket_link_release_client;
 
     linkManager->ops.listen      = (server_link_listen_fn)socket_link_listen;
     linkManager->ops.accept      = (server_link_accept_fn)socket_link_accept;
     linkManager->ops.recv_packet = (server_link_recv_packet_fn)socket_link_recv_packet;
     linkManager->ops.respond     = (server_link_respond_fn)socket_link_respond;
+    linkManager->ops.flush       = (server_link_flush_fn)socket_link_flush;
     linkManager->ops.destroy     = (server_link_destroy_fn)socket_link_destroy;
     
     *linkOut = &linkManager->ops;
@@ -0,0 +1,424 @@
+/* MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Shared Memory Link Type Definitions & Structures
+ * - This header describes the base link-structure, prototypes
+ *   and functionality, refer to the individual things for descriptions
+ */
+
+#define _GNU_SOURCE // memfd_create
+
+#include <errno.h>
+#include "../include/gracht/link/shm.h"
+#include "../include/gracht/link/stream.h"
+#include "../include/gracht/debug.h"
+#include "../include/gracht/threads.h"
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#define SHM_LINK_WAIT_TIMEOUT_NS 100000000
+
+struct shm_link_manager {
+    struct client_link_ops          ops;
+    struct client_link_ops*         socket;
+    struct shm_client_configuration config;
+    int                             iod;
+    mtx_t                           lock;
+
+    // the ring is only written by this side, the server only marks records free.
+    // head and tail are free running, and wrap through the mask
+    struct gracht_shm_ring_header*  ring;
+    char*                           data;
+    size_t                          size;
+    size_t                          head;
+    size_t                          tail;
+};
+
+static inline int shm_link_owns(struct shm_link_manager* linkManager, void* buffer)
+{
+    return linkManager->ring && (char*)buffer >= linkManager->data &&
+        (char*)buffer < linkManager->data + linkManager->size;
+}
+
+static void shm_link_reclaim(struct shm_link_manager* linkManager)
+{
+    while (linkManager->tail != linkManager->head) {
+        struct gracht_shm_record* record = (struct gracht_shm_record*)
+            (linkManager->data + (linkManager->tail & (linkManager->size - 1)));
+        if (atomic_load(&record->state) != GRACHT_SHM_RECORD_FREE) {
+            break;
+        }
+        linkManager->tail += record->span;
+    }
+}
+
+static inline int shm_link_fits(struct shm_link_manager* linkManager, size_t length)
+{
+    return linkManager->size - (linkManager->head - linkManager->tail) >= length;
+}
+
+// Waits for the server to release records, the timeout makes sure a lost wakeup
+// or a server that went away never blocks the caller for long.
+static void shm_link_wait(struct shm_link_manager* linkManager, size_t length)
+{
+    struct timespec timeout = { 0, SHM_LINK_WAIT_TIMEOUT_NS };
+    unsigned int    sequence;
+
+    sequence = atomic_load(&linkManager->ring->released);
+    atomic_store(&linkManager->ring->waiters, 1);
+    shm_link_reclaim(linkManager);
+    if (!shm_link_fits(linkManager, length)) {
+        syscall(SYS_futex, &linkManager->ring->released, FUTEX_WAIT, sequence, &timeout, NULL, 0);
+    }
+    atomic_store(&linkManager->ring->waiters, 0);
+}
+
+// Must be called with the lock held. Records never wrap, if there is not enough
+// room at the end of the ring, the rest is filled by a free padding record.
+static void* shm_link_alloc_record(struct shm_link_manager* linkManager, size_t length)
+{
+    struct gracht_shm_record* record;
+    size_t                    span = sizeof(struct gracht_shm_record) + length;
+    size_t                    position;
+    size_t                    padding;
+
+    span = (span + GRACHT_SHM_RECORD_ALIGN - 1) & ~((size_t)GRACHT_SHM_RECORD_ALIGN - 1);
+    if (span > linkManager->size) {
+        errno = (E2BIG);
+        return NULL;
+    }
+
+    while (1) {
+        position = linkManager->head & (linkManager->size - 1);
+        padding  = (position + span > linkManager->size) ? (linkManager->size - position) : 0;
+
+        shm_link_reclaim(linkManager);
+        if (shm_link_fits(linkManager, padding + span)) {
+            break;
+        }
+        shm_link_wait(linkManager, padding + span);
+    }
+
+    if (padding) {
+        record = (struct gracht_shm_record*)(linkManager->data + position);
+        record->span = (uint32_t)padding;
+        atomic_store(&record->state, GRACHT_SHM_RECORD_FREE);
+        linkManager->head += padding;
+        position = 0;
+    }
+
+    record = (struct gracht_shm_record*)(linkManager->data + position);
+    record->span = (uint32_t)span;
+    atomic_store(&record->state, GRACHT_SHM_RECORD_USED);
+    linkManager->head += span;
+    return (char*)record + sizeof(struct gracht_shm_record);
+}
+
+static void shm_link_free_record(void* buffer)
+{
+    struct gracht_shm_record* record = (struct gracht_shm_record*)
+        ((char*)buffer - sizeof(struct gracht_shm_record));
+    atomic_store(&record->state, GRACHT_SHM_RECORD_FREE);
+}
+
+static int shm_link_create_ring(struct shm_link_manager* linkManager)
+{
+    size_t mappingSize = GRACHT_SHM_HEADER_SIZE + linkManager->config.ring_size;
+    void*  mapping;
+    int    fd;
+
+    fd = memfd_create("gracht-shm", MFD_CLOEXEC);
+    if (fd < 0) {
+        ERROR("link_shm: failed to create ring memory\n");
+        return -1;
+    }
+
+    if (ftruncate(fd, (off_t)mappingSize)) {
+        ERROR("link_shm: failed to size ring memory\n");
+        close(fd);
+        return -1;
+    }
+
+    mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        ERROR("link_shm: failed to map ring memory\n");
+        close(fd);
+        return -1;
+    }
+
+    linkManager->ring = mapping;
+    linkManager->data = (char*)mapping + GRACHT_SHM_HEADER_SIZE;
+    linkManager->size = linkManager->config.ring_size;
+    linkManager->ring->magic = GRACHT_SHM_MAGIC;
+    linkManager->ring->size  = (uint32_t)linkManager->config.ring_size;
+    atomic_init(&linkManager->ring->released, 0);
+    atomic_init(&linkManager->ring->waiters, 0);
+    return fd;
+}
+
+static int shm_link_send_handshake(struct shm_link_manager* linkManager, int fd)
+{
+    struct gracht_shm_handshake handshake = { GRACHT_SHM_MAGIC, (uint32_t)linkManager->size };
+    char                        control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr*             cmsg;
+    struct iovec iov[1] = {
+        { .iov_base = &handshake, .iov_len = sizeof(struct gracht_shm_handshake) }
+    };
+    struct msghdr msg = {
+        .msg_name       = NULL,
+        .msg_namelen    = 0,
+        .msg_iov        = &iov[0],
+        .msg_iovlen     = 1,
+        .msg_control    = &control[0],
+        .msg_controllen = sizeof(control),
+        .msg_flags      = 0
+    };
+
+    memset(&control[0], 0, sizeof(control));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(linkManager->iod, &msg, 0) != sizeof(struct gracht_shm_handshake)) {
+        ERROR("link_shm: failed to send ring handshake\n");
+        errno = (EPIPE);
+        return -1;
+    }
+    return 0;
+}
+
+static int shm_link_connect(struct shm_link_manager* linkManager)
+{
+    int status;
+    int fd;
+
+    linkManager->iod = linkManager->socket->connect(linkManager->socket);
+    if (linkManager->iod < 0) {
+        return -1;
+    }
+
+    fd = shm_link_create_ring(linkManager);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // the server keeps its own reference to the memory once it has mapped it
+    status = shm_link_send_handshake(linkManager, fd);
+    close(fd);
+    if (status) {
+        return -1;
+    }
+    return linkManager->iod;
+}
+
+static int shm_link_recv(struct shm_link_manager* linkManager,
+    void* messageBuffer, unsigned int flags, struct gracht_message** messageOut)
+{
+    return linkManager->socket->recv(linkManager->socket, messageBuffer, flags, messageOut);
+}
+
+static void shm_link_release(struct shm_link_manager* linkManager,
+    void* messageBuffer, struct gracht_message* message)
+{
+    linkManager->socket->release(linkManager->socket, messageBuffer, message);
+}
+
+// Moves buffer parameters into the ring, buffers that were allocated from the ring
+// are passed as is. Returns a mask of the parameters that were copied to the ring
+static int shm_link_convert_params(struct shm_link_manager* linkManager, struct gracht_message* message)
+{
+    int copied = 0;
+    int i;
+
+    mtx_lock(&linkManager->lock);
+    for (i = 0; i < message->header.param_in; i++) {
+        struct gracht_param* param  = &message->params[i];
+        void*                buffer = param->data.buffer;
+
+        if ((param->type != GRACHT_PARAM_BUFFER && param->type != GRACHT_PARAM_SHM) ||
+            !buffer || !param->length) {
+            continue;
+        }
+
+        if (!shm_link_owns(linkManager, buffer)) {
+            if (param->type != GRACHT_PARAM_SHM && param->length < linkManager->config.threshold) {
+                continue;
+            }
+
+            buffer = shm_link_alloc_record(linkManager, param->length);
+            if (!buffer) {
+                // too large for the ring, try to send it inline
+                param->type = GRACHT_PARAM_BUFFER;
+                continue;
+            }
+            memcpy(buffer, param->data.buffer, param->length);
+            copied |= (1 << i);
+        }
+
+        param->type       = GRACHT_PARAM_SHM;
+        param->data.value = (size_t)((char*)buffer - linkManager->data);
+        message->header.length -= param->length;
+    }
+    mtx_unlock(&linkManager->lock);
+    return copied;
+}
+
+static int shm_link_send(struct shm_link_manager* linkManager,
+    struct gracht_message* message, void* messageContext)
+{
+    struct iovec  iov[1 + message->header.param_in];
+    int           copied;
+    int           i;
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_iov = &iov[0],
+        .msg_iovlen = 1,
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = 0
+    };
+
+    copied = shm_link_convert_params(linkManager, message);
+
+    // perform length check before sending, shared memory parameters are not included
+    if (message->header.length > linkManager->config.socket.max_message_size) {
+        errno = (E2BIG);
+        goto error;
+    }
+
+    iov[0].iov_base = message;
+    iov[0].iov_len  = sizeof(struct gracht_message) + (
+        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param));
+
+    for (i = 0; i < message->header.param_in; i++) {
+        if (message->params[i].type == GRACHT_PARAM_BUFFER) {
+            iov[msg.msg_iovlen].iov_len  = message->params[i].length;
+            iov[msg.msg_iovlen].iov_base = message->params[i].data.buffer;
+            msg.msg_iovlen++;
+        }
+    }
+
+    if (gracht_stream_send(linkManager->iod, &msg, message->header.length)) {
+        ERROR("link_shm: failed to send message of %u bytes (%i)\n",
+              message->header.length, errno);
+        errno = (EPIPE);
+        goto error;
+    }
+    return GRACHT_MESSAGE_INPROGRESS;
+
+error:
+    for (i = 0; i < message->header.param_in; i++) {
+        if (copied & (1 << i)) {
+            shm_link_free_record(linkManager->data + message->params[i].data.value);
+        }
+    }
+    return GRACHT_MESSAGE_ERROR;
+}
+
+static void shm_link_destroy(struct shm_link_manager* linkManager)
+{
+    if (!linkManager) {
+        return;
+    }
+
+    linkManager->socket->destroy(linkManager->socket);
+    if (linkManager->ring) {
+        munmap(linkManager->ring, GRACHT_SHM_HEADER_SIZE + linkManager->size);
+    }
+    mtx_destroy(&linkManager->lock);
+    free(linkManager);
+}
+
+int gracht_link_shm_client_create(struct client_link_ops** linkOut,
+    struct shm_client_configuration* configuration)
+{
+    struct shm_link_manager* linkManager;
+
+    // the ring is announced over the connection, so a stream link is required
+    if (!configuration || configuration->socket.type != gracht_link_stream_based ||
+        (configuration->ring_size & (configuration->ring_size - 1))) {
+        errno = (EINVAL);
+        return -1;
+    }
+
+    linkManager = (struct shm_link_manager*)malloc(sizeof(struct shm_link_manager));
+    if (!linkManager) {
+        errno = (ENOMEM);
+        return -1;
+    }
+
+    memset(linkManager, 0, sizeof(struct shm_link_manager));
+    memcpy(&linkManager->config, configuration, sizeof(struct shm_client_configuration));
+    if (!linkManager->config.ring_size) {
+        linkManager->config.ring_size = GRACHT_SHM_DEFAULT_RING_SIZE;
+    }
+    if (!linkManager->config.threshold) {
+        linkManager->config.threshold = GRACHT_SHM_DEFAULT_THRESHOLD;
+    }
+    if (!linkManager->config.socket.max_message_size) {
+        linkManager->config.socket.max_message_size = GRACHT_MAX_MESSAGE_SIZE;
+    }
+
+    if (gracht_link_socket_client_create(&linkManager->socket, &linkManager->config.socket)) {
+        free(linkManager);
+        return -1;
+    }
+    mtx_init(&linkManager->lock, mtx_plain);
+
+    linkManager->ops.connect     = (client_link_connect_fn)shm_link_connect;
+    linkManager->ops.recv        = (client_link_recv_fn)shm_link_recv;
+    linkManager->ops.send        = (client_link_send_fn)shm_link_send;
+    linkManager->ops.release     = (client_link_release_fn)shm_link_release;
+    linkManager->ops.destroy     = (client_link_destroy_fn)shm_link_destroy;
+
+    *linkOut = &linkManager->ops;
+    return 0;
+}
+
+void* gracht_link_shm_client_alloc(struct client_link_ops* link, size_t length)
+{
+    struct shm_link_manager* linkManager = (struct shm_link_manager*)link;
+    void*                    buffer;
+
+    if (!linkManager || !linkManager->ring || !length) {
+        errno = (EINVAL);
+        return NULL;
+    }
+
+    mtx_lock(&linkManager->lock);
+    buffer = shm_link_alloc_record(linkManager, length);
+    mtx_unlock(&linkManager->lock);
+    return buffer;
+}
+
+void gracht_link_shm_client_free(struct client_link_ops* link, void* buffer)
+{
+    struct shm_link_manager* linkManager = (struct shm_link_manager*)link;
+
+    if (!linkManager || !shm_link_owns(linkManager, buffer)) {
+        return;
+    }
+    shm_link_free_record(buffer);
+}
@@ -0,0 +1,384 @@
+/* MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Shared Memory Link Type Definitions & Structures
+ * - This header describes the base link-structure, prototypes
+ *   and functionality, refer to the individual things for descriptions
+ */
+
+#include <errno.h>
+#include "../include/gracht/link/shm.h"
+#include "../include/gracht/debug.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define SHM_LINK_HANDSHAKE_TIMEOUT 1000
+
+struct shm_link_manager;
+
+// The shm link wraps the clients of the socket link, as it needs to keep the
+// ring mapping around for each of them.
+struct shm_link_client {
+    struct gracht_server_client    base;
+    struct gracht_server_client*   socket_client;
+    struct shm_link_manager*       manager;
+    struct gracht_shm_ring_header* ring;
+    char*                          data;
+    size_t                         size;
+};
+
+struct shm_link_manager {
+    struct server_link_ops  ops;
+    struct server_link_ops* socket;
+};
+
+static int shm_link_map_ring(struct shm_link_client* client)
+{
+    struct gracht_shm_handshake handshake;
+    struct pollfd               pollfd = { .fd = client->base.iod, .events = POLLIN };
+    char                        control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr*             cmsg;
+    struct stat                 stats;
+    void*                       mapping;
+    int                         fd = -1;
+    struct iovec iov[1] = {
+        { .iov_base = &handshake, .iov_len = sizeof(struct gracht_shm_handshake) }
+    };
+    struct msghdr msg = {
+        .msg_name       = NULL,
+        .msg_namelen    = 0,
+        .msg_iov        = &iov[0],
+        .msg_iovlen     = 1,
+        .msg_control    = &control[0],
+        .msg_controllen = sizeof(control),
+        .msg_flags      = 0
+    };
+
+    // the handshake is sent right after connecting, so don't wait long for it
+    if (poll(&pollfd, 1, SHM_LINK_HANDSHAKE_TIMEOUT) != 1) {
+        ERROR("link_shm: client did not send the ring handshake\n");
+        errno = (ETIMEDOUT);
+        return -1;
+    }
+
+    if (recvmsg(client->base.iod, &msg, MSG_WAITALL) != sizeof(struct gracht_shm_handshake)) {
+        ERROR("link_shm: failed to read the ring handshake\n");
+        errno = (EPIPE);
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (fd < 0 || handshake.magic != GRACHT_SHM_MAGIC || !handshake.size ||
+        (handshake.size & (handshake.size - 1))) {
+        ERROR("link_shm: invalid ring handshake\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = (EPROTO);
+        return -1;
+    }
+
+    if (fstat(fd, &stats) || stats.st_size < (off_t)(GRACHT_SHM_HEADER_SIZE + handshake.size)) {
+        ERROR("link_shm: ring memory is smaller than announced\n");
+        close(fd);
+        errno = (EPROTO);
+        return -1;
+    }
+
+    mapping = mmap(NULL, GRACHT_SHM_HEADER_SIZE + handshake.size,
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        ERROR("link_shm: failed to map the ring memory\n");
+        return -1;
+    }
+
+    client->ring = mapping;
+    client->data = (char*)mapping + GRACHT_SHM_HEADER_SIZE;
+    client->size = handshake.size;
+    return 0;
+}
+
+static struct shm_link_client* shm_link_wrap_client(struct shm_link_manager* linkManager,
+    struct gracht_server_client* socketClient)
+{
+    struct shm_link_client* client;
+
+    client = (struct shm_link_client*)malloc(sizeof(struct shm_link_client));
+    if (!client) {
+        ERROR("link_shm: failed to allocate data for link\n");
+        errno = (ENOMEM);
+        return NULL;
+    }
+
+    memset(client, 0, sizeof(struct shm_link_client));
+    client->base.header.id = socketClient->header.id;
+    client->base.iod       = socketClient->iod;
+    client->socket_client  = socketClient;
+    client->manager        = linkManager;
+    return client;
+}
+
+// Shared memory parameters carry the offset of the data in the clients ring,
+// translate them to pointers, and make sure they stay within the ring.
+static int shm_link_resolve_params(struct shm_link_client* client, struct gracht_recv_message* message)
+{
+    struct gracht_param* params = message->params;
+    int                  i;
+
+    for (i = 0; i < message->param_in; i++) {
+        size_t offset;
+
+        if (params[i].type != GRACHT_PARAM_SHM) {
+            continue;
+        }
+
+        offset = params[i].data.value;
+        if (!client || !client->ring ||
+            offset < sizeof(struct gracht_shm_record) || offset > client->size ||
+            params[i].length > client->size - offset ||
+            (offset - sizeof(struct gracht_shm_record)) % GRACHT_SHM_RECORD_ALIGN) {
+            return -1;
+        }
+        params[i].data.buffer = client->data + offset;
+    }
+    return 0;
+}
+
+static int shm_link_create_client(struct shm_link_manager* linkManager, struct gracht_recv_message* message,
+    struct gracht_server_client** clientOut)
+{
+    struct gracht_server_client* socketClient;
+    struct shm_link_client*      client;
+
+    if (linkManager->socket->create_client(linkManager->socket, message, &socketClient)) {
+        return -1;
+    }
+
+    client = shm_link_wrap_client(linkManager, socketClient);
+    if (!client) {
+        linkManager->socket->destroy_client(socketClient);
+        return -1;
+    }
+
+    *clientOut = &client->base;
+    return 0;
+}
+
+static int shm_link_destroy_client(struct shm_link_client* client)
+{
+    int status;
+
+    if (!client) {
+        errno = (EINVAL);
+        return -1;
+    }
+
+    if (client->ring) {
+        munmap(client->ring, GRACHT_SHM_HEADER_SIZE + client->size);
+    }
+
+    status = client->manager->socket->destroy_client(client->socket_client);
+    free(client);
+    return status;
+}
+
+static int shm_link_recv_client(struct shm_link_client* client,
+    struct gracht_recv_message* message, unsigned int flags)
+{
+    struct server_link_ops* socket = client->manager->socket;
+
+    while (1) {
+        if (socket->recv_client(client->socket_client, message, flags)) {
+            return -1;
+        }
+
+        if (!shm_link_resolve_params(client, message)) {
+            break;
+        }
+        ERROR("link_shm: dropping message with invalid shared memory parameter\n");
+        if (socket->release_client) {
+            socket->release_client(client->socket_client, message);
+        }
+    }
+    return 0;
+}
+
+static int shm_link_send_client(struct shm_link_client* client,
+    struct gracht_message* message, unsigned int flags)
+{
+    struct server_link_ops* socket = client->manager->socket;
+    return socket->send_client(client->socket_client, message, flags);
+}
+
+static int shm_link_queue_client(struct shm_link_client* client,
+    struct gracht_message* message, unsigned int flags)
+{
+    struct server_link_ops* socket = client->manager->socket;
+    return socket->queue_client(client->socket_client, message, flags);
+}
+
+// Marks the records of the message free, the client reclaims them in order
+// the next time it needs space in the ring.
+static int shm_link_release_client(struct shm_link_client* client, struct gracht_recv_message* message)
+{
+    struct server_link_ops* socket   = client->manager->socket;
+    struct gracht_param*    params   = message->params;
+    int                     released = 0;
+    int                     i;
+
+    for (i = 0; i < message->param_in; i++) {
+        struct gracht_shm_record* record;
+
+        if (params[i].type != GRACHT_PARAM_SHM) {
+            continue;
+        }
+
+        record = (struct gracht_shm_record*)((char*)params[i].data.buffer - sizeof(struct gracht_shm_record));
+        atomic_store(&record->state, GRACHT_SHM_RECORD_FREE);
+        released++;
+    }
+
+    if (released) {
+        atomic_fetch_add(&client->ring->released, 1);
+        if (atomic_load(&client->ring->waiters)) {
+            syscall(SYS_futex, &client->ring->released, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        }
+    }
+
+    if (socket->release_client) {
+        return socket->release_client(client->socket_client, message);
+    }
+    return 0;
+}
+
+static int shm_link_listen(struct shm_link_manager* linkManager, int mode)
+{
+    return linkManager->socket->listen(linkManager->socket, mode);
+}
+
+static int shm_link_accept(struct shm_link_manager* linkManager, struct gracht_server_client** clientOut)
+{
+    struct gracht_server_client* socketClient;
+    struct shm_link_client*      client;
+
+    if (linkManager->socket->accept(linkManager->socket, &socketClient)) {
+        return -1;
+    }
+
+    client = shm_link_wrap_client(linkManager, socketClient);
+    if (!client) {
+        linkManager->socket->destroy_client(socketClient);
+        return -1;
+    }
+
+    if (shm_link_map_ring(client)) {
+        shm_link_destroy_client(client);
+        return -1;
+    }
+
+    *clientOut = &client->base;
+    return 0;
+}
+
+// Packets have no ring to refer to, so shared memory parameters can't be resolved
+static int shm_link_recv_packet(struct shm_link_manager* linkManager,
+    struct gracht_recv_message* message, unsigned int flags)
+{
+    while (1) {
+        if (linkManager->socket->recv_packet(linkManager->socket, message, flags)) {
+            return -1;
+        }
+
+        if (!shm_link_resolve_params(NULL, message)) {
+            break;
+        }
+        ERROR("link_shm: dropping packet with shared memory parameter\n");
+    }
+    return 0;
+}
+
+static int shm_link_respond(struct shm_link_manager* linkManager,
+    struct gracht_recv_message* messageContext, struct gracht_message* message)
+{
+    return linkManager->socket->respond(linkManager->socket, messageContext, message);
+}
+
+static int shm_link_flush(struct shm_link_manager* linkManager)
+{
+    return linkManager->socket->flush(linkManager->socket);
+}
+
+static void shm_link_destroy(struct shm_link_manager* linkManager)
+{
+    if (!linkManager) {
+        return;
+    }
+
+    linkManager->socket->destroy(linkManager->socket);
+    free(linkManager);
+}
+
+int gracht_link_shm_server_create(struct server_link_ops** linkOut,
+    struct socket_server_configuration* configuration)
+{
+    struct shm_link_manager* linkManager;
+
+    linkManager = (struct shm_link_manager*)malloc(sizeof(struct shm_link_manager));
+    if (!linkManager) {
+        errno = (ENOMEM);
+        return -1;
+    }
+
+    memset(linkManager, 0, sizeof(struct shm_link_manager));
+    if (gracht_link_socket_server_create(&linkManager->socket, configuration)) {
+        free(linkManager);
+        return -1;
+    }
+
+    linkManager->ops.create_client  = (server_create_client_fn)shm_link_create_client;
+    linkManager->ops.destroy_client = (server_destroy_client_fn)shm_link_destroy_client;
+
+    linkManager->ops.recv_client    = (server_recv_client_fn)shm_link_recv_client;
+    linkManager->ops.send_client    = (server_send_client_fn)shm_link_send_client;
+    linkManager->ops.queue_client   = linkManager->socket->queue_client ?
+        (server_queue_client_fn)shm_link_queue_client : NULL;
+    linkManager->ops.release_client = (server_release_client_fn)shm_link_release_client;
+
+    linkManager->ops.listen      = (server_link_listen_fn)shm_link_listen;
+    linkManager->ops.accept      = (server_link_accept_fn)shm_link_accept;
+    linkManager->ops.recv_packet = (server_link_recv_packet_fn)shm_link_recv_packet;
+    linkManager->ops.respond     = (server_link_respond_fn)shm_link_respond;
+    linkManager->ops.flush       = linkManager->socket->flush ?
+        (server_link_flush_fn)shm_link_flush : NULL;
+    linkManager->ops.destroy     = (server_link_destroy_fn)shm_link_destroy;
+
+    *linkOut = &linkManager->ops;
+    return 0;
+}
@@ -0,0 +1,176 @@
+/* MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Stream Link Helpers
+ * - Framing of messages on stream sockets, shared by the socket and shared
+ *   memory links
+ */
+
+#include <errno.h>
+#include "../include/gracht/link/socket.h"
+#include "../include/gracht/link/stream.h"
+#include <stdlib.h>
+#include <string.h>
+
+void gracht_stream_reader_destroy(struct gracht_stream_reader* reader)
+{
+    free(reader->data);
+    free(reader->large);
+    reader->data         = NULL;
+    reader->offset       = 0;
+    reader->length       = 0;
+    reader->large        = NULL;
+    reader->large_length = 0;
+}
+
+static int gracht_stream_reader_fill_large(struct gracht_stream_reader* reader, int iod,
+    int flags, void** messageOut)
+{
+    uint32_t length = ((struct gracht_message*)reader->large)->header.length;
+    intmax_t bytes_read;
+
+    while (reader->large_length < length) {
+        bytes_read = recv(iod, reader->large + reader->large_length,
+            length - reader->large_length, flags);
+        if (bytes_read <= 0) {
+            if (bytes_read == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = (ENODATA);
+            }
+            return -1;
+        }
+        reader->large_length += (size_t)bytes_read;
+    }
+
+    *messageOut          = reader->large;
+    reader->large        = NULL;
+    reader->large_length = 0;
+    return 0;
+}
+
+int gracht_stream_reader_read(struct gracht_stream_reader* reader, int iod,
+    void* messageBuffer, int flags, void** messageOut)
+{
+    size_t   max_length = reader->max_length ? reader->max_length : GRACHT_MAX_MESSAGE_SIZE;
+    intmax_t bytes_read;
+
+    if (reader->broken) {
+        errno = (EPIPE);
+        return -1;
+    }
+
+    if (reader->large) {
+        return gracht_stream_reader_fill_large(reader, iod, flags, messageOut);
+    }
+
+    if (!reader->data) {
+        reader->data = malloc(GRACHT_STREAM_BUFFER_SIZE);
+        if (!reader->data) {
+            errno = (ENOMEM);
+            return -1;
+        }
+    }
+
+    while (1) {
+        if (reader->length >= sizeof(struct gracht_message)) {
+            struct gracht_message* message = (struct gracht_message*)(reader->data + reader->offset);
+            uint32_t               length  = message->header.length;
+
+            if (length < sizeof(struct gracht_message) || length > max_length) {
+                // the stream is out of sync, there is no way to recover from this,
+                // so the connection is shut down instead of parsing what follows
+                reader->offset = 0;
+                reader->length = 0;
+                reader->broken = 1;
+                shutdown(iod, SHUT_RDWR);
+                errno = (EPIPE);
+                return -1;
+            }
+
+            if (length > GRACHT_MAX_MESSAGE_SIZE) {
+                size_t available = reader->length < length ? reader->length : length;
+
+                reader->large = malloc(length);
+                if (!reader->large) {
+                    errno = (ENOMEM);
+                    return -1;
+                }
+
+                // the rest of the message is received directly into its buffer
+                memcpy(reader->large, message, available);
+                reader->large_length = available;
+                reader->offset      += available;
+                reader->length      -= available;
+                return gracht_stream_reader_fill_large(reader, iod, flags, messageOut);
+            }
+
+            if (reader->length >= length) {
+                memcpy(messageBuffer, message, length);
+                reader->offset += length;
+                reader->length -= length;
+                *messageOut = messageBuffer;
+                return 0;
+            }
+        }
+
+        // move the partial message to the start of the buffer to make room
+        if (reader->offset) {
+            if (reader->length) {
+                memmove(reader->data, reader->data + reader->offset, reader->length);
+            }
+            reader->offset = 0;
+        }
+
+        bytes_read = recv(iod, reader->data + reader->length,
+            GRACHT_STREAM_BUFFER_SIZE - reader->length, flags);
+        if (bytes_read <= 0) {
+            if (bytes_read == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = (ENODATA);
+            }
+            return -1;
+        }
+        reader->length += (size_t)bytes_read;
+    }
+}
+
+int gracht_stream_send(int iod, struct msghdr* msg, size_t length)
+{
+    size_t sent = 0;
+
+    while (1) {
+        intmax_t bytesWritten = sendmsg(iod, msg, 0);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        sent += (size_t)bytesWritten;
+        if (sent >= length) {
+            return 0;
+        }
+
+        while (bytesWritten >= (intmax_t)msg->msg_iov->iov_len) {
+            bytesWritten -= (intmax_t)msg->msg_iov->iov_len;
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+        msg->msg_iov->iov_base  = (char*)msg->msg_iov->iov_base + bytesWritten;
+        msg->msg_iov->iov_len  -= (size_t)bytesWritten;
+    }
+}
@@ -131,6 +131,7 @@ int gracht_link_vali_client_create(struct client_link_ops** linkOut)
     linkManager->ops.connect     = (client_link_connect_fn)vali_link_connect;
     linkManager->ops.recv        = (client_link_recv_fn)vali_link_recv;
     linkManager->ops.send        = (client_link_send_fn)vali_link_send_message;
+    linkManager->ops.release     = NULL;
     linkManager->ops.destroy     = (client_link_destroy_fn)vali_link_destroy;
 
     *linkOut = &linkManager->ops;
@@ -185,11 +185,14 @@ int gracht_link_vali_server_create(struct server_link_ops** linkOut, struct ipms
 
     linkManager->ops.recv_client = (server_recv_client_fn)vali_link_recv_client;
     linkManager->ops.send_client = (server_send_client_fn)vali_link_send_client;
+    linkManager->ops.queue_client = NULL;
+    linkManager->ops.release_client = NULL;
 
     linkManager->ops.listen      = (server_link_listen_fn)vali_link_listen;
     linkManager->ops.accept      = (server_link_accept_fn)vali_link_accept;
     linkManager->ops.recv_packet = (server_link_recv_packet_fn)vali_link_recv_packet;
     linkManager->ops.respond     = (server_link_respond_fn)vali_link_respond;
+    linkManager->ops.flush       = NULL;
     linkManager->ops.destroy     = (server_link_destroy_fn)vali_link_destroy;
     
     *linkOut = &linkManager->ops;
@@ -26,8 +26,10 @@
 #include "include/gracht/aio.h"
 #include "include/gracht/client.h"
 #include "include/gracht/debug.h"
-#include "include/gracht/list.h"
+#include "include/gracht/dispatch.h"
+#include "include/gracht/hashtable.h"
 #include "include/gracht/server.h"
+#include "include/gracht/threads.h"
 #include "include/gracht/link/link.h"
 #include <stdlib.h>
 #include <string.h>
@@ -45,20 +47,54 @@ static gracht_protocol_function_t control_functions[2] = {
 };
 static gracht_protocol_t control_protocol = GRACHT_PROTOCOL_INIT(0, "gctrl", 2, control_functions);
 
-extern int server_invoke_action(struct gracht_list*, struct gracht_recv_message*);
+extern int server_invoke_action(struct gracht_dispatch_table*, struct gracht_recv_message*);
 
-struct gracht_server {
-    struct server_link_ops* ops;
-    void*                   messageBuffer;
-    int                     initialized;
-    int                     completion_iod;
-    int                     client_iod;
-    int                     dgram_iod;
-    struct gracht_list      protocols;
-    struct gracht_list      clients;
-} server_object = { NULL, NULL, 0, -1, -1, -1, { 0 }, { 0 } };
+#define GRACHT_WORKER_QUEUE_SIZE 32
+
+#define WORKER_ITEM_MESSAGE    0
+#define WORKER_ITEM_DISCONNECT 1
+
+struct gracht_worker_item {
+    int                          type;
+    struct gracht_server_client* client;
+    struct gracht_recv_message   message;
+};
 
+// Each worker owns a bounded queue of items, and each item owns a message buffer
+// in the workers storage. Messages are received directly into the queue slot, which
+// is released again once the handler has run.
+struct gracht_worker {
+    thrd_t                    thread;
+    mtx_t                     sync_object;
+    cnd_t                     items_available;
+    cnd_t                     slots_available;
+    int                       running;
+    int                       head;
+    int                       tail;
+    int                       count;
+    char*                     storage;
+    struct gracht_worker_item items[GRACHT_WORKER_QUEUE_SIZE];
+};
+
+struct gracht_server {
+    struct server_link_ops*      ops;
+    void*                        messageBuffer;
+    int                          initialized;
+    int                          completion_iod;
+    int                          client_iod;
+    int                          dgram_iod;
+    struct gracht_dispatch_table protocols;
+    struct gracht_hashtable      clients;
+    mtx_t                        clients_lock;
+    int                          worker_count;
+    struct gracht_worker*        workers;
+    int                          coalesce_events;
+} server_object = { NULL, NULL, 0, -1, -1, -1, { { 0 } }, { 0 } };
+
+static int  workers_create(int);
+static void workers_destroy(void);
 static void client_destroy(struct gracht_server_client*);
+static void client_release(struct gracht_server_client*);
 static void client_subscribe(struct gracht_server_client*, uint8_t);
 static void client_unsubscribe(struct gracht_server_client*, uint8_t);
 static int  client_is_subscribed(struct gracht_server_client*, uint8_t);
@@ -78,6 +114,14 @@ int gracht_server_initialize(gracht_server_configuration_t* configuration)
     // store handler
     server_object.initialized = 1;
     server_object.ops = configuration->link;
+    server_object.coalesce_events = configuration->coalesce_events &&
+        server_object.ops->queue_client && server_object.ops->flush;
+
+    if (gracht_hashtable_construct(&server_object.clients, 0)) {
+        ERROR("gracht_server: failed to create client registry\n");
+        return -1;
+    }
+    mtx_init(&server_object.clients_lock, mtx_plain);
     
     // create the io event set, for async io
     server_object.completion_iod = gracht_aio_create();
@@ -113,10 +157,199 @@ int gracht_server_initialize(gracht_server_configuration_t* configuration)
         return -1;
     }
     
+    if (configuration->max_dispatchers > 0) {
+        if (workers_create(configuration->max_dispatchers)) {
+            ERROR("gracht_server_initialize: failed to create worker threads\n");
+            return -1;
+        }
+    }
+    
     gracht_server_register_protocol(&control_protocol);
     return 0;
 }
 
+// The client may only be used without a reference from the main loop, which
+// is where disconnects are queued. Everyone else uses client_acquire.
+static struct gracht_server_client* get_client(int id)
+{
+    struct gracht_server_client* client;
+
+    mtx_lock(&server_object.clients_lock);
+    client = (struct gracht_server_client*)gracht_hashtable_get(&server_object.clients, id);
+    mtx_unlock(&server_object.clients_lock);
+    return client;
+}
+
+// Clients are reference counted, the registry holds one reference and anyone
+// sending to a client holds another, so the send itself is done without the lock.
+// Whoever drops the last reference destroys the client.
+static struct gracht_server_client* client_acquire(int id)
+{
+    struct gracht_server_client* client;
+
+    mtx_lock(&server_object.clients_lock);
+    client = (struct gracht_server_client*)gracht_hashtable_get(&server_object.clients, id);
+    if (client) {
+        client->references++;
+    }
+    mtx_unlock(&server_object.clients_lock);
+    return client;
+}
+
+static void add_client(struct gracht_server_client* client)
+{
+    client->references = 1;
+    mtx_lock(&server_object.clients_lock);
+    gracht_hashtable_insert(&server_object.clients, &client->header);
+    mtx_unlock(&server_object.clients_lock);
+}
+
+// Worker pool
+// Messages are assigned to workers based on the client id, which means all
+// messages from one client are processed in order by the same worker.
+static struct gracht_worker* get_worker(int clientId)
+{
+    uint32_t hash = (uint32_t)clientId * 2654435769u;
+    return &server_object.workers[(hash >> 16) % (uint32_t)server_object.worker_count];
+}
+
+static struct gracht_worker_item* worker_reserve(struct gracht_worker* worker)
+{
+    struct gracht_worker_item* item;
+
+    mtx_lock(&worker->sync_object);
+    while (worker->count == GRACHT_WORKER_QUEUE_SIZE) {
+        cnd_wait(&worker->slots_available, &worker->sync_object);
+    }
+    item = &worker->items[worker->tail];
+    mtx_unlock(&worker->sync_object);
+
+    item->message.storage = worker->storage + (worker->tail * GRACHT_MAX_MESSAGE_SIZE);
+    return item;
+}
+
+static void worker_commit(struct gracht_worker* worker)
+{
+    mtx_lock(&worker->sync_object);
+    worker->tail = (worker->tail + 1) % GRACHT_WORKER_QUEUE_SIZE;
+    worker->count++;
+    cnd_signal(&worker->items_available);
+    mtx_unlock(&worker->sync_object);
+}
+
+// Invokes the action, and lets the link release any resources that were held
+// by the message, like shared memory parameters.
+static int handle_message(struct gracht_server_client* client, struct gracht_recv_message* message)
+{
+    int status = server_invoke_action(&server_object.protocols, message);
+    if (client && server_object.ops->release_client) {
+        server_object.ops->release_client(client, message);
+    }
+    return status;
+}
+
+static int worker_main(void* context)
+{
+    struct gracht_worker*      worker = context;
+    struct gracht_worker_item* item;
+
+    while (1) {
+        mtx_lock(&worker->sync_object);
+        while (!worker->count && worker->running) {
+            cnd_wait(&worker->items_available, &worker->sync_object);
+        }
+
+        if (!worker->count) {
+            mtx_unlock(&worker->sync_object);
+            break;
+        }
+        item = &worker->items[worker->head];
+        mtx_unlock(&worker->sync_object);
+
+        // the item stays reserved while it is being handled, as the message
+        // is located in the slot storage
+        if (item->type == WORKER_ITEM_DISCONNECT) {
+            client_destroy(item->client);
+        }
+        else if (handle_message(item->client, &item->message)) {
+            WARNING("[worker_main] failed to invoke server action\n");
+        }
+        gracht_server_flush_events();
+
+        mtx_lock(&worker->sync_object);
+        worker->head = (worker->head + 1) % GRACHT_WORKER_QUEUE_SIZE;
+        worker->count--;
+        cnd_signal(&worker->slots_available);
+        mtx_unlock(&worker->sync_object);
+    }
+    return 0;
+}
+
+static int workers_create(int count)
+{
+    int i;
+
+    server_object.workers = calloc(count, sizeof(struct gracht_worker));
+    if (!server_object.workers) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct gracht_worker* worker = &server_object.workers[i];
+
+        worker->storage = malloc(GRACHT_WORKER_QUEUE_SIZE * GRACHT_MAX_MESSAGE_SIZE);
+        if (!worker->storage) {
+            errno = ENOMEM;
+            break;
+        }
+
+        mtx_init(&worker->sync_object, mtx_plain);
+        cnd_init(&worker->items_available);
+        cnd_init(&worker->slots_available);
+        worker->running = 1;
+        if (thrd_create(&worker->thread, worker_main, worker) != thrd_success) {
+            mtx_destroy(&worker->sync_object);
+            cnd_destroy(&worker->items_available);
+            cnd_destroy(&worker->slots_available);
+            free(worker->storage);
+            break;
+        }
+        server_object.worker_count++;
+    }
+
+    if (server_object.worker_count != count) {
+        workers_destroy();
+        return -1;
+    }
+    return 0;
+}
+
+static void workers_destroy(void)
+{
+    int i;
+
+    // workers finish their queued items before exitting
+    for (i = 0; i < server_object.worker_count; i++) {
+        struct gracht_worker* worker = &server_object.workers[i];
+
+        mtx_lock(&worker->sync_object);
+        worker->running = 0;
+        cnd_signal(&worker->items_available);
+        mtx_unlock(&worker->sync_object);
+
+        thrd_join(worker->thread, NULL);
+        mtx_destroy(&worker->sync_object);
+        cnd_destroy(&worker->items_available);
+        cnd_destroy(&worker->slots_available);
+        free(worker->storage);
+    }
+
+    free(server_object.workers);
+    server_object.workers      = NULL;
+    server_object.worker_count = 0;
+}
+
 static int handle_client_socket(void)
 {
     struct gracht_server_client* client;
@@ -127,7 +360,7 @@ static int handle_client_socket(void)
         return status;
     }
     
-    gracht_list_append(&server_object.clients, &client->header);
+    add_client(client);
     gracht_aio_add(server_object.completion_iod, client->iod);
     return 0;
 }
@@ -146,41 +379,105 @@ static int handle_sync_event(void* storage)
             }
             break;
         }
-        status = server_invoke_action(&server_object.protocols, &message);
+
+        if (server_object.worker_count) {
+            // the sender is not known before the packet has been read, so the
+            // packet is copied to the workers slot, and the parameter pointer rebased
+            struct gracht_worker*      worker = get_worker(message.client);
+            struct gracht_worker_item* item   = worker_reserve(worker);
+            void*                      slotStorage = item->message.storage;
+
+            memcpy(slotStorage, storage, GRACHT_MAX_MESSAGE_SIZE);
+            item->type    = WORKER_ITEM_MESSAGE;
+            item->client  = NULL;
+            item->message = message;
+            item->message.storage = slotStorage;
+            if (message.params) {
+                item->message.params = (char*)slotStorage + ((char*)message.params - (char*)storage);
+            }
+            worker_commit(worker);
+        }
+        else {
+            status = server_invoke_action(&server_object.protocols, &message);
+        }
     }
     
     return status;
 }
 
+static void client_disconnect(int iod, struct gracht_server_client* client, struct gracht_worker* worker)
+{
+    int status = gracht_aio_remove(server_object.completion_iod, iod);
+    if (status) {
+        // TODO log
+    }
+    
+    // let the worker destroy the client once it has handled the pending
+    // messages. The client keeps the iod open until then, so it can't be reused
+    if (worker) {
+        struct gracht_worker_item* item = worker_reserve(worker);
+        item->type   = WORKER_ITEM_DISCONNECT;
+        item->client = client;
+        worker_commit(worker);
+    }
+    else {
+        client_destroy(client);
+    }
+}
+
 static int handle_async_event(int iod, uint32_t events, void* storage)
 {
     int                          status;
     struct gracht_recv_message   message = { .storage = storage };
-    struct gracht_server_client* client = 
-        (struct gracht_server_client*)gracht_list_lookup(&server_object.clients, iod);
+    struct gracht_server_client* client  = get_client(iod);
+    struct gracht_worker*        worker  = NULL;
     TRACE("[handle_async_event] %i, 0x%x\n", iod, events);
+
+    if (!client) {
+        ERROR("[handle_async_event] client %i was not found\n", iod);
+        return -1;
+    }
+
+    if (server_object.worker_count) {
+        worker = get_worker(client->header.id);
+    }
     
     // Check for control event. On non-passive sockets, control event is the
     // disconnect event.
     if (events & GRACHT_AIO_EVENT_DISCONNECT) {
-        status = gracht_aio_remove(server_object.completion_iod, iod);
-        if (status) {
-            // TODO log
-        }
-        
-        client_destroy(client);
+        client_disconnect(iod, client, worker);
     }
     else if ((events & GRACHT_AIO_EVENT_IN) || !events) {
         while (1) {
+            struct gracht_worker_item* item = NULL;
+            if (worker) {
+                item = worker_reserve(worker);
+                message.storage = item->message.storage;
+            }
+
             status = server_object.ops->recv_client(client, &message, MSG_DONTWAIT);
             if (status) {
                 if (errno != ENODATA) {
                     ERROR("[handle_async_event] server_object.ops->recv_client returned %i\n", errno);
                 }
+
+                // the link shut down a stream that went out of sync, no more
+                // messages can be read from it
+                if (errno == EPIPE) {
+                    client_disconnect(iod, client, worker);
+                }
                 break;
             }
 
-            status = server_invoke_action(&server_object.protocols, &message);
+            if (item) {
+                item->type    = WORKER_ITEM_MESSAGE;
+                item->client  = client;
+                item->message = message;
+                worker_commit(worker);
+                continue;
+            }
+
+            status = handle_message(client, &message);
             if (status) {
                 WARNING("[handle_async_event] failed to invoke server action\n");
             }
@@ -189,22 +486,37 @@ static int handle_async_event(int iod, uint32_t events, void* storage)
     return 0;
 }
 
+static void handle_extern_client(gracht_client_t* client)
+{
+    // the client link can read several messages at once, so keep going until
+    // it has nothing left. Messages that could not be handled are still consumed.
+    while (1) {
+        int status = gracht_client_wait_message(client, NULL, server_object.messageBuffer, 0);
+        if (status && errno != ENOTSUP && errno != ENOENT) {
+            break;
+        }
+    }
+}
+
+static void client_shutdown(struct gracht_object_header* header, void* context)
+{
+    server_object.ops->destroy_client((struct gracht_server_client*)header);
+}
+
 static int gracht_server_shutdown(void)
 {
-    struct gracht_server_client* client;
-    
     if (!server_object.initialized) {
         errno = ENOTSUP;
         return -1;
     }
-    
-    client = (struct gracht_server_client*)server_object.clients.head;
-    while (client) {
-        struct gracht_server_client* temp = (struct gracht_server_client*)client->header.link;
-        client_destroy(client);
-        client = temp;
+
+    if (server_object.worker_count) {
+        workers_destroy();
     }
-    server_object.clients.head = NULL;
+    
+    gracht_hashtable_enumerate(&server_object.clients, client_shutdown, NULL);
+    gracht_hashtable_destroy(&server_object.clients);
+    mtx_destroy(&server_object.clients_lock);
     
     if (server_object.completion_iod != -1) {
         gracht_aio_destroy(server_object.completion_iod);
@@ -213,6 +525,8 @@ static int gracht_server_shutdown(void)
     if (server_object.messageBuffer) {
         free(server_object.messageBuffer);
     }
+
+    gracht_dispatch_clear(&server_object.protocols);
     
     if (server_object.ops != NULL) {
         server_object.ops->destroy(server_object.ops);
@@ -272,8 +586,7 @@ int gracht_server_main_loop(void)
 
             TRACE("gracht_server: event %u from %i\n", flags, iod);
             if (gracht_aio_event_is_extern(&events[i])) {
-                gracht_client_wait_message(gracht_aio_event_extern(&events[i]),
-                        NULL, server_object.messageBuffer, 0);
+                handle_extern_client(gracht_aio_event_extern(&events[i]));
             }
             else if (iod == server_object.client_iod) {
                 handle_client_socket();
@@ -285,6 +598,7 @@ int gracht_server_main_loop(void)
                 handle_async_event(iod, flags, storage);
             }
         }
+        gracht_server_flush_events();
     }
     
     free(storage);
@@ -294,6 +608,7 @@ int gracht_server_main_loop(void)
 int gracht_server_respond(struct gracht_recv_message* messageContext, struct gracht_message* message)
 {
     struct gracht_server_client* client;
+    int                          status;
 
     if (!messageContext || !message) {
         ERROR("gracht_server: null message or context");
@@ -304,41 +619,89 @@ int gracht_server_respond(struct gracht_recv_message* messageContext, struct gra
     // update the id for the response
     message->header.id = messageContext->message_id;
 
-    client = (struct gracht_server_client*)gracht_list_lookup(&server_object.clients, messageContext->client);
+    client = client_acquire(messageContext->client);
     if (!client) {
         return server_object.ops->respond(server_object.ops, messageContext, message);
     }
 
-    return server_object.ops->send_client(client, message, MSG_WAITALL);
+    status = server_object.ops->send_client(client, message, MSG_WAITALL);
+    client_release(client);
+    return status;
 }
 
 int gracht_server_send_event(int client, struct gracht_message* message, unsigned int flags)
 {
-    struct gracht_server_client* serverClient = 
-        (struct gracht_server_client*)gracht_list_lookup(&server_object.clients, client);
+    struct gracht_server_client* serverClient;
+    int                          status;
+
+    serverClient = client_acquire(client);
     if (!serverClient) {
         errno = (ENOENT);
         return -1;
     }
     
     // When sending target specific events - we do not care about subscriptions
-    return server_object.ops->send_client(serverClient, message, flags);
+    status = server_object.ops->send_client(serverClient, message, flags);
+    client_release(serverClient);
+    return status;
+}
+
+struct broadcast_context {
+    uint8_t                       protocol;
+    struct gracht_server_client** clients;
+    int                           count;
+};
+
+static void client_broadcast(struct gracht_object_header* header, void* context)
+{
+    struct gracht_server_client* client    = (struct gracht_server_client*)header;
+    struct broadcast_context*    broadcast = context;
+
+    if (client_is_subscribed(client, broadcast->protocol)) {
+        client->references++;
+        broadcast->clients[broadcast->count++] = client;
+    }
 }
 
 int gracht_server_broadcast_event(struct gracht_message* message, unsigned int flags)
 {
-    struct gracht_server_client* client;
+    struct broadcast_context context = { message->header.protocol, NULL, 0 };
+    int                      i;
     
-    client = (struct gracht_server_client*)server_object.clients.head;
-    while (client) {
-        if (client_is_subscribed(client, message->header.protocol)) {
-            server_object.ops->send_client(client, message, flags);
+    // the subscribers are collected under the lock, and sent to after it is released
+    mtx_lock(&server_object.clients_lock);
+    if (server_object.clients.element_count) {
+        context.clients = malloc(server_object.clients.element_count * sizeof(struct gracht_server_client*));
+        if (!context.clients) {
+            mtx_unlock(&server_object.clients_lock);
+            errno = (ENOMEM);
+            return -1;
+        }
+        gracht_hashtable_enumerate(&server_object.clients, client_broadcast, &context);
+    }
+    mtx_unlock(&server_object.clients_lock);
+
+    for (i = 0; i < context.count; i++) {
+        if (server_object.coalesce_events) {
+            server_object.ops->queue_client(context.clients[i], message, flags);
+        }
+        else {
+            server_object.ops->send_client(context.clients[i], message, flags);
         }
-        client = (struct gracht_server_client*)client->header.link;
+        client_release(context.clients[i]);
     }
+    free(context.clients);
     return 0;
 }
 
+int gracht_server_flush_events(void)
+{
+    if (!server_object.coalesce_events) {
+        return 0;
+    }
+    return server_object.ops->flush(server_object.ops);
+}
+
 int gracht_server_register_protocol(gracht_protocol_t* protocol)
 {
     if (!protocol) {
@@ -346,8 +709,7 @@ int gracht_server_register_protocol(gracht_protocol_t* protocol)
         return -1;
     }
     
-    gracht_list_append(&server_object.protocols, &protocol->header);
-    return 0;
+    return gracht_dispatch_add(&server_object.protocols, protocol);
 }
 
 int gracht_server_unregister_protocol(gracht_protocol_t* protocol)
@@ -357,8 +719,7 @@ int gracht_server_unregister_protocol(gracht_protocol_t* protocol)
         return -1;
     }
     
-    gracht_list_remove(&server_object.protocols, &protocol->header);
-    return 0;
+    return gracht_dispatch_remove(&server_object.protocols, protocol);
 }
 
 int gracht_server_get_dgram_iod(void)
@@ -367,10 +728,35 @@ int gracht_server_get_dgram_iod(void)
 }
 
 // Client helpers
+static void client_release(struct gracht_server_client* client)
+{
+    int references;
+
+    mtx_lock(&server_object.clients_lock);
+    references = --client->references;
+    mtx_unlock(&server_object.clients_lock);
+
+    if (!references) {
+        server_object.ops->destroy_client(client);
+    }
+}
+
+// Removes the client from the registry and drops the reference it held, the
+// client is destroyed once anyone still sending to it is done
 static void client_destroy(struct gracht_server_client* client)
 {
-    gracht_list_remove(&server_object.clients, &client->header);
-    server_object.ops->destroy_client(client);
+    int registered;
+
+    mtx_lock(&server_object.clients_lock);
+    registered = gracht_hashtable_get(&server_object.clients, client->header.id) == &client->header;
+    if (registered) {
+        gracht_hashtable_remove(&server_object.clients, client->header.id);
+    }
+    mtx_unlock(&server_object.clients_lock);
+
+    if (registered) {
+        client_release(client);
+    }
 }
 
 // Client subscription helpers
@@ -412,31 +798,46 @@ static int client_is_subscribed(struct gracht_server_client* client, uint8_t id)
 // Server control protocol implementation
 void gracht_control_subscribe_callback(struct gracht_recv_message* message, struct gracht_subscription_args* input)
 {
-    struct gracht_server_client* client = 
-        (struct gracht_server_client*)gracht_list_lookup(&server_object.clients, message->client);
+    struct gracht_server_client* client;
+
+    // The lookup and the insert are done under one lock, so concurrent subscribes
+    // from a new client only creates it once
+    mtx_lock(&server_object.clients_lock);
+    client = (struct gracht_server_client*)gracht_hashtable_get(&server_object.clients, message->client);
     if (!client) {
         if (server_object.ops->create_client(server_object.ops, message, &client)) {
+            mtx_unlock(&server_object.clients_lock);
             ERROR("[gracht_control_subscribe_callback] server_object.ops->create_client returned error");
             return;
         }
-        gracht_list_append(&server_object.clients, &client->header);
+        client->references = 1;
+        gracht_hashtable_insert(&server_object.clients, &client->header);
     }
 
     client_subscribe(client, input->protocol_id);
+    mtx_unlock(&server_object.clients_lock);
 }
 
 void gracht_control_unsubscribe_callback(struct gracht_recv_message* message, struct gracht_subscription_args* input)
 {
-    struct gracht_server_client* client = 
-        (struct gracht_server_client*)gracht_list_lookup(&server_object.clients, message->client);
+    struct gracht_server_client* client;
+
+    mtx_lock(&server_object.clients_lock);
+    client = (struct gracht_server_client*)gracht_hashtable_get(&server_object.clients, message->client);
     if (!client) {
+        mtx_unlock(&server_object.clients_lock);
         return;
     }
 
     client_unsubscribe(client, input->protocol_id);
     
-    // cleanup the client if we unsubscripe
+    // cleanup the client if we unsubscripe, it is removed before the lock is
+    // released so no one else can look it up, and destroyed once unused
     if (input->protocol_id == 0xFF) {
-        client_destroy(client);
+        gracht_hashtable_remove(&server_object.clients, client->header.id);
+        mtx_unlock(&server_object.clients_lock);
+        client_release(client);
+        return;
     }
+    mtx_unlock(&server_object.clients_lock);
 }
@@ -23,9 +23,11 @@
  */
 
 #include "include/gracht/types.h"
-#include "include/gracht/list.h"
+#include "include/gracht/dispatch.h"
 #include "include/gracht/debug.h"
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 // client callbacks
 typedef void (*client_invoke00_t)(void);
@@ -35,28 +37,99 @@ typedef void (*client_invokeA0_t)(void*);
 typedef void (*server_invoke00_t)(struct gracht_recv_message*);
 typedef void (*server_invokeA0_t)(struct gracht_recv_message*, void*);
 
-static gracht_protocol_function_t* get_protocol_action(struct gracht_list* protocols,
-    uint8_t protocol_id, uint8_t action_id)
+int gracht_dispatch_add(struct gracht_dispatch_table* table, gracht_protocol_t* protocol)
 {
-    int                i;
-    gracht_protocol_t* protocol = (struct gracht_protocol*)
-        gracht_list_lookup(protocols, (int)(uint32_t)protocol_id);
-    
-    if (!protocol) {
-        ERROR("[get_protocol_action] protocol %u was not implemented", protocol_id);
-        errno = ENOTSUP;
-        return NULL;
+    struct gracht_dispatch_entry* entry;
+    int                           action_count = 0;
+    int                           i;
+
+    if (!table || !protocol) {
+        errno = EINVAL;
+        return -1;
     }
-    
+
+    if (table->entries[protocol->id]) {
+        errno = EEXIST;
+        return -1;
+    }
+
     for (i = 0; i < protocol->num_functions; i++) {
-        if (protocol->functions[i].id == action_id) {
-            return &protocol->functions[i];
+        if (protocol->functions[i].id >= action_count) {
+            action_count = protocol->functions[i].id + 1;
         }
     }
 
-    ERROR("[get_protocol_action] action %u was not implemented", action_id);
-    errno = ENOTSUP;
-    return NULL;
+    entry = malloc(sizeof(struct gracht_dispatch_entry) + (action_count * sizeof(gracht_protocol_function_t*)));
+    if (!entry) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    entry->protocol     = protocol;
+    entry->action_count = action_count;
+    memset(&entry->actions[0], 0, action_count * sizeof(gracht_protocol_function_t*));
+
+    // walk backwards so the first occurence of an action id wins, this keeps
+    // the behaviour identical to the previous linear scan
+    for (i = protocol->num_functions - 1; i >= 0; i--) {
+        entry->actions[protocol->functions[i].id] = &protocol->functions[i];
+    }
+
+    table->entries[protocol->id] = entry;
+    return 0;
+}
+
+int gracht_dispatch_remove(struct gracht_dispatch_table* table, gracht_protocol_t* protocol)
+{
+    struct gracht_dispatch_entry* entry;
+
+    if (!table || !protocol) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    entry = table->entries[protocol->id];
+    if (!entry || entry->protocol != protocol) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    table->entries[protocol->id] = NULL;
+    free(entry);
+    return 0;
+}
+
+void gracht_dispatch_clear(struct gracht_dispatch_table* table)
+{
+    int i;
+
+    if (!table) {
+        return;
+    }
+
+    for (i = 0; i < GRACHT_DISPATCH_MAX_PROTOCOLS; i++) {
+        if (table->entries[i]) {
+            free(table->entries[i]);
+            table->entries[i] = NULL;
+        }
+    }
+}
+
+static gracht_protocol_function_t* get_protocol_action(struct gracht_dispatch_table* table,
+    uint8_t protocol_id, uint8_t action_id)
+{
+    gracht_protocol_function_t* function = gracht_dispatch_lookup(table, protocol_id, action_id);
+    if (!function) {
+        if (!table->entries[protocol_id]) {
+            ERROR("[get_protocol_action] protocol %u was not implemented", protocol_id);
+        }
+        else {
+            ERROR("[get_protocol_action] action %u was not implemented", action_id);
+        }
+        errno = ENOTSUP;
+        return NULL;
+    }
+    return function;
 }
 
 static void unpack_parameters(struct gracht_param* params, uint8_t count, void* params_storage, uint8_t* unpackBuffer)
@@ -102,15 +175,23 @@ static void unpack_parameters(struct gracht_param* params, uint8_t count, void*
     }
 }
 
-int server_invoke_action(struct gracht_list* protocols, struct gracht_recv_message* recvMessage)
+int server_invoke_action(struct gracht_dispatch_table* protocols, struct gracht_recv_message* recvMessage)
 {
     gracht_protocol_function_t* function = get_protocol_action(protocols,
         recvMessage->protocol, recvMessage->action);
-    void* param_storage;
+    gracht_protocol_t*          protocol;
+    void*                       param_storage;
     
     if (!function) {
         return -1;
     }
+
+    // prefer the generated decoder for the function, it skips the unpack buffer
+    protocol = protocols->entries[recvMessage->protocol]->protocol;
+    if (recvMessage->action < protocol->num_invokers && protocol->invokers[recvMessage->action] &&
+        !protocol->invokers[recvMessage->action](function->address, recvMessage)) {
+        return 0;
+    }
     
     param_storage = ((char*)recvMessage->params +
         (recvMessage->param_count * sizeof(struct gracht_param)));
@@ -128,7 +209,7 @@ int server_invoke_action(struct gracht_list* protocols, struct gracht_recv_messa
     return 0;
 }
 
-int client_invoke_action(struct gracht_list* protocols, struct gracht_message* message)
+int client_invoke_action(struct gracht_dispatch_table* protocols, struct gracht_message* message)
 {
     gracht_protocol_function_t* function = get_protocol_action(protocols,
         message->header.protocol, message->header.action);
@@ -26,15 +26,53 @@
 #include <gracht/link/socket.h>
 #include <gracht/server.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/un.h>
+#include <time.h>
 
 #include <test_utils_protocol_client.h>
 
+#define BENCHMARK_WINDOW 32
+
 static const char* dgramPath = "/tmp/g_dgram";
 static const char* clientsPath = "/tmp/g_clients";
 static char        messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
 
+// Pipelines requests in windows, as the requests are small this measures the
+// per-message overhead of the link and the server.
+static int run_benchmark(gracht_client_t* client, int count)
+{
+    struct gracht_message_context contexts[BENCHMARK_WINDOW];
+    struct timespec               start, end;
+    double                        elapsed;
+    int                           sent = 0;
+    int                           status;
+    int                           i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sent < count) {
+        int window = (count - sent) < BENCHMARK_WINDOW ? (count - sent) : BENCHMARK_WINDOW;
+        for (i = 0; i < window; i++) {
+            if (test_utils_print(client, &contexts[i], "benchmark")) {
+                printf("gracht_client: failed to send request %i\n", sent + i);
+                return -1;
+            }
+        }
+
+        for (i = 0; i < window; i++) {
+            gracht_client_wait_message(client, &contexts[i], &messageBuffer[0], GRACHT_WAIT_BLOCK);
+            test_utils_print_result(client, &contexts[i], &status);
+        }
+        sent += window;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    printf("gracht_client: %i requests in %.3f s, %.0f messages/s\n", count, elapsed, count / elapsed);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     struct socket_client_configuration linkConfiguration = { 0 };
@@ -61,6 +99,12 @@ int main(int argc, char **argv)
         return code;
     }
 
+    if (argc > 2 && !strcmp(argv[1], "-b")) {
+        code = run_benchmark(client, atoi(argv[2]));
+        gracht_client_shutdown(client);
+        return code;
+    }
+
     if (argc > 1) {
         code = test_utils_print(client, &context, argv[1]);
     }
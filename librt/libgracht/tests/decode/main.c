@@ -0,0 +1,178 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Decode benchmark
+ *  - Measures the cost of decoding a message and invoking the callback through
+ *    the generated decoders, compared to the generic parameter unpacking
+ */
+
+#include <gracht/dispatch.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <bench_decode_protocol_server.h>
+
+#define INVOKE_COUNT (8 * 1024 * 1024)
+
+extern int server_invoke_action(struct gracht_dispatch_table*, struct gracht_recv_message*);
+
+void bench_decode_one_callback(struct gracht_recv_message* message, struct bench_decode_one_args*);
+void bench_decode_four_callback(struct gracht_recv_message* message, struct bench_decode_four_args*);
+void bench_decode_eight_callback(struct gracht_recv_message* message, struct bench_decode_eight_args*);
+
+static gracht_protocol_function_t bench_decode_callbacks[3] = {
+    { PROTOCOL_BENCH_DECODE_ONE_ID , bench_decode_one_callback },
+    { PROTOCOL_BENCH_DECODE_FOUR_ID , bench_decode_four_callback },
+    { PROTOCOL_BENCH_DECODE_EIGHT_ID , bench_decode_eight_callback },
+};
+DEFINE_BENCH_DECODE_SERVER_PROTOCOL(bench_decode_callbacks, 3);
+
+static gracht_protocol_t generic_protocol = GRACHT_PROTOCOL_INIT(0xF1, "bench_decode", 3, bench_decode_callbacks);
+
+struct bench_message {
+    struct gracht_recv_message base;
+    struct gracht_param        params[8];
+    char                       storage[64];
+};
+
+static size_t checksum;
+
+void bench_decode_one_callback(struct gracht_recv_message* message, struct bench_decode_one_args* args)
+{
+    checksum += (size_t)args->a;
+}
+
+void bench_decode_four_callback(struct gracht_recv_message* message, struct bench_decode_four_args* args)
+{
+    checksum += (size_t)args->a + args->b + (size_t)args->name[0] + ((char*)args->data)[1];
+}
+
+void bench_decode_eight_callback(struct gracht_recv_message* message, struct bench_decode_eight_args* args)
+{
+    checksum += (size_t)args->a + args->b + args->c + args->d + args->e + (size_t)args->f +
+        (size_t)args->name[0] + ((char*)args->data)[1];
+}
+
+static void push_value(struct bench_message* message, size_t value, size_t length)
+{
+    struct gracht_param* param = &message->params[message->base.param_in++];
+    param->type       = GRACHT_PARAM_VALUE;
+    param->length     = length;
+    param->data.value = value;
+}
+
+static void push_buffer(struct bench_message* message, size_t* offset, const char* data, size_t length)
+{
+    struct gracht_param* param = &message->params[message->base.param_in++];
+    param->type        = GRACHT_PARAM_BUFFER;
+    param->length      = length;
+    param->data.buffer = NULL;
+    memcpy(&message->storage[*offset], data, length);
+    *offset += length;
+}
+
+static void build_message(struct bench_message* message, uint8_t action, int param_count)
+{
+    size_t offset = 0;
+
+    memset(message, 0, sizeof(struct bench_message));
+    message->base.params   = &message->params[0];
+    message->base.protocol = 0xF1;
+    message->base.action   = action;
+
+    push_value(message, 1337, sizeof(int));
+    if (param_count == 4) {
+        push_value(message, 42, sizeof(uint32_t));
+        push_buffer(message, &offset, "decode", 7);
+        push_buffer(message, &offset, "\x01\x02\x03\x04", 4);
+    }
+    else if (param_count == 8) {
+        push_value(message, 42, sizeof(uint32_t));
+        push_value(message, 7, sizeof(uint8_t));
+        push_value(message, 65536, sizeof(size_t));
+        push_value(message, 512, sizeof(uint16_t));
+        push_value(message, 1, sizeof(int));
+        push_buffer(message, &offset, "decode", 7);
+        push_buffer(message, &offset, "\x01\x02\x03\x04", 4);
+    }
+
+    // the storage is expected right after the parameters
+    message->base.param_count = param_count;
+    memmove(&message->params[param_count], &message->storage[0], offset);
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1000000000.0 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static double run_invokes(struct gracht_dispatch_table* table, struct bench_message* message, size_t* sum)
+{
+    struct timespec start, end;
+    int             i;
+
+    checksum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < INVOKE_COUNT; i++) {
+        server_invoke_action(table, &message->base);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *sum = checksum;
+    return elapsed_ns(&start, &end) / INVOKE_COUNT;
+}
+
+int main(int argc, char **argv)
+{
+    struct gracht_dispatch_table typedTable   = { { 0 } };
+    struct gracht_dispatch_table genericTable = { { 0 } };
+    struct bench_message         message;
+    uint8_t                      actions[3]   = {
+        PROTOCOL_BENCH_DECODE_ONE_ID, PROTOCOL_BENCH_DECODE_FOUR_ID, PROTOCOL_BENCH_DECODE_EIGHT_ID
+    };
+    int                          paramCounts[3] = { 1, 4, 8 };
+    int                          i;
+
+    if (gracht_dispatch_add(&typedTable, &bench_decode_server_protocol) ||
+        gracht_dispatch_add(&genericTable, &generic_protocol)) {
+        printf("gdecode: failed to add protocol\n");
+        return -1;
+    }
+
+    printf("gdecode: %i invokes per case\n", INVOKE_COUNT);
+    for (i = 0; i < 3; i++) {
+        size_t genericSum, typedSum;
+        double genericNs, typedNs;
+
+        build_message(&message, actions[i], paramCounts[i]);
+        genericNs = run_invokes(&genericTable, &message, &genericSum);
+        typedNs   = run_invokes(&typedTable, &message, &typedSum);
+        if (genericSum != typedSum) {
+            printf("gdecode: decoders disagree for %i parameters\n", paramCounts[i]);
+            return -1;
+        }
+
+        printf("gdecode: %i parameters, generic %.2f ns/message, generated %.2f ns/message\n",
+            paramCounts[i], genericNs, typedNs);
+    }
+
+    gracht_dispatch_clear(&typedTable);
+    gracht_dispatch_clear(&genericTable);
+    return 0;
+}
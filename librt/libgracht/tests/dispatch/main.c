@@ -0,0 +1,136 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Dispatch benchmark
+ *  - Measures the cost of resolving (protocol, action) to a callback through
+ *    the dispatch table, compared to walking the protocol list
+ */
+
+#include <gracht/dispatch.h>
+#include <gracht/list.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PROTOCOL_COUNT  12
+#define FUNCTION_COUNT  16
+#define LOOKUP_COUNT    (16 * 1024 * 1024)
+#define SEQUENCE_LENGTH 4096
+
+static gracht_protocol_function_t functions[PROTOCOL_COUNT][FUNCTION_COUNT];
+static gracht_protocol_t          protocols[PROTOCOL_COUNT];
+
+static gracht_protocol_function_t* list_lookup(struct gracht_list* list, uint8_t protocol_id, uint8_t action_id)
+{
+    struct gracht_object_header* item = list->head;
+    gracht_protocol_t*           protocol;
+    int                          i;
+
+    while (item && item->id != (int)(uint32_t)protocol_id) {
+        item = item->link;
+    }
+
+    if (!item) {
+        return NULL;
+    }
+
+    protocol = (gracht_protocol_t*)item;
+
+    for (i = 0; i < protocol->num_functions; i++) {
+        if (protocol->functions[i].id == action_id) {
+            return &protocol->functions[i];
+        }
+    }
+    return NULL;
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1000000000.0 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    struct gracht_list           list  = { 0 };
+    struct gracht_dispatch_table table = { { 0 } };
+    uint8_t                      sequence[SEQUENCE_LENGTH][2];
+    struct timespec              start, end;
+    uintptr_t                    checksum = 0;
+    double                       list_ns, table_ns;
+    int                          i, j;
+
+    // setup protocols with ids spread out like the system protocols are
+    for (i = 0; i < PROTOCOL_COUNT; i++) {
+        for (j = 0; j < FUNCTION_COUNT; j++) {
+            functions[i][j].id      = (uint8_t)j;
+            functions[i][j].address = &functions[i][j];
+        }
+
+        protocols[i].header.id     = 0x10 + (i * 0x10);
+        protocols[i].header.link   = NULL;
+        protocols[i].id            = (uint8_t)(0x10 + (i * 0x10));
+        protocols[i].name          = "bench";
+        protocols[i].num_functions = FUNCTION_COUNT;
+        protocols[i].functions     = &functions[i][0];
+
+        gracht_list_append(&list, &protocols[i].header);
+        if (gracht_dispatch_add(&table, &protocols[i])) {
+            printf("gdispatch: failed to add protocol %i\n", i);
+            return -1;
+        }
+    }
+
+    srand(1337);
+    for (i = 0; i < SEQUENCE_LENGTH; i++) {
+        sequence[i][0] = protocols[rand() % PROTOCOL_COUNT].id;
+        sequence[i][1] = (uint8_t)(rand() % FUNCTION_COUNT);
+    }
+
+    // verify both methods agree before timing them
+    for (i = 0; i < SEQUENCE_LENGTH; i++) {
+        if (list_lookup(&list, sequence[i][0], sequence[i][1]) !=
+            gracht_dispatch_lookup(&table, sequence[i][0], sequence[i][1])) {
+            printf("gdispatch: lookup mismatch for %u/%u\n", sequence[i][0], sequence[i][1]);
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < LOOKUP_COUNT; i++) {
+        uint8_t* entry = &sequence[i & (SEQUENCE_LENGTH - 1)][0];
+        checksum += (uintptr_t)list_lookup(&list, entry[0], entry[1]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    list_ns = elapsed_ns(&start, &end) / LOOKUP_COUNT;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < LOOKUP_COUNT; i++) {
+        uint8_t* entry = &sequence[i & (SEQUENCE_LENGTH - 1)][0];
+        checksum -= (uintptr_t)gracht_dispatch_lookup(&table, entry[0], entry[1]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    table_ns = elapsed_ns(&start, &end) / LOOKUP_COUNT;
+
+    printf("gdispatch: %i protocols, %i functions each, %i lookups\n", PROTOCOL_COUNT, FUNCTION_COUNT, LOOKUP_COUNT);
+    printf("gdispatch: list walk      %.2f ns/message\n", list_ns);
+    printf("gdispatch: dispatch table %.2f ns/message\n", table_ns);
+
+    gracht_dispatch_clear(&table);
+    return checksum == 0 ? 0 : -1;
+}
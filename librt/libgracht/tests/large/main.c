@@ -0,0 +1,296 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Large message test
+ *  - Forks a server that echoes buffers back, round-trips buffers from 4KB to
+ *    16MB through the socket link and verifies them, for both the inline and the
+ *    worker dispatching. Checks that a stream that goes out of sync is
+ *    disconnected, then measures the memory used by idle connections.
+ */
+
+#include <errno.h>
+#include <gracht/link/socket.h>
+#include <gracht/server.h>
+#include <malloc.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <test_utils_protocol_client.h>
+#include <test_utils_protocol_server.h>
+
+#define MAX_TRANSFER_SIZE (16 * 1024 * 1024)
+#define MAX_MESSAGE_SIZE  (MAX_TRANSFER_SIZE + 1024)
+#define IDLE_CLIENTS      64
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args*);
+void test_utils_transfer_callback(struct gracht_recv_message* message, struct test_utils_transfer_args*);
+
+static gracht_protocol_function_t test_utils_callbacks[2] = {
+    { PROTOCOL_TEST_UTILS_PRINT_ID , test_utils_print_callback },
+    { PROTOCOL_TEST_UTILS_TRANSFER_ID , test_utils_transfer_callback },
+};
+DEFINE_TEST_UTILS_SERVER_PROTOCOL(test_utils_callbacks, 2);
+
+static const char* dgramPath   = "/tmp/g_lg_dgram";
+static const char* clientsPath = "/tmp/g_lg_clients";
+static char        messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
+
+// Reports the heap usage of the server, so the cost of its idle clients can be measured
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args* args)
+{
+    struct mallinfo2 info = mallinfo2();
+    test_utils_print_response(message, (int)info.uordblks);
+}
+
+void test_utils_transfer_callback(struct gracht_recv_message* message, struct test_utils_transfer_args* args)
+{
+    test_utils_transfer_response(message, args->data, message->param_count ?
+        ((struct gracht_param*)message->params)[0].length : 0);
+}
+
+static int run_server(int workers)
+{
+    struct socket_server_configuration linkConfiguration   = { 0 };
+    struct gracht_server_configuration serverConfiguration = { 0 };
+
+    struct sockaddr_un* dgramAddr  = (struct sockaddr_un*)&linkConfiguration.dgram_address;
+    struct sockaddr_un* serverAddr = (struct sockaddr_un*)&linkConfiguration.server_address;
+
+    linkConfiguration.dgram_address_length  = sizeof(struct sockaddr_un);
+    linkConfiguration.server_address_length = sizeof(struct sockaddr_un);
+    linkConfiguration.max_message_size      = MAX_MESSAGE_SIZE;
+
+    unlink(dgramPath);
+    dgramAddr->sun_family = AF_LOCAL;
+    strncpy(dgramAddr->sun_path, dgramPath, sizeof(dgramAddr->sun_path) - 1);
+
+    unlink(clientsPath);
+    serverAddr->sun_family = AF_LOCAL;
+    strncpy(serverAddr->sun_path, clientsPath, sizeof(serverAddr->sun_path) - 1);
+
+    gracht_link_socket_server_create(&serverConfiguration.link, &linkConfiguration);
+    serverConfiguration.max_dispatchers = workers;
+    if (gracht_server_initialize(&serverConfiguration)) {
+        printf("glarge: error initializing server library %i\n", errno);
+        return -1;
+    }
+
+    gracht_server_register_protocol(&test_utils_server_protocol);
+    return gracht_server_main_loop();
+}
+
+static gracht_client_t* connect_client(size_t maxMessageSize)
+{
+    struct socket_client_configuration linkConfiguration = { 0 };
+    struct gracht_client_configuration clientConfiguration;
+    struct sockaddr_un*                addr = (struct sockaddr_un*)&linkConfiguration.address;
+    gracht_client_t*                   client;
+    int                                attempts;
+
+    linkConfiguration.address_length   = sizeof(struct sockaddr_un);
+    linkConfiguration.type             = gracht_link_stream_based;
+    linkConfiguration.max_message_size = maxMessageSize;
+    addr->sun_family = AF_LOCAL;
+    strncpy(addr->sun_path, clientsPath, sizeof(addr->sun_path) - 1);
+
+    // the server might still be starting up
+    for (attempts = 0; attempts < 100; attempts++) {
+        gracht_link_socket_client_create(&clientConfiguration.link, &linkConfiguration);
+        if (!gracht_client_create(&clientConfiguration, &client)) {
+            return client;
+        }
+        usleep(10000);
+    }
+    return NULL;
+}
+
+static int server_heap_usage(gracht_client_t* client)
+{
+    struct gracht_message_context context;
+    int                           usage = -1;
+
+    test_utils_print(client, &context, "heap");
+    gracht_client_wait_message(client, &context, &messageBuffer[0], GRACHT_WAIT_BLOCK);
+    test_utils_print_result(client, &context, &usage);
+    return usage;
+}
+
+static int run_transfers(gracht_client_t* client, char* data, char* reply)
+{
+    struct gracht_message_context context;
+    size_t                        length;
+
+    for (length = 4096; length <= MAX_TRANSFER_SIZE; length *= 4) {
+        struct timespec start, end;
+        double          elapsed;
+        int             status;
+
+        memset(reply, 0, length);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (test_utils_transfer(client, &context, data, length, length)) {
+            printf("glarge: failed to send %zu bytes (%i)\n", length, errno);
+            return -1;
+        }
+        gracht_client_wait_message(client, &context, &messageBuffer[0], GRACHT_WAIT_BLOCK);
+        status = test_utils_transfer_result(client, &context, reply);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (status != GRACHT_MESSAGE_COMPLETED || memcmp(data, reply, length)) {
+            printf("glarge: %zu byte buffer did not round-trip (status %i)\n", length, status);
+            return -1;
+        }
+
+        elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+        printf("glarge: %9zu, %10.3f, %8.1f\n", length, elapsed * 1000.0,
+            (double)(2 * length) / elapsed / (1024.0 * 1024.0));
+    }
+
+    // messages above the configured limit are refused before anything is sent
+    if (!test_utils_transfer(client, &context, data, MAX_MESSAGE_SIZE, 0) || errno != E2BIG) {
+        printf("glarge: message above the limit was not refused\n");
+        return -1;
+    }
+    return 0;
+}
+
+// A frame with an invalid length leaves the stream out of sync, so the server must
+// disconnect that client, and keep serving the others
+static int verify_broken_stream(gracht_client_t* client)
+{
+    struct sockaddr_un    addr    = { 0 };
+    struct gracht_message message = { 0 };
+    struct timeval        timeout = { 5, 0 };
+    char                  byte;
+    int                   iod;
+
+    addr.sun_family = AF_LOCAL;
+    strncpy(addr.sun_path, clientsPath, sizeof(addr.sun_path) - 1);
+    iod = socket(AF_LOCAL, SOCK_STREAM, 0);
+    if (iod < 0 || connect(iod, (const struct sockaddr*)&addr, sizeof(addr))) {
+        printf("glarge: failed to connect raw socket (%i)\n", errno);
+        return -1;
+    }
+
+    message.header.length = 1;
+    setsockopt(iod, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (send(iod, &message, sizeof(message), 0) != sizeof(message) || recv(iod, &byte, 1, 0) != 0) {
+        printf("glarge: out of sync stream was not disconnected\n");
+        close(iod);
+        return -1;
+    }
+    close(iod);
+
+    if (server_heap_usage(client) < 0) {
+        printf("glarge: server stopped responding after disconnecting a stream\n");
+        return -1;
+    }
+    printf("glarge: out of sync stream was disconnected\n");
+    return 0;
+}
+
+static int measure_idle_clients(gracht_client_t* client)
+{
+    gracht_client_t* clients[IDLE_CLIENTS];
+    size_t           clientBefore, clientAfter;
+    int              serverBefore, serverAfter;
+    int              i;
+
+    serverBefore = server_heap_usage(client);
+    clientBefore = mallinfo2().uordblks;
+    for (i = 0; i < IDLE_CLIENTS; i++) {
+        clients[i] = connect_client(MAX_MESSAGE_SIZE);
+        if (!clients[i]) {
+            printf("glarge: failed to connect idle client %i\n", i);
+            return -1;
+        }
+
+        // one request each, so the connections have set up their receive state
+        server_heap_usage(clients[i]);
+    }
+    clientAfter = mallinfo2().uordblks;
+    serverAfter = server_heap_usage(client);
+
+    printf("glarge: idle connection overhead, client %zu bytes, server %i bytes\n",
+        (clientAfter - clientBefore) / IDLE_CLIENTS, (serverAfter - serverBefore) / IDLE_CLIENTS);
+
+    for (i = 0; i < IDLE_CLIENTS; i++) {
+        gracht_client_shutdown(clients[i]);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char* data  = malloc(MAX_MESSAGE_SIZE);
+    char* reply = malloc(MAX_TRANSFER_SIZE);
+    int   status = 0;
+    int   workers;
+    int   i;
+
+    if (!data || !reply) {
+        printf("glarge: failed to allocate buffers\n");
+        return 1;
+    }
+
+    for (i = 0; i < MAX_MESSAGE_SIZE; i++) {
+        data[i] = (char)(i * 31 + (i >> 12));
+    }
+
+    for (workers = 0; workers <= 2 && !status; workers += 2) {
+        gracht_client_t* client;
+        pid_t            server;
+
+        server = fork();
+        if (server == 0) {
+            exit(run_server(workers));
+        }
+
+        client = connect_client(MAX_MESSAGE_SIZE);
+        if (!client) {
+            printf("glarge: failed to connect client\n");
+            status = -1;
+        }
+        else {
+            printf("glarge: %i workers, message limit %i bytes\n", workers, MAX_MESSAGE_SIZE);
+            printf("glarge:     bytes, round-trip ms,     MB/s\n");
+            status = run_transfers(client, data, reply);
+            if (!status) {
+                status = verify_broken_stream(client);
+            }
+            if (!status && !workers) {
+                status = measure_idle_clients(client);
+            }
+            gracht_client_shutdown(client);
+        }
+
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+    }
+
+    free(data);
+    free(reply);
+    return status ? 1 : 0;
+}
@@ -0,0 +1,325 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Client ping-pong test
+ *  - Forks a server and measures the round trip latency of sync calls, while
+ *    counting the allocations made by the client. The program is linked with
+ *    --wrap for the allocator functions, so only library and test calls count
+ */
+
+#include <errno.h>
+#include <gracht/link/socket.h>
+#include <gracht/server.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <test_utils_protocol_client.h>
+#include <test_utils_protocol_server.h>
+
+#define WARMUP_CALLS   1000
+#define PINGPONG_CALLS 100000
+#define WINDOW_CALLS   8
+#define WINDOW_COUNT   10000
+#define AWAIT_CALLS    20000
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args*);
+
+static gracht_protocol_function_t test_utils_callbacks[1] = {
+    { PROTOCOL_TEST_UTILS_PRINT_ID , test_utils_print_callback },
+};
+DEFINE_TEST_UTILS_SERVER_PROTOCOL(test_utils_callbacks, 1);
+
+static const char* dgramPath   = "/tmp/g_pp_dgram";
+static const char* clientsPath = "/tmp/g_pp_clients";
+static atomic_long allocations;
+static volatile int receiving;
+
+extern void* __real_malloc(size_t);
+extern void* __real_calloc(size_t, size_t);
+extern void* __real_realloc(void*, size_t);
+
+void* __wrap_malloc(size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size)
+{
+    atomic_fetch_add(&allocations, 1);
+    return __real_realloc(pointer, size);
+}
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args* args)
+{
+    test_utils_print_response(message, (int)strlen(args->message));
+}
+
+static int run_server(void)
+{
+    struct socket_server_configuration linkConfiguration   = { 0 };
+    struct gracht_server_configuration serverConfiguration = { 0 };
+
+    struct sockaddr_un* dgramAddr  = (struct sockaddr_un*)&linkConfiguration.dgram_address;
+    struct sockaddr_un* serverAddr = (struct sockaddr_un*)&linkConfiguration.server_address;
+
+    linkConfiguration.dgram_address_length  = sizeof(struct sockaddr_un);
+    linkConfiguration.server_address_length = sizeof(struct sockaddr_un);
+
+    unlink(dgramPath);
+    dgramAddr->sun_family = AF_LOCAL;
+    strncpy(dgramAddr->sun_path, dgramPath, sizeof(dgramAddr->sun_path) - 1);
+
+    unlink(clientsPath);
+    serverAddr->sun_family = AF_LOCAL;
+    strncpy(serverAddr->sun_path, clientsPath, sizeof(serverAddr->sun_path) - 1);
+
+    gracht_link_socket_server_create(&serverConfiguration.link, &linkConfiguration);
+    if (gracht_server_initialize(&serverConfiguration)) {
+        printf("gpingpong: error initializing server library %i\n", errno);
+        return -1;
+    }
+
+    gracht_server_register_protocol(&test_utils_server_protocol);
+    return gracht_server_main_loop();
+}
+
+static gracht_client_t* connect_client(void)
+{
+    struct socket_client_configuration linkConfiguration = { 0 };
+    struct gracht_client_configuration clientConfiguration;
+    struct sockaddr_un*                addr = (struct sockaddr_un*)&linkConfiguration.address;
+    gracht_client_t*                   client;
+    int                                attempts;
+
+    linkConfiguration.address_length = sizeof(struct sockaddr_un);
+    linkConfiguration.type           = gracht_link_stream_based;
+    addr->sun_family = AF_LOCAL;
+    strncpy(addr->sun_path, clientsPath, sizeof(addr->sun_path) - 1);
+
+    // the server might still be starting up
+    for (attempts = 0; attempts < 100; attempts++) {
+        gracht_link_socket_client_create(&clientConfiguration.link, &linkConfiguration);
+        if (!gracht_client_create(&clientConfiguration, &client)) {
+            return client;
+        }
+        usleep(10000);
+    }
+    return NULL;
+}
+
+static int call(gracht_client_t* client)
+{
+    char                          messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
+    struct gracht_message_context context;
+    int                           status = -1;
+
+    if (test_utils_print(client, &context, "ping")) {
+        return -1;
+    }
+    gracht_client_wait_message(client, &context, &messageBuffer[0], GRACHT_WAIT_BLOCK);
+    test_utils_print_result(client, &context, &status);
+    return status == 4 ? 0 : -1;
+}
+
+static long elapsed_ns(struct timespec* start, struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static int compare_long(const void* a, const void* b)
+{
+    long left = *(const long*)a, right = *(const long*)b;
+    return (left > right) - (left < right);
+}
+
+static long run_pingpong(gracht_client_t* client)
+{
+    long*           latencies = malloc(PINGPONG_CALLS * sizeof(long));
+    struct timespec start, end;
+    long            total = 0;
+    long            count;
+    int             i;
+
+    if (!latencies) {
+        return -1;
+    }
+
+    atomic_store(&allocations, 0);
+    for (i = 0; i < PINGPONG_CALLS; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (call(client)) {
+            printf("gpingpong: call %i failed\n", i);
+            free(latencies);
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latencies[i] = elapsed_ns(&start, &end);
+        total += latencies[i];
+    }
+    count = atomic_load(&allocations);
+
+    qsort(latencies, PINGPONG_CALLS, sizeof(long), compare_long);
+    printf("gpingpong: ping-pong, %i calls, %.2f allocations/call, avg %.2f us, p50 %.2f us, p99 %.2f us\n",
+        PINGPONG_CALLS, (double)count / PINGPONG_CALLS, (double)total / PINGPONG_CALLS / 1000.0,
+        latencies[PINGPONG_CALLS / 2] / 1000.0, latencies[(PINGPONG_CALLS * 99) / 100] / 1000.0);
+    free(latencies);
+    return count;
+}
+
+static long run_window(gracht_client_t* client)
+{
+    char                          messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
+    struct gracht_message_context contexts[WINDOW_CALLS];
+    long                          count;
+    int                           status;
+    int                           i, j;
+
+    atomic_store(&allocations, 0);
+    for (i = 0; i < WINDOW_COUNT; i++) {
+        for (j = 0; j < WINDOW_CALLS; j++) {
+            if (test_utils_print(client, &contexts[j], "ping")) {
+                return -1;
+            }
+        }
+        for (j = 0; j < WINDOW_CALLS; j++) {
+            gracht_client_wait_message(client, &contexts[j], &messageBuffer[0], GRACHT_WAIT_BLOCK);
+            test_utils_print_result(client, &contexts[j], &status);
+            if (status != 4) {
+                printf("gpingpong: windowed call returned %i\n", status);
+                return -1;
+            }
+        }
+    }
+    count = atomic_load(&allocations);
+    printf("gpingpong: %i outstanding, %i calls, %.2f allocations/call\n",
+        WINDOW_CALLS, WINDOW_CALLS * WINDOW_COUNT, (double)count / (WINDOW_CALLS * WINDOW_COUNT));
+    return count;
+}
+
+// A receiver thread handles all incoming messages, while the caller waits for
+// its responses through the awaiters
+static void* receiver_thread(void* context)
+{
+    char             messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
+    gracht_client_t* client = context;
+
+    while (receiving) {
+        gracht_client_wait_message(client, NULL, &messageBuffer[0], GRACHT_WAIT_BLOCK);
+    }
+    return NULL;
+}
+
+static int await_call(gracht_client_t* client)
+{
+    struct gracht_message_context context;
+    int                           status = -1;
+
+    if (test_utils_print(client, &context, "ping")) {
+        return -1;
+    }
+    gracht_client_await(client, &context);
+    test_utils_print_result(client, &context, &status);
+    return status == 4 ? 0 : -1;
+}
+
+static long run_awaiter(gracht_client_t* client)
+{
+    pthread_t thread;
+    long      count;
+    int       status = 0;
+    int       i;
+
+    receiving = 1;
+    pthread_create(&thread, NULL, receiver_thread, client);
+
+    atomic_store(&allocations, 0);
+    for (i = 0; i < AWAIT_CALLS && !status; i++) {
+        status = await_call(client);
+    }
+    count = atomic_load(&allocations);
+
+    // the last call wakes up the receiver so it can see the flag
+    receiving = 0;
+    await_call(client);
+    pthread_join(thread, NULL);
+
+    if (status) {
+        printf("gpingpong: awaited call %i failed\n", i);
+        return -1;
+    }
+    printf("gpingpong: awaited from a second thread, %i calls, %.2f allocations/call\n",
+        AWAIT_CALLS, (double)count / AWAIT_CALLS);
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    gracht_client_t* client;
+    pid_t            server;
+    long             counts[3];
+    int              status = 0;
+    int              i;
+
+    server = fork();
+    if (server == 0) {
+        exit(run_server());
+    }
+
+    client = connect_client();
+    if (!client) {
+        printf("gpingpong: failed to connect client\n");
+        status = -1;
+    }
+    else {
+        for (i = 0; i < WARMUP_CALLS; i++) {
+            call(client);
+        }
+
+        counts[0] = run_pingpong(client);
+        counts[1] = run_window(client);
+        counts[2] = run_awaiter(client);
+        for (i = 0; i < 3; i++) {
+            if (counts[i] != 0) {
+                printf("gpingpong: expected no allocations on the call path\n");
+                status = -1;
+                break;
+            }
+        }
+        gracht_client_shutdown(client);
+    }
+
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    return status ? 1 : 0;
+}
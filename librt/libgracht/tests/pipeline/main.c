@@ -0,0 +1,216 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Pipelined transfer test
+ *  - Forks a server and transfers a buffer in chunks, keeping a number of
+ *    requests in flight with the async stubs and completion callbacks, and
+ *    measures the throughput for each queue depth
+ */
+
+#include <errno.h>
+#include <gracht/link/socket.h>
+#include <gracht/server.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <test_utils_protocol_client.h>
+#include <test_utils_protocol_server.h>
+
+#define CHUNK_SIZE     256
+#define TRANSFER_SIZE  (16 * 1024 * 1024)
+#define MAX_DEPTH      64
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args*);
+
+static gracht_protocol_function_t test_utils_callbacks[1] = {
+    { PROTOCOL_TEST_UTILS_PRINT_ID , test_utils_print_callback },
+};
+DEFINE_TEST_UTILS_SERVER_PROTOCOL(test_utils_callbacks, 1);
+
+static const char* dgramPath   = "/tmp/g_pl_dgram";
+static const char* clientsPath = "/tmp/g_pl_clients";
+
+struct transfer {
+    gracht_client_t*              client;
+    struct gracht_message_context contexts[MAX_DEPTH];
+    char                          chunk[CHUNK_SIZE];
+    long                          issued;
+    long                          completed;
+    long                          total;
+    int                           failed;
+};
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args* args)
+{
+    test_utils_print_response(message, (int)strlen(args->message));
+}
+
+static int run_server(void)
+{
+    struct socket_server_configuration linkConfiguration   = { 0 };
+    struct gracht_server_configuration serverConfiguration = { 0 };
+
+    struct sockaddr_un* dgramAddr  = (struct sockaddr_un*)&linkConfiguration.dgram_address;
+    struct sockaddr_un* serverAddr = (struct sockaddr_un*)&linkConfiguration.server_address;
+
+    linkConfiguration.dgram_address_length  = sizeof(struct sockaddr_un);
+    linkConfiguration.server_address_length = sizeof(struct sockaddr_un);
+
+    unlink(dgramPath);
+    dgramAddr->sun_family = AF_LOCAL;
+    strncpy(dgramAddr->sun_path, dgramPath, sizeof(dgramAddr->sun_path) - 1);
+
+    unlink(clientsPath);
+    serverAddr->sun_family = AF_LOCAL;
+    strncpy(serverAddr->sun_path, clientsPath, sizeof(serverAddr->sun_path) - 1);
+
+    gracht_link_socket_server_create(&serverConfiguration.link, &linkConfiguration);
+    if (gracht_server_initialize(&serverConfiguration)) {
+        printf("gpipeline: error initializing server library %i\n", errno);
+        return -1;
+    }
+
+    gracht_server_register_protocol(&test_utils_server_protocol);
+    return gracht_server_main_loop();
+}
+
+static gracht_client_t* connect_client(void)
+{
+    struct socket_client_configuration linkConfiguration = { 0 };
+    struct gracht_client_configuration clientConfiguration;
+    struct sockaddr_un*                addr = (struct sockaddr_un*)&linkConfiguration.address;
+    gracht_client_t*                   client;
+    int                                attempts;
+
+    linkConfiguration.address_length = sizeof(struct sockaddr_un);
+    linkConfiguration.type           = gracht_link_stream_based;
+    addr->sun_family = AF_LOCAL;
+    strncpy(addr->sun_path, clientsPath, sizeof(addr->sun_path) - 1);
+
+    // the server might still be starting up
+    for (attempts = 0; attempts < 100; attempts++) {
+        gracht_link_socket_client_create(&clientConfiguration.link, &linkConfiguration);
+        if (!gracht_client_create(&clientConfiguration, &client)) {
+            return client;
+        }
+        usleep(10000);
+    }
+    return NULL;
+}
+
+static void chunk_completed(gracht_client_t*, struct gracht_message_context*, void*);
+
+static void issue_chunk(struct transfer* transfer, struct gracht_message_context* context)
+{
+    transfer->issued++;
+    if (test_utils_print_async(transfer->client, context, chunk_completed, transfer, &transfer->chunk[0])) {
+        printf("gpipeline: failed to send chunk %li (%i)\n", transfer->issued, errno);
+        transfer->failed = 1;
+    }
+}
+
+// The context is reused for the next chunk as soon as its response has been read
+static void chunk_completed(gracht_client_t* client, struct gracht_message_context* context, void* callbackContext)
+{
+    struct transfer* transfer = callbackContext;
+    int              status   = -1;
+
+    test_utils_print_result(client, context, &status);
+    if (status != CHUNK_SIZE - 1) {
+        printf("gpipeline: chunk returned %i\n", status);
+        transfer->failed = 1;
+        return;
+    }
+
+    transfer->completed++;
+    if (transfer->issued < transfer->total) {
+        issue_chunk(transfer, context);
+    }
+}
+
+static int run_transfer(struct transfer* transfer, int depth)
+{
+    char            messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
+    struct timespec start, end;
+    double          elapsed;
+    int             i;
+
+    transfer->issued    = 0;
+    transfer->completed = 0;
+    transfer->total     = TRANSFER_SIZE / CHUNK_SIZE;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < depth && transfer->issued < transfer->total; i++) {
+        issue_chunk(transfer, &transfer->contexts[i]);
+    }
+
+    while (transfer->completed < transfer->total && !transfer->failed) {
+        if (gracht_client_poll(transfer->client, &messageBuffer[0], GRACHT_WAIT_BLOCK) < 0 && errno != ENODATA) {
+            printf("gpipeline: poll failed (%i)\n", errno);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (transfer->failed) {
+        return -1;
+    }
+
+    elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    printf("gpipeline: %5i, %10.0f, %8.1f\n", depth, (double)transfer->total / elapsed,
+        (double)TRANSFER_SIZE / elapsed / (1024.0 * 1024.0));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct transfer transfer = { 0 };
+    pid_t           server;
+    int             status = 0;
+    int             depth;
+
+    server = fork();
+    if (server == 0) {
+        exit(run_server());
+    }
+
+    transfer.client = connect_client();
+    if (!transfer.client) {
+        printf("gpipeline: failed to connect client\n");
+        status = -1;
+    }
+    else {
+        memset(&transfer.chunk[0], 'g', CHUNK_SIZE - 1);
+        printf("gpipeline: %i byte chunks, %i MB transfer\n", CHUNK_SIZE, TRANSFER_SIZE / (1024 * 1024));
+        printf("gpipeline: depth, requests/s,     MB/s\n");
+        for (depth = 1; depth <= MAX_DEPTH && !status; depth *= 2) {
+            status = run_transfer(&transfer, depth);
+        }
+        gracht_client_shutdown(transfer.client);
+    }
+
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    return status ? 1 : 0;
+}
@@ -26,6 +26,7 @@
 #include <gracht/link/socket.h>
 #include <gracht/server.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/un.h>
 
@@ -40,21 +41,39 @@ DEFINE_TEST_UTILS_SERVER_PROTOCOL(test_utils_callbacks, 1);
 
 static const char* dgramPath = "/tmp/g_dgram";
 static const char* clientsPath = "/tmp/g_clients";
+static int         quiet = 0;
 
 void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args* args)
 {
-    printf("print: received message: %s\n", args->message);
+    if (!quiet) {
+        printf("print: received message: %s\n", args->message);
+    }
     test_utils_print_response(message, strlen(args->message));
 }
 
 int main(int argc, char **argv)
 {
     struct socket_server_configuration linkConfiguration = { 0 };
-    struct gracht_server_configuration serverConfiguration;
+    struct gracht_server_configuration serverConfiguration = { 0 };
     int                                code;
     
     struct sockaddr_un* dgramAddr = (struct sockaddr_un*)&linkConfiguration.dgram_address;
     struct sockaddr_un* serverAddr = (struct sockaddr_un*)&linkConfiguration.server_address;
+    int                 i;
+
+    // -q disables printing of messages, -w <count> enables worker threads
+    // and -c enables event coalescing
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-q")) {
+            quiet = 1;
+        }
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            serverConfiguration.max_dispatchers = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-c")) {
+            serverConfiguration.coalesce_events = 1;
+        }
+    }
     
     linkConfiguration.dgram_address_length = sizeof(struct sockaddr_un);
     linkConfiguration.server_address_length = sizeof(struct sockaddr_un);
@@ -0,0 +1,266 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Shared memory link test
+ *  - Forks a server on the shm link, and measures latency and bandwidth of
+ *    requests with payloads from 64 bytes to 1MB, sent inline on the socket,
+ *    copied to the ring, and allocated directly in the ring
+ */
+
+#include <errno.h>
+#include <gracht/link/shm.h>
+#include <gracht/server.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <test_utils_protocol_client.h>
+#include <test_utils_protocol_server.h>
+
+#define MIN_PAYLOAD     64
+#define MAX_PAYLOAD     (1024 * 1024)
+#define BYTES_PER_RUN   (64 * 1024 * 1024)
+#define MIN_ITERATIONS  1000
+#define MAX_ITERATIONS  20000
+#define PIPELINE_WINDOW 16
+
+#define MODE_SOCKET   0
+#define MODE_COPY     1
+#define MODE_ZEROCOPY 2
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args*);
+
+static gracht_protocol_function_t test_utils_callbacks[1] = {
+    { PROTOCOL_TEST_UTILS_PRINT_ID , test_utils_print_callback },
+};
+DEFINE_TEST_UTILS_SERVER_PROTOCOL(test_utils_callbacks, 1);
+
+static const char* dgramPath   = "/tmp/g_shm_dgram";
+static const char* clientsPath = "/tmp/g_shm_clients";
+static const char* modeNames[] = { "socket", "copy", "zerocopy" };
+static char        messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
+
+// the length is returned so the client can verify the payload arrived intact
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args* args)
+{
+    test_utils_print_response(message, (int)strlen(args->message));
+}
+
+static int run_server(void)
+{
+    struct socket_server_configuration linkConfiguration   = { 0 };
+    struct gracht_server_configuration serverConfiguration = { 0 };
+
+    struct sockaddr_un* dgramAddr  = (struct sockaddr_un*)&linkConfiguration.dgram_address;
+    struct sockaddr_un* serverAddr = (struct sockaddr_un*)&linkConfiguration.server_address;
+
+    linkConfiguration.dgram_address_length  = sizeof(struct sockaddr_un);
+    linkConfiguration.server_address_length = sizeof(struct sockaddr_un);
+
+    unlink(dgramPath);
+    dgramAddr->sun_family = AF_LOCAL;
+    strncpy(dgramAddr->sun_path, dgramPath, sizeof(dgramAddr->sun_path) - 1);
+
+    unlink(clientsPath);
+    serverAddr->sun_family = AF_LOCAL;
+    strncpy(serverAddr->sun_path, clientsPath, sizeof(serverAddr->sun_path) - 1);
+
+    gracht_link_shm_server_create(&serverConfiguration.link, &linkConfiguration);
+    if (gracht_server_initialize(&serverConfiguration)) {
+        printf("gshm: error initializing server library %i\n", errno);
+        return -1;
+    }
+
+    gracht_server_register_protocol(&test_utils_server_protocol);
+    return gracht_server_main_loop();
+}
+
+static gracht_client_t* connect_client(size_t threshold, struct client_link_ops** linkOut)
+{
+    struct shm_client_configuration    linkConfiguration = { 0 };
+    struct gracht_client_configuration clientConfiguration;
+    struct sockaddr_un*                addr = (struct sockaddr_un*)&linkConfiguration.socket.address;
+    gracht_client_t*                   client;
+    int                                attempts;
+
+    linkConfiguration.socket.address_length = sizeof(struct sockaddr_un);
+    linkConfiguration.socket.type           = gracht_link_stream_based;
+    linkConfiguration.threshold             = threshold;
+    addr->sun_family = AF_LOCAL;
+    strncpy(addr->sun_path, clientsPath, sizeof(addr->sun_path) - 1);
+
+    // the server might still be starting up
+    for (attempts = 0; attempts < 100; attempts++) {
+        gracht_link_shm_client_create(&clientConfiguration.link, &linkConfiguration);
+        if (!gracht_client_create(&clientConfiguration, &client)) {
+            *linkOut = clientConfiguration.link;
+            return client;
+        }
+        usleep(10000);
+    }
+    return NULL;
+}
+
+static char* get_payload(struct client_link_ops* link, int mode, char* userBuffer, size_t size)
+{
+    char* payload = userBuffer;
+    if (mode == MODE_ZEROCOPY) {
+        payload = gracht_link_shm_client_alloc(link, size);
+        if (!payload) {
+            return NULL;
+        }
+    }
+
+    // produce the payload where it is sent from
+    memset(payload, 'g', size - 1);
+    payload[size - 1] = '\0';
+    return payload;
+}
+
+static int run_payload(gracht_client_t* client, struct client_link_ops* link,
+    int mode, char* userBuffer, size_t size)
+{
+    struct gracht_message_context context;
+    struct timespec               start, end;
+    double                        elapsed;
+    long                          iterations = BYTES_PER_RUN / (long)size;
+    long                          i;
+    int                           status;
+
+    if (iterations < MIN_ITERATIONS) {
+        iterations = MIN_ITERATIONS;
+    }
+    if (iterations > MAX_ITERATIONS) {
+        iterations = MAX_ITERATIONS;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        char* payload = get_payload(link, mode, userBuffer, size);
+        if (!payload || test_utils_print(client, &context, payload)) {
+            printf("gshm: failed to send %zu byte request (%i)\n", size, errno);
+            return -1;
+        }
+
+        gracht_client_wait_message(client, &context, &messageBuffer[0], GRACHT_WAIT_BLOCK);
+        test_utils_print_result(client, &context, &status);
+        if (status != (int)size - 1) {
+            printf("gshm: %s payload of %zu bytes arrived as %i bytes\n", modeNames[mode], size, status);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    printf("gshm: %8s, %8zu, %10.2f, %10.1f\n", modeNames[mode], size,
+        (elapsed * 1000000.0) / (double)iterations,
+        ((double)size * (double)iterations) / elapsed / (1024.0 * 1024.0));
+    return 0;
+}
+
+// Keeps more requests in flight than the ring can hold, so the client has to
+// wait for the server to release records
+static int run_pipeline(gracht_client_t* client, struct client_link_ops* link, char* userBuffer)
+{
+    struct gracht_message_context contexts[PIPELINE_WINDOW];
+    int                           status;
+    int                           i;
+
+    for (i = 0; i < PIPELINE_WINDOW; i++) {
+        char* payload = get_payload(link, MODE_ZEROCOPY, userBuffer, MAX_PAYLOAD);
+        if (!payload || test_utils_print(client, &contexts[i], payload)) {
+            printf("gshm: failed to send pipelined request %i (%i)\n", i, errno);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < PIPELINE_WINDOW; i++) {
+        gracht_client_wait_message(client, &contexts[i], &messageBuffer[0], GRACHT_WAIT_BLOCK);
+        test_utils_print_result(client, &contexts[i], &status);
+        if (status != MAX_PAYLOAD - 1) {
+            printf("gshm: pipelined request %i arrived as %i bytes\n", i, status);
+            return -1;
+        }
+    }
+    printf("gshm: %i pipelined 1MB requests through a %i byte ring\n",
+        PIPELINE_WINDOW, GRACHT_SHM_DEFAULT_RING_SIZE);
+    return 0;
+}
+
+static int run_clients(void)
+{
+    struct client_link_ops* links[3];
+    gracht_client_t*        clients[3];
+    char*                   userBuffer;
+    size_t                  size;
+    int                     status = 0;
+    int                     mode;
+
+    userBuffer = malloc(MAX_PAYLOAD);
+    clients[MODE_SOCKET]   = connect_client(SIZE_MAX, &links[MODE_SOCKET]);
+    clients[MODE_COPY]     = connect_client(0, &links[MODE_COPY]);
+    clients[MODE_ZEROCOPY] = connect_client(0, &links[MODE_ZEROCOPY]);
+    if (!userBuffer || !clients[MODE_SOCKET] || !clients[MODE_COPY] || !clients[MODE_ZEROCOPY]) {
+        printf("gshm: failed to connect clients\n");
+        return -1;
+    }
+
+    printf("gshm:     mode,  payload, latency us,       MB/s\n");
+    for (size = MIN_PAYLOAD; size <= MAX_PAYLOAD && !status; size *= 4) {
+        for (mode = MODE_SOCKET; mode <= MODE_ZEROCOPY && !status; mode++) {
+            // inline payloads are limited by the maximum message size
+            if (mode == MODE_SOCKET && size > GRACHT_MAX_MESSAGE_SIZE / 2) {
+                continue;
+            }
+            status = run_payload(clients[mode], links[mode], mode, userBuffer, size);
+        }
+    }
+
+    if (!status) {
+        status = run_pipeline(clients[MODE_ZEROCOPY], links[MODE_ZEROCOPY], userBuffer);
+    }
+
+    for (mode = MODE_SOCKET; mode <= MODE_ZEROCOPY; mode++) {
+        gracht_client_shutdown(clients[mode]);
+    }
+    free(userBuffer);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    pid_t server;
+    int   status;
+
+    server = fork();
+    if (server == 0) {
+        exit(run_server());
+    }
+
+    status = run_clients();
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    return status ? 1 : 0;
+}
@@ -0,0 +1,187 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Client stress test
+ *  - Runs a server in a seperate thread and connects an increasing amount of
+ *    local socket clients, reporting the per-request latency at each step
+ */
+
+#include <errno.h>
+#include <gracht/link/socket.h>
+#include <gracht/server.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include <test_utils_protocol_client.h>
+#include <test_utils_protocol_server.h>
+
+#define MAX_CLIENTS       4096
+#define REQUESTS_PER_STEP 4096
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args*);
+
+static gracht_protocol_function_t test_utils_callbacks[1] = {
+    { PROTOCOL_TEST_UTILS_PRINT_ID , test_utils_print_callback },
+};
+DEFINE_TEST_UTILS_SERVER_PROTOCOL(test_utils_callbacks, 1);
+
+static const char* dgramPath   = "/tmp/g_stress_dgram";
+static const char* clientsPath = "/tmp/g_stress_clients";
+static char        messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
+
+static gracht_client_t* clients[MAX_CLIENTS];
+static int              clientCount = 0;
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args* args)
+{
+    test_utils_print_response(message, (int)strlen(args->message));
+}
+
+static void* server_thread(void* context)
+{
+    gracht_server_main_loop();
+    return NULL;
+}
+
+static int start_server(void)
+{
+    struct socket_server_configuration linkConfiguration = { 0 };
+    struct gracht_server_configuration serverConfiguration = { 0 };
+    pthread_t                          thread;
+    int                                code;
+
+    struct sockaddr_un* dgramAddr  = (struct sockaddr_un*)&linkConfiguration.dgram_address;
+    struct sockaddr_un* serverAddr = (struct sockaddr_un*)&linkConfiguration.server_address;
+
+    linkConfiguration.dgram_address_length  = sizeof(struct sockaddr_un);
+    linkConfiguration.server_address_length = sizeof(struct sockaddr_un);
+
+    unlink(dgramPath);
+    dgramAddr->sun_family = AF_LOCAL;
+    strncpy(dgramAddr->sun_path, dgramPath, sizeof(dgramAddr->sun_path) - 1);
+
+    unlink(clientsPath);
+    serverAddr->sun_family = AF_LOCAL;
+    strncpy(serverAddr->sun_path, clientsPath, sizeof(serverAddr->sun_path) - 1);
+
+    gracht_link_socket_server_create(&serverConfiguration.link, &linkConfiguration);
+    code = gracht_server_initialize(&serverConfiguration);
+    if (code) {
+        printf("gstress: error initializing server library %i\n", errno);
+        return code;
+    }
+
+    gracht_server_register_protocol(&test_utils_server_protocol);
+    return pthread_create(&thread, NULL, server_thread, NULL);
+}
+
+static int connect_clients(int count)
+{
+    struct socket_client_configuration linkConfiguration = { 0 };
+    struct gracht_client_configuration clientConfiguration;
+    struct sockaddr_un*                addr = (struct sockaddr_un*)&linkConfiguration.address;
+
+    linkConfiguration.address_length = sizeof(struct sockaddr_un);
+    linkConfiguration.type           = gracht_link_stream_based;
+    addr->sun_family = AF_LOCAL;
+    strncpy(addr->sun_path, clientsPath, sizeof(addr->sun_path) - 1);
+
+    while (clientCount < count) {
+        gracht_link_socket_client_create(&clientConfiguration.link, &linkConfiguration);
+        if (gracht_client_create(&clientConfiguration, &clients[clientCount])) {
+            printf("gstress: failed to connect client %i (%i)\n", clientCount, errno);
+            return -1;
+        }
+        clientCount++;
+    }
+    return 0;
+}
+
+static int run_requests(double* latencyOut)
+{
+    struct gracht_message_context context;
+    struct timespec               start, end;
+    int                           status;
+    int                           i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < REQUESTS_PER_STEP; i++) {
+        gracht_client_t* client = clients[i % clientCount];
+
+        status = -1;
+        if (test_utils_print(client, &context, "stress")) {
+            return -1;
+        }
+        gracht_client_wait_message(client, &context, &messageBuffer[0], GRACHT_WAIT_BLOCK);
+        test_utils_print_result(client, &context, &status);
+        if (status != (int)strlen("stress")) {
+            printf("gstress: unexpected status %i\n", status);
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *latencyOut = ((double)(end.tv_sec - start.tv_sec) * 1000000.0 +
+        (double)(end.tv_nsec - start.tv_nsec) / 1000.0) / REQUESTS_PER_STEP;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct rlimit limit;
+    int           maxClients = MAX_CLIENTS;
+    int           count;
+
+    if (argc > 1) {
+        maxClients = atoi(argv[1]);
+        if (maxClients <= 0 || maxClients > MAX_CLIENTS) {
+            maxClients = MAX_CLIENTS;
+        }
+    }
+
+    // each client costs two descriptors as both ends live in this process
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < (rlim_t)(maxClients * 2 + 64)) {
+            maxClients = (int)(limit.rlim_cur - 64) / 2;
+            printf("gstress: limiting to %i clients due to descriptor limit\n", maxClients);
+        }
+    }
+
+    if (start_server()) {
+        return -1;
+    }
+
+    printf("gstress: clients, latency (us/request)\n");
+    for (count = 1; count <= maxClients; count *= 2) {
+        double latency;
+
+        if (connect_clients(count) || run_requests(&latency)) {
+            return -1;
+        }
+        printf("gstress: %7i, %.2f\n", count, latency);
+    }
+    return 0;
+}
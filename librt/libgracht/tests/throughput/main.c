@@ -0,0 +1,216 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Server throughput test
+ *  - Forks a server for each worker count from 1 to the number of cores, and
+ *    measures the requests per second a set of client threads can achieve
+ */
+
+#include <errno.h>
+#include <gracht/link/socket.h>
+#include <gracht/server.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <test_utils_protocol_client.h>
+#include <test_utils_protocol_server.h>
+
+#define CLIENT_THREADS 16
+#define RUN_SECONDS    2
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args*);
+
+static gracht_protocol_function_t test_utils_callbacks[1] = {
+    { PROTOCOL_TEST_UTILS_PRINT_ID , test_utils_print_callback },
+};
+DEFINE_TEST_UTILS_SERVER_PROTOCOL(test_utils_callbacks, 1);
+
+static const char*   dgramPath   = "/tmp/g_tp_dgram";
+static const char*   clientsPath = "/tmp/g_tp_clients";
+static int           handlerDelay = 200;
+static volatile int  running;
+
+// the handler simulates a blocking operation like a file read
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args* args)
+{
+    if (handlerDelay) {
+        usleep(handlerDelay);
+    }
+    test_utils_print_response(message, (int)strlen(args->message));
+}
+
+static int run_server(int workers)
+{
+    struct socket_server_configuration linkConfiguration   = { 0 };
+    struct gracht_server_configuration serverConfiguration = { 0 };
+
+    struct sockaddr_un* dgramAddr  = (struct sockaddr_un*)&linkConfiguration.dgram_address;
+    struct sockaddr_un* serverAddr = (struct sockaddr_un*)&linkConfiguration.server_address;
+
+    linkConfiguration.dgram_address_length  = sizeof(struct sockaddr_un);
+    linkConfiguration.server_address_length = sizeof(struct sockaddr_un);
+
+    unlink(dgramPath);
+    dgramAddr->sun_family = AF_LOCAL;
+    strncpy(dgramAddr->sun_path, dgramPath, sizeof(dgramAddr->sun_path) - 1);
+
+    unlink(clientsPath);
+    serverAddr->sun_family = AF_LOCAL;
+    strncpy(serverAddr->sun_path, clientsPath, sizeof(serverAddr->sun_path) - 1);
+
+    gracht_link_socket_server_create(&serverConfiguration.link, &linkConfiguration);
+    serverConfiguration.max_dispatchers = workers;
+    if (gracht_server_initialize(&serverConfiguration)) {
+        printf("gthroughput: error initializing server library %i\n", errno);
+        return -1;
+    }
+
+    gracht_server_register_protocol(&test_utils_server_protocol);
+    return gracht_server_main_loop();
+}
+
+static gracht_client_t* connect_client(void)
+{
+    struct socket_client_configuration linkConfiguration = { 0 };
+    struct gracht_client_configuration clientConfiguration;
+    struct sockaddr_un*                addr = (struct sockaddr_un*)&linkConfiguration.address;
+    gracht_client_t*                   client;
+    int                                attempts;
+
+    linkConfiguration.address_length = sizeof(struct sockaddr_un);
+    linkConfiguration.type           = gracht_link_stream_based;
+    addr->sun_family = AF_LOCAL;
+    strncpy(addr->sun_path, clientsPath, sizeof(addr->sun_path) - 1);
+
+    // the server might still be starting up
+    for (attempts = 0; attempts < 100; attempts++) {
+        gracht_link_socket_client_create(&clientConfiguration.link, &linkConfiguration);
+        if (!gracht_client_create(&clientConfiguration, &client)) {
+            return client;
+        }
+        usleep(10000);
+    }
+    return NULL;
+}
+
+static void* client_thread(void* context)
+{
+    char                          messageBuffer[GRACHT_MAX_MESSAGE_SIZE];
+    struct gracht_message_context messageContext;
+    gracht_client_t*              client = connect_client();
+    long*                         count  = context;
+    int                           status;
+
+    if (!client) {
+        printf("gthroughput: failed to connect client\n");
+        return NULL;
+    }
+
+    while (!running) {
+        usleep(1000);
+    }
+
+    while (running > 0) {
+        if (test_utils_print(client, &messageContext, "throughput")) {
+            break;
+        }
+        gracht_client_wait_message(client, &messageContext, &messageBuffer[0], GRACHT_WAIT_BLOCK);
+        test_utils_print_result(client, &messageContext, &status);
+        (*count)++;
+    }
+
+    gracht_client_shutdown(client);
+    return NULL;
+}
+
+static double run_clients(void)
+{
+    pthread_t threads[CLIENT_THREADS];
+    long      counts[CLIENT_THREADS] = { 0 };
+    long      total = 0;
+    int       i;
+
+    running = 0;
+    for (i = 0; i < CLIENT_THREADS; i++) {
+        pthread_create(&threads[i], NULL, client_thread, &counts[i]);
+    }
+
+    // allow the clients to connect before starting the clock
+    usleep(100000);
+    running = 1;
+    sleep(RUN_SECONDS);
+    running = -1;
+
+    for (i = 0; i < CLIENT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        total += counts[i];
+    }
+    return (double)total / RUN_SECONDS;
+}
+
+int main(int argc, char **argv)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long maxWorkers;
+    long workers;
+
+    if (argc > 1) {
+        handlerDelay = atoi(argv[1]);
+    }
+
+    maxWorkers = cores;
+    if (argc > 2) {
+        maxWorkers = atol(argv[2]);
+    }
+    if (maxWorkers < 1) {
+        maxWorkers = 1;
+    }
+
+    printf("gthroughput: %i client threads, %i us handler delay, %li cores\n",
+        CLIENT_THREADS, handlerDelay, cores);
+    printf("gthroughput: workers, requests/s\n");
+    for (workers = 0; workers <= maxWorkers; workers++) {
+        pid_t  server;
+        double requests;
+
+        server = fork();
+        if (server == 0) {
+            exit(run_server((int)workers));
+        }
+
+        requests = run_clients();
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+
+        if (workers == 0) {
+            printf("gthroughput: inline, %.0f\n", requests);
+        }
+        else {
+            printf("gthroughput: %7li, %.0f\n", workers, requests);
+        }
+    }
+    return 0;
+}
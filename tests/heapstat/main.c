@@ -0,0 +1,165 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Kernel Heap Statistics
+ *  - Dumps the statistics of the kernel heap caches, and controls and dumps the
+ *    sampled allocation profiler of the kernel heap.
+ *
+ *  heapstat             prints the statistics of every cache
+ *  heapstat -p <n>      samples every n'th allocation, 0 disables the profiler
+ *  heapstat -s          prints the samples collected, grouped by call site
+ */
+
+#include <os/mollenos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct call_site {
+    uintptr_t caller;
+    size_t    count;
+    size_t    bytes;
+};
+
+static int compare_call_sites(const void* a, const void* b)
+{
+    const struct call_site* siteA = a;
+    const struct call_site* siteB = b;
+    if (siteA->count != siteB->count) {
+        return siteA->count < siteB->count ? 1 : -1;
+    }
+    return 0;
+}
+
+static int dump_caches(void)
+{
+    HeapCacheStatistics_t* statistics;
+    OsStatus_t             status;
+    int                    count = 0;
+    int                    i;
+
+    // Query the number of caches first, and leave room for caches created meanwhile
+    status = HeapQuery(NULL, &count);
+    if (status != OsSuccess) {
+        printf("heapstat: failed to query the kernel heap: %i\n", status);
+        return -1;
+    }
+
+    count += 16;
+    statistics = malloc(count * sizeof(HeapCacheStatistics_t));
+    if (!statistics) {
+        return -1;
+    }
+
+    status = HeapQuery(statistics, &count);
+    if (status != OsSuccess) {
+        printf("heapstat: failed to query the kernel heap: %i\n", status);
+        free(statistics);
+        return -1;
+    }
+
+    printf("%-24s %8s %6s %6s %12s %12s %10s %10s %8s %8s\n", "cache", "size", "slabs",
+        "pages", "allocs", "frees", "in use", "peak", "created", "reaped");
+    for (i = 0; i < count; i++) {
+        HeapCacheStatistics_t* entry = &statistics[i];
+        printf("%-24s %8zu %6zu %6zu %12llu %12llu %10zu %10zu %8zu %8zu\n", &entry->Name[0],
+            entry->ObjectSize, entry->NumberOfSlabs, entry->NumberOfSlabs * entry->PagesPerSlab,
+            (unsigned long long)entry->NumberOfAllocations, (unsigned long long)entry->NumberOfFrees,
+            entry->ObjectsInUse, entry->HighWaterMark, entry->NumberOfSlabsCreated,
+            entry->NumberOfSlabsReaped);
+    }
+    free(statistics);
+    return 0;
+}
+
+static int dump_samples(void)
+{
+    HeapProfileSample_t* samples;
+    struct call_site*    sites;
+    OsStatus_t           status;
+    int                  count = HEAP_PROFILE_MAX_SAMPLES;
+    int                  siteCount = 0;
+    int                  i, j;
+
+    samples = malloc(HEAP_PROFILE_MAX_SAMPLES * sizeof(HeapProfileSample_t));
+    sites   = malloc(HEAP_PROFILE_MAX_SAMPLES * sizeof(struct call_site));
+    if (!samples || !sites) {
+        free(samples);
+        free(sites);
+        return -1;
+    }
+
+    status = HeapProfile(-1, samples, &count);
+    if (status != OsSuccess) {
+        printf("heapstat: failed to read the profiler samples: %i\n", status);
+        free(samples);
+        free(sites);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < siteCount; j++) {
+            if (sites[j].caller == samples[i].Caller) {
+                break;
+            }
+        }
+        if (j == siteCount) {
+            sites[j].caller = samples[i].Caller;
+            sites[j].count  = 0;
+            sites[j].bytes  = 0;
+            siteCount++;
+        }
+        sites[j].count++;
+        sites[j].bytes += samples[i].Size;
+    }
+    qsort(sites, siteCount, sizeof(struct call_site), compare_call_sites);
+
+    printf("%i samples from %i call sites\n", count, siteCount);
+    printf("%-18s %8s %12s\n", "caller", "samples", "bytes");
+    for (i = 0; i < siteCount; i++) {
+        printf("0x%-16llx %8zu %12zu\n", (unsigned long long)sites[i].caller,
+            sites[i].count, sites[i].bytes);
+    }
+    free(samples);
+    free(sites);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    OsStatus_t status;
+    int        count = 0;
+
+    if (argc > 2 && !strcmp(argv[1], "-p")) {
+        status = HeapProfile(atoi(argv[2]), NULL, &count);
+        if (status != OsSuccess) {
+            printf("heapstat: failed to set the sample interval: %i\n", status);
+            return -1;
+        }
+        return 0;
+    }
+    else if (argc > 1 && !strcmp(argv[1], "-s")) {
+        return dump_samples();
+    }
+    else if (argc > 1) {
+        printf("usage: heapstat [-p <interval> | -s]\n");
+        return -1;
+    }
+    return dump_caches();
+}
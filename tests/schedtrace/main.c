@@ -0,0 +1,201 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scheduler Trace Tool
+ *  - Captures the scheduler trace of the kernel to a dump, and decodes dumps into
+ *    latency histograms and Chrome trace JSON. Decoding also works on other systems:
+ *
+ *  cc -O2 -idirafter ../../librt/libc/include -o schedtrace main.c schedtrace.c
+ *
+ *  schedtrace -c <dump> [-t <ms>]         traces for the given time, 1000 by default
+ *  schedtrace [-f <mhz>] [-j <json>] <dump>  prints the histograms, and writes the
+ *                                         Chrome trace if -j is given. The timestamp
+ *                                         frequency is taken from the dump if -f is
+ *                                         not given.
+ */
+
+#include "schedtrace.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MOLLENOS
+#include <os/mollenos.h>
+#include <threads.h>
+
+#define CAPTURE_RECORDS  8192
+#define CAPTURE_INTERVAL 50
+
+static int capture(const char* path, int milliseconds)
+{
+    SchedulerTraceRecord_t* records;
+    OsStatus_t              status;
+    FILE*                   file;
+    size_t                  total = 0;
+    int                     elapsed = 0;
+    int                     count;
+    int                     result = 0;
+
+    records = malloc(CAPTURE_RECORDS * sizeof(SchedulerTraceRecord_t));
+    file    = fopen(path, "wb");
+    if (!records || !file || schedtrace_write_header(file)) {
+        printf("schedtrace: failed to create %s\n", path);
+        free(records);
+        if (file) {
+            fclose(file);
+        }
+        return -1;
+    }
+
+    status = SchedulerTrace(SCHEDULER_TRACE_ENABLE, NULL, NULL);
+    if (status != OsSuccess) {
+        printf("schedtrace: failed to enable the scheduler trace: %i\n", status);
+        free(records);
+        fclose(file);
+        return -1;
+    }
+
+    // Drain often enough that the rings don't overflow, and once more at the end
+    while (!result) {
+        do {
+            count  = CAPTURE_RECORDS;
+            status = SchedulerTrace(SCHEDULER_TRACE_DRAIN, records, &count);
+            if (status != OsSuccess || schedtrace_write(file, records, count)) {
+                printf("schedtrace: failed to drain the scheduler trace: %i\n", status);
+                result = -1;
+                break;
+            }
+            total += count;
+        } while (count == CAPTURE_RECORDS);
+
+        if (elapsed >= milliseconds) {
+            break;
+        }
+        thrd_sleepex(CAPTURE_INTERVAL);
+        elapsed += CAPTURE_INTERVAL;
+    }
+
+    (void)SchedulerTrace(SCHEDULER_TRACE_DISABLE, NULL, NULL);
+    free(records);
+    fclose(file);
+    printf("schedtrace: captured %zu records to %s\n", total, path);
+    return result;
+}
+#endif
+
+static int decode(const char* path, const char* jsonPath, double mhz)
+{
+    SchedulerTraceRecord_t*  records;
+    struct schedtrace_stats* stats;
+    FILE*                    file;
+    size_t                   count = 0;
+    double                   ticksPerUs = mhz;
+    int                      result = 0;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        printf("schedtrace: failed to open %s\n", path);
+        return -1;
+    }
+    records = schedtrace_load(file, &count);
+    fclose(file);
+    if (!records) {
+        printf("schedtrace: %s is not a scheduler trace\n", path);
+        return -1;
+    }
+
+    if (ticksPerUs <= 0.0) {
+        ticksPerUs = schedtrace_frequency(records, count);
+        if (ticksPerUs <= 0.0) {
+            printf("schedtrace: the trace is too short to find the timestamp frequency, use -f\n");
+            free(records);
+            return -1;
+        }
+    }
+
+    stats = malloc(sizeof(struct schedtrace_stats));
+    if (!stats || schedtrace_analyze(records, count, ticksPerUs, stats)) {
+        printf("schedtrace: out of memory\n");
+        free(stats);
+        free(records);
+        return -1;
+    }
+    schedtrace_print(stdout, stats);
+    free(stats);
+
+    if (jsonPath) {
+        file = fopen(jsonPath, "w");
+        if (!file || schedtrace_chrome_json(file, records, count, ticksPerUs)) {
+            printf("schedtrace: failed to write %s\n", jsonPath);
+            result = -1;
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+    free(records);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    const char* capturePath = NULL;
+    const char* jsonPath    = NULL;
+    const char* path        = NULL;
+    double      mhz         = 0.0;
+    int         milliseconds = 1000;
+    int         i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            capturePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            milliseconds = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            jsonPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            mhz = atof(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        }
+        else {
+            capturePath = NULL;
+            path        = NULL;
+            break;
+        }
+    }
+
+    if (capturePath) {
+#ifdef MOLLENOS
+        return capture(capturePath, milliseconds);
+#else
+        (void)milliseconds;
+        printf("schedtrace: traces can only be captured on Vali\n");
+        return -1;
+#endif
+    }
+    else if (!path) {
+        printf("usage: schedtrace -c <dump> [-t <ms>] | [-f <mhz>] [-j <json>] <dump>\n");
+        return -1;
+    }
+    return decode(path, jsonPath, mhz);
+}
@@ -0,0 +1,576 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scheduler Trace Decoder
+ *  - Records of all cores are merged by timestamp, so the decoder relies on the
+ *    timestamp counters of the cores being synchronized. Latencies are tracked per
+ *    thread handle, the idle threads are recognized by their queue.
+ */
+
+#include "schedtrace.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WAKE_REASONS 3
+
+struct thread_state {
+    uint32_t handle;
+    int      used;
+    int      queued;
+    int      queue;
+    int      migrating;
+    int      woken;
+    int      reason;
+    int      asleep;
+    uint32_t timeout;
+    double   queued_at;
+    double   woken_at;
+    double   slept_at;
+};
+
+struct thread_table {
+    struct thread_state* states;
+    size_t               capacity;
+    size_t               count;
+};
+
+static const char* WakeReasons[WAKE_REASONS] = { "queue", "timeout", "interrupt" };
+
+static size_t hash_handle(uint32_t handle)
+{
+    return (size_t)(handle * 2654435761u);
+}
+
+static int table_grow(struct thread_table* table)
+{
+    struct thread_table grown;
+    size_t              i, j;
+
+    grown.capacity = table->capacity ? table->capacity * 2 : 64;
+    grown.count    = table->count;
+    grown.states   = calloc(grown.capacity, sizeof(struct thread_state));
+    if (!grown.states) {
+        return -1;
+    }
+
+    for (i = 0; i < table->capacity; i++) {
+        if (table->states[i].used) {
+            j = hash_handle(table->states[i].handle) & (grown.capacity - 1);
+            while (grown.states[j].used) {
+                j = (j + 1) & (grown.capacity - 1);
+            }
+            grown.states[j] = table->states[i];
+        }
+    }
+    free(table->states);
+    *table = grown;
+    return 0;
+}
+
+static struct thread_state* table_get(struct thread_table* table, uint32_t handle)
+{
+    size_t i;
+
+    if ((table->count + 1) * 2 > table->capacity && table_grow(table)) {
+        return NULL;
+    }
+
+    i = hash_handle(handle) & (table->capacity - 1);
+    while (table->states[i].used && table->states[i].handle != handle) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    if (!table->states[i].used) {
+        memset(&table->states[i], 0, sizeof(struct thread_state));
+        table->states[i].used   = 1;
+        table->states[i].handle = handle;
+        table->count++;
+    }
+    return &table->states[i];
+}
+
+// Records were lost, so nothing that is pending can be trusted
+static void table_reset(struct thread_table* table)
+{
+    size_t i;
+    for (i = 0; i < table->capacity; i++) {
+        table->states[i].queued    = 0;
+        table->states[i].migrating = 0;
+        table->states[i].woken     = 0;
+        table->states[i].asleep    = 0;
+    }
+}
+
+int schedtrace_write_header(FILE* file)
+{
+    SchedulerTraceHeader_t header;
+
+    header.Magic      = SCHEDULER_TRACE_MAGIC;
+    header.Version    = SCHEDULER_TRACE_VERSION;
+    header.RecordSize = sizeof(SchedulerTraceRecord_t);
+    return fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+}
+
+int schedtrace_write(FILE* file, const SchedulerTraceRecord_t* records, size_t count)
+{
+    if (!count) {
+        return 0;
+    }
+    return fwrite(records, sizeof(SchedulerTraceRecord_t), count, file) == count ? 0 : -1;
+}
+
+int schedtrace_sort(SchedulerTraceRecord_t* records, size_t count)
+{
+    SchedulerTraceRecord_t* buffer;
+    SchedulerTraceRecord_t* source = records;
+    SchedulerTraceRecord_t* target;
+    size_t                  width, i;
+
+    if (count < 2) {
+        return 0;
+    }
+
+    // Bottom up merge sort, as it keeps the drain order of equal timestamps
+    buffer = malloc(count * sizeof(SchedulerTraceRecord_t));
+    if (!buffer) {
+        return -1;
+    }
+
+    target = buffer;
+    for (width = 1; width < count; width *= 2) {
+        for (i = 0; i < count; i += 2 * width) {
+            size_t left     = i;
+            size_t middle   = (i + width < count) ? i + width : count;
+            size_t right    = middle;
+            size_t end      = (i + 2 * width < count) ? i + 2 * width : count;
+            size_t k        = i;
+
+            while (left < middle && right < end) {
+                if (source[right].Timestamp < source[left].Timestamp) {
+                    target[k++] = source[right++];
+                }
+                else {
+                    target[k++] = source[left++];
+                }
+            }
+            while (left < middle) {
+                target[k++] = source[left++];
+            }
+            while (right < end) {
+                target[k++] = source[right++];
+            }
+        }
+        target = source;
+        source = (source == records) ? buffer : records;
+    }
+
+    if (source != records) {
+        memcpy(records, source, count * sizeof(SchedulerTraceRecord_t));
+    }
+    free(buffer);
+    return 0;
+}
+
+SchedulerTraceRecord_t* schedtrace_load(FILE* file, size_t* count)
+{
+    SchedulerTraceHeader_t  header;
+    SchedulerTraceRecord_t* records  = NULL;
+    size_t                  capacity = 0;
+    size_t                  read     = 0;
+    size_t                  chunk;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.Magic != SCHEDULER_TRACE_MAGIC ||
+        header.Version != SCHEDULER_TRACE_VERSION || header.RecordSize != sizeof(SchedulerTraceRecord_t)) {
+        return NULL;
+    }
+
+    do {
+        if (read == capacity) {
+            SchedulerTraceRecord_t* grown;
+            capacity = capacity ? capacity * 2 : 4096;
+            grown    = realloc(records, capacity * sizeof(SchedulerTraceRecord_t));
+            if (!grown) {
+                free(records);
+                return NULL;
+            }
+            records = grown;
+        }
+        chunk = fread(&records[read], sizeof(SchedulerTraceRecord_t), capacity - read, file);
+        read += chunk;
+    } while (chunk);
+
+    if (schedtrace_sort(records, read)) {
+        free(records);
+        return NULL;
+    }
+    *count = read;
+    return records;
+}
+
+double schedtrace_frequency(const SchedulerTraceRecord_t* records, size_t count)
+{
+    const SchedulerTraceRecord_t* first = NULL;
+    const SchedulerTraceRecord_t* last  = NULL;
+    uint32_t                      milliseconds;
+    size_t                        i;
+
+    for (i = 0; i < count; i++) {
+        if (records[i].Event == SCHEDULER_TRACE_CLOCK) {
+            if (!first) {
+                first = &records[i];
+            }
+            last = &records[i];
+        }
+    }
+
+    // The system tick is in milliseconds, so it takes a while before it is precise
+    if (!first || last->Timestamp <= first->Timestamp) {
+        return 0.0;
+    }
+    milliseconds = last->Data - first->Data;
+    if (milliseconds < 10) {
+        return 0.0;
+    }
+    return (double)(last->Timestamp - first->Timestamp) / ((double)milliseconds * 1000.0);
+}
+
+static void histogram_add(struct schedtrace_histogram* histogram, double us)
+{
+    uint64_t whole  = us > 0.0 ? (uint64_t)us : 0;
+    int      bucket = 0;
+
+    while (whole && bucket < SCHEDTRACE_BUCKETS - 1) {
+        whole >>= 1;
+        bucket++;
+    }
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_us += us;
+    if (us > histogram->max_us) {
+        histogram->max_us = us;
+    }
+}
+
+int schedtrace_analyze(const SchedulerTraceRecord_t* records, size_t count,
+    double ticks_per_us, struct schedtrace_stats* stats)
+{
+    struct thread_table   table = { NULL, 0, 0 };
+    struct thread_state*  state;
+    size_t                i;
+
+    memset(stats, 0, sizeof(struct schedtrace_stats));
+    stats->records      = count;
+    stats->ticks_per_us = ticks_per_us;
+    if (ticks_per_us <= 0.0) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        const SchedulerTraceRecord_t* record = &records[i];
+        struct schedtrace_core*       core   = &stats->cores[record->Core];
+        double                        now    = (double)(record->Timestamp - records[0].Timestamp) / ticks_per_us;
+
+        if (record->Event == SCHEDULER_TRACE_LOST) {
+            core->lost += record->Data;
+            table_reset(&table);
+            continue;
+        }
+        if (record->Event == SCHEDULER_TRACE_CLOCK ||
+            (record->Event == SCHEDULER_TRACE_SWITCH && record->Queue == SCHEDULER_TRACE_QUEUE_NONE)) {
+            core->switches += record->Event == SCHEDULER_TRACE_SWITCH;
+            continue;
+        }
+
+        state = table_get(&table, record->Thread);
+        if (!state) {
+            free(table.states);
+            return -1;
+        }
+
+        switch (record->Event) {
+            case SCHEDULER_TRACE_ENQUEUE: {
+                // A migrated thread has been waiting since it was queued on the other core
+                if (!state->queued || !state->migrating) {
+                    state->queued_at = now;
+                    state->queue     = record->Queue;
+                }
+                state->queued    = 1;
+                state->migrating = 0;
+                core->enqueues++;
+                core->queued_total += record->QueueLength;
+                if (record->QueueLength > core->queued_max) {
+                    core->queued_max = record->QueueLength;
+                }
+            } break;
+            case SCHEDULER_TRACE_DEQUEUE: {
+                if (state->queued) {
+                    histogram_add(&stats->queue_wait[state->queue], now - state->queued_at);
+                }
+                state->queued    = 0;
+                state->migrating = 0;
+            } break;
+            case SCHEDULER_TRACE_MIGRATE: {
+                state->migrating = state->queued;
+            } break;
+            case SCHEDULER_TRACE_WAKE: {
+                state->woken    = 1;
+                state->woken_at = now;
+                state->reason   = record->Data < WAKE_REASONS ? (int)record->Data : 0;
+            } break;
+            case SCHEDULER_TRACE_SWITCH: {
+                core->switches++;
+                if (state->woken) {
+                    histogram_add(&stats->wake_latency[state->reason], now - state->woken_at);
+                    state->woken = 0;
+                }
+            } break;
+
+            default:
+                break;
+        }
+    }
+    free(table.states);
+    return 0;
+}
+
+static void print_histogram(FILE* file, const char* title, const struct schedtrace_histogram* histogram)
+{
+    uint64_t largest = 0;
+    int      first   = -1;
+    int      last    = 0;
+    int      i, j;
+
+    for (i = 0; i < SCHEDTRACE_BUCKETS; i++) {
+        if (histogram->buckets[i]) {
+            first   = first < 0 ? i : first;
+            last    = i;
+            largest = histogram->buckets[i] > largest ? histogram->buckets[i] : largest;
+        }
+    }
+    if (first < 0) {
+        return;
+    }
+
+    fprintf(file, "%s: %llu samples, avg %.1f us, max %.1f us\n", title,
+        (unsigned long long)histogram->count, histogram->total_us / (double)histogram->count,
+        histogram->max_us);
+    for (i = first; i <= last; i++) {
+        int width = (int)((histogram->buckets[i] * 40 + largest - 1) / largest);
+        if (i == 0) {
+            fprintf(file, "  %21s", "< 1 us");
+        }
+        else {
+            fprintf(file, "  %9llu - %6llu us", 1ULL << (i - 1), 1ULL << i);
+        }
+        fprintf(file, " %10llu ", (unsigned long long)histogram->buckets[i]);
+        for (j = 0; j < width; j++) {
+            fputc('#', file);
+        }
+        fputc('\n', file);
+    }
+}
+
+void schedtrace_print(FILE* file, const struct schedtrace_stats* stats)
+{
+    char title[64];
+    int  i;
+
+    fprintf(file, "%zu records, %.1f ticks per us\n\n", stats->records, stats->ticks_per_us);
+    fprintf(file, "%-6s %10s %10s %10s %10s %10s\n", "core", "enqueues", "avg queued",
+        "max queued", "switches", "lost");
+    for (i = 0; i < SCHEDTRACE_CORES; i++) {
+        const struct schedtrace_core* core = &stats->cores[i];
+        if (core->enqueues || core->switches || core->lost) {
+            fprintf(file, "%-6i %10llu %10.2f %10u %10llu %10llu\n", i,
+                (unsigned long long)core->enqueues,
+                core->enqueues ? (double)core->queued_total / (double)core->enqueues : 0.0,
+                core->queued_max, (unsigned long long)core->switches,
+                (unsigned long long)core->lost);
+        }
+    }
+
+    fprintf(file, "\nqueue wait, from enqueue until dequeue\n");
+    for (i = 0; i < SCHEDTRACE_QUEUES; i++) {
+        snprintf(title, sizeof(title), "queue %i", i);
+        print_histogram(file, title, &stats->queue_wait[i]);
+    }
+
+    fprintf(file, "\nwake latency, from wake up until running\n");
+    for (i = 0; i < WAKE_REASONS; i++) {
+        snprintf(title, sizeof(title), "%s", WakeReasons[i]);
+        print_histogram(file, title, &stats->wake_latency[i]);
+    }
+}
+
+struct json_writer {
+    FILE* file;
+    int   first;
+};
+
+static void json_begin(struct json_writer* writer)
+{
+    fprintf(writer->file, writer->first ? "\n" : ",\n");
+    writer->first = 0;
+}
+
+static void json_slice(struct json_writer* writer, const char* name, int pid, uint32_t tid,
+    double start, double end, const char* argName, unsigned argValue)
+{
+    json_begin(writer);
+    fprintf(writer->file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%i,\"tid\":%u,\"ts\":%.3f,"
+        "\"dur\":%.3f,\"args\":{\"%s\":%u}}", name, pid, tid, start, end - start, argName, argValue);
+}
+
+static void json_instant(struct json_writer* writer, const char* name, int pid, uint32_t tid,
+    double now, const char* argName, const char* argValue)
+{
+    json_begin(writer);
+    fprintf(writer->file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%i,\"tid\":%u,"
+        "\"ts\":%.3f,\"args\":{\"%s\":\"%s\"}}", name, pid, tid, now, argName, argValue);
+}
+
+int schedtrace_chrome_json(FILE* file, const SchedulerTraceRecord_t* records, size_t count,
+    double ticks_per_us)
+{
+    struct json_writer   writer = { file, 1 };
+    struct thread_table  table  = { NULL, 0, 0 };
+    struct thread_state* state;
+    uint32_t             running[SCHEDTRACE_CORES];
+    double               runningSince[SCHEDTRACE_CORES];
+    int                  coreSeen[SCHEDTRACE_CORES] = { 0 };
+    char                 text[32];
+    double               now = 0.0;
+    size_t               i;
+
+    if (ticks_per_us <= 0.0) {
+        return -1;
+    }
+
+    // Cores are the tracks of process 0, and threads the tracks of process 1
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    json_begin(&writer);
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"cores\"}}");
+    json_begin(&writer);
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"threads\"}}");
+
+    for (i = 0; i < count; i++) {
+        const SchedulerTraceRecord_t* record = &records[i];
+        int                           core   = record->Core;
+
+        now = (double)(record->Timestamp - records[0].Timestamp) / ticks_per_us;
+        if (!coreSeen[core]) {
+            coreSeen[core] = 1;
+            running[core]  = 0;
+            json_begin(&writer);
+            fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%i,"
+                "\"args\":{\"name\":\"core %i\"}}", core, core);
+        }
+
+        switch (record->Event) {
+            case SCHEDULER_TRACE_SWITCH: {
+                if (coreSeen[core] == 2) {
+                    snprintf(text, sizeof(text), "thread %u", running[core]);
+                    json_slice(&writer, text, 0, core, runningSince[core], now, "thread", running[core]);
+                }
+                coreSeen[core] = 1;
+                if (record->Queue != SCHEDULER_TRACE_QUEUE_NONE) {
+                    coreSeen[core]     = 2;
+                    running[core]      = record->Thread;
+                    runningSince[core] = now;
+                }
+                continue;
+            }
+            case SCHEDULER_TRACE_ENQUEUE:
+            case SCHEDULER_TRACE_DEQUEUE:
+            case SCHEDULER_TRACE_MIGRATE: {
+                json_begin(&writer);
+                fprintf(file, "{\"name\":\"core %i queued\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,"
+                    "\"args\":{\"threads\":%u}}", core, now, record->QueueLength);
+            } break;
+            case SCHEDULER_TRACE_LOST: {
+                snprintf(text, sizeof(text), "%u", record->Data);
+                json_instant(&writer, "lost", 0, core, now, "records", text);
+                table_reset(&table);
+                continue;
+            }
+
+            default:
+                break;
+        }
+
+        if (record->Event == SCHEDULER_TRACE_CLOCK) {
+            continue;
+        }
+
+        state = table_get(&table, record->Thread);
+        if (!state) {
+            free(table.states);
+            return -1;
+        }
+
+        switch (record->Event) {
+            case SCHEDULER_TRACE_ENQUEUE: {
+                if (!state->queued) {
+                    state->queued    = 1;
+                    state->queued_at = now;
+                    state->queue     = record->Queue;
+                }
+            } break;
+            case SCHEDULER_TRACE_DEQUEUE: {
+                if (state->queued) {
+                    json_slice(&writer, "queued", 1, record->Thread, state->queued_at, now,
+                        "queue", state->queue);
+                }
+                state->queued = 0;
+            } break;
+            case SCHEDULER_TRACE_MIGRATE: {
+                snprintf(text, sizeof(text), "%u", record->Data);
+                json_instant(&writer, "migrate", 1, record->Thread, now, "core", text);
+            } break;
+            case SCHEDULER_TRACE_SLEEP: {
+                state->asleep   = 1;
+                state->slept_at = now;
+                state->timeout  = record->Data;
+            } break;
+            case SCHEDULER_TRACE_WAKE: {
+                if (state->asleep) {
+                    json_slice(&writer, "asleep", 1, record->Thread, state->slept_at, now,
+                        "timeout", state->timeout);
+                }
+                state->asleep = 0;
+                json_instant(&writer, "wake", 1, record->Thread, now, "reason",
+                    WakeReasons[record->Data < WAKE_REASONS ? record->Data : 0]);
+            } break;
+
+            default:
+                break;
+        }
+    }
+
+    // Close the threads that were still running at the end of the trace
+    for (i = 0; i < SCHEDTRACE_CORES; i++) {
+        if (coreSeen[i] == 2) {
+            snprintf(text, sizeof(text), "thread %u", running[i]);
+            json_slice(&writer, text, 0, (uint32_t)i, runningSince[i], now, "thread", running[i]);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    free(table.states);
+    return ferror(file) ? -1 : 0;
+}
@@ -0,0 +1,106 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2019, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scheduler Trace Decoder
+ *  - Reads and writes scheduler trace dumps, and turns the records into latency
+ *    histograms and Chrome trace JSON. Only uses the C library, so it also builds
+ *    on other systems to decode dumps taken on Vali.
+ */
+
+#ifndef __SCHEDTRACE_H__
+#define __SCHEDTRACE_H__
+
+#ifdef MOLLENOS
+#include <os/osdefs.h>
+#else
+// The Vali headers can't be used on other systems, so provide what the trace types need
+#define __OS_DEFINITIONS__
+#include <stddef.h>
+#include <stdint.h>
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+#endif
+#include <os/types/scheduler_trace.h>
+#include <stdio.h>
+
+// Bucket 0 holds latencies below 1us, and bucket n the latencies from 2^(n-1)us
+// up to 2^n us
+#define SCHEDTRACE_BUCKETS 32
+#define SCHEDTRACE_QUEUES  256
+#define SCHEDTRACE_CORES   256
+
+struct schedtrace_histogram {
+    uint64_t buckets[SCHEDTRACE_BUCKETS];
+    uint64_t count;
+    double   total_us;
+    double   max_us;
+};
+
+struct schedtrace_core {
+    uint64_t enqueues;
+    uint64_t queued_total; // Sum of the queue lengths after each enqueue
+    unsigned queued_max;
+    uint64_t switches;
+    uint64_t lost;
+};
+
+struct schedtrace_stats {
+    size_t                      records;
+    double                      ticks_per_us;
+    struct schedtrace_histogram queue_wait[SCHEDTRACE_QUEUES]; // Enqueue until dequeue
+    struct schedtrace_histogram wake_latency[3];               // Wake until running, by reason
+    struct schedtrace_core      cores[SCHEDTRACE_CORES];
+};
+
+/* schedtrace_write_header, schedtrace_write
+ * Writes the header of a dump, and appends records to it. Returns 0 on success. */
+int schedtrace_write_header(FILE* file);
+int schedtrace_write(FILE* file, const SchedulerTraceRecord_t* records, size_t count);
+
+/* schedtrace_load
+ * Reads a dump and returns its records ordered by timestamp, records with the same
+ * timestamp keep the order they were drained in. Returns NULL if the file is not a
+ * dump of this version, the records must be freed by the caller. */
+SchedulerTraceRecord_t* schedtrace_load(FILE* file, size_t* count);
+
+/* schedtrace_sort
+ * Orders the records by timestamp, keeping the drain order of equal timestamps. */
+int schedtrace_sort(SchedulerTraceRecord_t* records, size_t count);
+
+/* schedtrace_frequency
+ * Estimates the timestamp ticks per microsecond from the clock records, which pair
+ * a timestamp with the system tick. Returns 0 if the records don't span enough time. */
+double schedtrace_frequency(const SchedulerTraceRecord_t* records, size_t count);
+
+/* schedtrace_analyze
+ * Fills in the statistics from records ordered by timestamp. Returns 0 on success. */
+int schedtrace_analyze(const SchedulerTraceRecord_t* records, size_t count,
+    double ticks_per_us, struct schedtrace_stats* stats);
+
+/* schedtrace_print
+ * Prints the histograms and core statistics. */
+void schedtrace_print(FILE* file, const struct schedtrace_stats* stats);
+
+/* schedtrace_chrome_json
+ * Writes records ordered by timestamp in the Chrome trace event format, with the
+ * threads running on each core, and the time each thread spends queued and asleep.
+ * Returns 0 on success. */
+int schedtrace_chrome_json(FILE* file, const SchedulerTraceRecord_t* records, size_t count,
+    double ticks_per_us);
+
+#endif //!__SCHEDTRACE_H__